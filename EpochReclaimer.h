@@ -0,0 +1,335 @@
+/*
+ * EpochReclaimer.h
+ *
+ * Epoch based reclamation for memory that lock free readers may still be looking at. Readers hold a Guard while they follow
+ * pointers, the guard publishes the global epoch the reader saw. Writers retire memory they unlinked instead of freeing it,
+ * it goes to the limbo list of the retiring thread tagged with the global epoch. Global epoch moves on only once every thread
+ * inside a guard has seen it, so memory retired in epoch e is freed once global epoch reaches e + 2, no guard can hold it by then.
+ * Limbo is freed in batches, every RETIRE_BATCH retires the retiring thread tries to move the epoch on and frees what became safe.
+ *
+ * One reclaimer is shared by all containers of the process. Thread records are allocated on first use, never freed and reused
+ * once their thread exits. Limbo of an exited thread is adopted by the next thread that reclaims, so it never waits for the record
+ * to be picked up again. A guard held for long holds every retire of the process back, readers that park should leave theirs.
+ */
+
+#ifndef EPOCHRECLAIMER_H_
+#define EPOCHRECLAIMER_H_
+
+#include <atomic>
+#include <cstdlib>
+#include <thread>
+#include <vector>
+
+class EpochReclaimer
+{
+    struct ThreadRecord;
+public:
+    static const unsigned long long RETIRE_BATCH = 64;
+
+    struct Stats
+    {
+        unsigned long long epoch;
+        unsigned long long retired;
+        unsigned long long freed; // retired - freed is what sits in limbo
+        unsigned long long threads; // records ever allocated, peak of threads that used the reclaimer at once
+    };
+
+    static EpochReclaimer & shared()
+    {
+        static EpochReclaimer reclaimer;
+        return reclaimer;
+    }
+
+    // critical section of a reader, guards nest
+    class Guard
+    {
+        ThreadRecord * record;
+    public:
+        inline Guard();
+        inline ~Guard();
+    };
+
+    // ptr was unlinked, deleter(ptr) runs once no guard that could have seen it is left
+    inline void retire(void * ptr, void (*deleter)(void *));
+    template<typename T>
+    inline void retire(T * ptr)
+    {
+        retire((void *) ptr, deleteDeleter<T>);
+    }
+    static void freeDeleter(void * ptr)
+    {
+        std::free(ptr);
+    }
+    template<typename T>
+    static void deleteDeleter(void * ptr)
+    {
+        delete (T *) ptr;
+    }
+    // moves the epoch on if it can and frees limbo of the calling thread that is safe by now, returns what is still in it
+    inline size_t reclaim();
+    // waits until everything the calling thread retired (or adopted) so far is freed. Not from inside a guard, it would wait for itself
+    inline void synchronize();
+    Stats stats() const; // approximate while threads retire
+
+private:
+    EpochReclaimer() :
+                    globalEpoch(1), records(0)
+    {
+    }
+    ~EpochReclaimer();
+    EpochReclaimer(const EpochReclaimer&) = delete;
+    EpochReclaimer& operator=(const EpochReclaimer&) = delete;
+
+    static const unsigned long long RECORD_ACTIVE = 1ULL; // low bit of record state, epoch is in the rest
+
+    struct Retired
+    {
+        void * ptr;
+        void (*deleter)(void *);
+        unsigned long long epoch;
+    };
+
+    struct ThreadRecord
+    {
+        std::atomic<unsigned long long> state; //8 epoch << 1 | RECORD_ACTIVE
+        unsigned long long nesting; //8 owner thread only
+        std::atomic<bool> inUse;
+        ThreadRecord * next; //8 records are only ever pushed
+        std::vector<Retired> limbo; // whoever holds inUse
+        std::atomic<unsigned long long> limboSize; //8 readable by adopters without taking the record
+        unsigned long long retiredSinceReclaim; //8
+        std::atomic<unsigned long long> retiredCount; //8 written by owner only, summed by stats
+        std::atomic<unsigned long long> freedCount; //8
+    }__attribute__((aligned(64)));
+
+    // releases the record when its thread exits
+    struct RecordHandle
+    {
+        ThreadRecord * record;
+        ~RecordHandle()
+        {
+            if(record)
+            {
+                record->state.store(0, std::memory_order_release);
+                record->inUse.store(false, std::memory_order_release);
+            }
+        }
+    };
+
+    inline ThreadRecord * threadRecord();
+    inline unsigned long long tryAdvance();
+    inline void adoptOrphans(ThreadRecord * record);
+    static inline void freeRetired(ThreadRecord * record, const Retired & retired);
+
+    std::atomic<unsigned long long> globalEpoch; //8
+    std::atomic<ThreadRecord *> records; //8
+};
+
+inline EpochReclaimer::ThreadRecord * EpochReclaimer::threadRecord()
+{
+    static thread_local RecordHandle handle = { 0 };
+    if(handle.record)
+        return handle.record;
+    for(ThreadRecord * record = records.load(std::memory_order_acquire); record; record = record->next)
+    {
+        bool expected = false;
+        if(!record->inUse.load(std::memory_order_relaxed) && record->inUse.compare_exchange_strong(expected, true, std::memory_order_acquire))
+        {
+            record->nesting = 0;
+            return handle.record = record;
+        }
+    }
+    ThreadRecord * record = new ThreadRecord();
+    record->state.store(0, std::memory_order_relaxed);
+    record->nesting = 0;
+    record->inUse.store(true, std::memory_order_relaxed);
+    record->limboSize.store(0, std::memory_order_relaxed);
+    record->retiredSinceReclaim = 0;
+    record->retiredCount.store(0, std::memory_order_relaxed);
+    record->freedCount.store(0, std::memory_order_relaxed);
+    record->next = records.load(std::memory_order_relaxed);
+    while(!records.compare_exchange_weak(record->next, record, std::memory_order_release))
+        ;
+    return handle.record = record;
+}
+
+// epoch may be stale by the time it is published, that only holds the next advance back. Exchange is a full barrier (same as
+// store + fence on x86, but visible to TSan), pointer loads of the critical section stay after the publication
+inline EpochReclaimer::Guard::Guard() :
+                record(EpochReclaimer::shared().threadRecord())
+{
+    if(record->nesting++)
+        return;
+    record->state.exchange((EpochReclaimer::shared().globalEpoch.load(std::memory_order_relaxed) << 1) | RECORD_ACTIVE, std::memory_order_seq_cst);
+}
+
+inline EpochReclaimer::Guard::~Guard()
+{
+    if(--(record->nesting))
+        return;
+    record->state.store(record->state.load(std::memory_order_relaxed) & ~RECORD_ACTIVE, std::memory_order_release);
+}
+
+inline unsigned long long EpochReclaimer::tryAdvance()
+{
+    unsigned long long epoch = globalEpoch.load(std::memory_order_seq_cst);
+    for(ThreadRecord * record = records.load(std::memory_order_acquire); record; record = record->next)
+    {
+        const unsigned long long state = record->state.load(std::memory_order_seq_cst);
+        if((state & RECORD_ACTIVE) && (state >> 1) != epoch)
+            return epoch;
+    }
+    if(globalEpoch.compare_exchange_strong(epoch, epoch + 1, std::memory_order_seq_cst))
+        return epoch + 1;
+    return epoch; // somebody else advanced it
+}
+
+inline void EpochReclaimer::freeRetired(ThreadRecord * record, const Retired & retired)
+{
+    retired.deleter(retired.ptr);
+    record->freedCount.store(record->freedCount.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+}
+
+// limbo of a record nobody holds moves to the caller, entries keep their epochs. Taking the record for the move keeps a thread
+// that picks it up meanwhile off its limbo
+inline void EpochReclaimer::adoptOrphans(ThreadRecord * record)
+{
+    for(ThreadRecord * orphan = records.load(std::memory_order_acquire); orphan; orphan = orphan->next)
+    {
+        if(orphan == record || !orphan->limboSize.load(std::memory_order_relaxed) || orphan->inUse.load(std::memory_order_relaxed))
+            continue;
+        bool expected = false;
+        if(!orphan->inUse.compare_exchange_strong(expected, true, std::memory_order_acquire))
+            continue;
+        record->limbo.insert(record->limbo.end(), orphan->limbo.begin(), orphan->limbo.end());
+        orphan->limbo.clear();
+        orphan->limboSize.store(0, std::memory_order_relaxed);
+        orphan->inUse.store(false, std::memory_order_release);
+    }
+}
+
+// epoch is read after the caller unlinked ptr, readers that saw it entered at that epoch or before
+inline void EpochReclaimer::retire(void * ptr, void (*deleter)(void *))
+{
+    if(!ptr)
+        return;
+    ThreadRecord * record = threadRecord();
+    Retired retired = { ptr, deleter, globalEpoch.load(std::memory_order_seq_cst) };
+    record->limbo.push_back(retired);
+    record->limboSize.store(record->limbo.size(), std::memory_order_relaxed);
+    record->retiredCount.store(record->retiredCount.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+    if(++(record->retiredSinceReclaim) >= RETIRE_BATCH)
+        reclaim();
+}
+
+inline size_t EpochReclaimer::reclaim()
+{
+    ThreadRecord * record = threadRecord();
+    record->retiredSinceReclaim = 0;
+    adoptOrphans(record);
+    const unsigned long long epoch = tryAdvance();
+    size_t kept = 0;
+    for(size_t retiredIdx = 0; retiredIdx < record->limbo.size(); ++retiredIdx)
+    {
+        Retired & retired = record->limbo[retiredIdx];
+        if(retired.epoch + 2 <= epoch)
+            freeRetired(record, retired);
+        else
+            record->limbo[kept++] = retired;
+    }
+    record->limbo.resize(kept);
+    record->limboSize.store(kept, std::memory_order_relaxed);
+    return kept;
+}
+
+inline void EpochReclaimer::synchronize()
+{
+    if(threadRecord()->nesting)
+        abort();
+    while(reclaim())
+        std::this_thread::yield();
+}
+
+inline EpochReclaimer::Stats EpochReclaimer::stats() const
+{
+    Stats res = { globalEpoch.load(std::memory_order_relaxed), 0, 0, 0 };
+    for(ThreadRecord * record = records.load(std::memory_order_acquire); record; record = record->next)
+    {
+        res.retired += record->retiredCount.load(std::memory_order_relaxed);
+        res.freed += record->freedCount.load(std::memory_order_relaxed);
+        ++res.threads;
+    }
+    return res;
+}
+
+// runs at exit. Limbo of records still held belongs to threads that may be running, it is left alone with the records themselves
+inline EpochReclaimer::~EpochReclaimer()
+{
+    for(ThreadRecord * record = records.load(std::memory_order_acquire); record; record = record->next)
+    {
+        bool expected = false;
+        if(!record->inUse.compare_exchange_strong(expected, true, std::memory_order_acquire))
+            continue;
+        for(size_t retiredIdx = 0; retiredIdx < record->limbo.size(); ++retiredIdx)
+            freeRetired(record, record->limbo[retiredIdx]);
+        record->limbo.clear();
+        record->limboSize.store(0, std::memory_order_relaxed);
+    }
+}
+
+/*
+    // Sample stress test, tests/EpochReclaimerTest.cpp runs it. Build it with -fsanitize=thread and again with -fsanitize=address.
+    // Writers swap nodes of a small array and retire what they swapped out, readers check every node they reach is still alive.
+    // ASan catches a node freed under a reader, TSan a missing happens-before between retire and free. retired == freed at the end,
+    // nothing is left in limbo
+
+    struct Node
+    {
+        std::atomic<unsigned long long> alive;
+        unsigned long long payload;
+    };
+    static void killNode(void * ptr)
+    {
+        ((Node *) ptr)->alive.store(0, std::memory_order_relaxed);
+        delete (Node *) ptr;
+    }
+
+    const unsigned long long SLOTS = 64, ROUNDS = 1000000;
+    std::atomic<Node *> slots[SLOTS];
+    for (unsigned long long slotIdx = 0; slotIdx < SLOTS; ++slotIdx)
+        slots[slotIdx].store(new Node { { 1 }, slotIdx });
+    std::atomic<unsigned long long> dead(0);
+    std::vector<std::thread> threads;
+    for (unsigned long long threadIdx = 0; threadIdx < 8; ++threadIdx)
+        threads.emplace_back([&, threadIdx]
+        {
+            EpochReclaimer & reclaimer = EpochReclaimer::shared();
+            for (unsigned long long i = 0; i < ROUNDS; ++i)
+            {
+                std::atomic<Node *> & slot = slots[(i * 7 + threadIdx) % SLOTS];
+                if (threadIdx % 2)
+                {
+                    Node * old = slot.exchange(new Node { { 1 }, i }, std::memory_order_acq_rel);
+                    reclaimer.retire(old, killNode);
+                }
+                else
+                {
+                    EpochReclaimer::Guard guard;
+                    Node * node = slot.load(std::memory_order_acquire);
+                    if (!node->alive.load(std::memory_order_relaxed))
+                        ++dead;
+                }
+            }
+            reclaimer.synchronize();
+        });
+    for (auto & thread : threads)
+        thread.join();
+    EpochReclaimer::shared().synchronize(); // adopts whatever exited threads left behind
+    for (unsigned long long slotIdx = 0; slotIdx < SLOTS; ++slotIdx)
+        delete slots[slotIdx].load();
+    EpochReclaimer::Stats stats = EpochReclaimer::shared().stats();
+    printf("dead %llu retired %llu freed %llu\n", dead.load(), stats.retired, stats.freed);
+
+*/
+
+#endif /* EPOCHRECLAIMER_H_ */
@@ -0,0 +1,123 @@
+/*
+ * FrequencySketch.h
+ *
+ * Count-min sketch of 4 bit counters for TinyLFU style admission. Counters for a key are 4 of the 16 in each of 4 words of
+ * a single 64 byte block, so a lookup touches one cacheline. Increments are lock free (CAS per word, saturated counters
+ * are never written), every sampleSize increments all counters are halved so old popularity fades away.
+ *
+ * Takes hashes, not keys: callers feed it the same avalanched hash they use for their own slot, sketch rehashes it.
+ */
+
+#ifndef FREQUENCYSKETCH_H_
+#define FREQUENCYSKETCH_H_
+
+#include <atomic>
+#include <cstdlib>
+#include <new>
+
+#include "seededhash.hh"
+
+class FrequencySketch
+{
+public:
+    static const unsigned long long MAX_FREQUENCY = 15;
+
+    // about 4 counters per capacity element, aged every 10 * capacity increments
+    explicit FrequencySketch(unsigned long long capacity);
+    ~FrequencySketch();
+
+    inline void increment(unsigned long long hash);
+    inline unsigned long long frequency(unsigned long long hash) const;
+
+private:
+    FrequencySketch(const FrequencySketch&) = delete;
+    FrequencySketch& operator=(const FrequencySketch&) = delete;
+
+    static const unsigned long long BLOCK_WORDS = 8;
+    static const unsigned long long SKETCH_DEPTH = 4;
+    static const unsigned long long RESET_MASK = 0x7777777777777777ULL;
+
+    // word and counter shift of row in the block picked by blockHash
+    static unsigned long long rowWord(unsigned long long blockHash, unsigned long long row)
+    {
+        return row * 2 + ((blockHash >> (40 + row)) & 1);
+    }
+    static unsigned long long rowShift(unsigned long long blockHash, unsigned long long row)
+    {
+        return ((blockHash >> (44 + row * 4)) & 15) * 4;
+    }
+    void age();
+
+    std::atomic<unsigned long long> * table; //8
+    unsigned long long blockMask; //8
+    unsigned long long sampleSize; //8
+    std::atomic<unsigned long long> samples; //8
+};
+
+inline FrequencySketch::FrequencySketch(unsigned long long capacity) :
+                table(0), blockMask(0), sampleSize(10 * (capacity ? capacity : 1)), samples(0)
+{
+    unsigned long long numBlocks = 1;
+    while(numBlocks * BLOCK_WORDS * 16 < capacity * SKETCH_DEPTH)
+        numBlocks <<= 1;
+    blockMask = numBlocks - 1;
+    table = (std::atomic<unsigned long long> *) aligned_alloc(64, numBlocks * BLOCK_WORDS * sizeof(std::atomic<unsigned long long>));
+    for(unsigned long long wordIdx = 0; wordIdx < numBlocks * BLOCK_WORDS; ++wordIdx)
+        new (&(table[wordIdx])) std::atomic<unsigned long long>(0);
+}
+
+inline FrequencySketch::~FrequencySketch()
+{
+    std::free(table);
+}
+
+inline void FrequencySketch::increment(unsigned long long hash)
+{
+    const unsigned long long blockHash = mix64(hash + HASH_PRIME64_3);
+    std::atomic<unsigned long long> * block = table + (blockHash & blockMask) * BLOCK_WORDS;
+    bool added = false;
+    for(unsigned long long row = 0; row < SKETCH_DEPTH; ++row)
+    {
+        std::atomic<unsigned long long> & word = block[rowWord(blockHash, row)];
+        const unsigned long long shift = rowShift(blockHash, row);
+        unsigned long long current = word.load(std::memory_order_relaxed);
+        while(((current >> shift) & 15) < MAX_FREQUENCY)
+        {
+            if(word.compare_exchange_weak(current, current + (1ULL << shift), std::memory_order_relaxed))
+            {
+                added = true;
+                break;
+            }
+        }
+    }
+    if(added && samples.fetch_add(1, std::memory_order_relaxed) + 1 == sampleSize)
+        age();
+}
+
+inline unsigned long long FrequencySketch::frequency(unsigned long long hash) const
+{
+    const unsigned long long blockHash = mix64(hash + HASH_PRIME64_3);
+    const std::atomic<unsigned long long> * block = table + (blockHash & blockMask) * BLOCK_WORDS;
+    unsigned long long res = MAX_FREQUENCY;
+    for(unsigned long long row = 0; row < SKETCH_DEPTH; ++row)
+    {
+        const unsigned long long count = (block[rowWord(blockHash, row)].load(std::memory_order_relaxed) >> rowShift(blockHash, row)) & 15;
+        if(count < res)
+            res = count;
+    }
+    return res;
+}
+
+// only the thread that hit sampleSize gets here, increments racing with it may get halved too
+inline void FrequencySketch::age()
+{
+    for(unsigned long long wordIdx = 0; wordIdx <= blockMask * BLOCK_WORDS + BLOCK_WORDS - 1; ++wordIdx)
+    {
+        unsigned long long current = table[wordIdx].load(std::memory_order_relaxed);
+        while(current && !table[wordIdx].compare_exchange_weak(current, (current >> 1) & RESET_MASK, std::memory_order_relaxed))
+            ;
+    }
+    samples.fetch_sub(sampleSize / 2, std::memory_order_relaxed);
+}
+
+#endif /* FREQUENCYSKETCH_H_ */
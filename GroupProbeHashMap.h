@@ -0,0 +1,455 @@
+/*
+ * GroupProbeHashMap.h
+ *
+ * Flat open addressing map for single threaded hot paths. Keys and values sit in one slot array, next to it one control byte per
+ * slot: 0 for an empty slot, 0x80 | 7 low hash bits for a full one. Probing is linear over slots but looks at a whole group of
+ * GROUP_WIDTH control bytes at a time (16 with SSE2, 32 when built with AVX2), one vector compare gives the slots whose hash bits
+ * match and the sign bits give the empty ones. Only matching slots before the first empty slot of the run get a key compare.
+ *
+ * Groups start at the home slot of the key, not at aligned positions, so a key is always found in the run that starts at its home
+ * slot. The first GROUP_WIDTH control bytes are mirrored past the end so groups near the end don't wrap. Remove shifts the rest of
+ * the run back into the hole (no tombstones), probe runs never carry deleted slots and a table under churn never needs a cleanup
+ * rehash. Home slot comes from the high hash bits (reduceRange), control bits from the low ones.
+ *
+ * Table doubles when it gets MAX_LOAD_PERCENT full. Same insert/put/get/set/remove API as CantStopHashMap.
+ */
+
+#ifndef GROUPPROBEHASHMAP_H_
+#define GROUPPROBEHASHMAP_H_
+
+#include <functional>
+#include <cstdlib>
+#include <cstring>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+
+#include <x86intrin.h>
+
+#include "seededhash.hh"
+
+template<typename K, typename V, class HashFunc = std::hash<K>, class KeyEqual = std::equal_to<K> >
+class GroupProbeHashMap
+{
+public:
+    typedef K key_type;
+    typedef V mapped_type;
+    typedef std::pair<const K, V> value_type;
+    typedef HashFunc hasher;
+    typedef std::ptrdiff_t difference_type;
+    typedef value_type* pointer;
+    typedef const value_type* const_pointer;
+    typedef value_type& reference;
+    typedef const value_type& const_reference;
+
+#ifdef __AVX2__
+    static const unsigned long long GROUP_WIDTH = 32;
+#else
+    static const unsigned long long GROUP_WIDTH = 16;
+#endif
+    static const unsigned long long MAX_LOAD_PERCENT = 80;
+    static const unsigned long long MIN_CAPACITY = 2 * GROUP_WIDTH;
+    static const unsigned char CTRL_EMPTY = 0;
+    static const unsigned char CTRL_FULL = 0x80;
+
+private:
+    unsigned char * ctrl; //8 capacity + GROUP_WIDTH control bytes, last GROUP_WIDTH mirror the first
+    value_type * slots; //8
+    unsigned long long capacity; //8
+    unsigned long long numElements; //8
+    unsigned long long growthLimit; //8 numElements that triggers the next rehash
+    HashFunc hasherFunc; // padded to 4
+    KeyEqual keyEqual; // padded to 4
+
+    GroupProbeHashMap(const GroupProbeHashMap&) = delete;
+    GroupProbeHashMap& operator=(const GroupProbeHashMap&) = delete;
+
+    static inline unsigned char ctrlOf(unsigned long long hash)
+    {
+        return CTRL_FULL | (unsigned char) (hash & 0x7F);
+    }
+    // bit per slot of the group starting at pos
+    static inline unsigned long long matchGroup(const unsigned char * group, unsigned char ctrlByte);
+    static inline unsigned long long fullGroup(const unsigned char * group);
+    inline unsigned long long wrapIdx(unsigned long long idx) const
+    {
+        return idx >= capacity ? idx - capacity : idx;
+    }
+    inline void setCtrl(unsigned long long pos, unsigned char ctrlByte)
+    {
+        ctrl[pos] = ctrlByte;
+        if(pos < GROUP_WIDTH)
+            ctrl[capacity + pos] = ctrlByte;
+    }
+    static inline void moveElement(value_type * to, value_type & from)
+    {
+        new (to) value_type(std::move((std::pair<K, V>&) from));
+    }
+
+    void allocate(unsigned long long inCapacity);
+    void rehash(unsigned long long newCapacity);
+    // slot of the key or capacity if missing, emptyPos gets the empty slot that ended the run
+    unsigned long long find(const K & inKey, unsigned long long hash, unsigned long long & emptyPos) const;
+    unsigned long long findEmpty(unsigned long long hash) const; // key known to be missing
+
+    // constructor(value_type *) placement constructs a new element, updater(value_type &) changes the existing one. true if inserted
+    template<class Constructor, class Updater>
+    bool upsertInternal(const K & inKey, Constructor & constructor, Updater & updater);
+    template<class VV>
+    bool setInternal(const K & inKey, VV && inValue);
+
+public:
+    // room for inMaxElements without a rehash
+    explicit GroupProbeHashMap(unsigned long long inMaxElements = 1024, const HashFunc & inHasher = HashFunc(), const KeyEqual & inKeyEqual = KeyEqual());
+    ~GroupProbeHashMap();
+
+    bool insert(const K & inKey, const V & inValue);
+    bool insert(const K & inKey, V && inValue);
+    bool put(const K & inKey, const V & inValue); // inserted(false) or set(true)
+    bool put(const K & inKey, V && inValue);
+    bool get(const K & inKey, V & inValue) const;
+    bool set(const K & inKey, const V & inValue);
+    bool set(const K & inKey, V && inValue);
+    bool remove(const K & inKey);
+
+    // emplace builds the pair from args first and drops it if key is there already. try_emplace constructs the value from args
+    // in place only if key is missing, args are left alone otherwise. NOTE: both true if inserted
+    template<class... Args>
+    bool emplace(Args&&... args);
+    template<class... Args>
+    bool try_emplace(const K & inKey, Args&&... args);
+    template<class... Args>
+    bool try_emplace(K && inKey, Args&&... args);
+
+    void clear();
+    void reserve(unsigned long long inMaxElements);
+    unsigned long long size() const
+    {
+        return numElements;
+    }
+    unsigned long long slotCount() const
+    {
+        return capacity;
+    }
+};
+
+template<typename K, typename V, class HashFunc, class KeyEqual>
+unsigned long long GroupProbeHashMap<K, V, HashFunc, KeyEqual>::matchGroup(const unsigned char * group, unsigned char ctrlByte)
+{
+#ifdef __AVX2__
+    const __m256i bytes = _mm256_loadu_si256((const __m256i *) group);
+    return (unsigned int) _mm256_movemask_epi8(_mm256_cmpeq_epi8(bytes, _mm256_set1_epi8((char) ctrlByte)));
+#else
+    const __m128i bytes = _mm_loadu_si128((const __m128i *) group);
+    return (unsigned int) _mm_movemask_epi8(_mm_cmpeq_epi8(bytes, _mm_set1_epi8((char) ctrlByte)));
+#endif
+}
+
+// full slots have the sign bit set, movemask alone picks them
+template<typename K, typename V, class HashFunc, class KeyEqual>
+unsigned long long GroupProbeHashMap<K, V, HashFunc, KeyEqual>::fullGroup(const unsigned char * group)
+{
+#ifdef __AVX2__
+    return (unsigned int) _mm256_movemask_epi8(_mm256_loadu_si256((const __m256i *) group));
+#else
+    return (unsigned int) _mm_movemask_epi8(_mm_loadu_si128((const __m128i *) group));
+#endif
+}
+
+template<typename K, typename V, class HashFunc, class KeyEqual>
+GroupProbeHashMap<K, V, HashFunc, KeyEqual>::GroupProbeHashMap(unsigned long long inMaxElements, const HashFunc & inHasher, const KeyEqual & inKeyEqual) :
+                ctrl(0), slots(0), capacity(0), numElements(0), growthLimit(0), hasherFunc(inHasher), keyEqual(inKeyEqual)
+{
+    unsigned long long inCapacity = MIN_CAPACITY;
+    while(inCapacity * MAX_LOAD_PERCENT / 100 < inMaxElements)
+        inCapacity <<= 1;
+    allocate(inCapacity);
+}
+
+template<typename K, typename V, class HashFunc, class KeyEqual>
+GroupProbeHashMap<K, V, HashFunc, KeyEqual>::~GroupProbeHashMap()
+{
+    clear();
+    std::free(ctrl);
+    std::free(slots);
+}
+
+template<typename K, typename V, class HashFunc, class KeyEqual>
+void GroupProbeHashMap<K, V, HashFunc, KeyEqual>::allocate(unsigned long long inCapacity)
+{
+    ctrl = (unsigned char *) std::malloc(inCapacity + GROUP_WIDTH);
+    slots = (value_type *) std::malloc(inCapacity * sizeof(value_type));
+    if(!ctrl || !slots)
+        abort();
+    memset(ctrl, CTRL_EMPTY, inCapacity + GROUP_WIDTH);
+    capacity = inCapacity;
+    growthLimit = capacity * MAX_LOAD_PERCENT / 100;
+}
+
+template<typename K, typename V, class HashFunc, class KeyEqual>
+void GroupProbeHashMap<K, V, HashFunc, KeyEqual>::rehash(unsigned long long newCapacity)
+{
+    unsigned char * oldCtrl = ctrl;
+    value_type * oldSlots = slots;
+    const unsigned long long oldCapacity = capacity;
+    allocate(newCapacity);
+    for(unsigned long long pos = 0; pos < oldCapacity; ++pos)
+    {
+        if(oldCtrl[pos] == CTRL_EMPTY)
+            continue;
+        const unsigned long long hash = applyHash(hasherFunc, oldSlots[pos].first);
+        const unsigned long long newPos = findEmpty(hash);
+        setCtrl(newPos, ctrlOf(hash));
+        moveElement(&slots[newPos], oldSlots[pos]);
+        oldSlots[pos].~value_type();
+    }
+    std::free(oldCtrl);
+    std::free(oldSlots);
+}
+
+template<typename K, typename V, class HashFunc, class KeyEqual>
+void GroupProbeHashMap<K, V, HashFunc, KeyEqual>::reserve(unsigned long long inMaxElements)
+{
+    unsigned long long newCapacity = capacity;
+    while(newCapacity * MAX_LOAD_PERCENT / 100 < inMaxElements)
+        newCapacity <<= 1;
+    if(newCapacity != capacity)
+        rehash(newCapacity);
+}
+
+template<typename K, typename V, class HashFunc, class KeyEqual>
+void GroupProbeHashMap<K, V, HashFunc, KeyEqual>::clear()
+{
+    if(!std::is_trivially_destructible<value_type>::value)
+    {
+        for(unsigned long long pos = 0; pos < capacity; ++pos)
+        {
+            if(ctrl[pos] != CTRL_EMPTY)
+                slots[pos].~value_type();
+        }
+    }
+    memset(ctrl, CTRL_EMPTY, capacity + GROUP_WIDTH);
+    numElements = 0;
+}
+
+template<typename K, typename V, class HashFunc, class KeyEqual>
+unsigned long long GroupProbeHashMap<K, V, HashFunc, KeyEqual>::find(const K & inKey, unsigned long long hash, unsigned long long & emptyPos) const
+{
+    const unsigned char ctrlByte = ctrlOf(hash);
+    unsigned long long idx = reduceRange(hash, capacity);
+    while(true) // table is never full, every run ends in an empty slot
+    {
+        unsigned long long matches = matchGroup(ctrl + idx, ctrlByte);
+        const unsigned long long empties = ~fullGroup(ctrl + idx) & ((1ULL << GROUP_WIDTH) - 1);
+        if(empties)
+            matches &= (empties & (0 - empties)) - 1; // past the first empty slot is another run
+        while(matches)
+        {
+            const unsigned long long pos = wrapIdx(idx + __builtin_ctzll(matches));
+            if(keyEqual(slots[pos].first, inKey))
+                return pos;
+            matches &= matches - 1;
+        }
+        if(empties)
+        {
+            emptyPos = wrapIdx(idx + __builtin_ctzll(empties));
+            return capacity;
+        }
+        idx = wrapIdx(idx + GROUP_WIDTH);
+    }
+}
+
+template<typename K, typename V, class HashFunc, class KeyEqual>
+unsigned long long GroupProbeHashMap<K, V, HashFunc, KeyEqual>::findEmpty(unsigned long long hash) const
+{
+    unsigned long long idx = reduceRange(hash, capacity);
+    while(true)
+    {
+        const unsigned long long empties = ~fullGroup(ctrl + idx) & ((1ULL << GROUP_WIDTH) - 1);
+        if(empties)
+            return wrapIdx(idx + __builtin_ctzll(empties));
+        idx = wrapIdx(idx + GROUP_WIDTH);
+    }
+}
+
+template<typename K, typename V, class HashFunc, class KeyEqual>
+template<class Constructor, class Updater>
+bool GroupProbeHashMap<K, V, HashFunc, KeyEqual>::upsertInternal(const K & inKey, Constructor & constructor, Updater & updater)
+{
+    const unsigned long long hash = applyHash(hasherFunc, inKey);
+    unsigned long long emptyPos;
+    const unsigned long long pos = find(inKey, hash, emptyPos);
+    if(pos != capacity)
+    {
+        updater(slots[pos]);
+        return false;
+    }
+    if(numElements >= growthLimit)
+    {
+        rehash(capacity << 1);
+        emptyPos = findEmpty(hash);
+    }
+    constructor(&slots[emptyPos]); // key may be moved from after this
+    setCtrl(emptyPos, ctrlOf(hash));
+    ++numElements;
+    return true;
+}
+
+template<typename K, typename V, class HashFunc, class KeyEqual>
+bool GroupProbeHashMap<K, V, HashFunc, KeyEqual>::insert(const K & inKey, const V & inValue)
+{
+    auto constructor = [&inKey, &inValue](value_type * element) { new (element) value_type(inKey, inValue); };
+    auto updater = [](value_type &) {};
+    return upsertInternal(inKey, constructor, updater);
+}
+
+template<typename K, typename V, class HashFunc, class KeyEqual>
+bool GroupProbeHashMap<K, V, HashFunc, KeyEqual>::insert(const K & inKey, V && inValue)
+{
+    auto constructor = [&inKey, &inValue](value_type * element) { new (element) value_type(inKey, std::move(inValue)); };
+    auto updater = [](value_type &) {};
+    return upsertInternal(inKey, constructor, updater);
+}
+
+template<typename K, typename V, class HashFunc, class KeyEqual>
+bool GroupProbeHashMap<K, V, HashFunc, KeyEqual>::put(const K & inKey, const V & inValue)
+{
+    auto constructor = [&inKey, &inValue](value_type * element) { new (element) value_type(inKey, inValue); };
+    auto updater = [&inValue](value_type & element) { element.second = inValue; };
+    return !upsertInternal(inKey, constructor, updater);
+}
+
+template<typename K, typename V, class HashFunc, class KeyEqual>
+bool GroupProbeHashMap<K, V, HashFunc, KeyEqual>::put(const K & inKey, V && inValue)
+{
+    auto constructor = [&inKey, &inValue](value_type * element) { new (element) value_type(inKey, std::move(inValue)); };
+    auto updater = [&inValue](value_type & element) { element.second = std::move(inValue); };
+    return !upsertInternal(inKey, constructor, updater);
+}
+
+template<typename K, typename V, class HashFunc, class KeyEqual>
+template<class... Args>
+bool GroupProbeHashMap<K, V, HashFunc, KeyEqual>::emplace(Args&&... args)
+{
+    std::pair<K, V> newElement(std::forward<Args>(args)...); // non const key so it can be moved in
+    auto constructor = [&newElement](value_type * element) { new (element) value_type(std::move(newElement)); };
+    auto updater = [](value_type &) {};
+    return upsertInternal(newElement.first, constructor, updater);
+}
+
+template<typename K, typename V, class HashFunc, class KeyEqual>
+template<class... Args>
+bool GroupProbeHashMap<K, V, HashFunc, KeyEqual>::try_emplace(const K & inKey, Args&&... args)
+{
+    auto constructor = [&](value_type * element)
+    {
+        new (element) value_type(std::piecewise_construct, std::forward_as_tuple(inKey), std::forward_as_tuple(std::forward<Args>(args)...));
+    };
+    auto updater = [](value_type &) {};
+    return upsertInternal(inKey, constructor, updater);
+}
+
+// key is compared against before it is moved into the new element
+template<typename K, typename V, class HashFunc, class KeyEqual>
+template<class... Args>
+bool GroupProbeHashMap<K, V, HashFunc, KeyEqual>::try_emplace(K && inKey, Args&&... args)
+{
+    auto constructor = [&](value_type * element)
+    {
+        new (element) value_type(std::piecewise_construct, std::forward_as_tuple(std::move(inKey)), std::forward_as_tuple(std::forward<Args>(args)...));
+    };
+    auto updater = [](value_type &) {};
+    return upsertInternal(inKey, constructor, updater);
+}
+
+template<typename K, typename V, class HashFunc, class KeyEqual>
+bool GroupProbeHashMap<K, V, HashFunc, KeyEqual>::get(const K & inKey, V & inValue) const
+{
+    unsigned long long emptyPos;
+    const unsigned long long pos = find(inKey, applyHash(hasherFunc, inKey), emptyPos);
+    if(pos == capacity)
+        return false;
+    inValue = slots[pos].second;
+    return true;
+}
+
+template<typename K, typename V, class HashFunc, class KeyEqual>
+bool GroupProbeHashMap<K, V, HashFunc, KeyEqual>::set(const K & inKey, const V & inValue)
+{
+    return setInternal(inKey, inValue);
+}
+
+template<typename K, typename V, class HashFunc, class KeyEqual>
+bool GroupProbeHashMap<K, V, HashFunc, KeyEqual>::set(const K & inKey, V && inValue)
+{
+    return setInternal(inKey, std::move(inValue));
+}
+
+template<typename K, typename V, class HashFunc, class KeyEqual>
+template<class VV>
+bool GroupProbeHashMap<K, V, HashFunc, KeyEqual>::setInternal(const K & inKey, VV && inValue)
+{
+    unsigned long long emptyPos;
+    const unsigned long long pos = find(inKey, applyHash(hasherFunc, inKey), emptyPos);
+    if(pos == capacity)
+        return false;
+    slots[pos].second = std::forward<VV>(inValue);
+    return true;
+}
+
+// backward shift: every later element of the run whose home slot is not between the hole and itself moves into the hole,
+// the run ends where the first empty slot is
+template<typename K, typename V, class HashFunc, class KeyEqual>
+bool GroupProbeHashMap<K, V, HashFunc, KeyEqual>::remove(const K & inKey)
+{
+    unsigned long long emptyPos;
+    unsigned long long holePos = find(inKey, applyHash(hasherFunc, inKey), emptyPos);
+    if(holePos == capacity)
+        return false;
+    slots[holePos].~value_type();
+    for(unsigned long long pos = wrapIdx(holePos + 1); ctrl[pos] != CTRL_EMPTY; pos = wrapIdx(pos + 1))
+    {
+        const unsigned long long homePos = reduceRange(applyHash(hasherFunc, slots[pos].first), capacity);
+        if(wrapIdx(pos + capacity - homePos) < wrapIdx(pos + capacity - holePos))
+            continue; // home is past the hole, element can't move before it
+        moveElement(&slots[holePos], slots[pos]);
+        slots[pos].~value_type();
+        setCtrl(holePos, ctrl[pos]);
+        holePos = pos;
+    }
+    setCtrl(holePos, CTRL_EMPTY);
+    --numElements;
+    return true;
+}
+
+/*
+    // Sample, same calls as CantStopHashMap (SparseHashTableV2.h), build with -mavx2 for 32 wide groups
+
+    GroupProbeHashMap<unsigned long long, unsigned long long> map(1000000);
+    const unsigned long long KEYS = 1000000;
+    std::vector<unsigned long long> keys(KEYS);
+    for (unsigned long long i = 0; i < KEYS; ++i)
+        keys[i] = mix64(i + 1);
+    auto start = std::chrono::steady_clock::now();
+    for (unsigned long long i = 0; i < KEYS; ++i)
+        map.insert(keys[i], i);
+    double insertSecs = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    unsigned long long value, hits = 0;
+    start = std::chrono::steady_clock::now();
+    for (unsigned long long i = 0; i < KEYS; ++i)
+        hits += map.get(keys[i], value);
+    double hitSecs = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    start = std::chrono::steady_clock::now();
+    for (unsigned long long i = 0; i < KEYS; ++i)
+        hits += map.get(keys[i] + 1, value);
+    double missSecs = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    start = std::chrono::steady_clock::now();
+    for (unsigned long long i = 0; i < KEYS; i += 2)
+        map.remove(keys[i]);
+    double removeSecs = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    printf("insert %f hit %f miss %f remove %f Mops/s, %llu hits, %llu left in %llu slots\n", KEYS / insertSecs / 1000000.0,
+           KEYS / hitSecs / 1000000.0, KEYS / missSecs / 1000000.0, KEYS / 2 / removeSecs / 1000000.0, hits, map.size(), map.slotCount());
+
+*/
+
+#endif /* GROUPPROBEHASHMAP_H_ */
@@ -0,0 +1,265 @@
+/*
+ * HugePages.h
+ *
+ * Huge page backing for big arrays, used like malloc/free. A policy names the largest page size worth trying, allocation falls
+ * back from 1 GB to 2 MB hugetlb pages (reserved through /proc/sys/vm/nr_hugepages or hugepages= on the kernel command line), then
+ * to a 2 MB aligned anonymous mapping madvised for transparent huge pages and finally to the heap. Arrays smaller than a huge page
+ * stay on the heap whatever the policy. Memory is not zeroed and only the page holding the header is touched, so NUMA policies set
+ * after allocate still apply to the rest.
+ *
+ * Every region remembers its backing in a header right before the returned pointer. stats() tells per region how much of it
+ * actually sits on huge pages, transparent ones are only counted once the kernel has backed them (after first touch or khugepaged).
+ */
+
+#ifndef HUGEPAGES_H_
+#define HUGEPAGES_H_
+
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#include <sys/mman.h>
+#include <unistd.h>
+
+#ifndef MAP_HUGE_SHIFT
+#define MAP_HUGE_SHIFT 26
+#endif
+
+class HugePages
+{
+public:
+    enum Policy
+    {
+        HUGEPAGES_NONE = 0, // heap, same as malloc
+        HUGEPAGES_TRANSPARENT = 1, // madvised anonymous mapping
+        HUGEPAGES_2M = 2, // 2 MB hugetlb, then transparent
+        HUGEPAGES_1G = 3 // 1 GB hugetlb for regions of at least 1 GB, then 2 MB, then transparent
+    };
+    enum Backing
+    {
+        BACKING_HEAP = 0,
+        BACKING_PAGES = 1, // anonymous mapping, transparent huge pages disabled or refused
+        BACKING_TRANSPARENT = 2,
+        BACKING_HUGETLB_2M = 3,
+        BACKING_HUGETLB_1G = 4,
+        BACKING_COUNT = 5
+    };
+
+    static const unsigned long long HUGE_2M = 2ULL << 20;
+    static const unsigned long long HUGE_1G = 1ULL << 30;
+
+    struct RegionStats
+    {
+        unsigned int backing;
+        unsigned long long size; // requested
+        unsigned long long mappedSize; // header and rounding included
+        unsigned long long hugeBytes; // currently on huge pages, approximate for transparent ones
+    };
+    // bytes requested per backing by live regions of the process
+    struct Totals
+    {
+        unsigned long long bytes[BACKING_COUNT];
+    };
+
+    // 0 if nothing could be allocated
+    static inline void * allocate(size_t size, unsigned int policy);
+    static inline void release(void * ptr); // 0 is fine
+    static inline unsigned int backing(const void * ptr);
+    static inline RegionStats stats(const void * ptr);
+    static inline Totals totals();
+    static inline const char * backingName(unsigned int backing);
+
+private:
+    struct Header
+    {
+        void * base; //8
+        unsigned long long mappedSize; //8
+        unsigned long long size; //8
+        unsigned int backing; //4
+        char padding0[36]; // padding to cacheline, keeps the region cacheline aligned on mappings
+    };
+
+    static std::atomic<unsigned long long> * liveBytes()
+    {
+        static std::atomic<unsigned long long> bytes[BACKING_COUNT] = {};
+        return bytes;
+    }
+    static inline Header * header(const void * ptr)
+    {
+        return (Header *) ptr - 1;
+    }
+    static inline void * mapHugetlb(size_t size, unsigned long long pageSize, Header & res);
+    static inline void * mapTransparent(size_t size, Header & res);
+    static inline bool transparentEnabled();
+    static inline unsigned long long smapsHugeBytes(const void * ptr, size_t size);
+};
+
+inline void * HugePages::mapHugetlb(size_t size, unsigned long long pageSize, Header & res)
+{
+    const unsigned long long mappedSize = (size + sizeof(Header) + pageSize - 1) & ~(pageSize - 1);
+    const int sizeFlag = (pageSize == HUGE_1G ? 30 : 21) << MAP_HUGE_SHIFT;
+    void * base = mmap(0, mappedSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | sizeFlag, -1, 0);
+    if(base == MAP_FAILED)
+        return 0; // nothing reserved for this size
+    res.base = base;
+    res.mappedSize = mappedSize;
+    res.backing = pageSize == HUGE_1G ? BACKING_HUGETLB_1G : BACKING_HUGETLB_2M;
+    return base;
+}
+
+// maps an extra huge page to cut a 2 MB aligned piece out of it, so the kernel can use huge pages from the first byte
+inline void * HugePages::mapTransparent(size_t size, Header & res)
+{
+    const unsigned long long pageSize = sysconf(_SC_PAGESIZE);
+    const unsigned long long mappedSize = (size + sizeof(Header) + pageSize - 1) & ~(pageSize - 1);
+    char * raw = (char *) mmap(0, mappedSize + HUGE_2M, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if(raw == MAP_FAILED)
+        return 0;
+    char * base = (char *) (((unsigned long long) raw + HUGE_2M - 1) & ~(HUGE_2M - 1));
+    if(base != raw)
+        munmap(raw, base - raw);
+    if(raw + mappedSize + HUGE_2M != base + mappedSize)
+        munmap(base + mappedSize, raw + mappedSize + HUGE_2M - (base + mappedSize));
+    res.base = base;
+    res.mappedSize = mappedSize;
+    res.backing = !madvise(base, mappedSize, MADV_HUGEPAGE) && transparentEnabled() ? BACKING_TRANSPARENT : BACKING_PAGES;
+    return base;
+}
+
+// "always [madvise] never", madvised regions get huge pages unless it is never
+inline bool HugePages::transparentEnabled()
+{
+    static const bool enabled = []()
+    {
+        FILE * pFile = fopen("/sys/kernel/mm/transparent_hugepage/enabled", "r");
+        if(!pFile)
+            return false;
+        char line[256];
+        const bool read = fgets(line, sizeof(line), pFile) != 0;
+        fclose(pFile);
+        return read && !strstr(line, "[never]");
+    }();
+    return enabled;
+}
+
+inline void * HugePages::allocate(size_t size, unsigned int policy)
+{
+    Header head;
+    memset(&head, 0, sizeof(head));
+    void * base = 0;
+    if(policy == HUGEPAGES_1G && size >= HUGE_1G)
+        base = mapHugetlb(size, HUGE_1G, head);
+    if(!base && policy >= HUGEPAGES_2M && size >= HUGE_2M)
+        base = mapHugetlb(size, HUGE_2M, head);
+    if(!base && policy != HUGEPAGES_NONE && size >= HUGE_2M)
+        base = mapTransparent(size, head);
+    if(!base)
+    {
+        base = std::malloc(size + sizeof(Header));
+        if(!base)
+            return 0;
+        head.base = base;
+        head.mappedSize = size + sizeof(Header);
+        head.backing = BACKING_HEAP;
+    }
+    head.size = size;
+    memcpy(base, &head, sizeof(head));
+    liveBytes()[head.backing].fetch_add(size, std::memory_order_relaxed);
+    return (Header *) base + 1;
+}
+
+inline void HugePages::release(void * ptr)
+{
+    if(!ptr)
+        return;
+    const Header head = *header(ptr);
+    liveBytes()[head.backing].fetch_sub(head.size, std::memory_order_relaxed);
+    if(head.backing == BACKING_HEAP)
+        std::free(head.base);
+    else
+        munmap(head.base, head.mappedSize);
+}
+
+inline unsigned int HugePages::backing(const void * ptr)
+{
+    return header(ptr)->backing;
+}
+
+// AnonHugePages of the mappings overlapping the region, regions sharing a mapping with others (heap) may see their neighbours'
+inline unsigned long long HugePages::smapsHugeBytes(const void * ptr, size_t size)
+{
+    FILE * pFile = fopen("/proc/self/smaps", "r");
+    if(!pFile)
+        return 0;
+    const unsigned long long begin = (unsigned long long) ptr;
+    const unsigned long long end = begin + size;
+    unsigned long long res = 0;
+    bool overlaps = false;
+    char line[512];
+    while(fgets(line, sizeof(line), pFile))
+    {
+        unsigned long long mapBegin, mapEnd, kbytes;
+        if(sscanf(line, "%llx-%llx ", &mapBegin, &mapEnd) == 2)
+            overlaps = mapBegin < end && begin < mapEnd;
+        else if(overlaps && sscanf(line, "AnonHugePages: %llu kB", &kbytes) == 1)
+            res += kbytes << 10;
+    }
+    fclose(pFile);
+    return res < size ? res : size;
+}
+
+inline HugePages::RegionStats HugePages::stats(const void * ptr)
+{
+    RegionStats res;
+    memset(&res, 0, sizeof(res));
+    if(!ptr)
+        return res;
+    const Header & head = *header(ptr);
+    res.backing = head.backing;
+    res.size = head.size;
+    res.mappedSize = head.mappedSize;
+    if(head.backing == BACKING_HUGETLB_2M || head.backing == BACKING_HUGETLB_1G)
+        res.hugeBytes = head.size;
+    else
+        res.hugeBytes = smapsHugeBytes(ptr, head.size); // heap may get transparent huge pages with "always" too
+    return res;
+}
+
+inline HugePages::Totals HugePages::totals()
+{
+    Totals res;
+    for(unsigned long long backingIdx = 0; backingIdx < BACKING_COUNT; ++backingIdx)
+        res.bytes[backingIdx] = liveBytes()[backingIdx].load(std::memory_order_relaxed);
+    return res;
+}
+
+inline const char * HugePages::backingName(unsigned int backing)
+{
+    static const char * names[BACKING_COUNT] = { "heap", "pages", "transparent", "hugetlb 2M", "hugetlb 1G" };
+    return backing < BACKING_COUNT ? names[backing] : "unknown";
+}
+
+/*
+    // Sample random probe benchmark, run it under perf stat -e dTLB-load-misses with each policy. 2 MB hugetlb pages need a reserve
+    // first (echo 2048 > /proc/sys/vm/nr_hugepages), without one HUGEPAGES_2M falls back to transparent pages
+    const unsigned long long SIZE = 4ULL << 30, PROBES = 100000000;
+    unsigned int policy = argc > 1 ? atoi(argv[1]) : HugePages::HUGEPAGES_NONE;
+    unsigned long long * arr = (unsigned long long *) HugePages::allocate(SIZE, policy);
+    memset(arr, 0, SIZE);
+    unsigned long long pos = 0, sum = 0;
+    auto start = std::chrono::steady_clock::now();
+    for (unsigned long long i = 0; i < PROBES; ++i)
+    {
+        pos = mix64(pos + i) % (SIZE / sizeof(unsigned long long));
+        sum += arr[pos]++;
+    }
+    double secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    HugePages::RegionStats stats = HugePages::stats(arr);
+    printf("%s: %llu of %llu bytes on huge pages, %f Mprobes/s (%llu)\n", HugePages::backingName(stats.backing), stats.hugeBytes, stats.size,
+           PROBES / secs / 1000000.0, sum);
+    HugePages::release(arr);
+
+*/
+
+#endif /* HUGEPAGES_H_ */
@@ -1,17 +1,47 @@
 #ifndef LFLRUHASHTABLE_H_
 #define LFLRUHASHTABLE_H_
 
+#include <algorithm>
 #include <functional>
 #include <atomic>
+#include <chrono>
 #include <cstdlib>
 #include <cstring>
 #include <stdexcept>
 #include <utility>
 #include <memory>
+#include <mutex>
+#include <vector>
 #include <math.h>
 
-// TODO: bring back expTime. for each thread keep a possible evict list that consist of items this thread inserted and their expTime was below that of lruLists.tail.expTime at the moment of insert. check the list before popping tail.
-template<typename K, typename V, class HashFunc = std::hash<K> >
+#include "seededhash.hh"
+#include "FrequencySketch.h"
+#include "HugePages.h"
+#include "WorkStealingPool.h"
+
+// Elements can carry expTime (nowMs() based, 0 is never). Expired elements are invisible to get/set and get reclaimed three ways:
+// by the get that finds them, by insert of the same key that takes them over, and by a per thread timer wheel that insert sweeps
+// before it evicts a live tail. Wheel holds (element, expTime) for elements the thread gave a TTL, stale entries just get dropped
+//
+// Policy flags make it scan resistant. POLICY_SLRU splits every thread list in two: new elements go to probation list, a hit moves
+// element to protected list (up to SLRU_PROTECTED_PERCENT of thread elements, its tail goes back to probation head), eviction
+// takes probation tail first. POLICY_TINYLFU counts get hits and inserts in a FrequencySketch and insert that would evict only
+// gets in if its key was seen more often than the victim's
+//
+// Thread lists are handed out by getMyThreadId() (cached per thread, given back at thread exit) or registerThread() / releaseThread().
+// Ids are recycled, a new thread takes over the list of a departed one. Released lists that nobody took yet are orphans, their cold
+// ends get stolen first by evicting threads, so nothing stays stranded. More threads than inNumThreads get new lists, list directory
+// starts with room for inMaxThreads and doubles when it runs out
+//
+// Capacity is not split between threads. Free elements live in a shared lock free pool as batches of FREE_BATCH, a thread takes a
+// batch when its own free list runs dry and gives one back once it holds 2 * FREE_BATCH (removes, expiry, a released thread). With
+// the pool empty, eviction takes the oldest cold end of all lists by accessClock, a coarse global clock elements are stamped with at
+// insert and hit. That is our own tail most of the time, elements of idle or slower threads otherwise, so a single writer can grow
+// to the whole table and the hit ratio stays close to one global LRU
+//
+// inHugePages (see HugePages.h) backs elementStorage and elementLinks with huge pages, both are probed at random and big enough to
+// miss the TLB on nearly every access. elementStorageStats() / elementLinksStats() tell what backing they got
+template<typename K, typename V, class HashFunc = SeededHash<K> >
 class LFLRUHashTable
 {
     template<typename KK, typename VV, class HH>
@@ -39,6 +69,9 @@ public:
         friend class LFLRUHashTableUtil;
 
         std::atomic<LRULinks> links;
+        unsigned long long expTime; // 0 never expires
+        unsigned int listInfo; // thread << 1 | protected, valid while linked. Next batch for a batch head in the free pool
+        unsigned int stamp; // accessClock at insert or last hit. Batch length for a batch head in the free pool
 
         K key;
         V value;
@@ -56,6 +89,16 @@ public:
     typedef const value_type& const_reference;
     static const unsigned long long HASH_MAX_LOCK_DEPTH = 248;
 
+    enum Policy
+    {
+        POLICY_LRU = 0,
+        POLICY_SLRU = 1, // probation / protected lists
+        POLICY_TINYLFU = 2, // frequency sketch admission
+        POLICY_SLRU_TINYLFU = POLICY_SLRU | POLICY_TINYLFU
+    };
+    static const unsigned long long SLRU_PROTECTED_PERCENT = 80;
+    static const unsigned long long TINYLFU_ADMIT_EVERY = 64; // turned down keys, one of them gets in anyway
+
 private:
 
     static const unsigned long long HOLY_GRAIL_SIZE = 16;
@@ -63,60 +106,198 @@ private:
     static const unsigned int LIST_END_MARK = 0xFFFFFFFE;
     static const unsigned int HASH_FREE_MARK = 0xFFFFFFFF;
     static const unsigned int HASH_LOCK_MARK = 0xFFFFFFFE;
+    static const unsigned long long EXPIRY_WHEEL_SLOTS = 256;
+    static const unsigned long long EXPIRY_TICK_MS = 1000; // wheel turns every ~4 minutes
+    static const unsigned long long EXPIRY_SWEEP_BUDGET = 32; // wheel entries looked at per insert that is about to evict
+    static const unsigned long long DEFAULT_MAX_THREADS = 1024; // room in list directory at start, chunks are set up as threads register
+    static const unsigned long long LIST_CHUNK_SIZE = 16; // thread lists (and their timer wheels) set up at once, they never move after
+    static const unsigned long long STEAL_TRIES = 4; // failed unlinks at the cold end of a list before steal gives up
+    static const unsigned long long STEAL_BATCH = 8; // elements taken from someone else's list at once
+    static const unsigned long long FREE_BATCH = 64; // elements moved between thread free list and free pool at once
+    static const unsigned long long VICTIM_RESCAN = 16; // evictions before the coldest list is looked up again
+    static const unsigned long long CLOCK_TICK_OPS = 64; // stamps per thread for one accessClock tick
+    static const unsigned long long PARALLEL_CHUNK_SLOTS = 65536; // pool task of packHashParallel / processHashParallel
+    static const unsigned int LIST_IDLE = 0; // not owned, nothing to steal
+    static const unsigned int LIST_OWNED = 1;
+    static const unsigned int LIST_ORPHAN = 2; // not owned, has elements
 
     struct ThreadLRUList
     {
         std::atomic_uint head; //4
         std::atomic_uint tail; //4
         std::atomic_uint freeListHead; //4
-        unsigned int reserved; //4
+        std::atomic_uint protectedCount; //4, changed by any thread that unlinks from protected list
+        std::atomic_uint protectedHead; //4
+        std::atomic_uint protectedTail; //4
+        std::atomic_uint size; //4, linked elements, changed by any thread that unlinks from the list
+        std::atomic_uint state; //4
         unsigned long long moves; //8
         unsigned long long inserts; //8
+        unsigned long long rejects; //8, TinyLFU said no (admitted anyway included)
+        unsigned int freeCount; //4, below are owner only
+        unsigned int clockOps; //4
+        unsigned int victimList; //4, where evictions go until victimCountdown runs out
+        unsigned int victimCountdown; //4
         unsigned int locks[HASH_MAX_LOCK_DEPTH]; // four cachelines
     }__attribute((aligned(64)));
 
+    struct ExpiryEntry
+    {
+        unsigned int elementIdx; //4
+        unsigned int reserved; //4
+        unsigned long long expTime; //8
+    };
+
+    // owned by its thread, slot is expTime / EXPIRY_TICK_MS % EXPIRY_WHEEL_SLOTS. Entries for later turns just stay in the slot
+    struct ExpiryWheel
+    {
+        ExpiryEntry * slots[EXPIRY_WHEEL_SLOTS];
+        unsigned int slotSizes[EXPIRY_WHEEL_SLOTS];
+        unsigned int slotCapacities[EXPIRY_WHEEL_SLOTS];
+        unsigned long long tick; // next tick to sweep, all before it are swept
+        unsigned long long sweepPos; // entries of tick slot that stay
+        unsigned long long numEntries;
+    }__attribute((aligned(64)));
+
+    struct ListChunk
+    {
+        ThreadLRUList lists[LIST_CHUNK_SIZE];
+        ExpiryWheel wheels[LIST_CHUNK_SIZE];
+    };
+
+    // shared with thread locals of registered threads, thread exit after table is gone finds table 0
+    struct ThreadRegistry
+    {
+        std::mutex mutex;
+        LFLRUHashTable * table;
+        std::vector<unsigned int> freeIds; // next one to hand out at the back
+    };
+
+    struct Registration
+    {
+        ThreadRegistry * key; // registries are make_shared, address is not reused while weak_ptr lives
+        std::weak_ptr<ThreadRegistry> registry;
+        unsigned long long threadIdx;
+    };
+
+    // thread local, releases thread ids of all tables the thread used when it exits
+    struct ThreadRegistrations
+    {
+        std::vector<Registration> items;
+        ~ThreadRegistrations();
+    };
+
     static_assert(sizeof(std::atomic_uint) == sizeof(unsigned int), "sizeof(std::atomic_uint) != sizeof(unsigned int)");
 
-    ThreadLRUList * lruLists; //8
+    std::atomic<ListChunk **> listChunks; //8, directory with room for maxThreads lists, numLists in use. Full one is replaced by a copy twice the size
+    std::vector<ListChunk **> oldListChunks; //24, replaced directories, threads may still read lists through them
     LRUElement * elementStorage; //8
     std::atomic_uint * elementLinks; //8
     unsigned long long numElements; //8
     unsigned long long hashSize; //8
-    unsigned long long numThreads; //8
-    std::atomic_size_t nextThreadId; //8
-    std::atomic_uint globalFreeListHead; //4
-    HashFunc hasherFunc; // padded to 4
+    unsigned long long numThreads; //8, lists set up in constructor
+    unsigned long long maxThreads; //8, multiple of LIST_CHUNK_SIZE
+    std::atomic_size_t numLists; //8
+    std::atomic_size_t numRegistered; //8
+    std::atomic_size_t numOrphans; //8
+    std::atomic_ullong freePool; //8, ABA tag << 32 | first batch head
+    std::atomic_uint accessClock; //4
+    unsigned int policy; //4
+    unsigned int hugePages; //4, HugePages::Policy of elementStorage and elementLinks
+    FrequencySketch * sketch; //8, POLICY_TINYLFU only
+    std::shared_ptr<ThreadRegistry> registry; //16
+    HashFunc hasherFunc; // seeded, 8 with SeededHash
 
     inline bool unlinkElement(unsigned int elementIdx);
-    inline unsigned int unlinkTail(unsigned long long threadIdx);
-    inline bool linkHead(unsigned long long threadIdx, unsigned int elementIdx);
+    inline unsigned int unlinkTail(unsigned long long threadIdx, bool protectedList = false);
+    inline bool linkHead(unsigned long long threadIdx, unsigned int elementIdx, bool protectedList = false);
     inline bool linkTail(unsigned long long threadIdx, unsigned int elementIdx);
+    inline void touchElement(unsigned long long threadIdx, unsigned int elementIdx);
+    inline unsigned int victimElement(unsigned long long threadIdx);
+    inline bool admit(unsigned long long threadIdx, unsigned long long keyHash);
     inline unsigned int lockElementHash(unsigned long long pos);
     inline unsigned int tryLockElementHash(unsigned long long pos);
     inline void unlockElementHash(unsigned long long pos, unsigned int idx);
     inline void unlockElementsHash(const unsigned long long begin, const unsigned long long end, unsigned int * indexes);
-    inline void removeFromHashPos(unsigned long long threadIdx, unsigned long long storagePos);
-    inline bool removeFromHashKey(unsigned long long threadIdx, const K & inKey, unsigned int& pos);
+    inline bool removeFromHashPos(unsigned long long threadIdx, unsigned long long storagePos, unsigned long long expiredAt = 0, bool * unlinked = 0,
+                                  unsigned long long * windowBegin = 0, unsigned long long * windowEnd = 0);
+    inline bool removeFromHashKey(unsigned long long threadIdx, const K & inKey, unsigned int& pos, bool * unlinked = 0);
+    inline void pushFreeElement(unsigned long long threadIdx, unsigned int elementIdx);
+    inline void pushFreeBatch(unsigned int batchHead, unsigned int batchSize);
+    inline unsigned int popFreeBatch(unsigned int & batchSize);
+    inline bool freePoolEmpty() const
+    {
+        return (unsigned int) freePool.load(std::memory_order_relaxed) == LIST_END_MARK;
+    }
+    inline unsigned int tickClock(unsigned long long threadIdx);
+    inline bool isExpired(unsigned int elementIdx, unsigned long long & now);
+    inline void addExpiry(unsigned long long threadIdx, unsigned int elementIdx, unsigned long long expTime, unsigned long long dueTick = 0);
+    inline ThreadLRUList & threadList(unsigned long long threadIdx) const
+    {
+        return listChunks.load(std::memory_order_acquire)[threadIdx / LIST_CHUNK_SIZE]->lists[threadIdx % LIST_CHUNK_SIZE];
+    }
+    inline ExpiryWheel & expiryWheel(unsigned long long threadIdx) const
+    {
+        return listChunks.load(std::memory_order_acquire)[threadIdx / LIST_CHUNK_SIZE]->wheels[threadIdx % LIST_CHUNK_SIZE];
+    }
+    void initListChunks(); // directory with chunks for numLists lists, their timer wheels start empty
+    void freeListChunks();
+    void clearExpiryWheel(unsigned long long threadIdx);
+    void addList(unsigned long long threadIdx);
+    void initList(unsigned long long threadIdx);
+    void releaseThreadLocked(unsigned long long threadIdx);
+    void initRegistry();
+    inline unsigned long long stealFromList(unsigned long long threadIdx, unsigned long long listIdx);
+    inline unsigned long long coldestList(unsigned long long threadIdx);
+    inline bool refillFreeList(unsigned long long threadIdx);
+    template<class Predicate>
+    inline size_t packSlots(unsigned long long threadIdx, unsigned long long beginPos, unsigned long long endPos, Predicate & itemPredicate,
+                            unsigned long long * shiftedPast = 0);
+    template<class Processor>
+    inline void processSlots(unsigned long long beginPos, unsigned long long endPos, Processor & itemProcessor);
 
 public:
-    LFLRUHashTable(unsigned long long inNumElements, unsigned long long inHashSize, unsigned long long inNumThreads, const HashFunc & inHasher = HashFunc());
+    // inNumThreads lists are set up at start, list directory has room for inMaxThreads (0 is DEFAULT_MAX_THREADS) or inNumThreads if more
+    LFLRUHashTable(unsigned long long inNumElements, unsigned long long inHashSize, unsigned long long inNumThreads, const HashFunc & inHasher = HashFunc(),
+                   unsigned int inPolicy = POLICY_LRU, unsigned long long inMaxThreads = 0, unsigned int inHugePages = HugePages::HUGEPAGES_NONE);
     ~LFLRUHashTable();
     LFLRUHashTable(const LFLRUHashTable& other);
     LFLRUHashTable& operator=(const LFLRUHashTable& other);
 
+    // id of calling thread, registered on first call and released when thread exits. Cheap enough to call per operation
     unsigned long long getMyThreadId();
+    // explicit ids for threads managed by caller, every registerThread needs a releaseThread from the same thread (or once it is gone)
+    unsigned long long registerThread();
+    void releaseThread(unsigned long long threadIdx);
+
+    // expTime clock, steady milliseconds
+    static unsigned long long nowMs()
+    {
+        return std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
 
     // below operations are wait-free (as in based on "spinlock" instead of mutex)
-    // IMPORTANT: additional flags for set and get allows for implementation of CAS, FETCH_ADD, FETCH_SUB etc. in client code.
-    // Example: if (get(false)) { ++value; set ( true ) } is equivalent to FETCH_ADD
-    // Example: if (get(false) && (value==expected)) set ( true ); is equivalent to CAS
-    inline bool insert(unsigned long long threadIdx, const K & inKey, const V & inValue/*, bool unlock = true*/);
-    inline bool insertOrSet(unsigned long long threadIdx, const K & inKey, const V & inValue/*, bool unlock = true*/); // NOTE: true if inserted
+    // IMPORTANT: CAS, FETCH_ADD, FETCH_SUB etc. go through update, fetchAdd, compareExchange and upsert below, each in one probe with
+    // the element hash slot locked. Example: update(threadIdx, key, [](V & value) { ++value; }) is equivalent to FETCH_ADD
+    // Example: compareExchange(threadIdx, key, expected, desired) is equivalent to CAS
+    // ttlMs 0 never expires. Expired element with the same key is taken over and counts as inserted. False also if TinyLFU turned key down
+    inline bool insert(unsigned long long threadIdx, const K & inKey, const V & inValue, unsigned long long ttlMs = 0/*, bool unlock = true*/);
+    inline bool insertOrSet(unsigned long long threadIdx, const K & inKey, const V & inValue, unsigned long long ttlMs = 0/*, bool unlock = true*/); // NOTE: true if inserted, TTL is replaced either way
     inline bool get(unsigned long long threadIdx, const K & inKey, V & inValue, unsigned int * casLocks = 0, unsigned long long locksStart = 0,
                     unsigned long long locksEnd = 0); // casLocks must be unsigned int[HASH_MAX_LOCK_DEPTH]
     inline bool set(unsigned long long threadIdx, const K & inKey, const V & inValue, unsigned int * casLocks = 0, unsigned long long locksStart = 0,
                     unsigned long long locksEnd = 0); // casLocks must be unsigned int[HASH_MAX_LOCK_DEPTH]
     inline bool remove(unsigned long long threadIdx, const K & inKey);
+    // read-modify-write in a single probe, updater(V &) runs with element hash slot locked and counts as a hit. Expired element is missing.
+    // upsert calls factory() for the value of a missing (or expired) key, then it is insert with everything that comes with it
+    template<class Updater>
+    inline bool update(unsigned long long threadIdx, const K & inKey, Updater updater); // NOTE: false if key is missing
+    inline bool fetchAdd(unsigned long long threadIdx, const K & inKey, const V & delta, V & previous); // NOTE: false if key is missing
+    inline bool compareExchange(unsigned long long threadIdx, const K & inKey, V & expected, const V & desired); // NOTE: false if missing or different, expected gets current value then
+    template<class Factory, class Updater>
+    inline bool upsert(unsigned long long threadIdx, const K & inKey, Factory factory, Updater updater, unsigned long long ttlMs = 0); // NOTE: true if inserted, TTL is replaced either way
+    // reclaims expired elements from thread timer wheel, looks at up to budget entries. Returns number of elements put to thread free list
+    inline unsigned long long sweepExpired(unsigned long long threadIdx, unsigned long long budget);
     inline bool lockElement(unsigned long long threadIdx, const K & inKey, unsigned int * casLocks, unsigned long long locksStart = 0,
                             unsigned long long locksEnd = 0); // casLocks must be unsigned int[HASH_MAX_LOCK_DEPTH]
     inline bool unlockElement(unsigned long long threadIdx, const K & inKey, unsigned int * casLocks, unsigned long long locksStart = 0,
@@ -124,17 +305,278 @@ public:
 
     void swap(LFLRUHashTable& other);
 
-    inline size_t packHash(unsigned long long threadIdx, std::function<bool(LRUElement&)> itemPredicate);
-    inline void processHash(unsigned long long threadIdx, std::function<void(LRUElement&)> itemProcessor);
+    HugePages::RegionStats elementStorageStats() const
+    {
+        return HugePages::stats(elementStorage);
+    }
+    HugePages::RegionStats elementLinksStats() const
+    {
+        return HugePages::stats(elementLinks);
+    }
+
+    // whole hash walks. itemPredicate(LRUElement &) returns false for elements to remove (as remove() does), itemProcessor(LRUElement &)
+    // may change values. Hash slot of the element is locked meanwhile. Elements shifted back by a removal may be looked at twice
+    template<class Predicate>
+    inline size_t packHash(unsigned long long threadIdx, Predicate itemPredicate); // NOTE: number of removed elements
+    template<class Processor>
+    inline void processHash(unsigned long long threadIdx, Processor itemProcessor);
+    // same, chunks of PARALLEL_CHUNK_SLOTS hash slots are split across pool workers, every chunk registers a thread list of its own
+    // (callables must be thread safe and must not run jobs on the same pool). progress(slotsDone, hashSize) is called by the worker
+    // that finished a chunk, noProgress if not needed. Slots that removals shifted elements into across a chunk end are packed again
+    // after workers are done, so every element is looked at, some of them twice
+    template<class Predicate, class Progress>
+    size_t packHashParallel(Predicate itemPredicate, Progress progress, WorkStealingPool & pool = WorkStealingPool::shared());
+    template<class Processor, class Progress>
+    void processHashParallel(Processor itemProcessor, Progress progress, WorkStealingPool & pool = WorkStealingPool::shared());
+    static void noProgress(unsigned long long, unsigned long long)
+    {
+    }
 };
 
 template<typename K, typename V, class HashFunc>
 unsigned long long LFLRUHashTable<K, V, HashFunc>::getMyThreadId()
 {
-    unsigned long long res = nextThreadId++;
-    if(res >= numThreads)
-        abort(); // too many worker threads
-    return res;
+    static thread_local ThreadRegistrations registrations;
+    ThreadRegistry * const key = registry.get();
+    for(size_t itemIdx = 0; itemIdx < registrations.items.size(); ++itemIdx)
+    {
+        if(registrations.items[itemIdx].key == key)
+            return registrations.items[itemIdx].threadIdx;
+    }
+    Registration item;
+    item.key = key;
+    item.registry = registry;
+    item.threadIdx = registerThread();
+    registrations.items.push_back(item);
+    return item.threadIdx;
+}
+
+template<typename K, typename V, class HashFunc>
+LFLRUHashTable<K, V, HashFunc>::ThreadRegistrations::~ThreadRegistrations()
+{
+    for(size_t itemIdx = 0; itemIdx < items.size(); ++itemIdx)
+    {
+        std::shared_ptr<ThreadRegistry> itemRegistry = items[itemIdx].registry.lock();
+        if(!itemRegistry)
+            continue;
+        std::lock_guard<std::mutex> lock(itemRegistry->mutex);
+        if(itemRegistry->table)
+            itemRegistry->table->releaseThreadLocked(items[itemIdx].threadIdx);
+    }
+}
+
+// most recently released id first, its list is the warmest. Out of ids a new list is set up
+template<typename K, typename V, class HashFunc>
+unsigned long long LFLRUHashTable<K, V, HashFunc>::registerThread()
+{
+    std::lock_guard<std::mutex> lock(registry->mutex);
+    unsigned long long threadIdx;
+    if(!registry->freeIds.empty())
+    {
+        threadIdx = registry->freeIds.back();
+        registry->freeIds.pop_back();
+    }
+    else
+    {
+        threadIdx = numLists.load(std::memory_order_relaxed);
+        addList(threadIdx);
+        numLists.store(threadIdx + 1, std::memory_order_release);
+    }
+    if(threadList(threadIdx).state.exchange(LIST_OWNED) == LIST_ORPHAN)
+        --numOrphans;
+    ++numRegistered;
+    return threadIdx;
+}
+
+template<typename K, typename V, class HashFunc>
+void LFLRUHashTable<K, V, HashFunc>::releaseThread(unsigned long long threadIdx)
+{
+    std::lock_guard<std::mutex> lock(registry->mutex);
+    releaseThreadLocked(threadIdx);
+}
+
+// free elements go to free pool, list stays for the next thread to take over and is an orphan until then
+template<typename K, typename V, class HashFunc>
+void LFLRUHashTable<K, V, HashFunc>::releaseThreadLocked(unsigned long long threadIdx)
+{
+    if(threadList(threadIdx).freeListHead != LIST_END_MARK)
+        pushFreeBatch(threadList(threadIdx).freeListHead, threadList(threadIdx).freeCount);
+    threadList(threadIdx).freeListHead = LIST_END_MARK;
+    threadList(threadIdx).freeCount = 0;
+    if(threadList(threadIdx).head != LIST_END_MARK || threadList(threadIdx).protectedHead != LIST_END_MARK)
+    {
+        threadList(threadIdx).state = LIST_ORPHAN;
+        ++numOrphans;
+    }
+    else
+        threadList(threadIdx).state = LIST_IDLE;
+    --numRegistered;
+    registry->freeIds.push_back(threadIdx);
+}
+
+// lists not owned by anyone go to free ids (lowest first), ones with elements are orphans
+template<typename K, typename V, class HashFunc>
+void LFLRUHashTable<K, V, HashFunc>::initRegistry()
+{
+    registry = std::make_shared<ThreadRegistry>();
+    registry->table = this;
+    numRegistered = 0;
+    numOrphans = 0;
+    for(unsigned long long threadIdx = numLists; threadIdx-- > 0; )
+    {
+        registry->freeIds.push_back(threadIdx);
+        if(threadList(threadIdx).head != LIST_END_MARK || threadList(threadIdx).protectedHead != LIST_END_MARK)
+        {
+            threadList(threadIdx).state = LIST_ORPHAN;
+            ++numOrphans;
+        }
+        else
+            threadList(threadIdx).state = LIST_IDLE;
+    }
+}
+
+// registry mutex is held, only registration adds lists. Directory that ran out of room is copied to one twice the size, chunks don't
+// move, so a thread still reading through the old directory finds the same lists there
+template<typename K, typename V, class HashFunc>
+void LFLRUHashTable<K, V, HashFunc>::addList(unsigned long long threadIdx)
+{
+    ListChunk ** directory = listChunks.load(std::memory_order_relaxed);
+    if(threadIdx == maxThreads)
+    {
+        ListChunk ** grown = (ListChunk **) std::calloc(2 * maxThreads / LIST_CHUNK_SIZE, sizeof(ListChunk *));
+        memcpy(grown, directory, maxThreads / LIST_CHUNK_SIZE * sizeof(ListChunk *));
+        oldListChunks.push_back(directory);
+        maxThreads *= 2;
+        directory = grown;
+    }
+    if(!(threadIdx % LIST_CHUNK_SIZE))
+        directory[threadIdx / LIST_CHUNK_SIZE] = (ListChunk *) aligned_alloc(alignof(ListChunk), sizeof(ListChunk));
+    listChunks.store(directory, std::memory_order_release);
+    initList(threadIdx);
+}
+
+template<typename K, typename V, class HashFunc>
+void LFLRUHashTable<K, V, HashFunc>::initList(unsigned long long threadIdx)
+{
+    threadList(threadIdx).head = LIST_END_MARK;
+    threadList(threadIdx).tail = LIST_END_MARK;
+    threadList(threadIdx).freeListHead = LIST_END_MARK;
+    threadList(threadIdx).protectedCount = 0;
+    threadList(threadIdx).protectedHead = LIST_END_MARK;
+    threadList(threadIdx).protectedTail = LIST_END_MARK;
+    threadList(threadIdx).size = 0;
+    threadList(threadIdx).state = LIST_IDLE;
+    threadList(threadIdx).moves = 0;
+    threadList(threadIdx).inserts = 0;
+    threadList(threadIdx).rejects = 0;
+    threadList(threadIdx).freeCount = 0;
+    threadList(threadIdx).clockOps = 0;
+    threadList(threadIdx).victimList = threadIdx;
+    threadList(threadIdx).victimCountdown = 0;
+    memset(&(expiryWheel(threadIdx)), 0, sizeof(ExpiryWheel));
+    expiryWheel(threadIdx).tick = nowMs() / EXPIRY_TICK_MS;
+}
+
+// unlinks up to STEAL_BATCH elements near the cold end of someone else's list, takes them out of the hash and puts them to our free
+// list. List ends and their neighbours can't be unlinked by us, so the last few elements stay with the list. Returns how many
+template<typename K, typename V, class HashFunc>
+unsigned long long LFLRUHashTable<K, V, HashFunc>::stealFromList(unsigned long long threadIdx, unsigned long long listIdx)
+{
+    unsigned int elementIdx = victimElement(listIdx);
+    unsigned long long stolen = 0;
+    for(unsigned long long tryIdx = 0; tryIdx < STEAL_TRIES && stolen < STEAL_BATCH && elementIdx < numElements; )
+    {
+        const unsigned int leftIdx = elementStorage[elementIdx].links.load(std::memory_order_acquire).left;
+        if(leftIdx >= numElements)
+            break;
+        if(unlinkElement(leftIdx))
+        {
+            removeFromHashPos(threadIdx, leftIdx); // racing remove may have beaten us to it, element is ours either way
+            pushFreeElement(threadIdx, leftIdx);
+            ++stolen; // elementIdx has a new left neighbour now
+        }
+        else
+        {
+            elementIdx = leftIdx;
+            ++tryIdx;
+        }
+    }
+    return stolen;
+}
+
+// list with the oldest cold end, ours unless another one is strictly older. Lists too short to steal from don't count
+template<typename K, typename V, class HashFunc>
+unsigned long long LFLRUHashTable<K, V, HashFunc>::coldestList(unsigned long long threadIdx)
+{
+    ThreadLRUList & list = threadList(threadIdx);
+    const unsigned long long lists = numLists.load(std::memory_order_acquire);
+    if(list.victimCountdown && list.victimList < lists)
+    {
+        --list.victimCountdown;
+        return list.victimList;
+    }
+    unsigned long long coldestIdx = threadIdx;
+    const unsigned int ownIdx = victimElement(threadIdx);
+    unsigned int coldestStamp = ownIdx != LIST_END_MARK ? elementStorage[ownIdx].stamp : accessClock.load(std::memory_order_relaxed) + 1;
+    for(unsigned long long listIdx = 0; listIdx < lists; ++listIdx)
+    {
+        if(listIdx == threadIdx || threadList(listIdx).size.load(std::memory_order_relaxed) <= STEAL_TRIES)
+            continue;
+        const unsigned int elementIdx = victimElement(listIdx);
+        if(elementIdx >= numElements)
+            continue;
+        const unsigned int stamp = elementStorage[elementIdx].stamp;
+        if((int) (stamp - coldestStamp) < 0) // clock wraps
+        {
+            coldestIdx = listIdx;
+            coldestStamp = stamp;
+        }
+    }
+    list.victimList = coldestIdx;
+    list.victimCountdown = VICTIM_RESCAN;
+    return coldestIdx;
+}
+
+// our free list ran dry: batch from free pool, elements of orphan lists, of the list with the oldest cold end, our own tail. False if
+// there is nothing to take
+template<typename K, typename V, class HashFunc>
+bool LFLRUHashTable<K, V, HashFunc>::refillFreeList(unsigned long long threadIdx)
+{
+    unsigned int batchSize = 0;
+    const unsigned int batchHead = popFreeBatch(batchSize);
+    if(batchHead != LIST_END_MARK)
+    {
+        threadList(threadIdx).freeListHead = batchHead;
+        threadList(threadIdx).freeCount = batchSize;
+        return true;
+    }
+    const unsigned long long lists = numLists.load(std::memory_order_acquire);
+    if(numOrphans.load(std::memory_order_relaxed))
+    {
+        for(unsigned long long listIdx = 0; listIdx < lists; ++listIdx)
+        {
+            if(threadList(listIdx).state.load(std::memory_order_relaxed) != LIST_ORPHAN)
+                continue;
+            if(stealFromList(threadIdx, listIdx))
+                return true;
+            unsigned int orphan = LIST_ORPHAN;
+            if(threadList(listIdx).size.load(std::memory_order_relaxed) <= STEAL_TRIES && threadList(listIdx).state.compare_exchange_strong(orphan, LIST_IDLE))
+                --numOrphans; // what is left waits for the next owner
+        }
+    }
+    const unsigned long long victimIdx = coldestList(threadIdx);
+    if(victimIdx != threadIdx)
+    {
+        if(stealFromList(threadIdx, victimIdx))
+            return true;
+        threadList(threadIdx).victimCountdown = 0; // look again next time
+    }
+    if(threadList(threadIdx).tail == LIST_END_MARK && threadList(threadIdx).protectedTail == LIST_END_MARK)
+        return false;
+    const unsigned int elementIdx = unlinkTail(threadIdx, threadList(threadIdx).tail == LIST_END_MARK);
+    removeFromHashPos(threadIdx, elementIdx);
+    pushFreeElement(threadIdx, elementIdx);
+    return true;
 }
 
 // this tries to unlink element from any thread LRU list it resides in. After successful call element has left and right links set to ACCESS_LOCK_MARK and lists are consistent
@@ -247,6 +689,9 @@ bool LFLRUHashTable<K, V, HashFunc>::unlinkElement(unsigned int elementIdx)
                     }
                     while(true);
                     // target element unlinked!
+                    threadList(elementStorage[elementIdx].listInfo >> 1).size.fetch_sub(1, std::memory_order_relaxed);
+                    if(elementStorage[elementIdx].listInfo & 1)
+                        threadList(elementStorage[elementIdx].listInfo >> 1).protectedCount.fetch_sub(1, std::memory_order_relaxed);
                     targetLinks.left = LIST_END_MARK;
                     targetLinks.right = LIST_END_MARK;
                     elementStorage[elementIdx].links.store(targetLinks, std::memory_order_release);
@@ -258,9 +703,11 @@ bool LFLRUHashTable<K, V, HashFunc>::unlinkElement(unsigned int elementIdx)
 }
 
 template<typename K, typename V, class HashFunc>
-unsigned int LFLRUHashTable<K, V, HashFunc>::unlinkTail(unsigned long long threadIdx)
+unsigned int LFLRUHashTable<K, V, HashFunc>::unlinkTail(unsigned long long threadIdx, bool protectedList)
 {
-    unsigned int oldTailIdx = lruLists[threadIdx].tail;
+    std::atomic_uint & head = protectedList ? threadList(threadIdx).protectedHead : threadList(threadIdx).head;
+    std::atomic_uint & tail = protectedList ? threadList(threadIdx).protectedTail : threadList(threadIdx).tail;
+    unsigned int oldTailIdx = tail;
     while (true)
     {
         // no one operates on old tail so memory order is relaxed
@@ -286,13 +733,16 @@ unsigned int LFLRUHashTable<K, V, HashFunc>::unlinkTail(unsigned long long threa
                 }
             }
             while(true);
-            lruLists[threadIdx].tail = oldTailLinks.left;
+            tail = oldTailLinks.left;
         }
         else
         {
-            lruLists[threadIdx].tail = LIST_END_MARK;
-            lruLists[threadIdx].head = LIST_END_MARK;
+            tail = LIST_END_MARK;
+            head = LIST_END_MARK;
         }
+        threadList(threadIdx).size.fetch_sub(1, std::memory_order_relaxed);
+        if(protectedList)
+            threadList(threadIdx).protectedCount.fetch_sub(1, std::memory_order_relaxed);
         // set unlinked element links to locked state
         oldTailLinks.left = LIST_END_MARK;
         oldTailLinks.right = LIST_END_MARK;
@@ -302,31 +752,45 @@ unsigned int LFLRUHashTable<K, V, HashFunc>::unlinkTail(unsigned long long threa
     return oldTailIdx;
 }
 
+// removes hash slot pointing to storagePos if there is one (element remove() couldn't unlink is not in the hash anymore).
+// With expiredAt only if element expTime is still at or before it. With unlinked element is also unlinked from its list while
+// the slot is still locked: once slot is free, a thief or the tail eviction may reuse the element, so unlinking it later could free a
+// live one. Unlink fails on list ends or when someone else unlinked it first, element is not ours then. windowBegin gets the slot
+// the element was found at, windowEnd the final hole counted from there without wrapping, shifted elements went in between
 template<typename K, typename V, class HashFunc>
-void LFLRUHashTable<K, V, HashFunc>::removeFromHashPos(unsigned long long threadIdx, unsigned long long storagePos)
+bool LFLRUHashTable<K, V, HashFunc>::removeFromHashPos(unsigned long long threadIdx, unsigned long long storagePos, unsigned long long expiredAt, bool * unlinked,
+                                                       unsigned long long * windowBegin, unsigned long long * windowEnd)
 {
     // element hash idx
-    unsigned long long idx = hasherFunc(elementStorage[storagePos].key) % hashSize; // TODO: seed
+    unsigned long long idx = reduceRange(applyHash(hasherFunc, elementStorage[storagePos].key), hashSize);
     unsigned long long lockRangeStart = idx;
     unsigned long long lockRangeEnd = idx;
     unsigned long long lockDepth = 0;
     unsigned long long lockDepthDeleted = HASH_MAX_LOCK_DEPTH;
     unsigned long long deletedIdx = 0;
-    unsigned int * locks = lruLists[threadIdx].locks;
+    unsigned int * locks = threadList(threadIdx).locks;
     locks[lockDepth] = lockElementHash(idx);
 
     // first, find the matching record
     while(true) // linear probing
     {
-        if(elementStorage[locks[lockDepth]].key == elementStorage[storagePos].key)
+        if(locks[lockDepth] == HASH_FREE_MARK || (locks[lockDepth] == storagePos && expiredAt
+                        && !(elementStorage[storagePos].expTime && elementStorage[storagePos].expTime <= expiredAt)))
+        {
+            unlockElementsHash(lockRangeStart, lockRangeEnd, locks);
+            return false;
+        }
+        if(locks[lockDepth] == storagePos)
         {
             deletedIdx = idx;
             lockDepthDeleted = lockDepth;
+            if(unlinked)
+                *unlinked = unlinkElement(storagePos);
             break;
         }
         else
         {
-            idx = (idx + 1) % hashSize;
+            idx = nextProbeIdx(idx, hashSize);
             lockRangeEnd = idx;
             if (lockDepth >= HASH_MAX_LOCK_DEPTH)
                 abort();
@@ -335,8 +799,9 @@ void LFLRUHashTable<K, V, HashFunc>::removeFromHashPos(unsigned long long thread
         }
     }
 
+    const unsigned long long foundIdx = idx;
     // walk forward until next hole to see if any records need to be moved back
-    idx = (idx + 1) % hashSize;
+    idx = nextProbeIdx(idx, hashSize);
     lockRangeEnd = idx;
     if (lockDepth >= HASH_MAX_LOCK_DEPTH)
         abort();
@@ -344,53 +809,60 @@ void LFLRUHashTable<K, V, HashFunc>::removeFromHashPos(unsigned long long thread
     locks[lockDepth] = lockElementHash(idx);
     while(locks[lockDepth] != HASH_FREE_MARK) // linear probing
     {
-        // calc hash. If its less or equal new hole position, swap, save new hole and move on
-        unsigned long long nextHash = hasherFunc(elementStorage[locks[lockDepth]].key);
-        if(nextHash % hashSize <= deletedIdx)
+        // calc hash. If its home is cyclically no closer than the hole, swap, save new hole and move on
+        unsigned long long homeIdx = reduceRange(applyHash(hasherFunc, elementStorage[locks[lockDepth]].key), hashSize);
+        if((idx + hashSize - homeIdx) % hashSize >= (idx + hashSize - deletedIdx) % hashSize)
         {
             // swap
             locks[lockDepthDeleted] = locks[lockDepth];
             lockDepthDeleted = lockDepth;
             deletedIdx = idx;
         }
-        idx = (idx + 1) % hashSize;
+        idx = nextProbeIdx(idx, hashSize);
         lockRangeEnd = idx;
         if (lockDepth >= HASH_MAX_LOCK_DEPTH)
             abort();
         ++lockDepth;
         locks[lockDepth] = lockElementHash(idx);
     }
+    if(windowEnd)
+        *windowEnd = foundIdx + (deletedIdx + hashSize - foundIdx) % hashSize;
+    if(windowBegin)
+        *windowBegin = foundIdx;
     if(lockDepthDeleted != HASH_MAX_LOCK_DEPTH)
         locks[lockDepthDeleted] = HASH_FREE_MARK;
     unlockElementsHash(lockRangeStart, lockRangeEnd, locks);
+    return true;
 }
 
 template<typename K, typename V, class HashFunc>
-bool LFLRUHashTable<K, V, HashFunc>::removeFromHashKey(unsigned long long threadIdx, const K& inKey, unsigned int& pos)
+bool LFLRUHashTable<K, V, HashFunc>::removeFromHashKey(unsigned long long threadIdx, const K& inKey, unsigned int& pos, bool * unlinked)
 {
     // element hash idx
-    unsigned long long idx = hasherFunc(inKey) % hashSize; // TODO: seed
+    unsigned long long idx = reduceRange(applyHash(hasherFunc, inKey), hashSize);
     unsigned long long lockRangeStart = idx;
     unsigned long long lockRangeEnd = idx;
     unsigned long long lockDepth = 0;
     unsigned long long lockDepthDeleted = HASH_MAX_LOCK_DEPTH;
     unsigned long long deletedIdx = 0;
-    unsigned int * locks = lruLists[threadIdx].locks;
+    unsigned int * locks = threadList(threadIdx).locks;
     locks[lockDepth] = lockElementHash(idx);
 
     // first, find the matching record
-    while(true) // linear probing
+    while(locks[lockDepth] != HASH_FREE_MARK) // linear probing
     {
         if(elementStorage[locks[lockDepth]].key == inKey)
         {
             deletedIdx = idx;
             lockDepthDeleted = lockDepth;
             pos = locks[lockDepthDeleted];
+            if(unlinked)
+                *unlinked = unlinkElement(pos);
             break;
         }
         else
         {
-            idx = (idx + 1) % hashSize;
+            idx = nextProbeIdx(idx, hashSize);
             lockRangeEnd = idx;
             if (lockDepth >= HASH_MAX_LOCK_DEPTH)
                 abort();
@@ -407,7 +879,7 @@ bool LFLRUHashTable<K, V, HashFunc>::removeFromHashKey(unsigned long long thread
     }
 
     // walk forward until next hole to see if any records need to be moved back
-    idx = (idx + 1) % hashSize;
+    idx = nextProbeIdx(idx, hashSize);
     lockRangeEnd = idx;
     if (lockDepth >= HASH_MAX_LOCK_DEPTH)
         abort();
@@ -415,23 +887,21 @@ bool LFLRUHashTable<K, V, HashFunc>::removeFromHashKey(unsigned long long thread
     locks[lockDepth] = lockElementHash(idx);
     while(locks[lockDepth] != HASH_FREE_MARK) // linear probing
     {
-        // calc hash. If its less or equal new hole position, swap, save new hole and move on
-        if(hasherFunc(elementStorage[locks[lockDepth]].key) % hashSize <= deletedIdx)
+        // calc hash. If its home is cyclically no closer than the hole, swap, save new hole and move on
+        unsigned long long homeIdx = reduceRange(applyHash(hasherFunc, elementStorage[locks[lockDepth]].key), hashSize);
+        if((idx + hashSize - homeIdx) % hashSize >= (idx + hashSize - deletedIdx) % hashSize)
         {
             // swap
             locks[lockDepthDeleted] = locks[lockDepth];
             lockDepthDeleted = lockDepth;
             deletedIdx = idx;
         }
-        else
-        {
-            idx = (idx + 1) % hashSize;
-            lockRangeEnd = idx;
-            if (lockDepth >= HASH_MAX_LOCK_DEPTH)
-                abort();
-            ++lockDepth;
-            locks[lockDepth] = lockElementHash(idx);
-        }
+        idx = nextProbeIdx(idx, hashSize);
+        lockRangeEnd = idx;
+        if (lockDepth >= HASH_MAX_LOCK_DEPTH)
+            abort();
+        ++lockDepth;
+        locks[lockDepth] = lockElementHash(idx);
     }
     if(lockDepthDeleted != HASH_MAX_LOCK_DEPTH)
         locks[lockDepthDeleted] = HASH_FREE_MARK;
@@ -439,13 +909,197 @@ bool LFLRUHashTable<K, V, HashFunc>::removeFromHashKey(unsigned long long thread
     return true;
 }
 
+// unlinked element that is not in the hash. expTime is cleared so timer wheel entries for it go stale. Free list that grew to
+// 2 * FREE_BATCH gives FREE_BATCH elements from its front to free pool
+template<typename K, typename V, class HashFunc>
+void LFLRUHashTable<K, V, HashFunc>::pushFreeElement(unsigned long long threadIdx, unsigned int elementIdx)
+{
+    elementStorage[elementIdx].expTime = 0;
+    LRULinks freeListHeadLinks = elementStorage[elementIdx].links.load();
+    freeListHeadLinks.left = LIST_END_MARK;
+    freeListHeadLinks.right = threadList(threadIdx).freeListHead;
+    elementStorage[elementIdx].links.store(freeListHeadLinks);
+    threadList(threadIdx).freeListHead = elementIdx;
+    if(++(threadList(threadIdx).freeCount) < 2 * FREE_BATCH)
+        return;
+    unsigned int batchTail = elementIdx;
+    for(unsigned long long batchIdx = 1; batchIdx < FREE_BATCH; ++batchIdx)
+        batchTail = elementStorage[batchTail].links.load(std::memory_order_relaxed).right;
+    LRULinks batchTailLinks = elementStorage[batchTail].links.load(std::memory_order_relaxed);
+    threadList(threadIdx).freeListHead = batchTailLinks.right;
+    threadList(threadIdx).freeCount -= FREE_BATCH;
+    batchTailLinks.right = LIST_END_MARK;
+    elementStorage[batchTail].links.store(batchTailLinks, std::memory_order_relaxed);
+    pushFreeBatch(elementIdx, FREE_BATCH);
+}
+
+// free pool is a stack of free lists, batch head keeps the next batch in listInfo and its length in stamp. Tag makes pop ABA safe,
+// listInfo read of a batch somebody else just popped is thrown away by the failing CAS
+template<typename K, typename V, class HashFunc>
+void LFLRUHashTable<K, V, HashFunc>::pushFreeBatch(unsigned int batchHead, unsigned int batchSize)
+{
+    elementStorage[batchHead].stamp = batchSize;
+    unsigned long long current = freePool.load(std::memory_order_relaxed);
+    do
+    {
+        elementStorage[batchHead].listInfo = (unsigned int) current;
+    }
+    while(!freePool.compare_exchange_weak(current, (((current >> 32) + 1) << 32) | batchHead, std::memory_order_release, std::memory_order_relaxed));
+}
+
+template<typename K, typename V, class HashFunc>
+unsigned int LFLRUHashTable<K, V, HashFunc>::popFreeBatch(unsigned int & batchSize)
+{
+    unsigned long long current = freePool.load(std::memory_order_acquire);
+    while((unsigned int) current != LIST_END_MARK)
+    {
+        const unsigned int batchHead = (unsigned int) current;
+        if(freePool.compare_exchange_weak(current, (((current >> 32) + 1) << 32) | elementStorage[batchHead].listInfo, std::memory_order_acquire))
+        {
+            batchSize = elementStorage[batchHead].stamp;
+            return batchHead;
+        }
+    }
+    return LIST_END_MARK;
+}
+
+// accessClock moves once per CLOCK_TICK_OPS stamps of a thread, so stamping every insert and hit costs no shared writes
+template<typename K, typename V, class HashFunc>
+unsigned int LFLRUHashTable<K, V, HashFunc>::tickClock(unsigned long long threadIdx)
+{
+    if(++(threadList(threadIdx).clockOps) % CLOCK_TICK_OPS)
+        return accessClock.load(std::memory_order_relaxed);
+    return accessClock.fetch_add(1, std::memory_order_relaxed) + 1;
+}
+
+// element hash slot must be locked. now is read once, only if element has expTime
+template<typename K, typename V, class HashFunc>
+bool LFLRUHashTable<K, V, HashFunc>::isExpired(unsigned int elementIdx, unsigned long long & now)
+{
+    const unsigned long long expTime = elementStorage[elementIdx].expTime;
+    if(!expTime)
+        return false;
+    if(!now)
+        now = nowMs();
+    return expTime <= now;
+}
+
+// dueTick overrides the tick expTime falls into
+template<typename K, typename V, class HashFunc>
+void LFLRUHashTable<K, V, HashFunc>::addExpiry(unsigned long long threadIdx, unsigned int elementIdx, unsigned long long expTime, unsigned long long dueTick)
+{
+    ExpiryWheel & wheel = expiryWheel(threadIdx);
+    const unsigned long long slot = std::max(dueTick ? dueTick : expTime / EXPIRY_TICK_MS, wheel.tick) % EXPIRY_WHEEL_SLOTS; // already due goes to next sweep
+    if(wheel.slotSizes[slot] == wheel.slotCapacities[slot])
+    {
+        wheel.slotCapacities[slot] = wheel.slotCapacities[slot] ? wheel.slotCapacities[slot] * 2 : 16;
+        wheel.slots[slot] = (ExpiryEntry*) std::realloc(wheel.slots[slot], wheel.slotCapacities[slot] * sizeof(ExpiryEntry));
+    }
+    ++wheel.numEntries;
+    ExpiryEntry & entry = wheel.slots[slot][wheel.slotSizes[slot]++];
+    entry.elementIdx = elementIdx;
+    entry.reserved = 0;
+    entry.expTime = expTime;
+}
+
+template<typename K, typename V, class HashFunc>
+void LFLRUHashTable<K, V, HashFunc>::initListChunks()
+{
+    ListChunk ** directory = (ListChunk **) std::calloc(maxThreads / LIST_CHUNK_SIZE, sizeof(ListChunk *));
+    for(unsigned long long chunkIdx = 0; chunkIdx * LIST_CHUNK_SIZE < numLists; ++chunkIdx)
+        directory[chunkIdx] = (ListChunk *) aligned_alloc(alignof(ListChunk), sizeof(ListChunk));
+    listChunks.store(directory, std::memory_order_release);
+    for(unsigned long long threadIdx = 0; threadIdx < numLists; ++threadIdx)
+    {
+        memset(&(expiryWheel(threadIdx)), 0, sizeof(ExpiryWheel));
+        expiryWheel(threadIdx).tick = nowMs() / EXPIRY_TICK_MS;
+    }
+}
+
 template<typename K, typename V, class HashFunc>
-bool LFLRUHashTable<K, V, HashFunc>::linkHead(unsigned long long threadIdx, unsigned int elementIdx)
+void LFLRUHashTable<K, V, HashFunc>::freeListChunks()
 {
-    unsigned int oldHead = lruLists[threadIdx].head;
+    ListChunk ** directory = listChunks.load();
+    for(unsigned long long chunkIdx = 0; chunkIdx * LIST_CHUNK_SIZE < numLists; ++chunkIdx)
+        std::free(directory[chunkIdx]);
+    std::free(directory);
+    for(size_t oldIdx = 0; oldIdx < oldListChunks.size(); ++oldIdx)
+        std::free(oldListChunks[oldIdx]);
+    oldListChunks.clear();
+}
+
+template<typename K, typename V, class HashFunc>
+void LFLRUHashTable<K, V, HashFunc>::clearExpiryWheel(unsigned long long threadIdx)
+{
+    ExpiryWheel & wheel = expiryWheel(threadIdx);
+    for(unsigned long long slot = 0; slot < EXPIRY_WHEEL_SLOTS; ++slot)
+        wheel.slotSizes[slot] = 0;
+    wheel.tick = nowMs() / EXPIRY_TICK_MS;
+    wheel.sweepPos = 0;
+    wheel.numEntries = 0;
+}
+
+// walks slots of fully elapsed ticks. Entry whose element has a different expTime by now is stale (TTL replaced, element freed
+// or reused) and dropped. Element is unlinked first (list ends can't be, they are looked at again next tick) and then taken out
+// of the hash only if it is still expired when its hash slot is locked, one that got new TTL meanwhile goes back to list head
+template<typename K, typename V, class HashFunc>
+unsigned long long LFLRUHashTable<K, V, HashFunc>::sweepExpired(unsigned long long threadIdx, unsigned long long budget)
+{
+    ExpiryWheel & wheel = expiryWheel(threadIdx);
+    const unsigned long long now = nowMs();
+    const unsigned long long nowTick = now / EXPIRY_TICK_MS;
+    unsigned long long freed = 0;
+    while(budget && wheel.tick < nowTick)
+    {
+        const unsigned long long slot = wheel.tick % EXPIRY_WHEEL_SLOTS;
+        while(budget && wheel.sweepPos < wheel.slotSizes[slot])
+        {
+            --budget;
+            ExpiryEntry entry = wheel.slots[slot][wheel.sweepPos];
+            if(entry.expTime > now)
+            {
+                ++wheel.sweepPos; // later turn
+                continue;
+            }
+            wheel.slots[slot][wheel.sweepPos] = wheel.slots[slot][--wheel.slotSizes[slot]];
+            --wheel.numEntries;
+            if(elementStorage[entry.elementIdx].expTime != entry.expTime)
+                continue;
+            if(!unlinkElement(entry.elementIdx))
+            {
+                addExpiry(threadIdx, entry.elementIdx, entry.expTime, wheel.tick + 1);
+                continue;
+            }
+            // not found with expTime unchanged means someone else took it out of the hash and couldn't unlink it
+            if(removeFromHashPos(threadIdx, entry.elementIdx, entry.expTime) || elementStorage[entry.elementIdx].expTime == entry.expTime)
+            {
+                pushFreeElement(threadIdx, entry.elementIdx);
+                ++freed;
+            }
+            else
+                linkHead(threadIdx, entry.elementIdx);
+        }
+        if(wheel.sweepPos >= wheel.slotSizes[slot])
+        {
+            ++wheel.tick;
+            wheel.sweepPos = 0;
+        }
+    }
+    return freed;
+}
+
+template<typename K, typename V, class HashFunc>
+bool LFLRUHashTable<K, V, HashFunc>::linkHead(unsigned long long threadIdx, unsigned int elementIdx, bool protectedList)
+{
+    std::atomic_uint & head = protectedList ? threadList(threadIdx).protectedHead : threadList(threadIdx).head;
+    unsigned int oldHead = head;
     LRULinks newHeadLinks;
     newHeadLinks.left = LIST_END_MARK;
     newHeadLinks.right = oldHead;
+    elementStorage[elementIdx].listInfo = (threadIdx << 1) | (protectedList ? 1 : 0);
+    threadList(threadIdx).size.fetch_add(1, std::memory_order_relaxed);
+    if(protectedList)
+        threadList(threadIdx).protectedCount.fetch_add(1, std::memory_order_relaxed);
     elementStorage[elementIdx].links.store(newHeadLinks, std::memory_order_relaxed);
     // no one operates on old head so memory order is relaxed
     if (oldHead != LIST_END_MARK)
@@ -456,19 +1110,21 @@ bool LFLRUHashTable<K, V, HashFunc>::linkHead(unsigned long long threadIdx, unsi
     }
     else
     {
-        lruLists[threadIdx].tail = elementIdx;
+        (protectedList ? threadList(threadIdx).protectedTail : threadList(threadIdx).tail) = elementIdx;
     }
-    lruLists[threadIdx].head = elementIdx;
+    head = elementIdx;
     return true;
 }
 
 template<typename K, typename V, class HashFunc>
 bool LFLRUHashTable<K, V, HashFunc>::linkTail(unsigned long long threadIdx, unsigned int elementIdx)
 {
-    unsigned int oldTail = lruLists[threadIdx].tail;
+    unsigned int oldTail = threadList(threadIdx).tail;
     LRULinks newTailLinks;
     newTailLinks.left = oldTail;
     newTailLinks.right = LIST_END_MARK;
+    elementStorage[elementIdx].listInfo = threadIdx << 1;
+    threadList(threadIdx).size.fetch_add(1, std::memory_order_relaxed);
     elementStorage[elementIdx].links.store(newTailLinks, std::memory_order_relaxed);
     // no one operates on old tail so memory order is relaxed
     if (oldTail != LIST_END_MARK)
@@ -479,12 +1135,51 @@ bool LFLRUHashTable<K, V, HashFunc>::linkTail(unsigned long long threadIdx, unsi
     }
     else
     {
-        lruLists[threadIdx].head = elementIdx;
+        threadList(threadIdx).head = elementIdx;
     }
-    lruLists[threadIdx].tail = elementIdx;
+    threadList(threadIdx).tail = elementIdx;
     return true;
 }
 
+// hit on element: to our list head, with POLICY_SLRU to protected head and protected overflow goes back to probation. Protected share
+// is of our list size, lists don't stay at numElements / numThreads once threads come and go
+template<typename K, typename V, class HashFunc>
+void LFLRUHashTable<K, V, HashFunc>::touchElement(unsigned long long threadIdx, unsigned int elementIdx)
+{
+    if(!unlinkElement(elementIdx))
+        return;
+    ++(threadList(threadIdx).moves);
+    elementStorage[elementIdx].stamp = tickClock(threadIdx);
+    if(!(policy & POLICY_SLRU))
+    {
+        linkHead(threadIdx, elementIdx);
+        return;
+    }
+    linkHead(threadIdx, elementIdx, true);
+    if(threadList(threadIdx).protectedCount.load(std::memory_order_relaxed) > threadList(threadIdx).size.load(std::memory_order_relaxed) * SLRU_PROTECTED_PERCENT / 100
+                    && threadList(threadIdx).protectedTail != LIST_END_MARK)
+        linkHead(threadIdx, unlinkTail(threadIdx, true));
+}
+
+// what eviction would take, probation tail unless probation list is empty
+template<typename K, typename V, class HashFunc>
+unsigned int LFLRUHashTable<K, V, HashFunc>::victimElement(unsigned long long threadIdx)
+{
+    return threadList(threadIdx).tail != LIST_END_MARK ? threadList(threadIdx).tail.load() : threadList(threadIdx).protectedTail.load();
+}
+
+// insert is about to evict, TinyLFU lets new key in only if it is more popular than the victim (cold end of the list eviction goes to). Racing remove may swap victim key
+// under us, that only costs one wrong decision. Victim that ties on saturated counters (or is a removed list end nobody gets anymore)
+// would keep its place forever, so every TINYLFU_ADMIT_EVERY-th turned down key gets in anyway
+template<typename K, typename V, class HashFunc>
+bool LFLRUHashTable<K, V, HashFunc>::admit(unsigned long long threadIdx, unsigned long long keyHash)
+{
+    const unsigned int victimIdx = victimElement(coldestList(threadIdx));
+    if(victimIdx == LIST_END_MARK || sketch->frequency(keyHash) > sketch->frequency(applyHash(hasherFunc, elementStorage[victimIdx].key)))
+        return true;
+    return ++(threadList(threadIdx).rejects) % TINYLFU_ADMIT_EVERY == 0;
+}
+
 template<typename K, typename V, class HashFunc>
 unsigned int LFLRUHashTable<K, V, HashFunc>::lockElementHash(unsigned long long pos)
 {
@@ -532,87 +1227,109 @@ void LFLRUHashTable<K, V, HashFunc>::unlockElementsHash(unsigned long long lockR
 template<typename K, typename V, class HashFunc>
 void LFLRUHashTable<K, V, HashFunc>::swap(LFLRUHashTable<K, V, HashFunc>& other)
 {
-    std::swap(nextThreadId, other.nextThreadId);
+    std::lock(registry->mutex, other.registry->mutex);
+    std::lock_guard<std::mutex> lock(registry->mutex, std::adopt_lock);
+    std::lock_guard<std::mutex> otherLock(other.registry->mutex, std::adopt_lock);
+    std::swap(registry, other.registry); // registered threads follow their lists
+    registry->table = this;
+    other.registry->table = &other;
+    std::swap(maxThreads, other.maxThreads);
+    numLists.store(other.numLists.exchange(numLists.load()));
+    numRegistered.store(other.numRegistered.exchange(numRegistered.load()));
+    numOrphans.store(other.numOrphans.exchange(numOrphans.load()));
     std::swap(hasherFunc, other.hasherFunc);
     std::swap(elementLinks, other.elementLinks);
     std::swap(hashSize, other.hashSize);
     std::swap(numElements, other.numElements);
     std::swap(numThreads, other.numThreads);
-    std::swap(lruLists, other.lruLists);
+    listChunks.store(other.listChunks.exchange(listChunks.load()));
+    std::swap(oldListChunks, other.oldListChunks);
+    std::swap(policy, other.policy);
+    std::swap(hugePages, other.hugePages);
+    std::swap(sketch, other.sketch);
     std::swap(elementStorage, other.elementStorage);
-    std::swap(globalFreeListHead, other.globalFreeListHead);
+    freePool.store(other.freePool.exchange(freePool.load()));
+    accessClock.store(other.accessClock.exchange(accessClock.load()));
 }
 
 template<typename K, typename V, class HashFunc>
 LFLRUHashTable<K, V, HashFunc>::LFLRUHashTable(unsigned long long inNumElements, unsigned long long inHashSize, unsigned long long inNumThreads,
-                                               const HashFunc & inHasher) :
-                lruLists(0), elementStorage(0), elementLinks(0), numElements(inNumElements), hashSize(inHashSize), numThreads(inNumThreads), globalFreeListHead(LIST_END_MARK), hasherFunc(
-                                inHasher)
+                                               const HashFunc & inHasher, unsigned int inPolicy, unsigned long long inMaxThreads,
+                                               unsigned int inHugePages) :
+                listChunks(0), elementStorage(0), elementLinks(0), numElements(inNumElements), hashSize(inHashSize), numThreads(inNumThreads), maxThreads(
+                                (std::max(inMaxThreads ? inMaxThreads : DEFAULT_MAX_THREADS, inNumThreads) + LIST_CHUNK_SIZE - 1) / LIST_CHUNK_SIZE * LIST_CHUNK_SIZE),
+                                numLists(inNumThreads), freePool(LIST_END_MARK), accessClock(0), policy(inPolicy), hugePages(inHugePages), sketch(0), hasherFunc(inHasher)
 {
     if(numElements >= hashSize)
         abort();
-    nextThreadId = 0;
-    elementStorage = (LRUElement*) std::malloc(numElements * sizeof(LRUElement));
+    elementStorage = (LRUElement*) HugePages::allocate(numElements * sizeof(LRUElement), hugePages);
     memset(elementStorage, 0, numElements * sizeof(LRUElement));
-    lruLists = (ThreadLRUList*) std::malloc(numThreads * sizeof(ThreadLRUList));
+    initListChunks();
     for(unsigned long long elementIdx = 0; elementIdx < numElements; ++elementIdx)
     {
         LRULinks links;
         links.left = LIST_END_MARK;
-        links.right = elementIdx + 1;
+        links.right = (elementIdx + 1) % FREE_BATCH && elementIdx + 1 < numElements ? elementIdx + 1 : LIST_END_MARK;
         elementStorage[elementIdx].links = links;
     }
-    unsigned long long elementsPerThread = numElements / numThreads;
+    // everything starts in free pool, first batches on top
+    for(unsigned long long batchHead = (numElements - 1) / FREE_BATCH * FREE_BATCH; batchHead < numElements; batchHead -= FREE_BATCH)
+        pushFreeBatch(batchHead, std::min((unsigned long long) FREE_BATCH, numElements - batchHead));
     for(unsigned long long threadIdx = 0; threadIdx < numThreads; ++threadIdx)
-    {
-        lruLists[threadIdx].head = LIST_END_MARK;
-        lruLists[threadIdx].tail = LIST_END_MARK;
-        lruLists[threadIdx].freeListHead = threadIdx * elementsPerThread;
-        LRULinks links;
-        links = elementStorage[(threadIdx + 1) * elementsPerThread - 1].links.load();
-        links.right = LIST_END_MARK;
-        if (links.left == (threadIdx + 1) * elementsPerThread - 1) abort();
-        elementStorage[(threadIdx + 1) * elementsPerThread - 1].links.store(links, std::memory_order_seq_cst);
-    }
-    elementLinks = (std::atomic_uint*) std::malloc(hashSize * sizeof(std::atomic_uint));
+        initList(threadIdx);
+    elementLinks = (std::atomic_uint*) HugePages::allocate(hashSize * sizeof(std::atomic_uint), hugePages);
     memset(elementLinks, 255 /*1/4 HASH_FREE_MARK*/, hashSize * sizeof(std::atomic_uint));
+    initRegistry();
+    if(policy & POLICY_TINYLFU)
+        sketch = new FrequencySketch(numElements);
 }
 
 template<typename K, typename V, class HashFunc>
 LFLRUHashTable<K, V, HashFunc>::~LFLRUHashTable()
 {
+    {
+        std::lock_guard<std::mutex> lock(registry->mutex);
+        registry->table = 0; // threads exiting later have nothing to release
+    }
     for(unsigned long long pos = 0; pos < hashSize; ++pos)
     {
         elementStorage[elementLinks[pos]].key.~K();
         elementStorage[elementLinks[pos]].value.~V();
     }
-    std::free(lruLists);
-    std::free(elementLinks);
-    std::free(elementStorage);
+    for(unsigned long long threadIdx = 0; threadIdx < numLists; ++threadIdx)
+    {
+        for(unsigned long long slot = 0; slot < EXPIRY_WHEEL_SLOTS; ++slot)
+            std::free(expiryWheel(threadIdx).slots[slot]);
+    }
+    freeListChunks();
+    delete sketch;
+    HugePages::release(elementLinks);
+    HugePages::release(elementStorage);
 }
 
 template<typename K, typename V, class HashFunc>
 LFLRUHashTable<K, V, HashFunc>::LFLRUHashTable(const LFLRUHashTable& other) :
-                lruLists(0), elementStorage(0), elementLinks(0), numElements(other.numElements), hashSize(other.hashSize), numThreads(other.numThreads), hasherFunc(
+                listChunks(0), elementStorage(0), elementLinks(0), numElements(other.numElements), hashSize(other.hashSize), numThreads(other.numThreads), maxThreads(
+                                other.maxThreads), numLists(other.numLists.load()), freePool(other.freePool.load()), accessClock(other.accessClock.load()), policy(other.policy), hugePages(other.hugePages), sketch(0), hasherFunc(
                                 other.hasherFunc)
 {
-    nextThreadId = other.nextThreadId;
-    elementStorage = (LRUElement*) std::malloc(numElements * sizeof(LRUElement));
-    elementLinks = (std::atomic_uint*) std::malloc(hashSize * sizeof(LRUElement));
-    lruLists = (ThreadLRUList*) std::malloc(numThreads * sizeof(ThreadLRUList));
-    memset(elementLinks, 255 /*1/4 HASH_FREE_MARK*/, hashSize * sizeof(LRUElement));
+    elementStorage = (LRUElement*) HugePages::allocate(numElements * sizeof(LRUElement), hugePages);
+    elementLinks = (std::atomic_uint*) HugePages::allocate(hashSize * sizeof(std::atomic_uint), hugePages);
+    memset(elementLinks, 255 /*1/4 HASH_FREE_MARK*/, hashSize * sizeof(std::atomic_uint));
     for(unsigned long long elementIdx = 0; elementIdx < numElements; ++elementIdx)
     {
         elementStorage[elementIdx] = other.elementStorage[elementIdx];
     }
-    for(unsigned long long lruIdx = 0; lruIdx < numThreads; ++lruIdx)
-    {
-        lruLists[lruIdx] = other.lruLists[lruIdx];
-    }
     for(unsigned long long pos = 0; pos < hashSize; ++pos)
     {
         elementLinks[pos] = other.elementLinks[pos];
     }
+    initListChunks(); // copies only expire lazily
+    for(unsigned long long threadIdx = 0; threadIdx < numLists; ++threadIdx)
+        memcpy((void *) &(threadList(threadIdx)), &(other.threadList(threadIdx)), sizeof(ThreadLRUList));
+    initRegistry(); // copied lists are up for grabs
+    if(policy & POLICY_TINYLFU)
+        sketch = new FrequencySketch(numElements); // and start counting from scratch
 }
 
 template<typename K, typename V, class HashFunc>
@@ -628,39 +1345,63 @@ LFLRUHashTable<K, V, HashFunc>& LFLRUHashTable<K, V, HashFunc>::operator=(const
 
 // returns true if inserted, false if set
 template<typename K, typename V, class HashFunc>
-bool LFLRUHashTable<K, V, HashFunc>::insertOrSet(unsigned long long threadIdx, const K & inKey, const V & inValue)
+bool LFLRUHashTable<K, V, HashFunc>::insertOrSet(unsigned long long threadIdx, const K & inKey, const V & inValue, unsigned long long ttlMs)
+{
+    return upsert(threadIdx, inKey, [&inValue]() -> const V & { return inValue; }, [&inValue](V & value) { value = inValue; }, ttlMs);
+}
+
+// returns true if inserted, false if updated
+template<typename K, typename V, class HashFunc>
+template<class Factory, class Updater>
+bool LFLRUHashTable<K, V, HashFunc>::upsert(unsigned long long threadIdx, const K & inKey, Factory factory, Updater updater, unsigned long long ttlMs)
 {
-    unsigned int elementToInsert = lruLists[threadIdx].freeListHead;
+    unsigned long long now = ttlMs ? nowMs() : 0;
+    const unsigned long long expTime = ttlMs ? now + ttlMs : 0;
+    // new list, or one that has given its free elements back
+    if(threadList(threadIdx).freeListHead == LIST_END_MARK && !refillFreeList(threadIdx))
+        return false; // nothing to take, rest of the elements are free ones of other threads or list ends
+    // last free element, expired elements go before live tail
+    if(expiryWheel(threadIdx).numEntries && elementStorage[threadList(threadIdx).freeListHead].links.load().right == LIST_END_MARK && freePoolEmpty())
+        sweepExpired(threadIdx, EXPIRY_SWEEP_BUDGET);
+    unsigned int elementToInsert = threadList(threadIdx).freeListHead;
     LRULinks freeListHeadLinks = elementStorage[elementToInsert].links.load();
     unsigned long long nextFreeHead = freeListHeadLinks.right;
-    lruLists[threadIdx].freeListHead = nextFreeHead;
+    threadList(threadIdx).freeListHead = nextFreeHead;
+    --(threadList(threadIdx).freeCount);
 
-    unsigned long long idx = hasherFunc(inKey) % hashSize; // TODO: seed
+    const unsigned long long keyHash = applyHash(hasherFunc, inKey);
+    if(sketch)
+        sketch->increment(keyHash);
+    unsigned long long idx = reduceRange(keyHash, hashSize);
     unsigned long long lockRangeStart = idx;
     unsigned long long lockRangeEnd = idx;
     unsigned long long lockDepth = 0;
-    unsigned int * locks = lruLists[threadIdx].locks;
+    unsigned int * locks = threadList(threadIdx).locks;
     locks[lockDepth] = lockElementHash(idx);
     while(locks[lockDepth] != HASH_FREE_MARK) // linear probing
     {
         if(elementStorage[locks[lockDepth]].key == inKey)
         {
-            elementStorage[locks[lockDepth]].value = inValue;
+            const bool expired = isExpired(locks[lockDepth], now);
+            if(expired)
+                elementStorage[locks[lockDepth]].value = factory();
+            else
+                updater(elementStorage[locks[lockDepth]].value);
+            elementStorage[locks[lockDepth]].expTime = expTime;
             unlockElementsHash(lockRangeStart, lockRangeEnd, locks);
-            if(unlinkElement(locks[lockDepth]))
-            {
-                ++(lruLists[threadIdx].moves);
-                linkHead(threadIdx, locks[lockDepth]);
-            }
+            touchElement(threadIdx, locks[lockDepth]);
+            if(expTime)
+                addExpiry(threadIdx, locks[lockDepth], expTime);
             freeListHeadLinks.left = LIST_END_MARK;
-            freeListHeadLinks.right = lruLists[threadIdx].freeListHead;
+            freeListHeadLinks.right = threadList(threadIdx).freeListHead;
             elementStorage[elementToInsert].links.store(freeListHeadLinks);
-            lruLists[threadIdx].freeListHead = elementToInsert;
-            return false;
+            threadList(threadIdx).freeListHead = elementToInsert;
+            ++(threadList(threadIdx).freeCount);
+            return expired;
         }
         else
         {
-            idx = (idx + 1) % hashSize;
+            idx = nextProbeIdx(idx, hashSize);
             lockRangeEnd = idx;
             if (lockDepth >= HASH_MAX_LOCK_DEPTH)
                 abort();
@@ -668,23 +1409,26 @@ bool LFLRUHashTable<K, V, HashFunc>::insertOrSet(unsigned long long threadIdx, c
             locks[lockDepth] = lockElementHash(idx);
         }
     }
+    if(sketch && threadList(threadIdx).freeListHead == LIST_END_MARK && freePoolEmpty() && !admit(threadIdx, keyHash))
+    {
+        unlockElementsHash(lockRangeStart, lockRangeEnd, locks);
+        pushFreeElement(threadIdx, elementToInsert);
+        return false;
+    }
+    ++(threadList(threadIdx).inserts);
     locks[lockDepth] = elementToInsert;
     elementStorage[elementToInsert].key = inKey;
-    elementStorage[elementToInsert].value = inValue;
+    elementStorage[elementToInsert].value = factory();
+    elementStorage[elementToInsert].expTime = expTime;
+    elementStorage[elementToInsert].stamp = tickClock(threadIdx);
     unlockElementsHash(lockRangeStart, lockRangeEnd, locks);
 
     linkHead(threadIdx, elementToInsert);
+    if(expTime)
+        addExpiry(threadIdx, elementToInsert, expTime);
 
-    if (lruLists[threadIdx].freeListHead == LIST_END_MARK)
-    {
-        elementToInsert = unlinkTail(threadIdx);
-        removeFromHashPos(threadIdx, elementToInsert);
-        freeListHeadLinks = elementStorage[elementToInsert].links.load();
-        freeListHeadLinks.left = LIST_END_MARK;
-        freeListHeadLinks.right = lruLists[threadIdx].freeListHead;
-        elementStorage[elementToInsert].links.store(freeListHeadLinks);
-        lruLists[threadIdx].freeListHead = elementToInsert;
-    }
+    if (threadList(threadIdx).freeListHead == LIST_END_MARK)
+        refillFreeList(threadIdx); // we hold at least the element we just linked
 
     return true;
 
@@ -694,17 +1438,38 @@ template<typename K, typename V, class HashFunc>
 bool LFLRUHashTable<K, V, HashFunc>::get(unsigned long long threadIdx, const K & inKey, V & value, unsigned int * casLocks, unsigned long long locksStart,
                                          unsigned long long locksEnd)
 {
-    unsigned long long idx = hasherFunc(inKey) % hashSize; // TODO: seed
+    const unsigned long long keyHash = applyHash(hasherFunc, inKey);
+    unsigned long long idx = reduceRange(keyHash, hashSize);
     unsigned long long lockRangeStart = idx;
     unsigned long long lockRangeEnd = idx;
     unsigned long long lockDepth = 0;
-    unsigned int * locks = casLocks ? casLocks : lruLists[threadIdx].locks;
+    unsigned int * locks = casLocks ? casLocks : threadList(threadIdx).locks;
     locks[lockDepth] = lockElementHash(idx);
 
     while(locks[lockDepth] != HASH_FREE_MARK) // linear probing
     {
         if(elementStorage[locks[lockDepth]].key == inKey)
         {
+            unsigned long long now = 0;
+            if(isExpired(locks[lockDepth], now))
+            {
+                // gone for good unless someone gives it new TTL before we get to remove it
+                if(!casLocks)
+                {
+                    const unsigned int elementIdx = locks[lockDepth];
+                    const unsigned long long expTime = elementStorage[elementIdx].expTime;
+                    unlockElementsHash(lockRangeStart, lockRangeEnd, locks);
+                    bool unlinked = false;
+                    if(removeFromHashPos(threadIdx, elementIdx, expTime, &unlinked) && unlinked)
+                        pushFreeElement(threadIdx, elementIdx);
+                }
+                else
+                {
+                    locksStart = lockRangeStart;
+                    locksEnd = lockRangeEnd;
+                }
+                return false;
+            }
             value = elementStorage[locks[lockDepth]].value; // read value
             if(!casLocks)
             {
@@ -715,16 +1480,14 @@ bool LFLRUHashTable<K, V, HashFunc>::get(unsigned long long threadIdx, const K &
                 locksStart = lockRangeStart;
                 locksEnd = lockRangeEnd;
             }
-            if(unlinkElement(locks[lockDepth]))
-            {
-                ++(lruLists[threadIdx].moves);
-                linkHead(threadIdx, locks[lockDepth]);
-            }
+            if(sketch)
+                sketch->increment(keyHash); // misses count at insert
+            touchElement(threadIdx, locks[lockDepth]);
             return true;
         }
         else
         {
-            idx = (idx + 1) % hashSize;
+            idx = nextProbeIdx(idx, hashSize);
             lockRangeEnd = idx;
             if (lockDepth >= HASH_MAX_LOCK_DEPTH)
                 abort();
@@ -748,56 +1511,72 @@ template<typename K, typename V, class HashFunc>
 bool LFLRUHashTable<K, V, HashFunc>::remove(unsigned long long threadIdx, const K & inKey)
 {
     unsigned int pos;
-    bool removed = removeFromHashKey(threadIdx, inKey, pos);
+    bool unlinked = false;
+    bool removed = removeFromHashKey(threadIdx, inKey, pos, &unlinked);
     if (removed)
     {
-        if (unlinkElement(pos))
-        {
-            LRULinks freeListHeadLinks = elementStorage[pos].links.load();
-            freeListHeadLinks.left = LIST_END_MARK;
-            freeListHeadLinks.right = lruLists[threadIdx].freeListHead;
-            elementStorage[pos].links.store(freeListHeadLinks);
-            lruLists[threadIdx].freeListHead = pos;
-        }
-        else
-        {
-            // TODO: here item needs to be placed into global free list that needs to be checked when thread is out of free elements before popping threads tail
-            // TODO: for now elements would eventually be reused, so leave it as is
-            // abort();
-        }
+        // list end ones stay, tail eviction or timer wheel gets them later
+        if(unlinked)
+            pushFreeElement(threadIdx, pos);
         return true;
     }
     return false;
 }
 
 template<typename K, typename V, class HashFunc>
-bool LFLRUHashTable<K, V, HashFunc>::insert(unsigned long long threadIdx, const K & inKey, const V & inValue)
+bool LFLRUHashTable<K, V, HashFunc>::insert(unsigned long long threadIdx, const K & inKey, const V & inValue, unsigned long long ttlMs)
 {
-    unsigned int elementToInsert = lruLists[threadIdx].freeListHead;
+    unsigned long long now = ttlMs ? nowMs() : 0;
+    const unsigned long long expTime = ttlMs ? now + ttlMs : 0;
+    // new list, or one that has given its free elements back
+    if(threadList(threadIdx).freeListHead == LIST_END_MARK && !refillFreeList(threadIdx))
+        return false; // nothing to take, rest of the elements are free ones of other threads or list ends
+    // last free element, expired elements go before live tail
+    if(expiryWheel(threadIdx).numEntries && elementStorage[threadList(threadIdx).freeListHead].links.load().right == LIST_END_MARK && freePoolEmpty())
+        sweepExpired(threadIdx, EXPIRY_SWEEP_BUDGET);
+    unsigned int elementToInsert = threadList(threadIdx).freeListHead;
     LRULinks freeListHeadLinks = elementStorage[elementToInsert].links.load();
     unsigned long long nextFreeHead = freeListHeadLinks.right;
-    lruLists[threadIdx].freeListHead = nextFreeHead;
+    threadList(threadIdx).freeListHead = nextFreeHead;
+    --(threadList(threadIdx).freeCount);
 
-    unsigned long long idx = hasherFunc(inKey) % hashSize; // TODO: seed
+    const unsigned long long keyHash = applyHash(hasherFunc, inKey);
+    if(sketch)
+        sketch->increment(keyHash);
+    unsigned long long idx = reduceRange(keyHash, hashSize);
     unsigned long long lockRangeStart = idx;
     unsigned long long lockRangeEnd = idx;
     unsigned long long lockDepth = 0;
-    unsigned int * locks = lruLists[threadIdx].locks;
+    unsigned int * locks = threadList(threadIdx).locks;
     locks[lockDepth] = lockElementHash(idx);
     while(locks[lockDepth] != HASH_FREE_MARK) // linear probing
     {
         if(elementStorage[locks[lockDepth]].key == inKey)
         {
+            // expired one is taken over in place
+            const bool expired = isExpired(locks[lockDepth], now);
+            if(expired)
+            {
+                elementStorage[locks[lockDepth]].value = inValue;
+                elementStorage[locks[lockDepth]].expTime = expTime;
+            }
             unlockElementsHash(lockRangeStart, lockRangeEnd, locks);
+            if(expired)
+            {
+                touchElement(threadIdx, locks[lockDepth]);
+                if(expTime)
+                    addExpiry(threadIdx, locks[lockDepth], expTime);
+            }
             freeListHeadLinks.left = LIST_END_MARK;
-            freeListHeadLinks.right = lruLists[threadIdx].freeListHead;
+            freeListHeadLinks.right = threadList(threadIdx).freeListHead;
             elementStorage[elementToInsert].links.store(freeListHeadLinks);
-            lruLists[threadIdx].freeListHead = elementToInsert;
-            return false;
+            threadList(threadIdx).freeListHead = elementToInsert;
+            ++(threadList(threadIdx).freeCount);
+            return expired;
         }
         else
         {
-            idx = (idx + 1) % hashSize;
+            idx = nextProbeIdx(idx, hashSize);
             lockRangeEnd = idx;
             if (lockDepth >= HASH_MAX_LOCK_DEPTH)
                 abort();
@@ -805,23 +1584,26 @@ bool LFLRUHashTable<K, V, HashFunc>::insert(unsigned long long threadIdx, const
             locks[lockDepth] = lockElementHash(idx);
         }
     }
+    if(sketch && threadList(threadIdx).freeListHead == LIST_END_MARK && freePoolEmpty() && !admit(threadIdx, keyHash))
+    {
+        unlockElementsHash(lockRangeStart, lockRangeEnd, locks);
+        pushFreeElement(threadIdx, elementToInsert);
+        return false;
+    }
+    ++(threadList(threadIdx).inserts);
     locks[lockDepth] = elementToInsert;
     elementStorage[elementToInsert].key = inKey;
     elementStorage[elementToInsert].value = inValue;
+    elementStorage[elementToInsert].expTime = expTime;
+    elementStorage[elementToInsert].stamp = tickClock(threadIdx);
     unlockElementsHash(lockRangeStart, lockRangeEnd, locks);
 
     linkHead(threadIdx, elementToInsert);
+    if(expTime)
+        addExpiry(threadIdx, elementToInsert, expTime);
 
-    if (lruLists[threadIdx].freeListHead == LIST_END_MARK)
-    {
-        elementToInsert = unlinkTail(threadIdx);
-        removeFromHashPos(threadIdx, elementToInsert);
-        freeListHeadLinks = elementStorage[elementToInsert].links.load();
-        freeListHeadLinks.left = LIST_END_MARK;
-        freeListHeadLinks.right = lruLists[threadIdx].freeListHead;
-        elementStorage[elementToInsert].links.store(freeListHeadLinks);
-        lruLists[threadIdx].freeListHead = elementToInsert;
-    }
+    if (threadList(threadIdx).freeListHead == LIST_END_MARK)
+        refillFreeList(threadIdx); // we hold at least the element we just linked
 
     return true;
 }
@@ -833,41 +1615,40 @@ bool LFLRUHashTable<K, V, HashFunc>::set(unsigned long long threadIdx, const K &
     if(casLocks)
     {
         unsigned int * locks = casLocks;
-        unsigned long long lockDepth = locksEnd > locksStart ? locksEnd - locksStart + 1 : hashSize - locksStart + locksEnd;
+        unsigned long long lockDepth = (locksEnd + hashSize - locksStart) % hashSize; // element is the last one of the locked range
         elementStorage[locks[lockDepth]].value = inValue;
         unlockElementsHash(locksStart, locksEnd, locks);
-        if(unlinkElement(locks[lockDepth]))
-        {
-            ++(lruLists[threadIdx].moves);
-            linkHead(threadIdx, locks[lockDepth]);
-        }
+        touchElement(threadIdx, locks[lockDepth]);
         return true;
     }
     else
     {
-        unsigned long long idx = hasherFunc(inKey) % hashSize; // TODO: seed
+        unsigned long long idx = reduceRange(applyHash(hasherFunc, inKey), hashSize);
         unsigned long long lockRangeStart = idx;
         unsigned long long lockRangeEnd = idx;
         unsigned long long lockDepth = 0;
-        unsigned int * locks = lruLists[threadIdx].locks;
+        unsigned int * locks = threadList(threadIdx).locks;
         locks[lockDepth] = lockElementHash(idx);
 
         while(locks[lockDepth] != HASH_FREE_MARK) // linear probing
         {
             if(elementStorage[locks[lockDepth]].key == inKey)
             {
-                elementStorage[locks[lockDepth]].value = inValue;
-                unlockElementsHash(lockRangeStart, lockRangeEnd, locks);
-                if(unlinkElement(locks[lockDepth]))
+                unsigned long long now = 0;
+                if(isExpired(locks[lockDepth], now))
                 {
-                    ++(lruLists[threadIdx].moves);
-                    linkHead(threadIdx, locks[lockDepth]);
+                    // left for get, insert or the wheel to reclaim
+                    unlockElementsHash(lockRangeStart, lockRangeEnd, locks);
+                    return false;
                 }
+                elementStorage[locks[lockDepth]].value = inValue;
+                unlockElementsHash(lockRangeStart, lockRangeEnd, locks);
+                touchElement(threadIdx, locks[lockDepth]);
                 return true;
             }
             else
             {
-                idx = (idx + 1) % hashSize;
+                idx = nextProbeIdx(idx, hashSize);
                 lockRangeEnd = idx;
                 if (lockDepth >= HASH_MAX_LOCK_DEPTH)
                     abort();
@@ -880,15 +1661,85 @@ bool LFLRUHashTable<K, V, HashFunc>::set(unsigned long long threadIdx, const K &
     }
 }
 
+template<typename K, typename V, class HashFunc>
+template<class Updater>
+bool LFLRUHashTable<K, V, HashFunc>::update(unsigned long long threadIdx, const K & inKey, Updater updater)
+{
+    const unsigned long long keyHash = applyHash(hasherFunc, inKey);
+    unsigned long long idx = reduceRange(keyHash, hashSize);
+    unsigned long long lockRangeStart = idx;
+    unsigned long long lockRangeEnd = idx;
+    unsigned long long lockDepth = 0;
+    unsigned int * locks = threadList(threadIdx).locks;
+    locks[lockDepth] = lockElementHash(idx);
+
+    while(locks[lockDepth] != HASH_FREE_MARK) // linear probing
+    {
+        if(elementStorage[locks[lockDepth]].key == inKey)
+        {
+            unsigned long long now = 0;
+            if(isExpired(locks[lockDepth], now))
+            {
+                // left for get, insert or the wheel to reclaim
+                unlockElementsHash(lockRangeStart, lockRangeEnd, locks);
+                return false;
+            }
+            updater(elementStorage[locks[lockDepth]].value);
+            unlockElementsHash(lockRangeStart, lockRangeEnd, locks);
+            if(sketch)
+                sketch->increment(keyHash);
+            touchElement(threadIdx, locks[lockDepth]);
+            return true;
+        }
+        else
+        {
+            idx = nextProbeIdx(idx, hashSize);
+            lockRangeEnd = idx;
+            if (lockDepth >= HASH_MAX_LOCK_DEPTH)
+                abort();
+            ++lockDepth;
+            locks[lockDepth] = lockElementHash(idx);
+        }
+    }
+    unlockElementsHash(lockRangeStart, lockRangeEnd, locks);
+    return false;
+}
+
+template<typename K, typename V, class HashFunc>
+bool LFLRUHashTable<K, V, HashFunc>::fetchAdd(unsigned long long threadIdx, const K & inKey, const V & delta, V & previous)
+{
+    return update(threadIdx, inKey, [&delta, &previous](V & value)
+    {
+        previous = value;
+        value = previous + delta;
+    });
+}
+
+template<typename K, typename V, class HashFunc>
+bool LFLRUHashTable<K, V, HashFunc>::compareExchange(unsigned long long threadIdx, const K & inKey, V & expected, const V & desired)
+{
+    bool exchanged = false;
+    return update(threadIdx, inKey, [&expected, &desired, &exchanged](V & value)
+    {
+        if(value == expected)
+        {
+            value = desired;
+            exchanged = true;
+        }
+        else
+            expected = value;
+    }) && exchanged;
+}
+
 template<typename K, typename V, class HashFunc>
 bool LFLRUHashTable<K, V, HashFunc>::lockElement(unsigned long long threadIdx, const K & inKey, unsigned int * casLocks, unsigned long long locksStart,
                                                  unsigned long long locksEnd)
 {
-    unsigned long long idx = hasherFunc(inKey) % hashSize; // TODO: seed
+    unsigned long long idx = reduceRange(applyHash(hasherFunc, inKey), hashSize);
     unsigned long long lockRangeStart = idx;
     unsigned long long lockRangeEnd = idx;
     unsigned long long lockDepth = 0;
-    unsigned int * locks = casLocks ? casLocks : lruLists[threadIdx].locks;
+    unsigned int * locks = casLocks ? casLocks : threadList(threadIdx).locks;
     locks[lockDepth] = lockElementHash(idx);
 
     while(locks[lockDepth] != HASH_FREE_MARK) // linear probing
@@ -901,7 +1752,7 @@ bool LFLRUHashTable<K, V, HashFunc>::lockElement(unsigned long long threadIdx, c
         }
         else
         {
-            idx = (idx + 1) % hashSize;
+            idx = nextProbeIdx(idx, hashSize);
             lockRangeEnd = idx;
             if (lockDepth >= HASH_MAX_LOCK_DEPTH)
                 abort();
@@ -922,22 +1773,163 @@ bool LFLRUHashTable<K, V, HashFunc>::unlockElement(unsigned long long threadIdx,
     return true;
 }
 
+// rejected element is taken out the way remove() does it, after its slot is unlocked. Backward shift only moves elements into
+// the hole, so slot is looked at again (or the one it was found at, when someone else shifted it back meanwhile). With
+// shiftedPast the furthest final hole of windows that went past endPos is kept (not wrapped), elements shifted there may have
+// gone behind whoever walks the next slots
 template<typename K, typename V, class HashFunc>
-void LFLRUHashTable<K, V, HashFunc>::processHash(unsigned long long threadIdx, std::function<void(LRUElement&)> itemProcessor)
+template<class Predicate>
+size_t LFLRUHashTable<K, V, HashFunc>::packSlots(unsigned long long threadIdx, unsigned long long beginPos, unsigned long long endPos,
+                                                 Predicate & itemPredicate, unsigned long long * shiftedPast)
 {
-    for (unsigned long long pos = 0; pos < hashSize; ++pos)
+    size_t numElementsProcessed = 0;
+    unsigned long long pos = beginPos;
+    while(pos < endPos)
     {
-        unsigned int idx = elementLinks[pos].load(std::memory_order_acquire);
-        unsigned int lockMark = HASH_LOCK_MARK;
-        while(true)
+        unsigned int idx = lockElementHash(pos);
+        bool keep = idx == HASH_FREE_MARK || itemPredicate(elementStorage[idx]);
+        unlockElementHash(pos, idx);
+        if(keep)
+        {
+            ++pos;
+            continue;
+        }
+        bool unlinked = false;
+        unsigned long long windowBegin = pos, windowEnd = pos;
+        if(removeFromHashPos(threadIdx, idx, 0, &unlinked, &windowBegin, &windowEnd))
         {
-            if(idx == HASH_LOCK_MARK)
-                idx = elementLinks[pos].load(std::memory_order_acquire);
-            else if(elementLinks[pos].compare_exchange_weak(idx, lockMark, std::memory_order_release))
-                break;
+            ++numElementsProcessed;
+            // list end ones stay, tail eviction or timer wheel gets them later
+            if(unlinked)
+                pushFreeElement(threadIdx, idx);
+            if(windowBegin < pos && windowBegin >= beginPos)
+                pos = windowBegin;
+            if(shiftedPast && windowEnd > endPos && windowEnd > *shiftedPast)
+                *shiftedPast = windowEnd;
         }
-        itemProcessor(elementStorage[idx]);
-        elementLinks[pos].store(idx, std::memory_order_acq_rel);
+    }
+    return numElementsProcessed;
+}
+
+template<typename K, typename V, class HashFunc>
+template<class Processor>
+void LFLRUHashTable<K, V, HashFunc>::processSlots(unsigned long long beginPos, unsigned long long endPos, Processor & itemProcessor)
+{
+    for(unsigned long long pos = beginPos; pos < endPos; ++pos)
+    {
+        unsigned int idx = lockElementHash(pos);
+        if(idx != HASH_FREE_MARK)
+            itemProcessor(elementStorage[idx]);
+        unlockElementHash(pos, idx);
     }
 }
+
+template<typename K, typename V, class HashFunc>
+template<class Predicate>
+size_t LFLRUHashTable<K, V, HashFunc>::packHash(unsigned long long threadIdx, Predicate itemPredicate)
+{
+    return packSlots(threadIdx, 0, hashSize, itemPredicate);
+}
+
+template<typename K, typename V, class HashFunc>
+template<class Processor>
+void LFLRUHashTable<K, V, HashFunc>::processHash(unsigned long long threadIdx, Processor itemProcessor)
+{
+    processSlots(0, hashSize, itemProcessor);
+}
+
+// elements freed by a chunk go back to free pool when its thread list is released. A removal near the end of a chunk may shift
+// elements of the next one back into slots its worker already passed, so once workers are done the slots such windows reached
+// past their chunk are packed again
+template<typename K, typename V, class HashFunc>
+template<class Predicate, class Progress>
+size_t LFLRUHashTable<K, V, HashFunc>::packHashParallel(Predicate itemPredicate, Progress progress, WorkStealingPool & pool)
+{
+    const unsigned long long numChunks = (hashSize + PARALLEL_CHUNK_SLOTS - 1) / PARALLEL_CHUNK_SLOTS;
+    std::vector<unsigned long long> shiftedPast(numChunks, 0);
+    std::atomic<size_t> numElementsProcessed(0);
+    std::atomic<unsigned long long> slotsDone(0);
+    pool.run(numChunks, [&](size_t, size_t chunkIdx)
+    {
+        const unsigned long long beginPos = chunkIdx * PARALLEL_CHUNK_SLOTS;
+        const unsigned long long endPos = std::min(beginPos + PARALLEL_CHUNK_SLOTS, hashSize);
+        const unsigned long long threadIdx = registerThread();
+        numElementsProcessed.fetch_add(packSlots(threadIdx, beginPos, endPos, itemPredicate, &shiftedPast[chunkIdx]), std::memory_order_relaxed);
+        releaseThread(threadIdx);
+        progress(slotsDone.fetch_add(endPos - beginPos, std::memory_order_relaxed) + endPos - beginPos, hashSize);
+    });
+    size_t numRepacked = 0;
+    const unsigned long long threadIdx = registerThread();
+    for(unsigned long long chunkIdx = 0; chunkIdx < numChunks; ++chunkIdx)
+    {
+        if(!shiftedPast[chunkIdx])
+            continue;
+        unsigned long long beginPos = std::min((chunkIdx + 1) * PARALLEL_CHUNK_SLOTS, hashSize);
+        unsigned long long endPos = shiftedPast[chunkIdx];
+        if(endPos > hashSize) // window wrapped past the last slot
+        {
+            if(beginPos < hashSize)
+                numRepacked += packSlots(threadIdx, beginPos, hashSize, itemPredicate);
+            beginPos = 0;
+            endPos -= hashSize;
+        }
+        numRepacked += packSlots(threadIdx, beginPos, endPos, itemPredicate);
+    }
+    releaseThread(threadIdx);
+    return numElementsProcessed.load() + numRepacked;
+}
+
+template<typename K, typename V, class HashFunc>
+template<class Processor, class Progress>
+void LFLRUHashTable<K, V, HashFunc>::processHashParallel(Processor itemProcessor, Progress progress, WorkStealingPool & pool)
+{
+    std::atomic<unsigned long long> slotsDone(0);
+    pool.run((hashSize + PARALLEL_CHUNK_SLOTS - 1) / PARALLEL_CHUNK_SLOTS, [&](size_t, size_t chunkIdx)
+    {
+        const unsigned long long beginPos = chunkIdx * PARALLEL_CHUNK_SLOTS;
+        const unsigned long long endPos = std::min(beginPos + PARALLEL_CHUNK_SLOTS, hashSize);
+        processSlots(beginPos, endPos, itemProcessor);
+        progress(slotsDone.fetch_add(endPos - beginPos, std::memory_order_relaxed) + endPos - beginPos, hashSize);
+    });
+}
+
+/*
+    // Sample hit ratio under zipf + scan traffic, 10K element cache, 1M keys zipf(0.99) in runs of 8000 with 20% chance of a
+    // 2000 key one-off scan in between, 20M get-else-insert ops on one thread. Results:
+    // LRU 52.7%, SLRU 60.6%, TinyLFU 59.8%, SLRU + TinyLFU 61.0%, all of them 150-170 ns/op
+
+    const unsigned long long KEYS = 1000000, CAPACITY = 10000, OPS = 20000000;
+    std::vector<double> cdf(KEYS);
+    double sum = 0;
+    for (unsigned long long i = 0; i < KEYS; ++i)
+        cdf[i] = sum += 1.0 / pow(i + 1, 0.99);
+    std::mt19937_64 rng(1);
+    std::vector<unsigned long long> trace;
+    unsigned long long scanKey = KEYS;
+    while (trace.size() < OPS)
+    {
+        if (rng() % 100 < 20)
+            for (int i = 0; i < 2000 && trace.size() < OPS; ++i)
+                trace.push_back(scanKey++);
+        else
+            for (int i = 0; i < 8000 && trace.size() < OPS; ++i)
+                trace.push_back(std::lower_bound(cdf.begin(), cdf.end(), std::uniform_real_distribution<double>(0, sum)(rng)) - cdf.begin());
+    }
+    typedef LFLRUHashTable<unsigned long long, unsigned long long> Table;
+    for (unsigned int policy = Table::POLICY_LRU; policy <= Table::POLICY_SLRU_TINYLFU; ++policy)
+    {
+        Table table(CAPACITY + 1, CAPACITY * 4, 1, SeededHash<unsigned long long>(), policy); // + 1, list keeps one element free
+        unsigned long long threadIdx = table.getMyThreadId(), hits = 0, value;
+        for (unsigned long long key : trace)
+        {
+            if (table.get(threadIdx, key, value))
+                ++hits;
+            else
+                table.insert(threadIdx, key, key);
+        }
+        printf("policy %u hit %.1f%%\n", policy, 100.0 * hits / OPS);
+    }
+
+*/
+
 #endif /* LFLRUHASHTABLE_H_ */
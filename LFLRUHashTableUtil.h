@@ -8,661 +8,582 @@
 #ifndef LFLRUHASHTABLEUTIL_H_
 #define LFLRUHASHTABLEUTIL_H_
 
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <functional>
+#include <string>
 #include <vector>
-#include <boost/thread.hpp>
+#include <type_traits>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 #include "LFLRUHashTable.h"
+#include "WorkStealingPool.h"
 
-// TODO: implement all TODO's in LFSparseHashTableUtil
-template<typename K, typename V, class HashFunc = std::hash<K> >
+template<typename K, typename V, class HashFunc = SeededHash<K> >
 class LFLRUHashTableUtil
 {
 public:
     typedef LFLRUHashTable<K, V, HashFunc> LFHT;
-    typedef typename LFHT::LRUBucket LFHTSB;
-    typedef typename LFHT::LRUBucketElement LFHTSBE;
+    typedef typename LFHT::LRUElement LFHTE;
+    typedef typename LFHT::LRULinks LFHTL;
+
+    // save/load file layout: header block | chunk data | SavedList per thread list | SavedChunk per chunk. Every thread LRU list is
+    // saved from head (MRU) to tail, SLRU protected segment before probation, as (size_t size, expTime, item) records, up to SAVE_CHUNK_ITEMS per chunk. Chunks go to the file in the
+    // order they get done, each one SAVE_BLOCK_SIZE aligned and padded for O_DIRECT, index at the end tells where. Links are not
+    // saved, position in the list is. expTime is system_clock milliseconds in the file (steady clock doesn't survive reboot), 0 never
+    static const unsigned long long SAVE_VERSION = 2;
+    static const unsigned long long SAVE_CHUNK_ITEMS = 65536;
+    static const size_t SAVE_BLOCK_SIZE = 4096;
+    static const size_t LOAD_PREFETCH_DISTANCE = 16;
+    static const unsigned long long RESET_FREE_ELEMENTS = 65536; // free storage per resetLists task, whole FREE_BATCHes
+
+    struct SaveHeader
+    {
+        char magic[8]; // "LFLRUSAV"
+        unsigned long long version;
+        unsigned long long numElements;
+        unsigned long long hashSize;
+        unsigned long long numLists;
+        unsigned long long numChunks;
+        unsigned long long listsOffset;
+        unsigned long long chunksOffset;
+        unsigned long long fileSize;
+    };
+
+    struct SavedList
+    {
+        unsigned long long numItems;
+    };
+
+    struct SavedChunk
+    {
+        unsigned long long listIdx;
+        unsigned long long firstRank; // position of first item in its list, 0 is MRU
+        unsigned long long numItems;
+        unsigned long long dataOffset;
+        unsigned long long dataSize;
+    };
 
     // ONLY FOR POD TYPES
-    static void saveRaw(LFLRUHashTable<K, V, HashFunc> * pTable, const char * fileName)
+    static bool saveRaw(LFLRUHashTable<K, V, HashFunc> * pTable, const char * fileName)
     {
-/*        FILE * pFile = fopen(fileName, "wb+");
-        fwrite(pTable, sizeof(LFHT), 1, pFile);
-        fwrite(pTable->buckets, sizeof(LFHTSB), (pTable->maxElements / LFHT::HOLY_GRAIL_SIZE + (pTable->maxElements % LFHT::HOLY_GRAIL_SIZE ? 1ULL : 0ULL)), pFile);
-        for(unsigned long long packBucketPos = 0;
-                        packBucketPos < pTable->maxElements / LFHT::HOLY_GRAIL_SIZE + (pTable->maxElements % LFHT::HOLY_GRAIL_SIZE ? 1ULL : 0ULL); ++packBucketPos)
+        static_assert(std::is_trivially_copyable<K>::value && std::is_trivially_copyable<V>::value, "saveRaw is for POD types");
+        return save(pTable, fileName, [](LFHTE & item, char * data)
         {
-            LFHTSB * bucket = &(pTable->buckets[packBucketPos]);
-            unsigned long long count = googlerank((const unsigned char*) &(bucket->elementBitmap), LFHT::HOLY_GRAIL_SIZE);
-            LFHTSBE * bucketElements = bucket->elements;
-            fwrite(bucketElements, sizeof(LFHTSBE), count, pFile);
-        }
-        fclose(pFile);*/
-        abort();
+            memcpy(data, (const void *) &(item.key), sizeof(K));
+            memcpy(data + sizeof(K), (const void *) &(item.value), sizeof(V));
+        }, [](LFHTE &)
+        {
+            return sizeof(K) + sizeof(V);
+        });
     }
 
-    // ONLY FOR POD TYPES
-    static void loadRaw(LFLRUHashTable<K, V, HashFunc> * pTable, const char * fileName)
+    // ONLY FOR POD TYPES. File saved with other K or V sizes is corrupt
+    static bool loadRaw(LFLRUHashTable<K, V, HashFunc> * pTable, const char * fileName)
     {
-/*        for(unsigned long long bucketPos = 0; bucketPos < pTable->maxElements / LFHT::HOLY_GRAIL_SIZE + (pTable->maxElements % LFHT::HOLY_GRAIL_SIZE ? 1ULL : 0ULL);
-                        ++bucketPos)
+        static_assert(std::is_trivially_copyable<K>::value && std::is_trivially_copyable<V>::value, "loadRaw is for POD types");
+        return load(pTable, fileName, [](LFHTE & item, char * data)
         {
-            LFHTSB * bucket = &(pTable->buckets[bucketPos]);
-            unsigned long long count = googlerank((const unsigned char*) &(bucket->elementBitmap), LFHT::HOLY_GRAIL_SIZE);
-            LFHTSBE * bucketElements = bucket->elements;
-            for(unsigned long long j = 0; j < count; ++j)
-            {
-                bucketElements[j].~LRUBucketElement();
-            }
-            std::free(bucket->elements);
-        }
-        std::free(pTable->buckets);
+            memcpy((void *) &(item.key), data, sizeof(K));
+            memcpy((void *) &(item.value), data + sizeof(K), sizeof(V));
+        }, sizeof(K) + sizeof(V));
+    }
 
-        FILE * pFile = fopen(fileName, "rb");
-        char metaBuffer[sizeof(LFHT)];
-        fread(metaBuffer, sizeof(LFHT), 1, pFile);
-        unsigned long long savedMaxElements = ((LFHT*) metaBuffer)->maxElements;
-        if(pTable->maxElements == savedMaxElements)
-        {
-            pTable->maxLoadFactor = ((LFHT*) metaBuffer)->maxLoadFactor;
-            pTable->minLoadFactor = ((LFHT*) metaBuffer)->minLoadFactor;
-
-            pTable->buckets = (LFHTSB*) std::malloc(
-                            (pTable->maxElements / LFHT::HOLY_GRAIL_SIZE + (pTable->maxElements % LFHT::HOLY_GRAIL_SIZE ? 1ULL : 0ULL)) * sizeof(LFHTSB));
-            memset(pTable->buckets, 0, (pTable->maxElements / LFHT::HOLY_GRAIL_SIZE + (pTable->maxElements % LFHT::HOLY_GRAIL_SIZE ? 1ULL : 0ULL)) * sizeof(LFHTSB));
-            fread(pTable->buckets, sizeof(LFHTSB), (pTable->maxElements / LFHT::HOLY_GRAIL_SIZE + (pTable->maxElements % LFHT::HOLY_GRAIL_SIZE ? 1ULL : 0ULL)),
-                  pFile);
-
-            for(unsigned long long packBucketPos = 0;
-                            packBucketPos < pTable->maxElements / LFHT::HOLY_GRAIL_SIZE + (pTable->maxElements % LFHT::HOLY_GRAIL_SIZE ? 1ULL : 0ULL);
-                            ++packBucketPos)
-            {
-                LFHTSB * bucket = &(pTable->buckets[packBucketPos]);
-                bucket->elementLocks = 0;
-                unsigned long long count = googlerank((const unsigned char*) &(bucket->elementBitmap), LFHT::HOLY_GRAIL_SIZE);
-                bucket->elements = (LFHTSBE *) std::malloc(count * sizeof(LFHTSBE));
-                fread(bucket->elements, sizeof(LFHTSBE), count, pFile);
-            }
-        }
-        else
+    // Saves every thread LRU list in recency order through itemSizeFunc/itemSaveFunc into a single file (fileName.tmp, renamed over
+    // fileName once complete). Each list is walked once by one of WorkStealingPool::shared() workers, chunks are written as they
+    // fill up. Expired elements and ones remove() couldn't unlink (list ends, not in the hash) are skipped. Table must not be used
+    // by other threads meanwhile. False on I/O errors or a broken list
+    static bool save(LFLRUHashTable<K, V, HashFunc> * pTable, const char * fileName, std::function<void(LFHTE&, char*)> itemSaveFunc, std::function<size_t(LFHTE&)> itemSizeFunc)
+    {
+        const unsigned long long numLists = pTable->numLists.load();
+        std::string tmpFileName = std::string(fileName) + ".tmp";
+        int fd = openDirect(tmpFileName.c_str(), O_WRONLY | O_CREAT | O_TRUNC);
+        if(fd < 0)
+            return false;
+        std::vector<SavedList> lists(numLists);
+        std::vector<std::vector<SavedChunk> > listChunks(numLists);
+        std::atomic<unsigned long long> nextDataOffset(SAVE_BLOCK_SIZE);
+        std::atomic<bool> ok(true);
+        const unsigned long long now = LFHT::nowMs();
+        const unsigned long long wallNow = wallNowMs();
+        WorkStealingPool & pool = WorkStealingPool::shared();
+        std::vector<IOBuffer> buffers(pool.size());
+        pool.run(numLists, [&](size_t workerIdx, size_t listIdx)
         {
-            pTable->buckets = (LFHTSB*) std::malloc(
-                            (pTable->maxElements / LFHT::HOLY_GRAIL_SIZE + (pTable->maxElements % LFHT::HOLY_GRAIL_SIZE ? 1ULL : 0ULL)) * sizeof(LFHTSB));
-            memset(pTable->buckets, 0, (pTable->maxElements / LFHT::HOLY_GRAIL_SIZE + (pTable->maxElements % LFHT::HOLY_GRAIL_SIZE ? 1ULL : 0ULL)) * sizeof(LFHTSB));
-
-            LFHTSB * pSavedBuckets = (LFHTSB*) std::malloc(
-                            (savedMaxElements / LFHT::HOLY_GRAIL_SIZE + (savedMaxElements % LFHT::HOLY_GRAIL_SIZE ? 1ULL : 0ULL)) * sizeof(LFHTSB));
-            memset(pSavedBuckets, 0, (savedMaxElements / LFHT::HOLY_GRAIL_SIZE + (savedMaxElements % LFHT::HOLY_GRAIL_SIZE ? 1ULL : 0ULL)) * sizeof(LFHTSB));
-            fread(pSavedBuckets, sizeof(LFHTSB), (savedMaxElements / LFHT::HOLY_GRAIL_SIZE + (savedMaxElements % LFHT::HOLY_GRAIL_SIZE ? 1ULL : 0ULL)), pFile);
-            for(unsigned long long packBucketPos = 0;
-                            packBucketPos < savedMaxElements / LFHT::HOLY_GRAIL_SIZE + (savedMaxElements % LFHT::HOLY_GRAIL_SIZE ? 1ULL : 0ULL);
-                            ++packBucketPos)
+            IOBuffer & buffer = buffers[workerIdx];
+            buffer.size = 0;
+            SavedChunk chunk;
+            memset(&chunk, 0, sizeof(chunk));
+            chunk.listIdx = listIdx;
+            // SLRU protected segment first, it is the hotter one
+            unsigned int elementIdx = pTable->threadList(listIdx).protectedHead.load(std::memory_order_acquire);
+            bool probation = elementIdx == LFHT::LIST_END_MARK;
+            if(probation)
+                elementIdx = pTable->threadList(listIdx).head.load(std::memory_order_acquire);
+            for(unsigned long long steps = 0; elementIdx != LFHT::LIST_END_MARK; ++steps)
             {
-                LFHTSB * savedbucket = &(pSavedBuckets[packBucketPos]);
-                savedbucket->elementLocks = 0;
-                unsigned long long count = googlerank((const unsigned char*) &(savedbucket->elementBitmap), LFHT::HOLY_GRAIL_SIZE);
-                LFHTSBE * pSavedBucketElements = (LFHTSBE *) std::malloc(count * sizeof(LFHTSBE));
-                fread(pSavedBucketElements, sizeof(LFHTSBE), count, pFile);
-
-                // calc all hashes and set bits in new hash
-                for(unsigned long long eidx = 0; eidx < count; ++eidx)
+                if(elementIdx >= pTable->numElements || steps >= pTable->numElements)
                 {
-                    K inKey = pSavedBucketElements[eidx].key;
-                    unsigned long long idx = pTable->hasherFunc(inKey) % pTable->maxElements; // TODO: seed
-                    unsigned long long bucketPos = idx / LFHT::HOLY_GRAIL_SIZE;
-                    unsigned long long bucketOffset = idx % LFHT::HOLY_GRAIL_SIZE;
-                    LFHTSB * bucket = &(pTable->buckets[bucketPos]);
-                    if(bucket->elementBitmap == 0)
-                    {
-                        bucket->bitmapSet(bucketOffset);
-                    }
-                    else
-                    {
-                        bool stepBack = false; // to avoid extra rank calculation later
-                        unsigned long long rank = googlerank((const unsigned char*) &(bucket->elementBitmap), bucketOffset + 1);
-                        while(true) // linear probing
-                        {
-                            bool elementExists = bucket->bitmapTest(bucketOffset);
-                            if(elementExists)
-                            {
-                                stepBack = true;
-                                ++rank;
-                                ++bucketOffset;
-                                idx = (idx + 1) % pTable->maxElements;
-                                if(bucketOffset == LFHT::HOLY_GRAIL_SIZE)
-                                {
-                                    rank = 1;
-                                    bucketPos = idx / LFHT::HOLY_GRAIL_SIZE;
-                                    bucketOffset = idx % LFHT::HOLY_GRAIL_SIZE;
-                                    bucket = &(pTable->buckets[bucketPos]);
-                                    if(bucket->elementBitmap == 0)
-                                    {
-                                        bucket->bitmapSet(bucketOffset);
-                                        break;
-                                    }
-                                }
-                            }
-                            else
-                            {
-                                if(stepBack)
-                                    --rank;
-                                bucket->bitmapSet(bucketOffset);
-                                break;
-                            }
-                        }
-                    }
+                    ok.store(false, std::memory_order_relaxed);
+                    return;
                 }
-                std::free(pSavedBucketElements);
-            }
-            // by now we have all bits set in all pTable->buckets as if we had loaded the pTable->
-            // alloc memory according to bucket counts and process file again to "insert allocated" all elements
-            for(unsigned long long bucketPos = 0;
-                            bucketPos < pTable->maxElements / LFHT::HOLY_GRAIL_SIZE + (pTable->maxElements % LFHT::HOLY_GRAIL_SIZE ? 1ULL : 0ULL); ++bucketPos)
-            {
-                LFHTSB * bucket = &(pTable->buckets[bucketPos]);
-                unsigned long long count = googlerank((const unsigned char*) &(bucket->elementBitmap), LFHT::HOLY_GRAIL_SIZE);
-                bucket->elements = (LFHTSBE *) std::malloc(sizeof(LFHTSBE) * count);
-                bucket->elementLocks = 0ULL;
-                bucket->elementBitmap = 0ULL;
-            }
-
-            // rewind the file
-            fseek(pFile,
-                  sizeof(LFHT) + sizeof(LFHTSB) * (savedMaxElements / LFHT::HOLY_GRAIL_SIZE + (savedMaxElements % LFHT::HOLY_GRAIL_SIZE ? 1ULL : 0ULL)),
-                  SEEK_SET);
-
-            // insert allocated
-            for(unsigned long long packBucketPos = 0;
-                            packBucketPos < savedMaxElements / LFHT::HOLY_GRAIL_SIZE + (savedMaxElements % LFHT::HOLY_GRAIL_SIZE ? 1ULL : 0ULL);
-                            ++packBucketPos)
-            {
-                LFHTSB * savedBucket = &(pSavedBuckets[packBucketPos]);
-                savedBucket->elementLocks = 0;
-                unsigned long long savedcount = googlerank((const unsigned char*) &(savedBucket->elementBitmap), LFHT::HOLY_GRAIL_SIZE);
-                LFHTSBE * pSavedBucketElements = (LFHTSBE *) std::malloc(savedcount * sizeof(LFHTSBE));
-                fread(pSavedBucketElements, sizeof(LFHTSBE), savedcount, pFile);
-
-                // every element should be inserted allocated into first 0 of pBucketsCopy
-                for(unsigned long long sidx = 0; sidx < savedcount; ++sidx)
+                LFHTE & element = pTable->elementStorage[elementIdx];
+                if((!element.expTime || element.expTime > now) && isHashed(pTable, elementIdx))
                 {
-                    K inKey = pSavedBucketElements[sidx].key;
-                    V inValue = pSavedBucketElements[sidx].value;
-                    unsigned long long idx = pTable->hasherFunc(inKey) % pTable->maxElements;
-                    unsigned long long bucketPos = idx / LFHT::HOLY_GRAIL_SIZE;
-                    unsigned long long bucketOffset = idx % LFHT::HOLY_GRAIL_SIZE;
-                    LFHTSB * bucket = &(pTable->buckets[bucketPos]);
-                    LFHTSBE * bucketElements = bucket->elements;
-                    if(bucket->elementBitmap == 0)
+                    size_t itemSize = itemSizeFunc(element);
+                    const unsigned long long expTime = element.expTime ? element.expTime - now + wallNow : 0;
+                    char * record = buffer.grow(RECORD_HEADER_SIZE + itemSize);
+                    memcpy(record, &itemSize, sizeof(size_t));
+                    memcpy(record + sizeof(size_t), &expTime, sizeof(expTime));
+                    itemSaveFunc(element, record + RECORD_HEADER_SIZE);
+                    if(++chunk.numItems == SAVE_CHUNK_ITEMS && !writeChunk(fd, buffer, chunk, nextDataOffset, listChunks[listIdx]))
                     {
-                        bucketElements = bucket->elements;
-                        new (&(bucketElements[0].key)) K(std::move(inKey));
-                        new (&(bucketElements[0].value)) V(std::move(inValue));
-                        bucket->bitmapSet(bucketOffset);
-                        continue;
-                    }
-                    else
-                    {
-                        bool stepBack = false; // to avoid extra rank calculation later
-                        unsigned long long rank = googlerank((const unsigned char*) &(bucket->elementBitmap), bucketOffset + 1);
-                        while(true) // linear probing
-                        {
-                            bool elementExists = bucket->bitmapTest(bucketOffset);
-                            if(elementExists)
-                            {
-                                stepBack = true;
-                                ++rank;
-                                ++bucketOffset;
-                                idx = (idx + 1) % pTable->maxElements;
-                                if(bucketOffset == LFHT::HOLY_GRAIL_SIZE)
-                                {
-                                    rank = 1;
-                                    bucketPos = idx / LFHT::HOLY_GRAIL_SIZE;
-                                    bucketOffset = idx % LFHT::HOLY_GRAIL_SIZE;
-                                    bucket = &(pTable->buckets[bucketPos]);
-                                    bucketElements = bucket->elements;
-                                    if(bucket->elementBitmap == 0)
-                                    {
-                                        new (&(bucketElements[0].key)) K(std::move(inKey));
-                                        new (&(bucketElements[0].value)) V(std::move(inValue));
-                                        bucket->bitmapSet(bucketOffset);
-                                        break;
-                                    }
-                                }
-                            }
-                            else
-                            {
-                                if(stepBack)
-                                    --rank;
-                                unsigned long long count = googlerank((const unsigned char*) &(bucket->elementBitmap), LFHT::HOLY_GRAIL_SIZE);
-                                if(rank < count)
-                                    memmove(bucketElements + rank + 1, bucketElements + rank, (count - rank) * sizeof(LFHTSBE));
-                                new (&(bucketElements[rank].key)) K(std::move(inKey));
-                                new (&(bucketElements[rank].value)) V(std::move(inValue));
-                                bucket->bitmapSet(bucketOffset);
-                                break;
-                            }
-                        }
+                        ok.store(false, std::memory_order_relaxed);
+                        return;
                     }
                 }
-                std::free(pSavedBucketElements);
+                elementIdx = element.links.load(std::memory_order_acquire).right;
+                if(elementIdx == LFHT::LIST_END_MARK && !probation)
+                {
+                    probation = true;
+                    elementIdx = pTable->threadList(listIdx).head.load(std::memory_order_acquire);
+                }
             }
-            std::free(pSavedBuckets);
+            if(chunk.numItems && !writeChunk(fd, buffer, chunk, nextDataOffset, listChunks[listIdx]))
+                ok.store(false, std::memory_order_relaxed);
+            lists[listIdx].numItems = chunk.firstRank;
+        });
+
+        SaveHeader header;
+        memset(&header, 0, sizeof(header));
+        memcpy(header.magic, "LFLRUSAV", sizeof(header.magic));
+        header.version = SAVE_VERSION;
+        header.numElements = pTable->numElements;
+        header.hashSize = pTable->hashSize;
+        header.numLists = numLists;
+        header.listsOffset = nextDataOffset.load(std::memory_order_relaxed);
+        header.chunksOffset = header.listsOffset + numLists * sizeof(SavedList);
+        IOBuffer meta;
+        memcpy(meta.grow(numLists * sizeof(SavedList)), &lists[0], numLists * sizeof(SavedList));
+        for(unsigned long long listIdx = 0; listIdx < numLists; ++listIdx)
+        {
+            header.numChunks += listChunks[listIdx].size();
+            if(!listChunks[listIdx].empty())
+                memcpy(meta.grow(listChunks[listIdx].size() * sizeof(SavedChunk)), &listChunks[listIdx][0], listChunks[listIdx].size() * sizeof(SavedChunk));
         }
-        fclose(pFile);*/
-        abort();
+        meta.pad();
+        header.fileSize = header.listsOffset + meta.size;
+        IOBuffer headerBlock;
+        memset(headerBlock.grow(SAVE_BLOCK_SIZE), 0, SAVE_BLOCK_SIZE);
+        memcpy(headerBlock.data, &header, sizeof(header));
+        // header goes last, a torn write never looks like a valid file
+        bool res = ok.load() && pwriteAll(fd, meta.data, meta.size, header.listsOffset) && fsync(fd) == 0
+                        && pwriteAll(fd, headerBlock.data, headerBlock.size, 0) && fsync(fd) == 0;
+        res = (close(fd) == 0) && res;
+        if(res)
+            res = rename(tmpFileName.c_str(), fileName) == 0;
+        else
+            unlink(tmpFileName.c_str());
+        return res;
     }
 
-    static void save(LFLRUHashTable<K, V, HashFunc> * pTable, const char * fileName, std::function<void(LFHTSBE&, char*)> itemSaveFunc, std::function<size_t(LFHTSBE&)> itemSizeFunc)
+    // Warm start from file written by save. Saved list i goes to thread list i % numLists (every list the table has set up so far, owned
+    // or not, a table without any gets one for the calling thread), lists sharing a thread are interleaved by recency. TTLs carry on from where they were at save (ones run out since are loaded
+    // expired) and go to thread timer wheels. If saved items don't fit, every thread keeps the same share of its most recent ones, rest is
+    // dropped. Thread lists are laid out back to back over the storage up front, the rest goes to free pool, then WorkStealingPool::shared()
+    // workers read chunks and link items into elementLinks in parallel, so geometry and seed of the table don't have to match
+    // the saved one. Items of other size than fixedItemSize (0 is any) make the file corrupt. Table must not be used by other threads
+    // meanwhile. False if file is missing or corrupt, table is left untouched if header or index are bad and empty if chunks are
+    static bool load(LFLRUHashTable<K, V, HashFunc> * pTable, const char * fileName, std::function<void(LFHTE&, char*)> itemLoadFunc,
+                     size_t fixedItemSize = 0)
     {
-/*        FILE * pFile = fopen(fileName, "wb+");
-        fwrite(pTable, sizeof(LFHT), 1, pFile);
-        fwrite(pTable->buckets, sizeof(LFHTSB), (pTable->maxElements / LFHT::HOLY_GRAIL_SIZE + (pTable->maxElements % LFHT::HOLY_GRAIL_SIZE ? 1ULL : 0ULL)), pFile);
-        std::vector<char> buffer;
-        size_t numBuckets = pTable->maxElements / LFHT::HOLY_GRAIL_SIZE + (pTable->maxElements % LFHT::HOLY_GRAIL_SIZE ? 1ULL : 0ULL);
-        size_t numStreams = boost::thread::hardware_concurrency();
-        size_t bucketsPerStream = numBuckets / numStreams + 1;
-        std::vector<std::shared_ptr<boost::thread> > savers(numStreams);
-        std::string itemDataFileNames;
-        for (size_t idxStream = 0; idxStream < numStreams; ++idxStream)
+        int fd = openDirect(fileName, O_RDONLY);
+        if(fd < 0)
+            return false;
+        struct stat fileStat;
+        IOBuffer meta;
+        SaveHeader header;
+        bool ok = fstat(fd, &fileStat) == 0 && (unsigned long long) fileStat.st_size >= SAVE_BLOCK_SIZE
+                        && preadAll(fd, meta.grow(SAVE_BLOCK_SIZE), SAVE_BLOCK_SIZE, 0);
+        if(ok)
         {
-            static const size_t MAX_PATH = 1024;
-            char fileNameBuf[MAX_PATH];
-            snprintf(fileNameBuf,MAX_PATH, "%s.data.%lu.%lu", fileName, idxStream*bucketsPerStream, bucketsPerStream*(idxStream+1) > numBuckets ? numBuckets : bucketsPerStream*(idxStream+1));
-            itemDataFileNames += fileNameBuf;
-            if (idxStream != numStreams - 1)
-                itemDataFileNames += std::string(";");
-            savers[idxStream].reset(new boost::thread(saveThreadProc, pTable, std::string(fileNameBuf), idxStream*bucketsPerStream, bucketsPerStream*(idxStream+1) > numBuckets ? numBuckets : bucketsPerStream*(idxStream+1), itemSaveFunc, itemSizeFunc));
+            memcpy(&header, meta.data, sizeof(header));
+            ok = !memcmp(header.magic, "LFLRUSAV", sizeof(header.magic)) && header.version == SAVE_VERSION && header.numLists
+                            && header.fileSize == (unsigned long long) fileStat.st_size && header.listsOffset >= SAVE_BLOCK_SIZE
+                            && !(header.listsOffset % SAVE_BLOCK_SIZE) && header.listsOffset <= header.fileSize
+                            && header.numLists <= header.fileSize / sizeof(SavedList) && header.numChunks <= header.fileSize / sizeof(SavedChunk)
+                            && header.chunksOffset == header.listsOffset + header.numLists * sizeof(SavedList)
+                            && header.chunksOffset + header.numChunks * sizeof(SavedChunk) <= header.fileSize;
         }
-        fwrite(itemDataFileNames.c_str(), itemDataFileNames.size(), 1, pFile);
-        fclose(pFile);
-        for (size_t idxStream = 0; idxStream < numStreams; ++idxStream)
+        if(ok)
         {
-            savers[idxStream]->join();
-        }*/
-        abort();
-    }
-
-    static void load(LFLRUHashTable<K, V, HashFunc> * pTable, const char * fileName, std::function<void(LFHTSBE&, char*)> itemLoadFunc)
-    {
-/*        for(unsigned long long bucketPos = 0; bucketPos < pTable->maxElements / LFHT::HOLY_GRAIL_SIZE + (pTable->maxElements % LFHT::HOLY_GRAIL_SIZE ? 1ULL : 0ULL);
-                        ++bucketPos)
+            meta.size = 0;
+            ok = preadAll(fd, meta.grow(header.fileSize - header.listsOffset), header.fileSize - header.listsOffset, header.listsOffset);
+        }
+        const SavedList * lists = (const SavedList *) meta.data;
+        const SavedChunk * chunks = (const SavedChunk *) (meta.data + header.chunksOffset - header.listsOffset);
+        // chunks of a list have to cover it in order, item positions are made up from ranks
+        std::vector<unsigned long long> covered(ok ? header.numLists : 0, 0);
+        for(unsigned long long chunkIdx = 0; ok && chunkIdx < header.numChunks; ++chunkIdx)
         {
-            LFHTSB * bucket = &(pTable->buckets[bucketPos]);
-            unsigned long long count = googlerank((const unsigned char*) &(bucket->elementBitmap), LFHT::HOLY_GRAIL_SIZE);
-            LFHTSBE * bucketElements = bucket->elements;
-            for(unsigned long long j = 0; j < count; ++j)
-            {
-                bucketElements[j].~LRUBucketElement();
-            }
-            std::free(bucket->elements);
+            const SavedChunk & chunk = chunks[chunkIdx];
+            ok = chunk.listIdx < header.numLists && chunk.numItems && chunk.firstRank == covered[chunk.listIdx] && chunk.dataSize
+                            && !(chunk.dataOffset % SAVE_BLOCK_SIZE) && chunk.dataOffset >= SAVE_BLOCK_SIZE && chunk.dataOffset <= header.listsOffset
+                            && ioAlign(chunk.dataSize) <= header.listsOffset - chunk.dataOffset;
+            if(ok)
+                covered[chunk.listIdx] += chunk.numItems;
+        }
+        for(unsigned long long listIdx = 0; ok && listIdx < header.numLists; ++listIdx)
+            ok = covered[listIdx] == lists[listIdx].numItems;
+        if(!ok)
+        {
+            close(fd);
+            return false;
         }
-        std::free(pTable->buckets);
 
-        FILE * pFile = fopen(fileName, "rb");
-        char metaBuffer[sizeof(LFHT)];
-        fread(metaBuffer, sizeof(LFHT), 1, pFile);
-        unsigned long long savedMaxElements = ((LFHT*) metaBuffer)->maxElements;
-        if(pTable->maxElements != savedMaxElements)
+        if(!pTable->numLists.load()) // lists are set up lazily, table may not have any yet
+            pTable->getMyThreadId();
+        const unsigned long long numThreads = pTable->numLists.load();
+        std::vector<unsigned long long> keep(numThreads, 0);
+        unsigned long long numItems = 0;
+        for(unsigned long long listIdx = 0; listIdx < header.numLists; ++listIdx)
         {
-            pTable->buckets = (LFHTSB*) std::malloc(
-                            (pTable->maxElements / LFHT::HOLY_GRAIL_SIZE + (pTable->maxElements % LFHT::HOLY_GRAIL_SIZE ? 1ULL : 0ULL)) * sizeof(LFHTSB));
-            memset(pTable->buckets, 0, (pTable->maxElements / LFHT::HOLY_GRAIL_SIZE + (pTable->maxElements % LFHT::HOLY_GRAIL_SIZE ? 1ULL : 0ULL)) * sizeof(LFHTSB));
-
-            // Seek past saved buckets
-            fseek(pFile, sizeof(LFHTSB)*(savedMaxElements / LFHT::HOLY_GRAIL_SIZE + (savedMaxElements % LFHT::HOLY_GRAIL_SIZE ? 1ULL : 0ULL)), SEEK_CUR);
-            static const size_t MAX_FILENAMES_LEN = 32768;
-            char fileNamesBuf[MAX_FILENAMES_LEN];
-            std::vector<std::string> fileNames;
-            fileNamesBuf[fread(fileNamesBuf, 1, MAX_FILENAMES_LEN, pFile)] = 0;
-            char* pch = strtok(fileNamesBuf,";");
-            while (pch != NULL)
-            {
-              fileNames.push_back(pch);
-              pch = strtok (NULL, ";");
-            }
-            fclose(pFile);
-            std::vector<std::shared_ptr<boost::thread> > loaders(fileNames.size());
-            for (size_t idxStream = 0; idxStream < fileNames.size(); ++idxStream)
-            {
-                loaders[idxStream].reset(new boost::thread(loadThreadProc, pTable, fileNames[idxStream], itemLoadFunc));
-            }
-            for (size_t idxStream = 0; idxStream < loaders.size(); ++idxStream)
-            {
-                loaders[idxStream]->join();
-            }
+            keep[listIdx % numThreads] += lists[listIdx].numItems;
+            numItems += lists[listIdx].numItems;
         }
-        else 
+        for(unsigned long long threadIdx = 0; numItems > pTable->numElements && threadIdx < numThreads; ++threadIdx)
+            keep[threadIdx] = (unsigned long long) ((double) keep[threadIdx] * pTable->numElements / numItems);
+        std::vector<unsigned long long> begins = listBegins(&keep[0], numThreads);
+        resetLists(pTable, &keep[0]);
+
+        std::atomic<bool> chunksOk(true);
+        const unsigned long long now = LFHT::nowMs();
+        const unsigned long long wallNow = wallNowMs();
+        WorkStealingPool & pool = WorkStealingPool::shared();
+        std::vector<IOBuffer> buffers(pool.size());
+        std::vector<std::vector<unsigned int> > loadedElements(pool.size());
+        pool.run(header.numChunks, [&](size_t workerIdx, size_t chunkIdx)
         {
-            pTable->buckets = (LFHTSB*) std::malloc(
-                            (pTable->maxElements / LFHT::HOLY_GRAIL_SIZE + (pTable->maxElements % LFHT::HOLY_GRAIL_SIZE ? 1ULL : 0ULL)) * sizeof(LFHTSB));
-            fread(pTable->buckets, sizeof(LFHTSB), (pTable->maxElements / LFHT::HOLY_GRAIL_SIZE + (pTable->maxElements % LFHT::HOLY_GRAIL_SIZE ? 1ULL : 0ULL)), pFile);
-            std::vector<unsigned char> freeSlots;
-            // by now we have all bits set in all pTable->buckets as if we had loaded the pTable->
-            // alloc memory according to bucket counts and process file again to "insert allocated" all elements
-            for(unsigned long long bucketPos = 0;
-                            bucketPos < pTable->maxElements / LFHT::HOLY_GRAIL_SIZE + (pTable->maxElements % LFHT::HOLY_GRAIL_SIZE ? 1ULL : 0ULL); ++bucketPos)
-            {
-                LFHTSB * bucket = &(pTable->buckets[bucketPos]);
-                unsigned long long count = googlerank((const unsigned char*) &(bucket->elementBitmap), LFHT::HOLY_GRAIL_SIZE);
-                bucket->elements = (LFHTSBE *) std::malloc(sizeof(LFHTSBE) * count);
-                freeSlots.push_back(count);
-                bucket->elementLocks = 0ULL;
-                bucket->elementBitmap = 0ULL;
-            }
-
-            static const size_t MAX_FILENAMES_LEN = 32768;
-            char fileNamesBuf[MAX_FILENAMES_LEN];
-            std::vector<std::string> fileNames;
-            fileNamesBuf[fread(fileNamesBuf, 1, MAX_FILENAMES_LEN, pFile)] = 0;
-            char* pch = strtok(fileNamesBuf,";");
-            while (pch != NULL)
-            {
-              fileNames.push_back(pch);
-              pch = strtok (NULL, ";");
-            }
-            fclose(pFile);
-
-            std::vector<std::shared_ptr<boost::thread> > loaders(fileNames.size());
-            std::vector<std::vector< LFHTSBE > > misfits(loaders.size());
-            for (size_t idxStream = 0; idxStream < fileNames.size(); ++idxStream)
-            {
-                loaders[idxStream].reset(new boost::thread(loadThreadProcComplex, pTable, fileNames[idxStream], itemLoadFunc, &(misfits[idxStream]), &freeSlots));
-            }
-            for (size_t idxStream = 0; idxStream < loaders.size(); ++idxStream)
+            if(!chunksOk.load(std::memory_order_relaxed))
+                return;
+            const SavedChunk & chunk = chunks[chunkIdx];
+            const unsigned long long threadIdx = chunk.listIdx % numThreads;
+            IOBuffer & buffer = buffers[workerIdx];
+            buffer.size = 0;
+            std::vector<unsigned int> & loaded = loadedElements[workerIdx];
+            loaded.clear();
+            if(!preadAll(fd, buffer.grow(ioAlign(chunk.dataSize)), ioAlign(chunk.dataSize), chunk.dataOffset))
             {
-                loaders[idxStream]->join();
+                chunksOk.store(false, std::memory_order_relaxed);
+                return;
             }
-            for(unsigned long long bucketPos = 0;
-                            bucketPos < pTable->maxElements / LFHT::HOLY_GRAIL_SIZE + (pTable->maxElements % LFHT::HOLY_GRAIL_SIZE ? 1ULL : 0ULL); ++bucketPos)
+            unsigned long long readIdx = 0;
+            for(unsigned long long rank = chunk.firstRank; rank < chunk.firstRank + chunk.numItems; ++rank)
             {
-                if (freeSlots[bucketPos])
+                size_t itemSize;
+                if(readIdx + RECORD_HEADER_SIZE > chunk.dataSize
+                                || (memcpy(&itemSize, buffer.data + readIdx, sizeof(size_t)), itemSize > chunk.dataSize - readIdx - RECORD_HEADER_SIZE)
+                                || (fixedItemSize && itemSize != fixedItemSize))
+                {
+                    chunksOk.store(false, std::memory_order_relaxed);
+                    return;
+                }
+                const unsigned long long pos = listPosition(lists, header.numLists, numThreads, chunk.listIdx, rank);
+                if(pos < keep[threadIdx])
                 {
-                    LFHTSB * bucket = &(pTable->buckets[bucketPos]);
-                    unsigned long long count = googlerank((const unsigned char*) &(bucket->elementBitmap), LFHT::HOLY_GRAIL_SIZE);
-                    bucket->elements = (LFHTSBE *) std::realloc(bucket->elements, count * sizeof(LFHTSBE));
+                    LFHTE item;
+                    itemLoadFunc(item, buffer.data + readIdx + RECORD_HEADER_SIZE);
+                    unsigned long long expTime;
+                    memcpy(&expTime, buffer.data + readIdx + sizeof(size_t), sizeof(expTime));
+                    const unsigned int elementIdx = begins[threadIdx] + pos;
+                    pTable->elementStorage[elementIdx].key = item.key;
+                    pTable->elementStorage[elementIdx].value = item.value;
+                    pTable->elementStorage[elementIdx].expTime = expTime ? now + (expTime > wallNow ? expTime - wallNow : 0) : 0;
+                    loaded.push_back(elementIdx);
                 }
+                readIdx += RECORD_HEADER_SIZE + itemSize;
             }
-            for (size_t idxStream = 0; idxStream < loaders.size(); ++idxStream)
+            // slot loads are the cost here, get them going a few items ahead
+            for(size_t loadedIdx = 0; loadedIdx < loaded.size(); ++loadedIdx)
             {
-                for(unsigned long long misfitPos = 0; misfitPos < misfits[idxStream].size(); ++ misfitPos)
+                if(loadedIdx + LOAD_PREFETCH_DISTANCE < loaded.size())
+                    __builtin_prefetch(pTable->elementLinks + homeIdx(pTable, loaded[loadedIdx + LOAD_PREFETCH_DISTANCE]), 1, 3 /* _MM_HINT_T0 */);
+                if(!linkHash(pTable, loaded[loadedIdx]))
                 {
-                    pTable->insert(misfits[idxStream][misfitPos].key, misfits[idxStream][misfitPos].value);
+                    chunksOk.store(false, std::memory_order_relaxed);
+                    return;
                 }
             }
-        }*/
-        abort();
-    }
-private:
-    static void saveThreadProc(LFLRUHashTable<K, V, HashFunc> * pTable, std::string fileName, size_t startIdx, size_t endIdx, std::function<void(LFHTSBE&, char*)> itemSaveFunc, std::function<size_t(LFHTSBE&)> itemSizeFunc)
-    {
-/*        FILE * pFile = fopen(fileName.c_str(), "wb+");
-        for(unsigned long long packBucketPos = startIdx; packBucketPos < endIdx; ++packBucketPos)
+        });
+        close(fd);
+        if(!chunksOk.load())
+        {
+            std::fill(keep.begin(), keep.end(), 0);
+            resetLists(pTable, &keep[0]);
+            return false;
+        }
+        pool.run(numThreads, [&](size_t, size_t threadIdx)
         {
-            std::vector<char> buffer;
-            LFHTSB * bucket = &(pTable->buckets[packBucketPos]);
-            unsigned long long count = googlerank((const unsigned char*) &(bucket->elementBitmap), LFHT::HOLY_GRAIL_SIZE);
-            LFHTSBE * bucketElements = bucket->elements;
-            for (size_t itemIdx = 0; itemIdx < count; ++itemIdx)
+            for(unsigned long long elementIdx = begins[threadIdx]; elementIdx < begins[threadIdx + 1]; ++elementIdx)
             {
-                size_t curItemSize = itemSizeFunc(bucketElements[itemIdx]);
-                buffer.reserve(sizeof(size_t) + curItemSize);
-                memcpy(&buffer[0],&curItemSize, sizeof(size_t));
-                itemSaveFunc(bucketElements[itemIdx], &buffer[sizeof(size_t)]);
-                fwrite(&buffer[0], 1, sizeof(size_t) + curItemSize, pFile);
+                if(pTable->elementStorage[elementIdx].expTime)
+                    pTable->addExpiry(threadIdx, elementIdx, pTable->elementStorage[elementIdx].expTime);
             }
-        }
-        fclose(pFile);*/
-        abort();
+        });
+        return true;
     }
 
-    static void loadThreadProc(LFLRUHashTable<K, V, HashFunc> * pTable, std::string fileName, std::function<void(LFHTSBE&, char*)> itemLoadFunc)
+private:
+    // SAVE_BLOCK_SIZE aligned buffer that grows like a vector
+    struct IOBuffer
     {
-/*        enum READER_STATE
+        char * data;
+        size_t size;
+        size_t capacity;
+
+        IOBuffer() : data(0), size(0), capacity(0)
         {
-            READING_SIZE,
-            READING_ITEM
-        };
+        }
+        ~IOBuffer()
+        {
+            std::free(data);
+        }
+        IOBuffer(const IOBuffer&) = delete;
+        IOBuffer& operator=(const IOBuffer&) = delete;
 
-        FILE * pFile = fopen(fileName.c_str(), "rb");
+        char * grow(size_t bytes) // returns where appended bytes go
+        {
+            if(size + bytes > capacity)
+            {
+                size_t newCapacity = ioAlign(std::max(capacity * 2, size + bytes));
+                char * newData = (char *) aligned_alloc(SAVE_BLOCK_SIZE, newCapacity);
+                if(size)
+                    memcpy(newData, data, size);
+                std::free(data);
+                data = newData;
+                capacity = newCapacity;
+            }
+            size += bytes;
+            return data + size - bytes;
+        }
+        void pad()
+        {
+            size_t padding = ioAlign(size) - size;
+            if(padding)
+                memset(grow(padding), 0, padding);
+        }
+    };
 
-        size_t sizeBytesRead = 0;
-        size_t itemBytesRead = 0;
+    static const size_t RECORD_HEADER_SIZE = sizeof(size_t) + sizeof(unsigned long long); // size, expTime
 
-        READER_STATE readerState = READING_SIZE;
+    static unsigned long long wallNowMs()
+    {
+        return std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+    }
 
-        std::vector<char> buffer(1024*1024);
+    // pads and writes out buffered chunk, moves chunk on to the next rank
+    static bool writeChunk(int fd, IOBuffer & buffer, SavedChunk & chunk, std::atomic<unsigned long long> & nextDataOffset, std::vector<SavedChunk> & chunks)
+    {
+        chunk.dataSize = buffer.size;
+        buffer.pad();
+        chunk.dataOffset = nextDataOffset.fetch_add(buffer.size, std::memory_order_relaxed);
+        chunks.push_back(chunk);
+        chunk.firstRank += chunk.numItems;
+        chunk.numItems = 0;
+        bool res = pwriteAll(fd, buffer.data, buffer.size, chunk.dataOffset);
+        buffer.size = 0;
+        return res;
+    }
 
-        size_t readIdx = 0;
-        size_t bytesRead = 0;
-        size_t readPos = 0;
+    // position of item in the thread list it is loaded into, lists sharing a thread go round robin: all rank 0 items, then rank 1 ...
+    static unsigned long long listPosition(const SavedList * lists, unsigned long long numLists, unsigned long long numThreads, unsigned long long listIdx,
+                                           unsigned long long rank)
+    {
+        unsigned long long pos = 0;
+        for(unsigned long long otherIdx = listIdx % numThreads; otherIdx < numLists; otherIdx += numThreads)
+            pos += std::min(lists[otherIdx].numItems, rank) + (otherIdx < listIdx && lists[otherIdx].numItems > rank ? 1 : 0);
+        return pos;
+    }
 
-        size_t nextItemSavedSize = 0;
+    // where thread list storage begins with keep[t] elements for thread t, lists back to back. One past the last list is where free
+    // storage begins
+    static std::vector<unsigned long long> listBegins(const unsigned long long * keep, unsigned long long numLists)
+    {
+        std::vector<unsigned long long> begins(numLists + 1, 0);
+        for(unsigned long long threadIdx = 0; threadIdx < numLists; ++threadIdx)
+            begins[threadIdx + 1] = begins[threadIdx] + keep[threadIdx];
+        return begins;
+    }
 
-        while(true)
+    // table must be idle, keep must add up to at most numElements. Thread t gets keep[t] elements at listBegins()[t] as its LRU list
+    // (first one is MRU), storage after the last list goes to free pool. Hash is emptied, stamps and accessClock start at 0. SLRU tables
+    // start with everything in probation. Lists of threads that are gone get elements too, they are orphans for the others to steal
+    // from until someone registers
+    static void resetLists(LFLRUHashTable<K, V, HashFunc> * pTable, const unsigned long long * keep)
+    {
+        const unsigned long long numLists = pTable->numLists.load();
+        const std::vector<unsigned long long> begins = listBegins(keep, numLists);
+        const unsigned long long freeBegin = begins[numLists];
+        const unsigned long long freeTasks = (pTable->numElements - freeBegin + RESET_FREE_ELEMENTS - 1) / RESET_FREE_ELEMENTS;
+        memset((void *) pTable->elementLinks, 255 /*1/4 HASH_FREE_MARK*/, pTable->hashSize * sizeof(std::atomic_uint));
+        pTable->freePool = LFHT::LIST_END_MARK;
+        pTable->accessClock = 0;
+        WorkStealingPool::shared().run(numLists + freeTasks, [&](size_t, size_t taskIdx)
         {
-            bool largeItem = false;
-            bytesRead = fread(&buffer[readPos], 1, buffer.capacity() - readPos, pFile) + readPos;
-            readPos = 0;
-            if (!bytesRead)
-                break; // TODO: anything left behind is bad news
-            readIdx = 0;
-            while(readIdx < bytesRead && !largeItem)
+            if(taskIdx >= numLists)
             {
-                switch (readerState)
+                const unsigned long long begin = freeBegin + (taskIdx - numLists) * RESET_FREE_ELEMENTS;
+                const unsigned long long end = std::min(begin + RESET_FREE_ELEMENTS, pTable->numElements);
+                for(unsigned long long elementIdx = begin; elementIdx < end; ++elementIdx)
                 {
-                    case READING_SIZE:
-                    {
-                        if (bytesRead - readIdx >= (sizeof(size_t) - sizeBytesRead))
-                        {
-                            memcpy(((char*)&nextItemSavedSize) + sizeBytesRead, &buffer[readIdx], sizeof(size_t) - sizeBytesRead);
-                            readIdx += sizeof(size_t) - sizeBytesRead;
-                            readerState = READING_ITEM;
-                            itemBytesRead = 0;
-                            sizeBytesRead = 0;
-                        }
-                        else
-                        {
-                            memcpy(((char*)&nextItemSavedSize) + sizeBytesRead, &buffer[readIdx], bytesRead - readIdx);
-                            sizeBytesRead += bytesRead - readIdx;
-                            readIdx += bytesRead - readIdx;
-                        }
-                        if (readerState == READING_ITEM && nextItemSavedSize >= (buffer.capacity() + sizeof(size_t)))
-                        {
-                            buffer.resize(buffer.capacity() + nextItemSavedSize + sizeof(size_t));
-                            largeItem = true;
-                        }
-                    }
-                    break;
-                    case READING_ITEM:
-                    {
-                        if (bytesRead - readIdx >= (nextItemSavedSize - itemBytesRead))
-                        {
-                            LFHTSBE nextItem;
-                            itemLoadFunc(nextItem, &buffer[readIdx]);
-                            pTable->insert(nextItem.key, nextItem.value);
-                            readIdx += nextItemSavedSize - itemBytesRead;
-                            readerState = READING_SIZE;
-                        }
-                        else
-                        {
-                            memmove(&buffer[0], &buffer[readIdx - itemBytesRead], bytesRead - readIdx + itemBytesRead);
-                            readPos = bytesRead - readIdx;
-                            readIdx += bytesRead - readIdx;
-                            itemBytesRead = 0;
-                        }
-                    }
-                    break;
-                    default:
-                        abort();
-                    break;
+                    LFHTL links;
+                    links.left = LFHT::LIST_END_MARK;
+                    links.right = (elementIdx + 1 - begin) % LFHT::FREE_BATCH && elementIdx + 1 < end ? elementIdx + 1 : LFHT::LIST_END_MARK;
+                    pTable->elementStorage[elementIdx].links.store(links, std::memory_order_relaxed);
                 }
+                for(unsigned long long batchHead = begin; batchHead < end; batchHead += LFHT::FREE_BATCH)
+                    pTable->pushFreeBatch(batchHead, std::min((unsigned long long) LFHT::FREE_BATCH, end - batchHead));
+                return;
             }
-        }
-        fclose(pFile);*/
-        abort();
+            const unsigned long long threadIdx = taskIdx;
+            const unsigned long long begin = begins[threadIdx];
+            const unsigned long long end = begins[threadIdx + 1];
+            for(unsigned long long elementIdx = begin; elementIdx < end; ++elementIdx)
+            {
+                LFHTL links;
+                links.left = elementIdx > begin ? elementIdx - 1 : LFHT::LIST_END_MARK;
+                links.right = elementIdx + 1 < end ? elementIdx + 1 : LFHT::LIST_END_MARK;
+                pTable->elementStorage[elementIdx].links.store(links, std::memory_order_relaxed);
+                pTable->elementStorage[elementIdx].listInfo = threadIdx << 1;
+                pTable->elementStorage[elementIdx].stamp = 0;
+            }
+            pTable->threadList(threadIdx).head = keep[threadIdx] ? begin : LFHT::LIST_END_MARK;
+            pTable->threadList(threadIdx).tail = keep[threadIdx] ? end - 1 : LFHT::LIST_END_MARK;
+            pTable->threadList(threadIdx).freeListHead = LFHT::LIST_END_MARK;
+            pTable->threadList(threadIdx).freeCount = 0;
+            pTable->threadList(threadIdx).clockOps = 0;
+            pTable->threadList(threadIdx).victimList = threadIdx;
+            pTable->threadList(threadIdx).victimCountdown = 0;
+            pTable->threadList(threadIdx).protectedHead = LFHT::LIST_END_MARK;
+            pTable->threadList(threadIdx).protectedTail = LFHT::LIST_END_MARK;
+            pTable->threadList(threadIdx).protectedCount = 0;
+            pTable->threadList(threadIdx).size = keep[threadIdx];
+            if(pTable->threadList(threadIdx).state != LFHT::LIST_OWNED)
+                pTable->threadList(threadIdx).state = keep[threadIdx] ? LFHT::LIST_ORPHAN : LFHT::LIST_IDLE;
+            pTable->threadList(threadIdx).rejects = 0;
+            pTable->threadList(threadIdx).moves = 0;
+            pTable->threadList(threadIdx).inserts = 0;
+            pTable->clearExpiryWheel(threadIdx);
+        });
+        pTable->numOrphans = 0;
+        for(unsigned long long threadIdx = 0; threadIdx < numLists; ++threadIdx)
+            pTable->numOrphans += pTable->threadList(threadIdx).state == LFHT::LIST_ORPHAN ? 1 : 0;
     }
 
-    static void loadThreadProcComplex(LFLRUHashTable<K, V, HashFunc> * pTable, std::string fileName, std::function<void(LFHTSBE&, char*)> itemLoadFunc, std::vector<LFHTSBE>* misfits, std::vector<unsigned char>* freeSlots)
+    // table must be idle. Whether elementIdx is what the hash points to for its key
+    static bool isHashed(LFLRUHashTable<K, V, HashFunc> * pTable, unsigned int elementIdx)
     {
-/*        enum READER_STATE
+        unsigned long long idx = homeIdx(pTable, elementIdx);
+        for(unsigned long long probe = 0; probe < pTable->hashSize; ++probe)
         {
-            READING_SIZE,
-            READING_ITEM
-        };
-
-        size_t endBucketPos = atoi(fileName.substr(fileName.rfind('.')+1).c_str());
-        size_t beginBucketPos = atoi(fileName.substr(fileName.rfind('.', fileName.rfind('.')-1)+1, fileName.rfind('.') - (fileName.rfind('.', fileName.rfind('.')-1)+1)).c_str());
-
-        FILE * pFile = fopen(fileName.c_str(), "rb");
-
-        size_t sizeBytesRead = 0;
-        size_t itemBytesRead = 0;
+            unsigned int current = pTable->elementLinks[idx].load(std::memory_order_acquire);
+            if(current == elementIdx)
+                return true;
+            if(current == LFHT::HASH_FREE_MARK)
+                return false;
+            idx = nextProbeIdx(idx, pTable->hashSize);
+        }
+        return false;
+    }
 
-        READER_STATE readerState = READING_SIZE;
+    static unsigned long long homeIdx(LFLRUHashTable<K, V, HashFunc> * pTable, unsigned int elementIdx)
+    {
+        return reduceRange(applyHash(pTable->hasherFunc, pTable->elementStorage[elementIdx].key), pTable->hashSize);
+    }
 
-        std::vector<char> buffer(1024*1024);
+    // warm start insert, CAS into first free slot is enough as nothing gets removed meanwhile. False on duplicate key
+    static bool linkHash(LFLRUHashTable<K, V, HashFunc> * pTable, unsigned int elementIdx)
+    {
+        const K & key = pTable->elementStorage[elementIdx].key;
+        unsigned long long idx = homeIdx(pTable, elementIdx);
+        for(unsigned long long probe = 0; probe < pTable->hashSize; ++probe)
+        {
+            unsigned int current = LFHT::HASH_FREE_MARK;
+            if(pTable->elementLinks[idx].compare_exchange_strong(current, elementIdx, std::memory_order_acq_rel))
+                return true;
+            if(pTable->elementStorage[current].key == key)
+                return false;
+            idx = nextProbeIdx(idx, pTable->hashSize);
+        }
+        return false;
+    }
 
-        size_t readIdx = 0;
-        size_t bytesRead = 0;
-        size_t readPos = 0;
+    // O_DIRECT if file system supports it (tmpfs doesn't)
+    static int openDirect(const char * fileName, int flags)
+    {
+        int fd = open(fileName, flags | O_DIRECT, 0644);
+        if(fd < 0 && errno == EINVAL)
+            fd = open(fileName, flags, 0644);
+        return fd;
+    }
 
-        size_t nextItemSavedSize = 0;
+    static unsigned long long ioAlign(unsigned long long offset)
+    {
+        return (offset + SAVE_BLOCK_SIZE - 1) & ~((unsigned long long) SAVE_BLOCK_SIZE - 1);
+    }
 
-        while(true)
+    static bool pwriteAll(int fd, const void * data, size_t size, unsigned long long offset)
+    {
+        const char * pos = (const char *) data;
+        while(size)
         {
-            bool largeItem = false;
-            bytesRead = fread(&buffer[readPos], 1, buffer.capacity() - readPos, pFile) + readPos;
-            readPos = 0;
-            if (!bytesRead)
-                break; // TODO: anything left behind is bad news
-            readIdx = 0;
-            while(readIdx < bytesRead && !largeItem)
-            {
-                switch (readerState)
-                {
-                    case READING_SIZE:
-                    {
-                        if (bytesRead - readIdx >= (sizeof(size_t) - sizeBytesRead))
-                        {
-                            memcpy(((char*)&nextItemSavedSize) + sizeBytesRead, &buffer[readIdx], sizeof(size_t) - sizeBytesRead);
-                            readIdx += sizeof(size_t) - sizeBytesRead;
-                            readerState = READING_ITEM;
-                            sizeBytesRead = 0;
-                            itemBytesRead = 0;
-                        }
-                        else
-                        {
-                            memcpy(((char*)&nextItemSavedSize) + sizeBytesRead, &buffer[readIdx], bytesRead - readIdx);
-                            sizeBytesRead += bytesRead - readIdx;
-                            readIdx += bytesRead - readIdx;
-                        }
-                        if (readerState == READING_ITEM && nextItemSavedSize >= (buffer.capacity() + sizeof(size_t)))
-                        {
-                            buffer.resize(buffer.capacity() + nextItemSavedSize + sizeof(size_t));
-                            largeItem = true;
-                        }
+            ssize_t written = pwrite(fd, pos, size, offset);
+            if(written <= 0)
+                return false;
+            pos += written;
+            offset += written;
+            size -= written;
+        }
+        return true;
+    }
 
-                    }
-                    break;
-                    case READING_ITEM:
-                    {
-                        if (bytesRead - readIdx >= (nextItemSavedSize - itemBytesRead))
-                        {
-                            LFHTSBE nextItem;
-                            itemLoadFunc(nextItem, &buffer[readIdx]);
-
-                            // do da elephant
-                            unsigned long long idx = pTable->hasherFunc(nextItem.key) % pTable->maxElements; // TODO: seed
-                            unsigned long long bucketPos = idx / LFHT::HOLY_GRAIL_SIZE;
-
-                            if (bucketPos >= beginBucketPos && bucketPos < endBucketPos)
-                            {
-                                bool inserted = false;
-                                unsigned long long bucketOffset = idx % LFHT::HOLY_GRAIL_SIZE;
-                                LFHTSB * bucket = &(pTable->buckets[bucketPos]);
-                                LFHTSBE * bucketElements = bucket->elements;
-                                if(bucket->elementBitmap == 0 && (*freeSlots)[bucketPos])
-                                {
-                                    bucketElements = bucket->elements;
-                                    new (&(bucketElements[0].key)) K(nextItem.key);
-                                    new (&(bucketElements[0].value)) V(nextItem.value);
-                                    --((*freeSlots)[bucketPos]);
-                                    inserted = true;
-                                    bucket->bitmapSet(bucketOffset);
-                                }
-                                else
-                                {
-                                    bool stepBack = false; // to avoid extra rank calculation later
-                                    unsigned long long rank = googlerank((const unsigned char*) &(bucket->elementBitmap), bucketOffset + 1);
-                                    while(true) // linear probing
-                                    {
-                                        bool elementExists = bucket->bitmapTest(bucketOffset);
-                                        if(elementExists)
-                                        {
-                                            stepBack = true;
-                                            ++rank;
-                                            ++bucketOffset;
-                                            idx = (idx + 1) % pTable->maxElements;
-                                            if(bucketOffset == LFHT::HOLY_GRAIL_SIZE)
-                                            {
-                                                rank = 1;
-                                                bucketPos = idx / LFHT::HOLY_GRAIL_SIZE;
-                                                bucketOffset = idx % LFHT::HOLY_GRAIL_SIZE;
-                                                bucket = &(pTable->buckets[bucketPos]);
-                                                bucketElements = bucket->elements;
-                                                if(bucket->elementBitmap == 0 && (*freeSlots)[bucketPos])
-                                                {
-                                                    new (&(bucketElements[0].key)) K(nextItem.key);
-                                                    new (&(bucketElements[0].value)) V(nextItem.value);
-                                                    --((*freeSlots)[bucketPos]);
-                                                    inserted = true;
-                                                    bucket->bitmapSet(bucketOffset);
-                                                    break;
-                                                }
-                                            }
-                                        }
-                                        else if ((*freeSlots)[bucketPos])
-                                        {
-                                            if(stepBack)
-                                                --rank;
-                                            unsigned long long count = googlerank((const unsigned char*) &(bucket->elementBitmap), LFHT::HOLY_GRAIL_SIZE);
-                                            if(rank < count)
-                                                memmove(bucketElements + rank + 1, bucketElements + rank, (count - rank) * sizeof(LFHTSBE));
-                                            new (&(bucketElements[rank].key)) K(nextItem.key);
-                                            new (&(bucketElements[rank].value)) V(nextItem.value);
-                                            --((*freeSlots)[bucketPos]);
-                                            inserted = true;
-                                            bucket->bitmapSet(bucketOffset);
-                                            break;
-                                        }
-                                    }
-                                }
-                                if (!inserted)
-                                    (*misfits).push_back(nextItem);
-                            }
-                            else
-                                (*misfits).push_back(nextItem);
-
-                            readIdx += nextItemSavedSize - itemBytesRead;
-                            readerState = READING_SIZE;
-                        }
-                        else
-                        {
-                            memmove(&buffer[0], &buffer[readIdx - itemBytesRead], bytesRead - readIdx + itemBytesRead);
-                            readPos = bytesRead - readIdx;
-                            readIdx += bytesRead - readIdx;
-                            itemBytesRead = 0;
-                        }
-                    }
-                    break;
-                    default:
-                        abort();
-                    break;
-                }
-            }
+    static bool preadAll(int fd, void * data, size_t size, unsigned long long offset)
+    {
+        char * pos = (char *) data;
+        while(size)
+        {
+            ssize_t bytesRead = pread(fd, pos, size, offset);
+            if(bytesRead <= 0)
+                return false;
+            pos += bytesRead;
+            offset += bytesRead;
+            size -= bytesRead;
         }
-        fclose(pFile);*/
-        abort();
+        return true;
     }
 };
 
+/*
+    // Sample warm restart, 4M u64 -> u64 items over 4 thread lists. On a single core box save takes ~400ms and load ~650ms
+    // (ext4, O_DIRECT), load is bound by elementLinks cache misses
+
+    typedef LFLRUHashTableUtil<unsigned long long, unsigned long long> Util;
+    const unsigned long long N = 1 << 22;
+    LFLRUHashTable<unsigned long long, unsigned long long> cache(N, N * 2, 4);
+    // ... worker threads insert / get with their getMyThreadId() ...
+    if(!Util::saveRaw(&cache, "cache.lru"))
+        abort();
+
+    // after restart, thread count and sizes may differ, most recent items of every list are kept
+    LFLRUHashTable<unsigned long long, unsigned long long> restored(N / 2, N, 2);
+    if(!Util::loadRaw(&restored, "cache.lru"))
+        abort();
+
+*/
+
 #endif /* LFLRUHASHTABLEUTIL_H_ */
@@ -10,6 +10,8 @@
 #include <memory>
 #include <allocator>
 
+#include "bittwiddlinghacks.hh"
+
 // TODO: implement save/load/rehash in a separate friend class\file LFSparseHashTableUtil
 // TODO: Implement support for monotonous keys for given key - truncate last bits for number of pairs to fit into cache line - hash, add truncated bits
 template<
@@ -79,33 +81,9 @@ public:
         {
             return data & (1ULL << (pos + POINTER_BITS + LOCK_BITS));
         }
-        inline unsigned long long rankAtPos(unsigned long long pos) 
+        inline unsigned long long rankAtPos(unsigned long long pos)
         {
-            // TODO: intrinsics for MSVC/GCC/CLANG
-            unsigned long long retval = 0;
-            static constexpr char bits_in_char[256] =
-            {
-                0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4,
-                1, 2, 2, 3, 2, 3, 3, 4, 2, 3, 3, 4, 3, 4, 4, 5,
-                1, 2, 2, 3, 2, 3, 3, 4, 2, 3, 3, 4, 3, 4, 4, 5,
-                2, 3, 3, 4, 3, 4, 4, 5, 3, 4, 4, 5, 4, 5, 5, 6,
-                1, 2, 2, 3, 2, 3, 3, 4, 2, 3, 3, 4, 3, 4, 4, 5,
-                2, 3, 3, 4, 3, 4, 4, 5, 3, 4, 4, 5, 4, 5, 5, 6,
-                2, 3, 3, 4, 3, 4, 4, 5, 3, 4, 4, 5, 4, 5, 5, 6,
-                3, 4, 4, 5, 4, 5, 5, 6, 4, 5, 5, 6, 5, 6, 6, 7,
-                1, 2, 2, 3, 2, 3, 3, 4, 2, 3, 3, 4, 3, 4, 4, 5,
-                2, 3, 3, 4, 3, 4, 4, 5, 3, 4, 4, 5, 4, 5, 5, 6,
-                2, 3, 3, 4, 3, 4, 4, 5, 3, 4, 4, 5, 4, 5, 5, 6,
-                3, 4, 4, 5, 4, 5, 5, 6, 4, 5, 5, 6, 5, 6, 6, 7,
-                2, 3, 3, 4, 3, 4, 4, 5, 3, 4, 4, 5, 4, 5, 5, 6,
-                3, 4, 4, 5, 4, 5, 5, 6, 4, 5, 5, 6, 5, 6, 6, 7,
-                3, 4, 4, 5, 4, 5, 5, 6, 4, 5, 5, 6, 5, 6, 6, 7,
-                4, 5, 5, 6, 5, 6, 6, 7, 5, 6, 6, 7, 6, 7, 7, 8,
-            };
-            const unsigned char* bm = (const unsigned char*)&data + (POINTER_BITS+LOCK_BITS) / CHAR_BIT;
-            for (; pos > 8ULL; pos -= 8ULL)
-                retval += bits_in_char[*bm++];
-            return retval + bits_in_char[*bm & ((1ULL << pos) - 1ULL)];
+            return rank64(data >> (POINTER_BITS + LOCK_BITS), pos);
         }
     };
 
@@ -1,6 +1,7 @@
 #ifndef LFSPARSEHASHTABLE_H_
 #define LFSPARSEHASHTABLE_H_
 
+#include <algorithm>
 #include <functional>
 #include <atomic>
 #include <cstdlib>
@@ -8,8 +9,12 @@
 #include <stdexcept>
 #include <utility>
 #include <memory>
+#include <thread>
+#include <type_traits>
+#include <vector>
 #include <math.h>
 
+#include <sys/mman.h>
 #include <x86intrin.h>
 
 //#define SPARSEHASHTABLE_DEBUG 1
@@ -19,8 +24,14 @@
 #endif
 
 #include "bittwiddlinghacks.hh"
+#include "seededhash.hh"
+#include "EpochReclaimer.h"
+#include "HugePages.h"
+#include "LockContention.h"
+#include "NumaPlacement.h"
+#include "SectorArena.h"
+#include "WorkStealingPool.h"
 
-// TODO: add rvalueref support to insert insertOrSet and set operations
 // OPTIONAL: for kv pairs larger than a cacheline implement double hashing and storing 50 elements per bucket (1 element bit, 8 small hash bits)*50 + 62 bits for pointer
 // OPTIONAL: Implement support for monotonous keys for given key - truncate last bits for number of pairs to fit into cache line - hash, add truncated bits
 // OPTIONAL DESIGN: This table design works great with tables that are saved/loaded AND most operations are get/set. with setups where most operations are inserts deletes
@@ -34,8 +45,32 @@
 // OPTIONAL DESIGN: All this sounds comples but should be fine and will have a lot less fragmentation and little wasted space at target load factor
 // OPTIONAL DESIGN: Another option is to have the sector backed up by two lockfree freelist (one continuously preallocated of size sectorSize*loadFactor) another with elements allocated on per element basis of size
 // OPTIONAL DESIGN: up to sectorSize*(1 - loadFactor), and have idx intrusively stored in elements to form smaller bucket lists. Space / time complexities for this are not clear, but this should give completely LF reads
+//
+// STORAGE_SECTORS implements the sector part of the above with bucket layout left as is (snapshots and LFSparseHashTableUtil
+// depend on it): bucket element arrays are runs in a SectorArena preallocated at maxLoadFactor, grown and shrunk in place
+// where neighbours allow, and arrays that don't fit go to heap. STORAGE_HEAP is the plain malloc/realloc per bucket
+//
+// READS_OPTIMISTIC makes get() of trivially copyable keys and values lock free: every unlock bumps the bucket version, readers
+// read version, bitmap and elements, check the probed lock bits are free and the version still holds before following elements,
+// copy the value out and check every bucket they probed once more. Heap element arrays are retired through EpochReclaimer
+// instead of freed (and not realloc'd), so a reader never touches unmapped memory. Readers that keep failing, get(unlock = false)
+// and tables that are migrating take the locked path
+//
+// PLACEMENT_INTERLEAVE / PLACEMENT_PARTITION place bucket arrays and sector arenas over NUMA nodes (see NumaPlacement.h) instead of
+// leaving them to first touch. Partition gives every node a contiguous part of the buckets together with the arena sectors of
+// that part, nodeOf(key) tells which node a key lives on so requests can be handed to threads of that node. Heap element arrays
+// (STORAGE_HEAP and sector overflow) follow first touch, which is the right node once requests are routed
+//
+// inHugePages (see HugePages.h) backs bucket arrays with huge pages so random probes over big tables don't miss the TLB on every
+// bucket. Placement still applies, bucketsStats() tells what backing the current array got
+//
+// Every bucket keeps 4 bits of hash per position (fingerprint, the low hash nibble with 0 taken out), so a bucket with its
+// fingerprints is a single cache line. Probes compare it first and follow elements only where it matches, optimistic get checks
+// the whole bucket with one SIMD compare, so probe runs cost no element reads except for the key itself (and 1 in 15 others).
+// FINGERPRINT_UNKNOWN (0) matches anything, buckets of an opened snapshot start that way and get real fingerprints when they are
+// first written
 
-template<typename K, typename V, class HashFunc = std::hash<K> >
+template<typename K, typename V, class HashFunc = SeededHash<K> >
 class LFSparseHashTable
 {
 #ifdef SPARSEHASHTABLE_DEBUG
@@ -68,9 +103,29 @@ public:
     typedef value_type& reference;
     typedef const value_type& const_reference;
 
+    enum Storage
+    {
+        STORAGE_HEAP = 0, // element array of every bucket is malloc'd and realloc'd on its own
+        STORAGE_SECTORS = 1 // element arrays are carved from per sector arenas, see SectorArena.h
+    };
+
+    enum Reads
+    {
+        READS_LOCKED = 0, // get locks the probed elements
+        READS_OPTIMISTIC = 1 // lock free get for trivially copyable keys and values, locked for anything else
+    };
+
+    enum Placement
+    {
+        PLACEMENT_FIRST_TOUCH = 0, // pages land on the node of the thread that writes them first
+        PLACEMENT_INTERLEAVE = 1, // buckets and sector arenas are spread page by page over all nodes
+        PLACEMENT_PARTITION = 2 // every node gets a contiguous part of the buckets and the sectors that go with it
+    };
+
     // CANT CHANGE THIS IN LF TABLE! HAS TO BE 64
     // "spin locking" is built around bucket of this size, excuse the caps
     static const unsigned long long HOLY_GRAIL_SIZE = 64; 
+    static const unsigned char FINGERPRINT_UNKNOWN = 0;
 
     struct SparseBucket
     {
@@ -79,21 +134,32 @@ public:
         unsigned long long elementLocks; //8
         unsigned long long elementBitmap; //8
         SparseBucketElement* elements; //8
+        unsigned long long version; //8 bumped by every unlock, optimistic readers validate against it
+        unsigned char fingerprints[HOLY_GRAIL_SIZE / 2]; //32 nibble per position (low ones 0-31, high ones 32-63), valid where elementBitmap is set
 
-        inline void lockElement(unsigned long long pos)
+        // contended acquires back off and count themselves in contention (may be 0), see LockContention.h
+        inline void lockElement(unsigned long long pos, LockContention * contention = 0)
         {
             __builtin_prefetch(this, 1, 3 /* _MM_HINT_T0 */);
             unsigned long long newLockset, oldLockset, expectedLockset = 0;
             expectedLockset = elementLocks & ~(1ULL << pos); // relaxed read from elementLocks
+            newLockset = expectedLockset | (1ULL << pos);
+            oldLockset = __sync_val_compare_and_swap(&elementLocks, expectedLockset, newLockset);
+            if(oldLockset == expectedLockset)
+                return;
+            LockContention::Waiter waiter(contention, &elementLocks);
             while(true)
             {
-                newLockset = expectedLockset | (1ULL << pos);
-                oldLockset = __sync_val_compare_and_swap(&elementLocks, expectedLockset, newLockset);
-                if(oldLockset != expectedLockset)
+                if(oldLockset & (1ULL << pos))
                 {
-                    expectedLockset = oldLockset &= ~(1ULL << pos);
+                    waiter.wait(oldLockset, 1ULL << pos);
+                    oldLockset = __atomic_load_n(&elementLocks, __ATOMIC_RELAXED);
+                    continue;
                 }
-                else
+                expectedLockset = oldLockset; // other bits changed, retry right away
+                newLockset = expectedLockset | (1ULL << pos);
+                oldLockset = __sync_val_compare_and_swap(&elementLocks, expectedLockset, newLockset);
+                if(oldLockset == expectedLockset)
                     break;
             }
         }
@@ -102,6 +168,7 @@ public:
             __builtin_prefetch(this, 1, 3 /* _MM_HINT_T0 */);
             unsigned long long newLockset, oldLockset, expectedLockset = 0;
             expectedLockset = elementLocks | (1ULL << pos); // relaxed read from elementLocks
+            __atomic_fetch_add(&version, 1ULL, __ATOMIC_RELAXED); // has to be visible before the unlock
             while(true)
             {
                 newLockset = expectedLockset & ~(1ULL << pos);
@@ -113,15 +180,22 @@ public:
                 else
                     break;
             }
+            LockContention::wake(&elementLocks, 1ULL << pos);
         }
-        inline void lockBucket()
+        inline void lockBucket(LockContention * contention = 0)
         {
             __builtin_prefetch(this, 1, 3);
-            unsigned long long newLockset, oldLockset, expectedLockset;
+            unsigned long long newLockset = 0xFFFFFFFFFFFFFFFFULL, oldLockset, expectedLockset = 0;
+            oldLockset = __sync_val_compare_and_swap(&elementLocks, expectedLockset, newLockset);
+            if(oldLockset == expectedLockset)
+                return;
+            LockContention::Waiter waiter(contention, &elementLocks);
             while(true)
             {
-                expectedLockset = 0;
-                newLockset = 0xFFFFFFFFFFFFFFFFULL;
+                waiter.wait(oldLockset, oldLockset);
+                oldLockset = __atomic_load_n(&elementLocks, __ATOMIC_RELAXED);
+                if(oldLockset)
+                    continue;
                 oldLockset = __sync_val_compare_and_swap(&elementLocks, expectedLockset, newLockset);
                 if(oldLockset == expectedLockset)
                     break;
@@ -131,18 +205,20 @@ public:
         {
             __builtin_prefetch(this, 1, 3);
             unsigned long long newLockset = 0ULL, oldLockset = 0ULL, expectedLockset = 0xFFFFFFFFFFFFFFFFULL;
+            __atomic_store_n(&version, version + 1ULL, __ATOMIC_RELAXED); // whole bucket is ours, nobody else bumps it now
             oldLockset = __sync_val_compare_and_swap(&elementLocks, expectedLockset, newLockset);
             if(oldLockset != expectedLockset)
                 abort();
+            LockContention::wake(&elementLocks, expectedLockset);
         }
         inline void unlockBucket(const unsigned long long begin, const unsigned long long end)
         {
             __builtin_prefetch(this, 1, 3 /* _MM_HINT_T0 */);
-            unsigned long long lockedBits = (((1ULL << (end - begin + 1ULL)) - 1ULL) << begin);
-            if(!lockedBits)
-                lockedBits = 0xFFFFFFFFFFFFFFFFULL;
+            // shifting by 64 is undefined, full bucket range has to be special cased
+            unsigned long long lockedBits = (end - begin + 1ULL == HOLY_GRAIL_SIZE) ? 0xFFFFFFFFFFFFFFFFULL : (((1ULL << (end - begin + 1ULL)) - 1ULL) << begin);
             unsigned long long newLockset, oldLockset, expectedLockset = 0;
             expectedLockset |= lockedBits;
+            __atomic_fetch_add(&version, 1ULL, __ATOMIC_RELAXED);
             while(true)
             {
                 newLockset = expectedLockset & ~(lockedBits);
@@ -154,9 +230,11 @@ public:
                 else
                     break;
             }
+            LockContention::wake(&elementLocks, lockedBits);
         }
-        inline void bitmapSet(unsigned long long pos)
+        inline void bitmapSet(unsigned long long pos, unsigned char fingerprint)
         {
+            setFingerprint(pos, fingerprint);
             elementBitmap |= (1ULL << pos);
         }
         inline void bitmapClear(unsigned long long pos)
@@ -167,26 +245,269 @@ public:
         {
             return elementBitmap & (1ULL << pos);
         }
+        inline unsigned char fingerprintAt(unsigned long long pos) const
+        {
+            return pos < HOLY_GRAIL_SIZE / 2 ? fingerprints[pos] & 0x0F : fingerprints[pos - HOLY_GRAIL_SIZE / 2] >> 4;
+        }
+        inline void setFingerprint(unsigned long long pos, unsigned char fingerprint)
+        {
+            if(pos < HOLY_GRAIL_SIZE / 2)
+                fingerprints[pos] = (fingerprints[pos] & 0xF0) | fingerprint;
+            else
+                fingerprints[pos - HOLY_GRAIL_SIZE / 2] = (fingerprints[pos - HOLY_GRAIL_SIZE / 2] & 0x0F) | (fingerprint << 4);
+        }
+        inline bool fingerprintMatch(unsigned long long pos, unsigned char fingerprint) const
+        {
+            const unsigned char stored = fingerprintAt(pos);
+            return stored == fingerprint || stored == FINGERPRINT_UNKNOWN;
+        }
+        // bit per position whose key may be the one with fingerprint, occupied or not. Low and high nibbles are compared apart, each
+        // gives a half of the positions
+        inline unsigned long long fingerprintCandidates(unsigned char fingerprint) const
+        {
+#ifdef __AVX2__
+            const __m256i nibbleMask = _mm256_set1_epi8(0x0F);
+            const __m256i needle = _mm256_set1_epi8((char) fingerprint);
+            const __m256i group = _mm256_loadu_si256((const __m256i *) fingerprints);
+            const __m256i low = _mm256_and_si256(group, nibbleMask);
+            const __m256i high = _mm256_and_si256(_mm256_srli_epi16(group, 4), nibbleMask);
+            const __m256i lowMatches = _mm256_or_si256(_mm256_cmpeq_epi8(low, needle), _mm256_cmpeq_epi8(low, _mm256_setzero_si256()));
+            const __m256i highMatches = _mm256_or_si256(_mm256_cmpeq_epi8(high, needle), _mm256_cmpeq_epi8(high, _mm256_setzero_si256()));
+            return (unsigned long long) (unsigned int) _mm256_movemask_epi8(lowMatches)
+                            | (unsigned long long) (unsigned int) _mm256_movemask_epi8(highMatches) << 32;
+#else
+            unsigned long long res = 0;
+            const __m128i nibbleMask = _mm_set1_epi8(0x0F);
+            const __m128i needle = _mm_set1_epi8((char) fingerprint);
+            for(unsigned long long part = 0; part < HOLY_GRAIL_SIZE / 32; ++part)
+            {
+                const __m128i group = _mm_loadu_si128((const __m128i *) (fingerprints + part * 16));
+                const __m128i low = _mm_and_si128(group, nibbleMask);
+                const __m128i high = _mm_and_si128(_mm_srli_epi16(group, 4), nibbleMask);
+                const __m128i lowMatches = _mm_or_si128(_mm_cmpeq_epi8(low, needle), _mm_cmpeq_epi8(low, _mm_setzero_si128()));
+                const __m128i highMatches = _mm_or_si128(_mm_cmpeq_epi8(high, needle), _mm_cmpeq_epi8(high, _mm_setzero_si128()));
+                res |= (unsigned long long) (unsigned int) _mm_movemask_epi8(lowMatches) << (part * 16);
+                res |= (unsigned long long) (unsigned int) _mm_movemask_epi8(highMatches) << (HOLY_GRAIL_SIZE / 2 + part * 16);
+            }
+            return res;
+#endif
+        }
+        // optimistic read of the bucket is still good, nobody holds probed positions or unlocked the bucket since version was read.
+        // Locks go first, unlock bumps version before it clears them
+        inline bool validate(unsigned long long readVersion, unsigned long long probedMask) const
+        {
+            std::atomic_thread_fence(std::memory_order_acquire);
+            if(__atomic_load_n(&elementLocks, __ATOMIC_ACQUIRE) & probedMask)
+                return false;
+            return __atomic_load_n(&version, __ATOMIC_ACQUIRE) == readVersion;
+        }
     };
 
 private:
 
+    // Online resize. resizeEpoch & RESIZE_STATE_MASK gives the state:
+    // RESIZE_STABLE    - only buckets are used
+    // RESIZE_PENDING   - new generation (or checkpoint cut) is being set up, operations wait until all operations in flight are drained
+    // RESIZE_MIGRATING - buckets is the new generation, oldBuckets is read only except for migration. Every operation migrates
+    //                    a few old buckets and mutating operations migrate the probe chain of their key before touching new generation
+    // RESIZE_RETIRING  - everything is migrated, old generation is freed once operations that could still see it are drained
+    // Operations register in a striped counter for epoch parity, so draining never needs a table wide lock.
+    static const unsigned long long RESIZE_STATE_MASK = 3ULL;
+    static const unsigned long long RESIZE_STABLE = 0ULL;
+    static const unsigned long long RESIZE_PENDING = 1ULL;
+    static const unsigned long long RESIZE_MIGRATING = 2ULL;
+    static const unsigned long long RESIZE_RETIRING = 3ULL;
+    static const unsigned long long RESIZE_GUARD_STRIPES = 64;
+    static const unsigned long long RESIZE_MIGRATE_STEP = 2; // old buckets migrated by every operation while migrating
+    static const unsigned long long RESIZE_CHECK_INTERVAL = 64; // load factor is checked every that many inserts per stripe, less for small tables
+    static const unsigned long long RESIZE_GROWTH_FACTOR = 2;
+    // yields a resize, checkpoint cut or retirement waits for operations in flight before it backs off and lets a later operation
+    // retry. Operations may be long lived (packHashParallel) or belong to the thread that is waiting
+    static const unsigned long long RESIZE_DRAIN_YIELDS = 1024;
+    // growth turned down that many times for kept locks closes the gate: new kept locks wait, up to RESIZE_GATE_YIELDS, for holders
+    // to let go of theirs and grow the table once they have. Threads that still hold kept locks go through so they can release them
+    static const unsigned long long RESIZE_GATE_REFUSALS = 8;
+    static const unsigned long long RESIZE_GATE_YIELDS = 64 * RESIZE_DRAIN_YIELDS;
+    static const size_t BATCH_WINDOW = 16; // keys prefetched ahead and resolved together by batch calls
+    static const unsigned long long PARALLEL_CHUNK_BUCKETS = 1024; // pool task of packHashParallel / processHashParallel
+    static const size_t SCAN_COUNT = 64; // default elements per scan call
+    static const unsigned long long OPTIMISTIC_ATTEMPTS = 4; // lock free get tries before it takes the locks
+    static const unsigned long long OPTIMISTIC_MAX_BUCKETS = 4; // probe runs over more buckets than that take the locks
+
+    struct ResizeGuardStripe
+    {
+        std::atomic<unsigned long long> activeOps[2]; //16
+        std::atomic<long long> elementCount; //8
+        std::atomic<unsigned long long> insertCount; //8 only grows, drives load factor checks
+        char padding0[32]; // padding to cacheline
+    }__attribute__((aligned(64)));
+
+    // registers the calling operation for the duration of its scope, helps migration and kicks off growth/retirement on exit
+    class OperationGuard
+    {
+        LFSparseHashTable * table;
+        unsigned long long epoch;
+        bool growRequested;
+        bool locksKept;
+    public:
+        inline OperationGuard(LFSparseHashTable * inTable);
+        inline ~OperationGuard();
+        inline bool migrating() const
+        {
+            return (epoch & RESIZE_STATE_MASK) == RESIZE_MIGRATING;
+        }
+        inline void elementAdded();
+        inline void elementRemoved();
+        inline void keepLocks() // caller leaves with an element locked, must not wait for other operations on exit
+        {
+            locksKept = true;
+        }
+    };
+
     SparseBucket * buckets; //8
     unsigned long long maxElements; //8
     double maxLoadFactor; // 8
     double minLoadFactor; // 8
-    HashFunc hasherFunc; // padded to 4
-    char padding0[28]; // padding to cacheline
+    HashFunc hasherFunc; // seeded, 8 with SeededHash
+    SectorArena<SparseBucketElement> * sectorArena; //8 STORAGE_SECTORS only
+    LockContention * lockContention; //8 backoff settings and counters of contended bucket locks
+    char padding0[8]; // padding to cacheline
+
+    SparseBucket * oldBuckets; //8
+    unsigned long long oldMaxElements; //8
+    unsigned char * oldBucketsMigrated; //8 flag per old bucket, set under old bucket lock
+    SectorArena<SparseBucketElement> * oldSectorArena; //8 old generation element arrays are released into it while migrating
+    ResizeGuardStripe * guardStripes; //8
+    std::atomic<unsigned long long> resizeEpoch; //8
+    std::atomic<unsigned long long> migrationCursor; //8 next old bucket to migrate
+    std::atomic<unsigned long long> migratedCount; //8
+    std::atomic<unsigned long long> heldLocks; //8 elements left locked across calls by get(unlock = false) and lockElement
+    std::atomic<unsigned long long> lockedRefusals; //8 growth turned down for kept locks since the last resize
+    std::atomic<bool> resizeBuilding; // a resize is allocating its generation, other threads don't build one as well
+    char * snapshotBase; //8 snapshot mapped by LFSparseHashTableUtil::openSnapshot, buckets point into it until they are written
+    unsigned long long snapshotSize; //8
+    // Checkpoints. Writers set the dirty bit of every bucket they changed (whole locked range for insert/remove) before unlocking it.
+    // Checkpoint cut is taken like a resize, with operations drained for a moment: dirty bits become pending bits of the checkpoint
+    // and dirty bits start over. Pending buckets are then copied out by LFSparseHashTableUtil, except for the ones some writer is
+    // about to change, these are copied by the writer first (under bucket lock) and handed over through checkpointCopies.
+    // Whatever gets written is the table as it was at the cut. Table does not resize while a checkpoint is running
+    struct CheckpointCopy
+    {
+        CheckpointCopy * next;
+        unsigned long long bucketPos;
+        unsigned long long elementBitmap;
+        SparseBucketElement * elements;
+    };
+    unsigned long long * dirtyBuckets; //8 bit per bucket
+    unsigned long long * checkpointBuckets; //8 pending bit per bucket, all clear when no checkpoint is running
+    std::atomic<CheckpointCopy *> checkpointCopies; //8
+    std::atomic<unsigned long long> checkpointCopiers; //8 writers between taking a pending bit and pushing the copy
+    std::atomic<bool> checkpointRunning;
+    bool dirtyAll; // everything changed since last checkpoint (resize or load), next delta has every bucket
+    unsigned long long checkpointId; //8 snapshot or delta the table was last written to or loaded from, 0 if none
+    unsigned int storage;
+    unsigned long long sectorSlots; //8
+    bool optimisticReads; // READS_OPTIMISTIC with trivially copyable keys and values
+    unsigned int placement;
+    unsigned int hugePages; // HugePages::Policy of bucket arrays
 
+    static inline unsigned long long guardStripeIdx();
+    static inline long long & threadKeptLocks(); // kept locks taken minus released by the calling thread, over all tables of the type
+    void waitKeptLockGate(); // before a kept lock is taken
+    static inline unsigned char fingerprintOf(unsigned long long inHash)
+    {
+        const unsigned char res = (unsigned char) (inHash & 0x0F); // reduceRange takes the high bits
+        return res == FINGERPRINT_UNKNOWN ? 1 : res;
+    }
+    void fingerprintBucket(SparseBucket * bucket); // recomputes fingerprints from keys, bucket must be locked or private
+    static void unlockRangeIn(SparseBucket * inBuckets, unsigned long long inMaxElements, unsigned long long lockRangeStartIdx, unsigned long long lockRangeEndIdx);
+    static void unlockBucketsIn(SparseBucket * inBuckets, unsigned long long inMaxElements, unsigned long long startBucketIdx, unsigned long long endBucketIdx);
     void unlockRange(unsigned long long lockRangeStartIdx, unsigned long long lockRangeEndIdx);
 
+    unsigned long long enterOperation();
+    void leaveOperation(unsigned long long epoch);
+    bool waitForDrain(unsigned long long parity); // false if operations of parity are still in flight after RESIZE_DRAIN_YIELDS
+    void helpMigrate();
+    void migrateAll();
+    void migrateOldBucket(unsigned long long oldBucketPos);
+    void migrateChain(unsigned long long inHash);
+    bool chainMigrated(unsigned long long inHash) const;
+    bool getMigrating(const K & inKey, unsigned long long inHash, V & value);
+    void retireOldGeneration();
+    void recountElements();
+    inline bool inSnapshot(const SparseBucketElement * elements) const;
+    inline SparseBucketElement * ownElements(SparseBucket * bucket, unsigned long long count);
+    inline SparseBucketElement * allocElements(unsigned long long bucketPos, unsigned long long count);
+    inline void freeElements(SparseBucketElement * elements);
+    // old generation arrays, only migration and teardown free those. Operations entering while old generation retires must not
+    // look at oldSectorArena, it is deleted under them
+    inline void freeOldElements(SparseBucketElement * elements);
+    // element arrays of trivially copyable keys and values are realloc'd and memmoved, anything else is move constructed into
+    // a new array. Arrays in sector arena grow and shrink in place when they can. grow leaves gapPos unconstructed, shrink
+    // expects removedPos to be destroyed already
+    static const bool ELEMENTS_RELOCATABLE = std::is_trivially_copyable<K>::value && std::is_trivially_copyable<V>::value;
+    static inline void relocateElements(SparseBucketElement * to, SparseBucketElement * from, unsigned long long count);
+    inline SparseBucketElement * growElements(unsigned long long bucketPos, SparseBucketElement * elements, unsigned long long count,
+                                              unsigned long long gapPos);
+    inline SparseBucketElement * shrinkElements(SparseBucketElement * elements, unsigned long long count, unsigned long long removedPos);
+    void resetStorage(); // new sector arena for current maxElements, no bucket may point into the old one
+    SectorArena<SparseBucketElement> * allocStorage(unsigned long long inMaxElements); // placed sector arena, 0 unless STORAGE_SECTORS
+    SparseBucket * allocBucketArray(unsigned long long numBuckets); // zeroed, placed over nodes before it is touched, HugePages::release it
+    void releaseSnapshot();
+    static inline unsigned long long * allocBucketBits(unsigned long long inMaxElements, bool set);
+    static inline bool testBucketBit(const unsigned long long * bucketBits, unsigned long long bucketPos);
+    static inline bool takeBucketBit(unsigned long long * bucketBits, unsigned long long bucketPos);
+    inline void markDirty(unsigned long long bucketPos);
+    void markDirtyRange(unsigned long long startBucketIdx, unsigned long long endBucketIdx);
+    void markAllDirty();
+    void resetDirty(bool dirty);
+    inline void preserveBucket(unsigned long long bucketPos);
+    void preserveBucketUnlocked(unsigned long long bucketPos);
+    bool beginCheckpoint(bool allBuckets, bool & full);
+    CheckpointCopy * endCheckpoint(bool abandon);
+
+    bool insertInternal(const K & inKey, unsigned long long inHash, const V & inValue);
+    bool insertOrSetInternal(const K & inKey, unsigned long long inHash, const V & inValue);
+    bool getInternal(const K & inKey, unsigned long long inHash, V & inValue, bool unlock);
+    bool getOptimistic(const K & inKey, unsigned long long inHash, V & value, bool & found);
+    template<class VV>
+    bool setInternal(const K & inKey, unsigned long long inHash, VV && inValue, bool locked);
+    // updater(SparseBucketElement &) runs with element range (update) or bucket range (emplace, upsert) locked,
+    // constructor(SparseBucketElement *) placement constructs key and value of a new element
+    template<class Updater>
+    bool updateInternal(const K & inKey, unsigned long long inHash, Updater & updater);
+    template<class Constructor>
+    bool emplaceInternal(const K & inKey, unsigned long long inHash, Constructor & constructor);
+    template<class Constructor, class Updater>
+    bool upsertInternal(const K & inKey, unsigned long long inHash, Constructor & constructor, Updater & updater);
+    template<class KK, class... Args>
+    bool tryEmplaceInternal(KK && inKey, Args&&... args);
+    bool removeInternal(const K & inKey, unsigned long long inHash);
+    bool lockElementInternal(const K & inKey, unsigned long long inHash);
+    bool unlockElementInternal(const K & inKey, unsigned long long inHash);
+    void prefetchBatchBuckets(const K * inKeys, unsigned long long * outHashes, size_t count);
+    void prefetchBatchElements(const unsigned long long * inHashes, size_t count);
+    template<class Predicate>
+    size_t packBuckets(unsigned long long beginBucketPos, unsigned long long endBucketPos, Predicate & itemPredicate, OperationGuard & guard,
+                       unsigned long long * shiftedPast = 0);
+    template<class Processor>
+    void processBuckets(unsigned long long beginBucketPos, unsigned long long endBucketPos, Processor & itemProcessor);
+    unsigned long long bucketHashBegin(unsigned long long bucketPos) const;
+    void migrateHashRange(unsigned long long beginHash, unsigned long long lastHash);
+    void scanBucket(unsigned long long bucketPos, unsigned long long fromHash, std::vector<SparseBucketElement> & outElements);
+
 #ifdef SPARSEHASHTABLE_DEBUG
     std::map<unsigned long long, unsigned long long> collisionAudit;
 #endif
 
 public:
+    // inSectorSlots is used by STORAGE_SECTORS only, 1024 - 8192. Contended bucket locks spin with backoff, after inLockSpinBudget
+    // pauses waiters park on a futex, LockContention::NEVER_PARK keeps them spinning. inReads is one of Reads, inPlacement of Placement,
+    // inHugePages of HugePages::Policy
     LFSparseHashTable(unsigned long long inMaxElements = 1024, double inMaxLoadFactor = 0.5, double inMinLoadFactor = 0.0, const HashFunc & inHasher =
-                                      HashFunc());
+                                      HashFunc(), unsigned int inStorage = STORAGE_HEAP, unsigned long long inSectorSlots = 1024,
+                                      unsigned long long inLockSpinBudget = LockContention::NEVER_PARK, unsigned int inReads = READS_OPTIMISTIC,
+                                      unsigned int inPlacement = PLACEMENT_FIRST_TOUCH, unsigned int inHugePages = HugePages::HUGEPAGES_NONE);
     ~LFSparseHashTable();
     LFSparseHashTable(const LFSparseHashTable& other);
     LFSparseHashTable& operator=(const LFSparseHashTable& other);
@@ -195,104 +516,975 @@ public:
     // IMPORTANT: additional flags for set and get allows for implementation of CAS, FETCH_ADD, FETCH_SUB etc. in client code.
     // Example: if (get(false)) { ++value; set ( true ) } is equivalent to FETCH_ADD
     // Example: if (get(false) && (value==expected)) set ( true ); is equivalent to CAS
+    // update, fetchAdd, compareExchange and upsert below do these in one probe
     bool insert(const K & inKey, const V & inValue/*, bool unlock = true*/);
+    bool insert(const K & inKey, V && inValue);
     bool insertOrSet(const K & inKey, const V & inValue/*, bool unlock = true*/); // NOTE: true if inserted
+    bool insertOrSet(const K & inKey, V && inValue); // NOTE: true if inserted
     bool get(const K & inKey, V & inValue, bool unlock = true); // NOTE: if called with unlock == false, it will try to get the element and leave it locked if found
     bool set(const K & inKey, const V & inValue, bool locked = false); // NOTE: if called with locked == true, it will not try to lock element but will unlock it after set
+    bool set(const K & inKey, V && inValue, bool locked = false);
     bool remove(const K & inKey);
     void unlockBuckets(unsigned long long startBucketIdx, unsigned long long endBucketIdx);
 
+    // emplace builds the element from args (whatever key and value are constructible from) first and drops it if key is there
+    // already. try_emplace constructs the value from args in place only if key is missing, args are left alone otherwise.
+    // NOTE: both true if inserted
+    template<class... Args>
+    bool emplace(Args&&... args);
+    template<class... Args>
+    bool try_emplace(const K & inKey, Args&&... args);
+    template<class... Args>
+    bool try_emplace(K && inKey, Args&&... args);
+
+    // read-modify-write in a single probe. updater(V &) runs with the element locked, it gets a copy of the value that is written
+    // back (elements are packed). upsert calls factory() for the value of a missing key, bucket range is locked for either
+    template<class Updater>
+    bool update(const K & inKey, Updater updater); // NOTE: false if key is missing
+    bool fetchAdd(const K & inKey, const V & delta, V & previous); // NOTE: false if key is missing
+    bool compareExchange(const K & inKey, V & expected, const V & desired); // NOTE: false if missing or different, expected gets current value then
+    template<class Factory, class Updater>
+    bool upsert(const K & inKey, Factory factory, Updater updater); // NOTE: true if inserted
+
     // these will come useful
     bool lockElement(const K & inKey);
     bool unlockElement(const K & inKey);
 
-    void swap(LFSparseHashTable& other);
+    // batched versions of get/insert/set(locked == false) for many keys at a time. Keys are hashed and their buckets and elements
+    // prefetched a window ahead, then resolved in order. outResults[i] is what single key call would have returned for inKeys[i],
+    // return value is the number of true results
+    size_t getBatch(const K * inKeys, V * outValues, bool * outResults, size_t count);
+    size_t insertBatch(const K * inKeys, const V * inValues, bool * outResults, size_t count);
+    size_t setBatch(const K * inKeys, const V * inValues, bool * outResults, size_t count);
+
+    // table grows by itself once size() goes over maxElements * maxLoadFactor. Buckets are migrated incrementally by operations,
+    // resize() starts migration explicitly (false if one is in progress) and finishResize() completes it on the calling thread
+    // Elements kept locked put growth off. Once it was turned down RESIZE_GATE_REFUSALS times, get(unlock = false) and lockElement of
+    // threads that hold no kept locks wait a while for the holders and grow the table first. A thread that never lets go of all its
+    // kept locks still holds growth off
+    bool resize(unsigned long long newMaxElements);
+    void finishResize();
+    unsigned long long size() const; // approximate while operations are in flight
+
+    // contended bucket lock acquires since construction or resetLockStats, uncontended ones are not counted. hotBucket is the most
+    // contended bucket seen, ~0 if none or it was in an old generation
+    struct LockStats
+    {
+        unsigned long long contendedAcquires;
+        unsigned long long spins; // _mm_pause count
+        unsigned long long parks;
+        unsigned long long hotBucket;
+        unsigned long long hotBucketContended;
+    };
+    LockStats lockStats() const;
+    void resetLockStats();
+
+    // NUMA node (see NumaPlacement.h) the home bucket of key is on with PLACEMENT_PARTITION, NumaPlacement::ANY_NODE otherwise.
+    // Parts move with resizes, a key routed to the wrong node during one still works, it is just remote
+    unsigned long long nodeOf(const K & inKey) const;
+    // backing of the current bucket array
+    HugePages::RegionStats bucketsStats() const
+    {
+        return HugePages::stats(buckets);
+    }
+
+    void swap(LFSparseHashTable& other);
+
+    // whole table walks. itemPredicate(SparseBucketElement &) returns false for elements to remove, itemProcessor(SparseBucketElement &)
+    // may change values. Bucket of the element is locked meanwhile. Elements shifted back by a removal may be looked at twice
+    template<class Predicate>
+    size_t packHash(Predicate itemPredicate); // NOTE: number of removed elements
+    template<class Processor>
+    void processHash(Processor itemProcessor);
+    // same, chunks of PARALLEL_CHUNK_BUCKETS buckets are split across pool workers (callables must be thread safe and must not run
+    // jobs on the same pool). progress(bucketsDone, numBuckets) is called by the worker that finished a chunk, noProgress if not needed.
+    // Buckets that removals shifted elements into across a chunk end are packed again after workers are done, so every element is
+    // looked at, some of them twice
+    template<class Predicate, class Progress>
+    size_t packHashParallel(Predicate itemPredicate, Progress progress, WorkStealingPool & pool = WorkStealingPool::shared());
+    template<class Processor, class Progress>
+    void processHashParallel(Processor itemProcessor, Progress progress, WorkStealingPool & pool = WorkStealingPool::shared());
+    static void noProgress(unsigned long long, unsigned long long)
+    {
+    }
+
+    // SCAN style cursor walk, runs alongside any other operation and across resizes, no locks are held between calls. Cursor is a
+    // hash, every element hashing below it was returned already, start with 0. Each call appends copies of whole buckets to
+    // outElements until count were added, returns false (cursor back to 0) once the walk is complete. Elements present for the whole
+    // walk are returned exactly once, ones inserted or removed meanwhile may or may not be. Cursor is only good for the hash seed it
+    // was taken with, table reloaded by LFSparseHashTableUtil has to be walked from 0
+    bool scan(unsigned long long & cursor, std::vector<SparseBucketElement> & outElements, size_t count = SCAN_COUNT);
+}__attribute__((aligned(HOLY_GRAIL_SIZE)));
+
+template<typename K, typename V, class HashFunc>
+void LFSparseHashTable<K, V, HashFunc>::unlockRange(unsigned long long lockRangeStartIdx, unsigned long long lockRangeEndIdx)
+{
+    unlockRangeIn(buckets, maxElements, lockRangeStartIdx, lockRangeEndIdx);
+}
+
+template<typename K, typename V, class HashFunc>
+void LFSparseHashTable<K, V, HashFunc>::unlockRangeIn(SparseBucket * inBuckets, unsigned long long inMaxElements, unsigned long long lockRangeStartIdx,
+                                                      unsigned long long lockRangeEndIdx)
+{
+    const unsigned long long rangeStartBucketPos = lockRangeStartIdx / HOLY_GRAIL_SIZE;
+    const unsigned long long rangeStartBucketOffset = lockRangeStartIdx % HOLY_GRAIL_SIZE;
+    const unsigned long long rangeEndBucketPos = lockRangeEndIdx / HOLY_GRAIL_SIZE;
+    const unsigned long long rangeEndBucketOffset = lockRangeEndIdx % HOLY_GRAIL_SIZE;
+    if(lockRangeEndIdx == lockRangeStartIdx)
+    {
+        SparseBucket * bucket = &(inBuckets[rangeStartBucketPos]);
+        bucket->unlockElement(rangeStartBucketOffset);
+    }
+    else if(lockRangeEndIdx > lockRangeStartIdx)
+    {
+        if(rangeEndBucketPos == rangeStartBucketPos)
+        { // same bucket
+            inBuckets[rangeStartBucketPos].unlockBucket(rangeStartBucketOffset, rangeEndBucketOffset);
+        }
+        else
+        {
+            inBuckets[rangeEndBucketPos].unlockBucket(0, rangeEndBucketOffset);
+            if(rangeEndBucketPos > rangeStartBucketPos + 1ULL)
+                unlockBucketsIn(inBuckets, inMaxElements, rangeStartBucketPos + 1, rangeEndBucketPos - 1);
+            inBuckets[rangeStartBucketPos].unlockBucket(rangeStartBucketOffset, 63ULL);
+        }
+    }
+    else // wrapped the bitch
+    {
+        // maxElements is always a multiple of HOLY_GRAIL_SIZE so last bucket is locked up to its last bit
+        const unsigned long long numBuckets = inMaxElements / HOLY_GRAIL_SIZE;
+        inBuckets[rangeEndBucketPos].unlockBucket(0, rangeEndBucketOffset);
+        if(rangeEndBucketPos > 0ULL)
+            unlockBucketsIn(inBuckets, inMaxElements, 0, rangeEndBucketPos - 1);
+        if(numBuckets - rangeStartBucketPos > 1ULL)
+            unlockBucketsIn(inBuckets, inMaxElements, rangeStartBucketPos + 1, numBuckets - 1);
+        inBuckets[rangeStartBucketPos].unlockBucket(rangeStartBucketOffset, 63ULL);
+    }
+}
+
+template<typename K, typename V, class HashFunc>
+void LFSparseHashTable<K, V, HashFunc>::unlockBuckets(unsigned long long startBucketIdx, unsigned long long endBucketIdx)
+{
+    unlockBucketsIn(buckets, maxElements, startBucketIdx, endBucketIdx);
+}
+
+template<typename K, typename V, class HashFunc>
+void LFSparseHashTable<K, V, HashFunc>::unlockBucketsIn(SparseBucket * inBuckets, unsigned long long inMaxElements, unsigned long long startBucketIdx,
+                                                        unsigned long long endBucketIdx)
+{
+
+    if(startBucketIdx == endBucketIdx)
+        inBuckets[startBucketIdx].unlockBucket();
+    else if(endBucketIdx > startBucketIdx)
+    {
+        while(endBucketIdx > startBucketIdx)
+        {
+            inBuckets[endBucketIdx--].unlockBucket();
+        };
+        inBuckets[startBucketIdx].unlockBucket();
+    }
+    else // wrapped the bitch
+    {
+        unsigned long long tmp = 0;
+        while(endBucketIdx > tmp)
+        {
+            inBuckets[endBucketIdx--].unlockBucket();
+        };
+        inBuckets[0].unlockBucket();
+
+        tmp = inMaxElements / HOLY_GRAIL_SIZE + (inMaxElements % HOLY_GRAIL_SIZE ? 1ULL : 0ULL);
+        while(tmp > startBucketIdx)
+        {
+            inBuckets[--tmp].unlockBucket();
+        };
+    }
+}
+
+template<typename K, typename V, class HashFunc>
+unsigned long long LFSparseHashTable<K, V, HashFunc>::guardStripeIdx()
+{
+    static std::atomic<unsigned long long> nextStripeIdx(0);
+    static thread_local unsigned long long stripeIdx = nextStripeIdx++ % RESIZE_GUARD_STRIPES;
+    return stripeIdx;
+}
+
+template<typename K, typename V, class HashFunc>
+long long & LFSparseHashTable<K, V, HashFunc>::threadKeptLocks()
+{
+    static thread_local long long keptLocks = 0;
+    return keptLocks;
+}
+
+template<typename K, typename V, class HashFunc>
+LFSparseHashTable<K, V, HashFunc>::OperationGuard::OperationGuard(LFSparseHashTable * inTable) :
+                table(inTable), epoch(inTable->enterOperation()), growRequested(false), locksKept(false)
+{
+    // migrating other buckets could run into an element this thread keeps locked
+    if(migrating() && !table->heldLocks.load(std::memory_order_relaxed))
+        table->helpMigrate();
+}
+
+template<typename K, typename V, class HashFunc>
+LFSparseHashTable<K, V, HashFunc>::OperationGuard::~OperationGuard()
+{
+    table->leaveOperation(epoch);
+    // both of these have to run outside of any operation, they wait for operations in flight to drain
+    if(!locksKept && migrating() && table->migratedCount.load(std::memory_order_relaxed) == table->oldMaxElements / HOLY_GRAIL_SIZE)
+        table->retireOldGeneration();
+    if(growRequested)
+    {
+        // new generation outgrew its load factor before the previous resize was done, that resize is finished first so
+        // inserts can't fill the new generation up
+        if(!locksKept && !table->heldLocks.load(std::memory_order_relaxed) &&
+           (table->resizeEpoch.load(std::memory_order_acquire) & RESIZE_STATE_MASK) != RESIZE_STABLE)
+            table->finishResize();
+        if(table->size() > table->maxElements * table->maxLoadFactor && !table->resize(table->maxElements * RESIZE_GROWTH_FACTOR) &&
+           table->heldLocks.load(std::memory_order_relaxed))
+            table->lockedRefusals.fetch_add(1, std::memory_order_relaxed);
+    }
+}
+
+template<typename K, typename V, class HashFunc>
+void LFSparseHashTable<K, V, HashFunc>::OperationGuard::elementAdded()
+{
+    ResizeGuardStripe & stripe = table->guardStripes[guardStripeIdx()];
+    stripe.elementCount.fetch_add(1, std::memory_order_relaxed);
+    unsigned long long stripeInserts = stripe.insertCount.fetch_add(1, std::memory_order_relaxed) + 1;
+    unsigned long long checkInterval = table->maxElements / HOLY_GRAIL_SIZE;
+    if(checkInterval > RESIZE_CHECK_INTERVAL)
+        checkInterval = RESIZE_CHECK_INTERVAL;
+    if(!(stripeInserts % checkInterval))
+        growRequested = table->size() > table->maxElements * table->maxLoadFactor;
+}
+
+template<typename K, typename V, class HashFunc>
+void LFSparseHashTable<K, V, HashFunc>::OperationGuard::elementRemoved()
+{
+    table->guardStripes[guardStripeIdx()].elementCount.fetch_sub(1, std::memory_order_relaxed);
+}
+
+template<typename K, typename V, class HashFunc>
+unsigned long long LFSparseHashTable<K, V, HashFunc>::enterOperation()
+{
+    ResizeGuardStripe & stripe = guardStripes[guardStripeIdx()];
+    while(true)
+    {
+        unsigned long long epoch = resizeEpoch.load(std::memory_order_acquire);
+        if((epoch & RESIZE_STATE_MASK) == RESIZE_PENDING)
+        {
+            std::this_thread::yield();
+            continue;
+        }
+        stripe.activeOps[epoch & 1ULL].fetch_add(1, std::memory_order_seq_cst);
+        // recheck, whoever changed the epoch might have already checked our stripe
+        if(resizeEpoch.load(std::memory_order_seq_cst) == epoch)
+            return epoch;
+        stripe.activeOps[epoch & 1ULL].fetch_sub(1, std::memory_order_release);
+    }
+}
+
+template<typename K, typename V, class HashFunc>
+void LFSparseHashTable<K, V, HashFunc>::leaveOperation(unsigned long long epoch)
+{
+    guardStripes[guardStripeIdx()].activeOps[epoch & 1ULL].fetch_sub(1, std::memory_order_release);
+}
+
+template<typename K, typename V, class HashFunc>
+bool LFSparseHashTable<K, V, HashFunc>::waitForDrain(unsigned long long parity)
+{
+    unsigned long long yields = 0;
+    for(unsigned long long stripeIdx = 0; stripeIdx < RESIZE_GUARD_STRIPES; ++stripeIdx)
+    {
+        while(guardStripes[stripeIdx].activeOps[parity].load(std::memory_order_seq_cst))
+        {
+            if(++yields > RESIZE_DRAIN_YIELDS)
+                return false;
+            std::this_thread::yield();
+        }
+    }
+    return true;
+}
+
+template<typename K, typename V, class HashFunc>
+bool LFSparseHashTable<K, V, HashFunc>::resize(unsigned long long newMaxElements)
+{
+    unsigned long long epoch = resizeEpoch.load(std::memory_order_acquire);
+    if((epoch & RESIZE_STATE_MASK) != RESIZE_STABLE || newMaxElements <= size() || checkpointRunning.load(std::memory_order_acquire))
+        return false;
+    // elements left locked across calls pin the generation, their holder may be the caller. Growth is retried later, once it has
+    // been turned down often enough new kept locks wait at the gate and holders get a while to let go of theirs
+    if(heldLocks.load(std::memory_order_acquire))
+    {
+        if(lockedRefusals.load(std::memory_order_relaxed) < RESIZE_GATE_REFUSALS || threadKeptLocks() > 0)
+            return false;
+        for(unsigned long long yields = 0; heldLocks.load(std::memory_order_acquire); ++yields)
+        {
+            if(yields == RESIZE_DRAIN_YIELDS)
+                return false;
+            std::this_thread::yield();
+        }
+    }
+
+    // new generation is allocated and zeroed while operations still run, PENDING only swaps pointers. maxElements can't change
+    // before the CAS succeeds, a resize in between would have moved the epoch
+    bool building = false;
+    if(!resizeBuilding.compare_exchange_strong(building, true, std::memory_order_acquire))
+        return false;
+    if(newMaxElements % HOLY_GRAIL_SIZE)
+        newMaxElements = ((newMaxElements / HOLY_GRAIL_SIZE) + 1) * HOLY_GRAIL_SIZE;
+    const unsigned long long currentMaxElements = maxElements;
+    unsigned char * newBucketsMigrated = (unsigned char*) std::malloc(currentMaxElements / HOLY_GRAIL_SIZE);
+    memset(newBucketsMigrated, 0, currentMaxElements / HOLY_GRAIL_SIZE);
+    SparseBucket * newBuckets = allocBucketArray(newMaxElements / HOLY_GRAIL_SIZE);
+    unsigned long long * newDirtyBuckets = allocBucketBits(newMaxElements, true); // bucket positions mean nothing to previous checkpoints anymore
+    unsigned long long * newCheckpointBuckets = allocBucketBits(newMaxElements, false);
+    SectorArena<SparseBucketElement> * newSectorArena = allocStorage(newMaxElements);
+
+    // nobody may look at buckets while they are swapped. Checkpoint may have taken its cut in between
+    bool pending = resizeEpoch.compare_exchange_strong(epoch, epoch + RESIZE_PENDING, std::memory_order_seq_cst);
+    if(pending && (checkpointRunning.load(std::memory_order_seq_cst) || !waitForDrain(0) || !waitForDrain(1) || heldLocks.load(std::memory_order_seq_cst)))
+    {
+        resizeEpoch.store(epoch, std::memory_order_seq_cst);
+        pending = false;
+    }
+    if(!pending)
+    {
+        resizeBuilding.store(false, std::memory_order_release);
+        std::free(newBucketsMigrated);
+        HugePages::release(newBuckets);
+        std::free(newDirtyBuckets);
+        std::free(newCheckpointBuckets);
+        delete newSectorArena;
+        return false;
+    }
+
+    unsigned long long * retiredDirtyBuckets = dirtyBuckets;
+    unsigned long long * retiredCheckpointBuckets = checkpointBuckets;
+    oldBuckets = buckets;
+    oldMaxElements = maxElements;
+    oldSectorArena = sectorArena;
+    oldBucketsMigrated = newBucketsMigrated;
+    buckets = newBuckets;
+    dirtyBuckets = newDirtyBuckets;
+    checkpointBuckets = newCheckpointBuckets;
+    sectorArena = newSectorArena;
+    dirtyAll = true;
+    maxElements = newMaxElements;
+    migrationCursor.store(0, std::memory_order_relaxed);
+    migratedCount.store(0, std::memory_order_relaxed);
+    resizeEpoch.store(epoch + RESIZE_MIGRATING, std::memory_order_seq_cst);
+    resizeBuilding.store(false, std::memory_order_release);
+    lockedRefusals.store(0, std::memory_order_relaxed);
+    std::free(retiredDirtyBuckets);
+    std::free(retiredCheckpointBuckets);
+    return true;
+}
+
+// kept locks taken all the time by many threads can keep heldLocks above zero for good, resize would never get its moment.
+// Gate is closed after RESIZE_GATE_REFUSALS refusals, whoever comes to take a kept lock then waits for the holders, finishes the
+// resize in progress and grows the table. Wait is bounded, a holder could be waiting for this thread to do something
+template<typename K, typename V, class HashFunc>
+void LFSparseHashTable<K, V, HashFunc>::waitKeptLockGate()
+{
+    if(lockedRefusals.load(std::memory_order_relaxed) < RESIZE_GATE_REFUSALS || threadKeptLocks() > 0)
+        return;
+    for(unsigned long long yields = 0; yields < RESIZE_GATE_YIELDS && lockedRefusals.load(std::memory_order_acquire) >= RESIZE_GATE_REFUSALS; ++yields)
+    {
+        if(!heldLocks.load(std::memory_order_seq_cst))
+        {
+            if((resizeEpoch.load(std::memory_order_acquire) & RESIZE_STATE_MASK) != RESIZE_STABLE)
+                finishResize();
+            else if(size() > maxElements * maxLoadFactor)
+                resize(maxElements * RESIZE_GROWTH_FACTOR);
+            else
+                lockedRefusals.store(0, std::memory_order_relaxed); // removals brought the load down meanwhile
+        }
+        std::this_thread::yield();
+    }
+}
+
+template<typename K, typename V, class HashFunc>
+void LFSparseHashTable<K, V, HashFunc>::finishResize()
+{
+    {
+        OperationGuard guard(this);
+        if(guard.migrating())
+            migrateAll();
+    }
+    // guard retires old generation on exit, unless some other thread won the race to do it. Retirement backs off while
+    // operations of the migrating epoch are in flight, so it is retried here
+    while((resizeEpoch.load(std::memory_order_acquire) & RESIZE_STATE_MASK) != RESIZE_STABLE)
+    {
+        retireOldGeneration();
+        std::this_thread::yield();
+    }
+}
+
+template<typename K, typename V, class HashFunc>
+unsigned long long LFSparseHashTable<K, V, HashFunc>::size() const
+{
+    long long count = 0;
+    for(unsigned long long stripeIdx = 0; stripeIdx < RESIZE_GUARD_STRIPES; ++stripeIdx)
+        count += guardStripes[stripeIdx].elementCount.load(std::memory_order_relaxed);
+    return count > 0 ? count : 0;
+}
+
+template<typename K, typename V, class HashFunc>
+typename LFSparseHashTable<K, V, HashFunc>::LockStats LFSparseHashTable<K, V, HashFunc>::lockStats() const
+{
+    const LockContention::Stats stats = lockContention->stats();
+    LockStats res;
+    res.contendedAcquires = stats.contendedAcquires;
+    res.spins = stats.spins;
+    res.parks = stats.parks;
+    // lock word is the first member of SparseBucket
+    const SparseBucket * hotBucket = (const SparseBucket *) stats.hotLock;
+    res.hotBucket = hotBucket >= buckets && hotBucket < buckets + maxElements / HOLY_GRAIL_SIZE ? hotBucket - buckets : ~0ULL;
+    res.hotBucketContended = res.hotBucket != ~0ULL ? stats.hotLockContended : 0;
+    return res;
+}
+
+template<typename K, typename V, class HashFunc>
+void LFSparseHashTable<K, V, HashFunc>::resetLockStats()
+{
+    lockContention->reset();
+}
+
+template<typename K, typename V, class HashFunc>
+unsigned long long LFSparseHashTable<K, V, HashFunc>::nodeOf(const K & inKey) const
+{
+    if(placement != PLACEMENT_PARTITION)
+        return NumaPlacement::ANY_NODE;
+    const unsigned long long numElements = maxElements;
+    return NumaPlacement::partitionNode(reduceRange(applyHash(hasherFunc, inKey), numElements) / HOLY_GRAIL_SIZE, numElements / HOLY_GRAIL_SIZE);
+}
+
+template<typename K, typename V, class HashFunc>
+void LFSparseHashTable<K, V, HashFunc>::recountElements()
+{
+    long long count = 0;
+    for(unsigned long long bucketPos = 0; bucketPos < maxElements / HOLY_GRAIL_SIZE; ++bucketPos)
+        count += rank64(buckets[bucketPos].elementBitmap, HOLY_GRAIL_SIZE);
+    for(unsigned long long stripeIdx = 0; stripeIdx < RESIZE_GUARD_STRIPES; ++stripeIdx)
+        guardStripes[stripeIdx].elementCount.store(stripeIdx ? 0 : count, std::memory_order_relaxed);
+}
+
+template<typename K, typename V, class HashFunc>
+bool LFSparseHashTable<K, V, HashFunc>::inSnapshot(const SparseBucketElement * elements) const
+{
+    return (const char *) elements >= snapshotBase && (const char *) elements < snapshotBase + snapshotSize;
+}
+
+// bucket must be locked. Mapped elements get copied out before anything reallocs or moves them, in place value writes
+// don't need this, mapping is private and kernel copies touched pages
+template<typename K, typename V, class HashFunc>
+typename LFSparseHashTable<K, V, HashFunc>::SparseBucketElement * LFSparseHashTable<K, V, HashFunc>::ownElements(SparseBucket * bucket,
+                                                                                                                 unsigned long long count)
+{
+    SparseBucketElement * bucketElements = bucket->elements;
+    if(!inSnapshot(bucketElements))
+        return bucketElements;
+    SparseBucketElement * ownedElements = allocElements(bucket - buckets, count);
+    memcpy(ownedElements, bucketElements, count * sizeof(SparseBucketElement));
+    bucket->elements = ownedElements;
+    fingerprintBucket(bucket); // snapshot keeps no fingerprints
+    return ownedElements;
+}
+
+template<typename K, typename V, class HashFunc>
+void LFSparseHashTable<K, V, HashFunc>::fingerprintBucket(SparseBucket * bucket)
+{
+    unsigned long long rank = 0;
+    for(unsigned long long bitmap = bucket->elementBitmap; bitmap; bitmap &= bitmap - 1ULL)
+        bucket->setFingerprint(__builtin_ctzll(bitmap), fingerprintOf(applyHash(hasherFunc, bucket->elements[rank++].key)));
+}
+
+// sector arena of the bucket if it has room, heap otherwise
+template<typename K, typename V, class HashFunc>
+typename LFSparseHashTable<K, V, HashFunc>::SparseBucketElement * LFSparseHashTable<K, V, HashFunc>::allocElements(unsigned long long bucketPos,
+                                                                                                                   unsigned long long count)
+{
+    if(sectorArena && bucketPos < maxElements / HOLY_GRAIL_SIZE)
+    {
+        SparseBucketElement * elements = sectorArena->alloc(bucketPos * HOLY_GRAIL_SIZE, count);
+        if(elements)
+            return elements;
+    }
+    return (SparseBucketElement *) std::malloc(count * sizeof(SparseBucketElement));
+}
+
+template<typename K, typename V, class HashFunc>
+void LFSparseHashTable<K, V, HashFunc>::freeElements(SparseBucketElement * elements)
+{
+    if(inSnapshot(elements))
+        return;
+    if(sectorArena && sectorArena->owns(elements))
+        sectorArena->release(elements);
+    else if(optimisticReads)
+        EpochReclaimer::shared().retire(elements, EpochReclaimer::freeDeleter);
+    else
+        std::free(elements);
+}
+
+template<typename K, typename V, class HashFunc>
+void LFSparseHashTable<K, V, HashFunc>::freeOldElements(SparseBucketElement * elements)
+{
+    if(oldSectorArena && oldSectorArena->owns(elements))
+        oldSectorArena->release(elements);
+    else
+        freeElements(elements);
+}
+
+// ranges may overlap
+template<typename K, typename V, class HashFunc>
+void LFSparseHashTable<K, V, HashFunc>::relocateElements(SparseBucketElement * to, SparseBucketElement * from, unsigned long long count)
+{
+    if(!count || to == from)
+        return;
+    if(ELEMENTS_RELOCATABLE)
+    {
+        memmove((void *) to, (void *) from, count * sizeof(SparseBucketElement));
+        return;
+    }
+    for(unsigned long long j = 0; j < count; ++j)
+    {
+        const unsigned long long k = to < from ? j : count - 1 - j;
+        new (&(to[k])) SparseBucketElement(std::move(from[k]));
+        from[k].~SparseBucketElement();
+    }
+}
+
+template<typename K, typename V, class HashFunc>
+typename LFSparseHashTable<K, V, HashFunc>::SparseBucketElement * LFSparseHashTable<K, V, HashFunc>::growElements(unsigned long long bucketPos,
+                                                                                                                  SparseBucketElement * elements,
+                                                                                                                  unsigned long long count,
+                                                                                                                  unsigned long long gapPos)
+{
+    SparseBucketElement * grownElements;
+    const bool inArena = sectorArena && sectorArena->owns(elements);
+    if(inArena)
+    {
+        // in place, towards the side with fewer elements to shift
+        grownElements = sectorArena->extend(elements, count, gapPos < count - gapPos);
+        if(grownElements == elements)
+        {
+            relocateElements(elements + gapPos + 1, elements + gapPos, count - gapPos);
+            return elements;
+        }
+        if(grownElements)
+        {
+            relocateElements(grownElements, elements, gapPos);
+            return grownElements;
+        }
+    }
+    if(ELEMENTS_RELOCATABLE && !sectorArena && !optimisticReads)
+    {
+        elements = (SparseBucketElement *) std::realloc((void *) elements, (count + 1) * sizeof(SparseBucketElement));
+        if(gapPos < count)
+            memmove((void *) (elements + gapPos + 1), (void *) (elements + gapPos), (count - gapPos) * sizeof(SparseBucketElement));
+        return elements;
+    }
+    // heap arrays move back to arena once there is room
+    grownElements = allocElements(bucketPos, count + 1);
+    relocateElements(grownElements, elements, gapPos);
+    relocateElements(grownElements + gapPos + 1, elements + gapPos, count - gapPos);
+    freeElements(elements);
+    return grownElements;
+}
+
+template<typename K, typename V, class HashFunc>
+typename LFSparseHashTable<K, V, HashFunc>::SparseBucketElement * LFSparseHashTable<K, V, HashFunc>::shrinkElements(SparseBucketElement * elements,
+                                                                                                                    unsigned long long count,
+                                                                                                                    unsigned long long removedPos)
+{
+    if(sectorArena && sectorArena->owns(elements))
+    {
+        // in place, hole gets closed from the shorter side
+        if(removedPos < count - removedPos - 1)
+        {
+            relocateElements(elements + 1, elements, removedPos);
+            return sectorArena->shrink(elements, count, true);
+        }
+        relocateElements(elements + removedPos, elements + removedPos + 1, count - removedPos - 1);
+        return sectorArena->shrink(elements, count, false);
+    }
+    if(ELEMENTS_RELOCATABLE && !optimisticReads)
+    {
+        if(removedPos + 1 < count)
+            memmove((void *) (elements + removedPos), (void *) (elements + removedPos + 1), (count - removedPos - 1) * sizeof(SparseBucketElement));
+        return (SparseBucketElement *) std::realloc((void *) elements, (count - 1) * sizeof(SparseBucketElement));
+    }
+    SparseBucketElement * shrunkElements = (SparseBucketElement *) std::malloc((count - 1) * sizeof(SparseBucketElement));
+    relocateElements(shrunkElements, elements, removedPos);
+    relocateElements(shrunkElements + removedPos, elements + removedPos + 1, count - removedPos - 1);
+    freeElements(elements);
+    return shrunkElements;
+}
+
+template<typename K, typename V, class HashFunc>
+void LFSparseHashTable<K, V, HashFunc>::resetStorage()
+{
+    delete sectorArena;
+    sectorArena = allocStorage(maxElements);
+}
+
+template<typename K, typename V, class HashFunc>
+SectorArena<typename LFSparseHashTable<K, V, HashFunc>::SparseBucketElement> * LFSparseHashTable<K, V, HashFunc>::allocStorage(unsigned long long inMaxElements)
+{
+    SectorArena<SparseBucketElement> * res = storage == STORAGE_SECTORS ? new SectorArena<SparseBucketElement>(inMaxElements, sectorSlots, maxLoadFactor) : 0;
+    if(!res || placement == PLACEMENT_FIRST_TOUCH)
+        return res;
+    const size_t sectorBytes = res->elementsPerSector() * sizeof(SparseBucketElement);
+    if(placement == PLACEMENT_INTERLEAVE)
+    {
+        NumaPlacement::interleave(res->sectorElements(0), res->sectorCount() * sectorBytes);
+        return res;
+    }
+    // sector goes where its first bucket is, runs of sectors on the same node are placed together
+    const unsigned long long numBuckets = inMaxElements / HOLY_GRAIL_SIZE;
+    const unsigned long long bucketsPerSector = res->sectorSlots() / HOLY_GRAIL_SIZE;
+    unsigned long long runStart = 0;
+    for(unsigned long long sectorIdx = 1; sectorIdx <= res->sectorCount(); ++sectorIdx)
+    {
+        const unsigned long long runNode = NumaPlacement::partitionNode(runStart * bucketsPerSector, numBuckets);
+        if(sectorIdx < res->sectorCount() && NumaPlacement::partitionNode(sectorIdx * bucketsPerSector, numBuckets) == runNode)
+            continue;
+        NumaPlacement::prefer(res->sectorElements(runStart), (sectorIdx - runStart) * sectorBytes, runNode);
+        runStart = sectorIdx;
+    }
+    return res;
+}
+
+template<typename K, typename V, class HashFunc>
+typename LFSparseHashTable<K, V, HashFunc>::SparseBucket * LFSparseHashTable<K, V, HashFunc>::allocBucketArray(unsigned long long numBuckets)
+{
+    SparseBucket * res = (SparseBucket *) HugePages::allocate(numBuckets * sizeof(SparseBucket), hugePages);
+    if(placement == PLACEMENT_INTERLEAVE)
+        NumaPlacement::interleave(res, numBuckets * sizeof(SparseBucket));
+    else if(placement == PLACEMENT_PARTITION)
+    {
+        for(unsigned long long node = 0; node < NumaPlacement::numNodes(); ++node)
+        {
+            const unsigned long long partBegin = NumaPlacement::partitionBegin(node, numBuckets);
+            NumaPlacement::prefer(res + partBegin, (NumaPlacement::partitionBegin(node + 1, numBuckets) - partBegin) * sizeof(SparseBucket), node);
+        }
+    }
+    memset((void *) res, 0, numBuckets * sizeof(SparseBucket)); // first touch, after the policy is set
+    return res;
+}
+
+// no bucket may point into the mapping anymore
+template<typename K, typename V, class HashFunc>
+void LFSparseHashTable<K, V, HashFunc>::releaseSnapshot()
+{
+    if(snapshotBase)
+        munmap(snapshotBase, snapshotSize);
+    snapshotBase = 0;
+    snapshotSize = 0;
+}
+
+template<typename K, typename V, class HashFunc>
+unsigned long long * LFSparseHashTable<K, V, HashFunc>::allocBucketBits(unsigned long long inMaxElements, bool set)
+{
+    const size_t bitsSize = ((inMaxElements / HOLY_GRAIL_SIZE + 63ULL) / 64ULL) * sizeof(unsigned long long);
+    unsigned long long * bucketBits = (unsigned long long *) std::malloc(bitsSize);
+    memset(bucketBits, set ? 0xFF : 0, bitsSize);
+    return bucketBits;
+}
+
+template<typename K, typename V, class HashFunc>
+bool LFSparseHashTable<K, V, HashFunc>::testBucketBit(const unsigned long long * bucketBits, unsigned long long bucketPos)
+{
+    return __atomic_load_n(&(bucketBits[bucketPos / 64ULL]), __ATOMIC_ACQUIRE) & (1ULL << (bucketPos % 64ULL));
+}
+
+// true for whoever cleared the bit
+template<typename K, typename V, class HashFunc>
+bool LFSparseHashTable<K, V, HashFunc>::takeBucketBit(unsigned long long * bucketBits, unsigned long long bucketPos)
+{
+    const unsigned long long bucketBit = 1ULL << (bucketPos % 64ULL);
+    if(!(__atomic_load_n(&(bucketBits[bucketPos / 64ULL]), __ATOMIC_RELAXED) & bucketBit))
+        return false;
+    return __atomic_fetch_and(&(bucketBits[bucketPos / 64ULL]), ~bucketBit, __ATOMIC_SEQ_CST) & bucketBit;
+}
 
-    size_t packHash(std::function<bool(SparseBucketElement&)> itemPredicate);
-    void processHash(std::function<void(SparseBucketElement&)> itemProcessor);
-}__attribute__((aligned(HOLY_GRAIL_SIZE)));
+// bucket must be locked. Plain check first, hot buckets are already dirty most of the time
+template<typename K, typename V, class HashFunc>
+void LFSparseHashTable<K, V, HashFunc>::markDirty(unsigned long long bucketPos)
+{
+    unsigned long long * dirtyWord = &(dirtyBuckets[bucketPos / 64ULL]);
+    const unsigned long long dirtyBit = 1ULL << (bucketPos % 64ULL);
+    if(!(__atomic_load_n(dirtyWord, __ATOMIC_RELAXED) & dirtyBit))
+        __atomic_fetch_or(dirtyWord, dirtyBit, __ATOMIC_RELAXED);
+}
 
 template<typename K, typename V, class HashFunc>
-void LFSparseHashTable<K, V, HashFunc>::unlockRange(unsigned long long lockRangeStartIdx, unsigned long long lockRangeEndIdx)
+void LFSparseHashTable<K, V, HashFunc>::markDirtyRange(unsigned long long startBucketIdx, unsigned long long endBucketIdx)
 {
-    const unsigned long long rangeStartBucketPos = lockRangeStartIdx / HOLY_GRAIL_SIZE;
-    const unsigned long long rangeStartBucketOffset = lockRangeStartIdx % HOLY_GRAIL_SIZE;
-    const unsigned long long rangeEndBucketPos = lockRangeEndIdx / HOLY_GRAIL_SIZE;
-    const unsigned long long rangeEndBucketOffset = lockRangeEndIdx % HOLY_GRAIL_SIZE;
-    if(lockRangeEndIdx == lockRangeStartIdx)
+    const unsigned long long numBuckets = maxElements / HOLY_GRAIL_SIZE;
+    while(true)
     {
-        SparseBucket * bucket = &(buckets[rangeStartBucketPos]);
-        bucket->unlockElement(rangeStartBucketOffset);
+        markDirty(startBucketIdx);
+        if(startBucketIdx == endBucketIdx)
+            break;
+        startBucketIdx = (startBucketIdx + 1ULL) % numBuckets; // wrapped ranges
     }
-    else if(lockRangeEndIdx > lockRangeStartIdx)
+}
+
+// checkpoint that failed half way, next one has to write everything
+template<typename K, typename V, class HashFunc>
+void LFSparseHashTable<K, V, HashFunc>::markAllDirty()
+{
+    for(unsigned long long wordPos = 0; wordPos < (maxElements / HOLY_GRAIL_SIZE + 63ULL) / 64ULL; ++wordPos)
+        __atomic_store_n(&(dirtyBuckets[wordPos]), 0xFFFFFFFFFFFFFFFFULL, __ATOMIC_RELAXED);
+    dirtyAll = true;
+}
+
+// table must be idle, buckets were just replaced by LFSparseHashTableUtil
+template<typename K, typename V, class HashFunc>
+void LFSparseHashTable<K, V, HashFunc>::resetDirty(bool dirty)
+{
+    std::free(dirtyBuckets);
+    std::free(checkpointBuckets);
+    dirtyBuckets = allocBucketBits(maxElements, dirty);
+    checkpointBuckets = allocBucketBits(maxElements, false);
+    dirtyAll = dirty;
+}
+
+// bucket must be locked for good, not just some of its elements. Called before the bucket is changed, if a running checkpoint
+// still has to write it out it gets its copy now
+template<typename K, typename V, class HashFunc>
+void LFSparseHashTable<K, V, HashFunc>::preserveBucket(unsigned long long bucketPos)
+{
+    if(!testBucketBit(checkpointBuckets, bucketPos))
+        return;
+    checkpointCopiers.fetch_add(1, std::memory_order_seq_cst);
+    if(takeBucketBit(checkpointBuckets, bucketPos))
     {
-        if(rangeEndBucketPos == rangeStartBucketPos)
-        { // same bucket
-            buckets[rangeStartBucketPos].unlockBucket(rangeStartBucketOffset, rangeEndBucketOffset);
-        }
-        else
-        {
-            buckets[rangeEndBucketPos].unlockBucket(0, rangeEndBucketOffset);
-            if(rangeEndBucketPos > rangeStartBucketPos + 1ULL)
-                unlockBuckets(rangeStartBucketPos + 1, rangeEndBucketPos - 1);
-            buckets[rangeStartBucketPos].unlockBucket(rangeStartBucketOffset, 63ULL);
-        }
+        SparseBucket * bucket = &(buckets[bucketPos]);
+        const unsigned long long count = rank64(bucket->elementBitmap, HOLY_GRAIL_SIZE);
+        CheckpointCopy * bucketCopy = (CheckpointCopy *) std::malloc(sizeof(CheckpointCopy));
+        bucketCopy->bucketPos = bucketPos;
+        bucketCopy->elementBitmap = bucket->elementBitmap;
+        bucketCopy->elements = (SparseBucketElement *) std::malloc(count * sizeof(SparseBucketElement));
+        memcpy((void *) bucketCopy->elements, bucket->elements, count * sizeof(SparseBucketElement)); // checkpoints are for POD types
+        bucketCopy->next = checkpointCopies.load(std::memory_order_relaxed);
+        while(!checkpointCopies.compare_exchange_weak(bucketCopy->next, bucketCopy, std::memory_order_release, std::memory_order_relaxed))
+            ;
     }
-    else // wrapped the bitch
+    checkpointCopiers.fetch_sub(1, std::memory_order_seq_cst);
+}
+
+// for writers that hold just elements of the bucket, they let them go, call this and start over
+template<typename K, typename V, class HashFunc>
+void LFSparseHashTable<K, V, HashFunc>::preserveBucketUnlocked(unsigned long long bucketPos)
+{
+    buckets[bucketPos].lockBucket(lockContention);
+    preserveBucket(bucketPos);
+    buckets[bucketPos].unlockBucket();
+}
+
+// takes the cut: with nothing in flight dirty bits become pending bits of the checkpoint (all buckets are pending if allBuckets).
+// full tells if every bucket changed since last checkpoint. False if table is resizing or operations in flight and kept locks
+// didn't drain
+template<typename K, typename V, class HashFunc>
+bool LFSparseHashTable<K, V, HashFunc>::beginCheckpoint(bool allBuckets, bool & full)
+{
+    unsigned long long epoch = resizeEpoch.load(std::memory_order_acquire);
+    if((epoch & RESIZE_STATE_MASK) != RESIZE_STABLE)
+        return false;
+    if(!resizeEpoch.compare_exchange_strong(epoch, epoch + RESIZE_PENDING, std::memory_order_seq_cst))
+        return false;
+    if(!waitForDrain(0) || !waitForDrain(1) || heldLocks.load(std::memory_order_seq_cst))
     {
-        buckets[rangeEndBucketPos].unlockBucket(0, rangeEndBucketOffset);
-        if(rangeEndBucketPos > 0ULL)
-            unlockBuckets(0, rangeEndBucketPos - 1);
+        resizeEpoch.store(epoch, std::memory_order_seq_cst);
+        return false;
+    }
 
-        if(maxElements / HOLY_GRAIL_SIZE + (maxElements % HOLY_GRAIL_SIZE ? 1ULL : 0ULL) - rangeStartBucketPos > 1ULL)
-            unlockBuckets(rangeStartBucketPos, maxElements / HOLY_GRAIL_SIZE + (maxElements % HOLY_GRAIL_SIZE ? 1ULL : 0ULL));
+    full = allBuckets || dirtyAll;
+    std::swap(dirtyBuckets, checkpointBuckets); // pending bits of previous checkpoint are all clear
+    if(allBuckets)
+        memset(checkpointBuckets, 0xFF, ((maxElements / HOLY_GRAIL_SIZE + 63ULL) / 64ULL) * sizeof(unsigned long long));
+    dirtyAll = false;
+    checkpointRunning.store(true, std::memory_order_relaxed);
+    resizeEpoch.store(epoch + RESIZE_STATE_MASK + 1ULL, std::memory_order_seq_cst); // stable again, next cycle
+    return true;
+}
 
-        // below lines are a hack to solve the following: when wrapping around table on maxElements that is not multiple of HOLY_GRAIL_SIZE
-        // remaining lock bits in last bucket remain unset which will deadlock on unlockBuckets. Just flip them here instead of
-        // costly checks in set/get code
-        unsigned long long lastLockMask = buckets[rangeStartBucketPos].elementBitmap;
-        lastLockMask |= lastLockMask >> 1;
-        lastLockMask |= lastLockMask >> 2;
-        lastLockMask |= lastLockMask >> 4;
-        lastLockMask |= lastLockMask >> 8;
-        lastLockMask |= lastLockMask >> 16;
-        lastLockMask |= lastLockMask >> 32;
-        lastLockMask = ~lastLockMask;
-        buckets[rangeStartBucketPos].elementLocks |= lastLockMask;
+// caller has taken every pending bit it could find. Waits for writers still copying and returns their copies, caller frees them.
+// Abandoned checkpoint drops its pending bits and leaves everything dirty
+template<typename K, typename V, class HashFunc>
+typename LFSparseHashTable<K, V, HashFunc>::CheckpointCopy * LFSparseHashTable<K, V, HashFunc>::endCheckpoint(bool abandon)
+{
+    if(abandon)
+    {
+        for(unsigned long long wordPos = 0; wordPos < (maxElements / HOLY_GRAIL_SIZE + 63ULL) / 64ULL; ++wordPos)
+            __atomic_store_n(&(checkpointBuckets[wordPos]), 0ULL, __ATOMIC_SEQ_CST);
+    }
+    while(checkpointCopiers.load(std::memory_order_seq_cst))
+        std::this_thread::yield();
+    CheckpointCopy * copies = checkpointCopies.exchange(0, std::memory_order_acquire);
+    if(abandon)
+        markAllDirty();
+    checkpointRunning.store(false, std::memory_order_release);
+    return copies;
+}
 
-        buckets[rangeStartBucketPos].unlockBucket(rangeStartBucketOffset, 63ULL);
+template<typename K, typename V, class HashFunc>
+void LFSparseHashTable<K, V, HashFunc>::helpMigrate()
+{
+    const unsigned long long oldNumBuckets = oldMaxElements / HOLY_GRAIL_SIZE;
+    for(unsigned long long step = 0; step < RESIZE_MIGRATE_STEP; ++step)
+    {
+        if(migrationCursor.load(std::memory_order_relaxed) >= oldNumBuckets)
+            return;
+        unsigned long long oldBucketPos = migrationCursor.fetch_add(1, std::memory_order_relaxed);
+        if(oldBucketPos >= oldNumBuckets)
+            return;
+        migrateOldBucket(oldBucketPos);
     }
 }
 
 template<typename K, typename V, class HashFunc>
-void LFSparseHashTable<K, V, HashFunc>::unlockBuckets(unsigned long long startBucketIdx, unsigned long long endBucketIdx)
+void LFSparseHashTable<K, V, HashFunc>::migrateAll()
 {
+    for(unsigned long long oldBucketPos = 0; oldBucketPos < oldMaxElements / HOLY_GRAIL_SIZE; ++oldBucketPos)
+        migrateOldBucket(oldBucketPos);
+}
 
-    if(startBucketIdx == endBucketIdx)
-        buckets[startBucketIdx].unlockBucket();
-    else if(endBucketIdx > startBucketIdx)
+// moves every element of old bucket into new generation. Bitmap is left as is, so old probe chains stay walkable
+template<typename K, typename V, class HashFunc>
+void LFSparseHashTable<K, V, HashFunc>::migrateOldBucket(unsigned long long oldBucketPos)
+{
+    if(__atomic_load_n(&(oldBucketsMigrated[oldBucketPos]), __ATOMIC_ACQUIRE))
+        return;
+    SparseBucket * oldBucket = &(oldBuckets[oldBucketPos]);
+    oldBucket->lockBucket(lockContention);
+    if(!oldBucketsMigrated[oldBucketPos])
     {
-        while(endBucketIdx > startBucketIdx)
+        unsigned long long count = rank64(oldBucket->elementBitmap, HOLY_GRAIL_SIZE);
+        SparseBucketElement * oldBucketElements = oldBucket->elements;
+        for(unsigned long long j = 0; j < count; ++j)
         {
-            buckets[endBucketIdx--].unlockBucket();
-        };
-        buckets[startBucketIdx].unlockBucket();
+            SparseBucketElement & oldElement = oldBucketElements[j];
+            auto constructor = [&oldElement](SparseBucketElement * element) { new (element) SparseBucketElement(std::move(oldElement)); };
+            emplaceInternal(oldElement.key, applyHash(hasherFunc, oldElement.key), constructor);
+            oldElement.~SparseBucketElement();
+        }
+        freeOldElements(oldBucketElements);
+        oldBucket->elements = 0;
+        __atomic_store_n(&(oldBucketsMigrated[oldBucketPos]), 1, __ATOMIC_RELEASE);
+        migratedCount.fetch_add(1, std::memory_order_release);
     }
-    else // wrapped the bitch
+    oldBucket->unlockBucket();
+}
+
+// key can only live in buckets of its old probe chain, once they are migrated key lives in new generation only
+template<typename K, typename V, class HashFunc>
+void LFSparseHashTable<K, V, HashFunc>::migrateChain(unsigned long long inHash)
+{
+    const unsigned long long oldNumBuckets = oldMaxElements / HOLY_GRAIL_SIZE;
+    unsigned long long idx = reduceRange(inHash, oldMaxElements);
+    unsigned long long bucketPos = idx / HOLY_GRAIL_SIZE;
+    unsigned long long bucketOffset = idx % HOLY_GRAIL_SIZE;
+    for(unsigned long long steps = 0; steps < oldNumBuckets; ++steps)
     {
-        unsigned long long tmp = 0;
-        while(endBucketIdx > tmp)
-        {
-            buckets[endBucketIdx--].unlockBucket();
-        };
-        buckets[0].unlockBucket();
+        migrateOldBucket(bucketPos);
+        // old bitmaps do not change while migrating. Chain goes on into next bucket only if the rest of this one is occupied
+        const unsigned long long chainMask = 0xFFFFFFFFFFFFFFFFULL << bucketOffset;
+        if((oldBuckets[bucketPos].elementBitmap & chainMask) != chainMask)
+            break;
+        bucketPos = (bucketPos + 1) % oldNumBuckets;
+        bucketOffset = 0;
+    }
+}
 
-        tmp = maxElements / HOLY_GRAIL_SIZE + (maxElements % HOLY_GRAIL_SIZE ? 1ULL : 0ULL);
-        while(tmp > startBucketIdx)
+template<typename K, typename V, class HashFunc>
+bool LFSparseHashTable<K, V, HashFunc>::chainMigrated(unsigned long long inHash) const
+{
+    const unsigned long long oldNumBuckets = oldMaxElements / HOLY_GRAIL_SIZE;
+    unsigned long long idx = reduceRange(inHash, oldMaxElements);
+    unsigned long long bucketPos = idx / HOLY_GRAIL_SIZE;
+    unsigned long long bucketOffset = idx % HOLY_GRAIL_SIZE;
+    for(unsigned long long steps = 0; steps < oldNumBuckets; ++steps)
+    {
+        if(!__atomic_load_n(&(oldBucketsMigrated[bucketPos]), __ATOMIC_ACQUIRE))
+            return false;
+        const unsigned long long chainMask = 0xFFFFFFFFFFFFFFFFULL << bucketOffset;
+        if((oldBuckets[bucketPos].elementBitmap & chainMask) != chainMask)
+            break;
+        bucketPos = (bucketPos + 1) % oldNumBuckets;
+        bucketOffset = 0;
+    }
+    return true;
+}
+
+// lookup for a key whose old probe chain is not fully migrated. Old chain is kept element locked while new generation is checked,
+// so the key can not be migrated (or inserted into new generation) under our feet
+template<typename K, typename V, class HashFunc>
+bool LFSparseHashTable<K, V, HashFunc>::getMigrating(const K & inKey, unsigned long long inHash, V & value)
+{
+    unsigned long long idx = reduceRange(inHash, oldMaxElements);
+    unsigned long long bucketPos = idx / HOLY_GRAIL_SIZE;
+    unsigned long long bucketOffset = idx % HOLY_GRAIL_SIZE;
+    unsigned long long lockRangeStart = idx;
+    unsigned long long lockRangeEnd = idx;
+    SparseBucket * bucket = &(oldBuckets[bucketPos]);
+    __builtin_prefetch(bucket, 1, 3 /* _MM_HINT_T0 */);
+    bucket->lockElement(bucketOffset, lockContention);
+    bool found = false;
+    unsigned long long rank = rank64(bucket->elementBitmap, bucketOffset + 1);
+    while(bucket->bitmapTest(bucketOffset)) // linear probing
+    {
+        if(!oldBucketsMigrated[bucketPos] && bucket->fingerprintMatch(bucketOffset, fingerprintOf(inHash)) && bucket->elements[rank - 1].key == inKey)
         {
-            buckets[--tmp].unlockBucket();
-        };
+            value = bucket->elements[rank - 1].value; // read value
+            found = true;
+            break;
+        }
+        ++rank;
+        ++bucketOffset;
+        lockRangeEnd = idx = nextProbeIdx(idx, oldMaxElements);
+        if(bucketOffset == HOLY_GRAIL_SIZE || !idx)
+        {
+            rank = 1;
+            bucketPos = idx / HOLY_GRAIL_SIZE;
+            bucketOffset = idx % HOLY_GRAIL_SIZE;
+            bucket = &(oldBuckets[bucketPos]);
+            __builtin_prefetch(bucket, 1, 3 /* _MM_HINT_T0 */);
+        }
+        bucket->lockElement(bucketOffset, lockContention);
+    }
+    if(!found)
+        found = getInternal(inKey, inHash, value, true);
+    unlockRangeIn(oldBuckets, oldMaxElements, lockRangeStart, lockRangeEnd);
+    return found;
+}
+
+template<typename K, typename V, class HashFunc>
+void LFSparseHashTable<K, V, HashFunc>::retireOldGeneration()
+{
+    unsigned long long epoch = resizeEpoch.load(std::memory_order_acquire);
+    if((epoch & RESIZE_STATE_MASK) != RESIZE_MIGRATING)
+        return;
+    if(!resizeEpoch.compare_exchange_strong(epoch, epoch + 1, std::memory_order_seq_cst))
+        return;
+    // generation may be one a resize started after the caller looked. Operations of migrating epoch may still walk old bitmaps,
+    // retried by a later operation if they don't drain
+    if(migratedCount.load(std::memory_order_acquire) != oldMaxElements / HOLY_GRAIL_SIZE || !waitForDrain(epoch & 1ULL))
+    {
+        resizeEpoch.store(epoch, std::memory_order_seq_cst);
+        return;
     }
+    HugePages::release(oldBuckets);
+    std::free(oldBucketsMigrated);
+    delete oldSectorArena;
+    oldBuckets = 0;
+    oldBucketsMigrated = 0;
+    oldSectorArena = 0;
+    oldMaxElements = 0;
+    releaseSnapshot(); // everything mapped was in old generation and got copied over
+    resizeEpoch.store(epoch + 2, std::memory_order_seq_cst);
 }
 
 template<typename K, typename V, class HashFunc>
@@ -303,15 +1495,50 @@ void LFSparseHashTable<K, V, HashFunc>::swap(LFSparseHashTable<K, V, HashFunc>&
     std::swap(maxElements, other.maxElements);
     std::swap(maxLoadFactor, other.maxLoadFactor);
     std::swap(minLoadFactor, other.minLoadFactor);
+    // NOTE: not thread safe, tables must be idle and not resizing
+    std::swap(oldBuckets, other.oldBuckets);
+    std::swap(oldMaxElements, other.oldMaxElements);
+    std::swap(oldBucketsMigrated, other.oldBucketsMigrated);
+    std::swap(sectorArena, other.sectorArena);
+    std::swap(oldSectorArena, other.oldSectorArena);
+    std::swap(storage, other.storage);
+    std::swap(sectorSlots, other.sectorSlots);
+    std::swap(lockContention, other.lockContention);
+    std::swap(optimisticReads, other.optimisticReads);
+    std::swap(placement, other.placement);
+    std::swap(hugePages, other.hugePages);
+    std::swap(guardStripes, other.guardStripes);
+    std::swap(snapshotBase, other.snapshotBase);
+    std::swap(snapshotSize, other.snapshotSize);
+    std::swap(dirtyBuckets, other.dirtyBuckets);
+    std::swap(checkpointBuckets, other.checkpointBuckets);
+    std::swap(dirtyAll, other.dirtyAll);
+    std::swap(checkpointId, other.checkpointId);
+    unsigned long long tmpEpoch = resizeEpoch.load();
+    resizeEpoch.store(other.resizeEpoch.load());
+    other.resizeEpoch.store(tmpEpoch);
+    tmpEpoch = migrationCursor.load();
+    migrationCursor.store(other.migrationCursor.load());
+    other.migrationCursor.store(tmpEpoch);
+    tmpEpoch = migratedCount.load();
+    migratedCount.store(other.migratedCount.load());
+    other.migratedCount.store(tmpEpoch);
 }
 
 template<typename K, typename V, class HashFunc>
 LFSparseHashTable<K, V, HashFunc>::LFSparseHashTable(unsigned long long inMaxElements, double inMaxLoadFactor, double inMinLoadFactor,
-                                                     const HashFunc & inHasher) :
+                                                     const HashFunc & inHasher, unsigned int inStorage, unsigned long long inSectorSlots,
+                                                     unsigned long long inLockSpinBudget, unsigned int inReads, unsigned int inPlacement,
+                                                     unsigned int inHugePages) :
 #ifdef SPARSEHASHTABLE_DEBUG
                                 debugPrints(false),
 #endif
-                                buckets(0), maxElements(inMaxElements), maxLoadFactor(inMaxLoadFactor), minLoadFactor(inMinLoadFactor), hasherFunc(inHasher)
+                                buckets(0), maxElements(inMaxElements), maxLoadFactor(inMaxLoadFactor), minLoadFactor(inMinLoadFactor), hasherFunc(inHasher),
+                                sectorArena(0), lockContention(new LockContention(inLockSpinBudget)), oldBuckets(0), oldMaxElements(0), oldBucketsMigrated(0),
+                                oldSectorArena(0), guardStripes(0), resizeEpoch(0), migrationCursor(0), migratedCount(0), heldLocks(0), lockedRefusals(0), resizeBuilding(false), snapshotBase(0),
+                                snapshotSize(0), dirtyBuckets(0), checkpointBuckets(0), checkpointCopies(0), checkpointCopiers(0), checkpointRunning(false),
+                                dirtyAll(true), checkpointId(0), storage(inStorage), sectorSlots(inSectorSlots),
+                                optimisticReads(ELEMENTS_RELOCATABLE && inReads == READS_OPTIMISTIC), placement(inPlacement), hugePages(inHugePages)
 {
     // code that deals with indexes wrapping the underlying array breaks if the size is not multiple of HOLY_GRAIL_SIZE
     if (maxElements%HOLY_GRAIL_SIZE)
@@ -319,13 +1546,18 @@ LFSparseHashTable<K, V, HashFunc>::LFSparseHashTable(unsigned long long inMaxEle
 
     if(minLoadFactor >= maxLoadFactor)
         minLoadFactor = maxLoadFactor / 2.0;
-    buckets = (SparseBucket*) std::malloc((maxElements / HOLY_GRAIL_SIZE + (maxElements % HOLY_GRAIL_SIZE ? 1ULL : 0ULL)) * sizeof(SparseBucket));
-    memset(buckets, 0, (maxElements / HOLY_GRAIL_SIZE + (maxElements % HOLY_GRAIL_SIZE ? 1ULL : 0ULL)) * sizeof(SparseBucket));
+    buckets = allocBucketArray(maxElements / HOLY_GRAIL_SIZE + (maxElements % HOLY_GRAIL_SIZE ? 1ULL : 0ULL));
+    guardStripes = (ResizeGuardStripe*) aligned_alloc(HOLY_GRAIL_SIZE, RESIZE_GUARD_STRIPES * sizeof(ResizeGuardStripe));
+    memset((void*) guardStripes, 0, RESIZE_GUARD_STRIPES * sizeof(ResizeGuardStripe));
+    dirtyBuckets = allocBucketBits(maxElements, true);
+    checkpointBuckets = allocBucketBits(maxElements, false);
+    resetStorage();
 }
 
 template<typename K, typename V, class HashFunc>
 LFSparseHashTable<K, V, HashFunc>::~LFSparseHashTable()
 {
+    optimisticReads = false; // nobody reads anymore, arrays can go right away
 #ifdef SPARSEHASHTABLE_DEBUG
     std::map<unsigned long long, unsigned long long> distributions;
     unsigned long long totalItems = 0;
@@ -337,7 +1569,7 @@ LFSparseHashTable<K, V, HashFunc>::~LFSparseHashTable()
         {
 #endif
         SparseBucket * bucket = &(buckets[bucketPos]);
-        unsigned long long count = googlerank((const unsigned char*) &(bucket->elementBitmap), HOLY_GRAIL_SIZE);
+        unsigned long long count = rank64(bucket->elementBitmap, HOLY_GRAIL_SIZE);
         SparseBucketElement * bucketElements = bucket->elements;
         for(unsigned long long j = 0; j < count; ++j)
         {
@@ -348,7 +1580,7 @@ LFSparseHashTable<K, V, HashFunc>::~LFSparseHashTable()
         totalItems += count;
     }
 #endif
-        std::free(bucket->elements);
+        freeElements(bucket->elements);
     }
 #ifdef SPARSEHASHTABLE_DEBUG
     if (debugPrints)
@@ -391,24 +1623,63 @@ LFSparseHashTable<K, V, HashFunc>::~LFSparseHashTable()
         printf("\n");
     }
 #endif
-    std::free(buckets);
+    HugePages::release(buckets);
+    // resize that was never finished, migrated old buckets have no elements left
+    if(oldBuckets)
+    {
+        for(unsigned long long oldBucketPos = 0; oldBucketPos < oldMaxElements / HOLY_GRAIL_SIZE; ++oldBucketPos)
+        {
+            if(oldBucketsMigrated[oldBucketPos])
+                continue;
+            SparseBucket * oldBucket = &(oldBuckets[oldBucketPos]);
+            unsigned long long count = rank64(oldBucket->elementBitmap, HOLY_GRAIL_SIZE);
+            for(unsigned long long j = 0; j < count; ++j)
+                oldBucket->elements[j].~SparseBucketElement();
+            freeOldElements(oldBucket->elements);
+        }
+        HugePages::release(oldBuckets);
+        std::free(oldBucketsMigrated);
+    }
+    delete sectorArena;
+    delete oldSectorArena;
+    delete lockContention;
+    releaseSnapshot();
+    std::free(dirtyBuckets);
+    std::free(checkpointBuckets);
+    std::free(guardStripes);
 }
 
 template<typename K, typename V, class HashFunc>
 LFSparseHashTable<K, V, HashFunc>::LFSparseHashTable(const LFSparseHashTable& other) :
-                buckets(0), maxElements(other.maxElements), maxLoadFactor(other.maxLoadFactor), minLoadFactor(other.minLoadFactor), hasherFunc(other.hasherFunc)
+                buckets(0), maxElements(other.maxElements), maxLoadFactor(other.maxLoadFactor), minLoadFactor(other.minLoadFactor), hasherFunc(other.hasherFunc),
+                sectorArena(0), lockContention(new LockContention(other.lockContention->spinBudget())), oldBuckets(0), oldMaxElements(0), oldBucketsMigrated(0),
+                oldSectorArena(0), guardStripes(0), resizeEpoch(0), migrationCursor(0),
+                migratedCount(0), heldLocks(0), lockedRefusals(0), resizeBuilding(false), snapshotBase(0), snapshotSize(0), dirtyBuckets(0), checkpointBuckets(0), checkpointCopies(0),
+                                checkpointCopiers(0), checkpointRunning(false), dirtyAll(true), checkpointId(0), storage(other.storage),
+                                sectorSlots(other.sectorSlots), optimisticReads(other.optimisticReads), placement(other.placement), hugePages(other.hugePages)
 {
     if(minLoadFactor >= maxLoadFactor)
         minLoadFactor = maxLoadFactor / 2.0;
-    buckets = (SparseBucket*) std::malloc((maxElements / HOLY_GRAIL_SIZE + (maxElements % HOLY_GRAIL_SIZE ? 1ULL : 0ULL)) * sizeof(SparseBucket));
-    memset(buckets, 0, (maxElements / HOLY_GRAIL_SIZE + (maxElements % HOLY_GRAIL_SIZE ? 1ULL : 0ULL)) * sizeof(SparseBucket));
+    resetStorage();
+    buckets = allocBucketArray(maxElements / HOLY_GRAIL_SIZE + (maxElements % HOLY_GRAIL_SIZE ? 1ULL : 0ULL));
     for(unsigned long long bucketPos = 0; bucketPos < other.maxElements / HOLY_GRAIL_SIZE + (maxElements % HOLY_GRAIL_SIZE ? 1ULL : 0ULL); ++bucketPos)
     {
         buckets[bucketPos] = other.buckets[bucketPos];
-        unsigned long long count = googlerank((const unsigned char*) &(buckets[bucketPos]->elementBitmap), HOLY_GRAIL_SIZE);
-        buckets[bucketPos].elements = (SparseBucketElement *) std::malloc(count * sizeof(SparseBucketElement));
-        memcpy(buckets[bucketPos].elements, other.buckets[bucketPos].elements, count * sizeof(SparseBucketElement));
+        unsigned long long count = rank64(buckets[bucketPos].elementBitmap, HOLY_GRAIL_SIZE);
+        buckets[bucketPos].elements = allocElements(bucketPos, count);
+        if(ELEMENTS_RELOCATABLE)
+            memcpy((void *) buckets[bucketPos].elements, other.buckets[bucketPos].elements, count * sizeof(SparseBucketElement));
+        else
+        {
+            for(unsigned long long j = 0; j < count; ++j)
+                new (&(buckets[bucketPos].elements[j])) SparseBucketElement(other.buckets[bucketPos].elements[j]);
+        }
     }
+    guardStripes = (ResizeGuardStripe*) aligned_alloc(HOLY_GRAIL_SIZE, RESIZE_GUARD_STRIPES * sizeof(ResizeGuardStripe));
+    memset((void*) guardStripes, 0, RESIZE_GUARD_STRIPES * sizeof(ResizeGuardStripe));
+    dirtyBuckets = allocBucketBits(maxElements, true);
+    checkpointBuckets = allocBucketBits(maxElements, false);
+    recountElements();
 }
 
 template<typename K, typename V, class HashFunc>
@@ -424,38 +1695,54 @@ LFSparseHashTable<K, V, HashFunc>& LFSparseHashTable<K, V, HashFunc>::operator=(
 
 // returns true if inserted, false if set
 template<typename K, typename V, class HashFunc>
-bool LFSparseHashTable<K, V, HashFunc>::insertOrSet(const K & inKey, const V & inValue)
+bool LFSparseHashTable<K, V, HashFunc>::insertOrSetInternal(const K & inKey, unsigned long long inHash, const V & inValue)
+{
+    auto constructor = [&inKey, &inValue](SparseBucketElement * element)
+    {
+        new (&(element->key)) K(inKey);
+        new (&(element->value)) V(inValue);
+    };
+    auto updater = [&inValue](SparseBucketElement & element) { element.value = inValue; };
+    return upsertInternal(inKey, inHash, constructor, updater);
+}
+
+// returns true if inserted, false if updated
+template<typename K, typename V, class HashFunc>
+template<class Constructor, class Updater>
+bool LFSparseHashTable<K, V, HashFunc>::upsertInternal(const K & inKey, unsigned long long inHash, Constructor & constructor, Updater & updater)
 {
-    unsigned long long idx = hasherFunc(inKey) % maxElements; // TODO: seed
+    unsigned long long idx = reduceRange(inHash, maxElements);
     unsigned long long bucketPos = idx / HOLY_GRAIL_SIZE;
     unsigned long long startBucketIdx = bucketPos, endBucketIdx = bucketPos;
     unsigned long long bucketOffset = idx % HOLY_GRAIL_SIZE;
     SparseBucket * bucket = &(buckets[bucketPos]);
     __builtin_prefetch(bucket, 1, 3 /* _MM_HINT_T0 */);
-    bucket->lockBucket();
+    bucket->lockBucket(lockContention);
+    preserveBucket(bucketPos);
     SparseBucketElement * bucketElements = bucket->elements;
     if(bucketElements == 0)
     {
-        bucket->elements = (SparseBucketElement *) std::malloc(sizeof(SparseBucketElement));
+        bucket->elements = allocElements(bucketPos, 1);
         bucketElements = bucket->elements;
-        new (&(bucketElements[0].key)) K(inKey);
-        new (&(bucketElements[0].value)) V(inValue);
-        bucket->bitmapSet(bucketOffset);
+        constructor(&(bucketElements[0]));
+        bucket->bitmapSet(bucketOffset, fingerprintOf(inHash));
+        markDirtyRange(startBucketIdx, endBucketIdx);
         unlockBuckets(startBucketIdx, endBucketIdx);
         return true;
     }
     else
     {
         bool stepBack = false; // to avoid extra rank calculation later
-        unsigned long long rank = googlerank((const unsigned char*) &(bucket->elementBitmap), bucketOffset + 1);
+        unsigned long long rank = rank64(bucket->elementBitmap, bucketOffset + 1);
         while(true) // linear probing
         {
             bool elementExists = bucket->bitmapTest(bucketOffset);
             if(elementExists)
             {
-                if(bucketElements[rank - 1].key == inKey)
+                if(bucket->fingerprintMatch(bucketOffset, fingerprintOf(inHash)) && bucketElements[rank - 1].key == inKey)
                 {
-                    bucketElements[rank - 1].value = inValue; // possible move assignment
+                    updater(bucketElements[rank - 1]);
+                    markDirtyRange(startBucketIdx, endBucketIdx);
                     unlockBuckets(startBucketIdx, endBucketIdx);
                     return false;
                 }
@@ -464,7 +1751,7 @@ bool LFSparseHashTable<K, V, HashFunc>::insertOrSet(const K & inKey, const V & i
                     stepBack = true;
                     ++rank;
                     ++bucketOffset;
-                    idx = (idx + 1) % maxElements;
+                    idx = nextProbeIdx(idx, maxElements);
                     if(bucketOffset == HOLY_GRAIL_SIZE || !idx)
                     {
                         rank = 1;
@@ -472,16 +1759,17 @@ bool LFSparseHashTable<K, V, HashFunc>::insertOrSet(const K & inKey, const V & i
                         bucketOffset = idx % HOLY_GRAIL_SIZE;
                         bucket = &(buckets[bucketPos]);
                         __builtin_prefetch(bucket, 1, 3 /* _MM_HINT_T0 */);
-                        bucket->lockBucket();
+                        bucket->lockBucket(lockContention);
+                        preserveBucket(bucketPos);
                         endBucketIdx = bucketPos;
                         bucketElements = bucket->elements;
                         if(bucketElements == 0)
                         {
-                            bucket->elements = (SparseBucketElement *) std::malloc(sizeof(SparseBucketElement));
+                            bucket->elements = allocElements(bucketPos, 1);
                             bucketElements = bucket->elements;
-                            new (&(bucketElements[0].key)) K(inKey); // possible move construction
-                            new (&(bucketElements[0].value)) V(inValue);
-                            bucket->bitmapSet(bucketOffset);
+                            constructor(&(bucketElements[0]));
+                            bucket->bitmapSet(bucketOffset, fingerprintOf(inHash));
+                            markDirtyRange(startBucketIdx, endBucketIdx);
                             unlockBuckets(startBucketIdx, endBucketIdx);
                             return true;
                         }
@@ -492,14 +1780,12 @@ bool LFSparseHashTable<K, V, HashFunc>::insertOrSet(const K & inKey, const V & i
             {
                 if(stepBack)
                     --rank;
-                unsigned long long count = googlerank((const unsigned char*) &(bucket->elementBitmap), HOLY_GRAIL_SIZE);
-                bucketElements = (SparseBucketElement *) std::realloc(bucketElements, (count + 1) * sizeof(SparseBucketElement));
+                unsigned long long count = rank64(bucket->elementBitmap, HOLY_GRAIL_SIZE);
+                bucketElements = growElements(bucketPos, ownElements(bucket, count), count, rank);
                 bucket->elements = bucketElements;
-                if(rank < count)
-                    memmove(bucketElements + rank + 1, bucketElements + rank, (count - rank) * sizeof(SparseBucketElement));
-                new (&(bucketElements[rank].key)) K(inKey); // possible move construction
-                new (&(bucketElements[rank].value)) V(inValue);
-                bucket->bitmapSet(bucketOffset);
+                constructor(&(bucketElements[rank]));
+                bucket->bitmapSet(bucketOffset, fingerprintOf(inHash));
+                markDirtyRange(startBucketIdx, endBucketIdx);
                 unlockBuckets(startBucketIdx, endBucketIdx);
                 return true;
             }
@@ -507,30 +1793,116 @@ bool LFSparseHashTable<K, V, HashFunc>::insertOrSet(const K & inKey, const V & i
     }
 }
 
+// lock free lookup for READS_OPTIMISTIC. Every bucket of the probe run is validated before its elements are followed (bitmap and
+// elements have to belong together) and again once the value is copied out. false if no attempt got a consistent view
 template<typename K, typename V, class HashFunc>
-bool LFSparseHashTable<K, V, HashFunc>::get(const K & inKey, V & value, bool unlock)
+bool LFSparseHashTable<K, V, HashFunc>::getOptimistic(const K & inKey, unsigned long long inHash, V & value, bool & found)
+{
+    const unsigned long long numBuckets = maxElements / HOLY_GRAIL_SIZE;
+    SparseBucket * probedBuckets[OPTIMISTIC_MAX_BUCKETS];
+    unsigned long long probedVersions[OPTIMISTIC_MAX_BUCKETS];
+    unsigned long long probedMasks[OPTIMISTIC_MAX_BUCKETS];
+    alignas(V) char valueCopy[sizeof(V)] = {}; // only read when found, zeroed for -Wmaybe-uninitialized
+    const unsigned char fingerprint = fingerprintOf(inHash);
+    EpochReclaimer::Guard reclaimGuard; // heap arrays we follow are not freed meanwhile
+    for(unsigned long long attempt = 0; attempt < OPTIMISTIC_ATTEMPTS; ++attempt)
+    {
+        const unsigned long long idx = reduceRange(inHash, maxElements);
+        unsigned long long bucketPos = idx / HOLY_GRAIL_SIZE;
+        unsigned long long bucketOffset = idx % HOLY_GRAIL_SIZE;
+        unsigned long long numProbed = 0;
+        bool consistent = true;
+        found = false;
+        while(true)
+        {
+            if(numProbed == OPTIMISTIC_MAX_BUCKETS)
+                return false;
+            SparseBucket * bucket = &(buckets[bucketPos]);
+            const unsigned long long version = __atomic_load_n(&(bucket->version), __ATOMIC_ACQUIRE);
+            const unsigned long long bitmap = __atomic_load_n(&(bucket->elementBitmap), __ATOMIC_ACQUIRE);
+            SparseBucketElement * bucketElements = __atomic_load_n(&(bucket->elements), __ATOMIC_ACQUIRE);
+            // occupied run from bucketOffset and the hole that ends it
+            const unsigned long long run = ~(bitmap >> bucketOffset) ? __builtin_ctzll(~(bitmap >> bucketOffset)) : HOLY_GRAIL_SIZE - bucketOffset;
+            const unsigned long long probedMask = bucketOffset + run + 1ULL >= HOLY_GRAIL_SIZE ? 0xFFFFFFFFFFFFFFFFULL << bucketOffset :
+                                                  ((1ULL << (run + 1ULL)) - 1ULL) << bucketOffset;
+            probedBuckets[numProbed] = bucket;
+            probedVersions[numProbed] = version;
+            probedMasks[numProbed++] = probedMask;
+            if(!bucket->validate(version, probedMask))
+            {
+                consistent = false;
+                break;
+            }
+            const unsigned long long rank = rank64(bitmap, bucketOffset);
+            // run is contiguous, element of position pos is at rank + pos - bucketOffset
+            for(unsigned long long candidates = bucket->fingerprintCandidates(fingerprint) & probedMask & bitmap; candidates; candidates &= candidates - 1ULL)
+            {
+                const unsigned long long pos = __builtin_ctzll(candidates);
+                if(bucketElements[rank + pos - bucketOffset].key == inKey)
+                {
+                    memcpy(valueCopy, (const void *) &(bucketElements[rank + pos - bucketOffset].value), sizeof(V));
+                    found = true;
+                    break;
+                }
+            }
+            if(found || bucketOffset + run < HOLY_GRAIL_SIZE)
+                break;
+            bucketPos = (bucketPos + 1ULL) % numBuckets;
+            bucketOffset = 0;
+        }
+        for(unsigned long long probedIdx = 0; consistent && probedIdx < numProbed; ++probedIdx)
+            consistent = probedBuckets[probedIdx]->validate(probedVersions[probedIdx], probedMasks[probedIdx]);
+        if(!consistent)
+        {
+            _mm_pause();
+            continue;
+        }
+        if(found)
+            memcpy((void *) &value, valueCopy, sizeof(V));
+        return true;
+    }
+    return false;
+}
+
+template<typename K, typename V, class HashFunc>
+bool LFSparseHashTable<K, V, HashFunc>::getInternal(const K & inKey, unsigned long long inHash, V & value, bool unlock)
 {
+    if(unlock && optimisticReads)
+    {
+        bool found;
+        if(getOptimistic(inKey, inHash, value, found))
+            return found;
+    }
     __builtin_prefetch(&value, 1, 3 /* _MM_HINT_T0 */);
-    unsigned long long idx = hasherFunc(inKey) % maxElements; // TODO: seed
+    unsigned long long idx = reduceRange(inHash, maxElements);
     unsigned long long bucketPos = idx / HOLY_GRAIL_SIZE;
     unsigned long long bucketOffset = idx % HOLY_GRAIL_SIZE;
     unsigned long long lockRangeStart = idx;
     unsigned long long lockRangeEnd = idx;
     SparseBucket * bucket = &(buckets[bucketPos]);
     __builtin_prefetch(bucket, 1, 3 /* _MM_HINT_T0 */);
-    bucket->lockElement(bucketOffset);
+    bucket->lockElement(bucketOffset, lockContention);
     SparseBucketElement * bucketElements = bucket->elements;
 #ifdef SPARSEHASHTABLE_DEBUG
     unsigned long long collisions = 0;
 #endif
-    unsigned long long rank = googlerank((const unsigned char*) &(bucket->elementBitmap), bucketOffset + 1);
+    unsigned long long rank = rank64(bucket->elementBitmap, bucketOffset + 1);
     while(bucket->bitmapTest(bucketOffset)) // linear probing
     {
-        if(bucketElements && bucketElements[rank - 1].key == inKey)
+        if(bucketElements && bucket->fingerprintMatch(bucketOffset, fingerprintOf(inHash)) && bucketElements[rank - 1].key == inKey)
         {
 #ifdef SPARSEHASHTABLE_DEBUG
             ++(collisionAudit[collisions]);
 #endif
+            if(!unlock && testBucketBit(checkpointBuckets, bucketPos)) // caller may write it, checkpoint gets its copy first
+            {
+                if(lockRangeStart == lockRangeEnd)
+                    bucket->unlockElement(bucketOffset);
+                else
+                    unlockRange(lockRangeStart, lockRangeEnd);
+                preserveBucketUnlocked(bucketPos);
+                return getInternal(inKey, inHash, value, false);
+            }
             value = bucketElements[rank - 1].value; // read value
             if(unlock)
             {
@@ -552,8 +1924,8 @@ bool LFSparseHashTable<K, V, HashFunc>::get(const K & inKey, V & value, bool unl
 #endif
             ++rank;
             ++bucketOffset;
-            lockRangeEnd = (lockRangeEnd + 1) % maxElements;
-            idx = (idx + 1) % maxElements;
+            lockRangeEnd = nextProbeIdx(lockRangeEnd, maxElements);
+            idx = nextProbeIdx(idx, maxElements);
             if(bucketOffset == HOLY_GRAIL_SIZE || !idx)
             {
                 rank = 1;
@@ -561,37 +1933,36 @@ bool LFSparseHashTable<K, V, HashFunc>::get(const K & inKey, V & value, bool unl
                 bucketOffset = idx % HOLY_GRAIL_SIZE;
                 bucket = &(buckets[bucketPos]);
                 __builtin_prefetch(bucket, 1, 3 /* _MM_HINT_T0 */);
-                bucket->lockElement(bucketOffset);
+                bucket->lockElement(bucketOffset, lockContention);
                 bucketElements = bucket->elements;
             }
             else
-                bucket->lockElement(bucketOffset);
+                bucket->lockElement(bucketOffset, lockContention);
         }
     }
-    if(unlock)
+    // nothing to leave locked if not found
+    if(lockRangeStart == lockRangeEnd) // unlock element
     {
-        if(lockRangeStart == lockRangeEnd) // unlock element
-        {
-            bucket->unlockElement(bucketOffset);
-        }
-        else // or element range is there were collisions
-        {
-            unlockRange(lockRangeStart, lockRangeEnd);
-        }
+        bucket->unlockElement(bucketOffset);
+    }
+    else // or element range is there were collisions
+    {
+        unlockRange(lockRangeStart, lockRangeEnd);
     }
     return false;
 }
 
 template<typename K, typename V, class HashFunc>
-bool LFSparseHashTable<K, V, HashFunc>::remove(const K & inKey)
+bool LFSparseHashTable<K, V, HashFunc>::removeInternal(const K & inKey, unsigned long long inHash)
 {
-    unsigned long long idx = hasherFunc(inKey) % maxElements; // TODO: seed
+    unsigned long long idx = reduceRange(inHash, maxElements);
     unsigned long long bucketPos = idx / HOLY_GRAIL_SIZE;
     unsigned long long startBucketIdx = bucketPos, endBucketIdx = bucketPos;
     unsigned long long bucketOffset = idx % HOLY_GRAIL_SIZE;
     SparseBucket * bucket = &(buckets[bucketPos]);
     __builtin_prefetch(bucket, 1, 3 /* _MM_HINT_T0 */);
-    bucket->lockBucket();
+    bucket->lockBucket(lockContention);
+    preserveBucket(bucketPos);
     SparseBucketElement * bucketElements = bucket->elements;
     bool elementFound = false;
 
@@ -600,21 +1971,22 @@ bool LFSparseHashTable<K, V, HashFunc>::remove(const K & inKey)
     while(bucket->bitmapTest(bucketOffset))
     {
         if(bucketElements)
-            rank = googlerank((const unsigned char*) &(bucket->elementBitmap), bucketOffset + 1);
-        if(bucketElements && bucketElements[rank - 1].key == inKey)
+            rank = rank64(bucket->elementBitmap, bucketOffset + 1);
+        if(bucketElements && bucket->fingerprintMatch(bucketOffset, fingerprintOf(inHash)) && bucketElements[rank - 1].key == inKey)
         {
             elementFound = true;
             break;
         }
         ++bucketOffset;
-        idx = (idx + 1) % maxElements;
+        idx = nextProbeIdx(idx, maxElements);
         if(bucketOffset == HOLY_GRAIL_SIZE || !idx)
         {
             bucketPos = idx / HOLY_GRAIL_SIZE;
             bucketOffset = idx % HOLY_GRAIL_SIZE;
             bucket = &(buckets[bucketPos]);
             __builtin_prefetch(bucket, 1, 3 /* _MM_HINT_T0 */);
-            bucket->lockBucket();
+            bucket->lockBucket(lockContention);
+            preserveBucket(bucketPos);
             endBucketIdx = bucketPos;
             bucketElements = bucket->elements;
         }
@@ -624,15 +1996,11 @@ bool LFSparseHashTable<K, V, HashFunc>::remove(const K & inKey)
         unlockBuckets(startBucketIdx, endBucketIdx);
         return false;
     }
-    else
-    {
-        bucketElements[rank - 1].~SparseBucketElement(); // destroy the deleted element
-    }
 
     // walk forward until next hole to see if any records need to be moved back
     unsigned long long deletedIdx = idx;
     ++bucketOffset;
-    idx = (idx + 1) % maxElements;
+    idx = nextProbeIdx(idx, maxElements);
     if(bucketOffset == HOLY_GRAIL_SIZE || !idx)
     {
         rank = 0; // if there are window elements rank will be incremented later
@@ -640,28 +2008,29 @@ bool LFSparseHashTable<K, V, HashFunc>::remove(const K & inKey)
         bucketOffset = idx % HOLY_GRAIL_SIZE;
         bucket = &(buckets[bucketPos]);
         __builtin_prefetch(bucket, 1, 3 /* _MM_HINT_T0 */);
-        bucket->lockBucket();
+        bucket->lockBucket(lockContention);
+        preserveBucket(bucketPos);
         endBucketIdx = bucketPos;
         bucketElements = bucket->elements;
-        bucketElements = (SparseBucketElement *) (((unsigned long long) bucketElements) & (~15ULL));
     }
     while(bucketElements && (bucket->bitmapTest(bucketOffset)))
     {
-        // calc hash. If its less or equal new hole position, swap, save new hole and move on
+        // calc hash. If hole is not before its home position (counting wrapped chains), swap, save new hole and move on
         ++rank;
-        if(bucketElements && hasherFunc(bucketElements[rank - 1].key) % maxElements <= deletedIdx)
+        if(bucketElements && (idx + maxElements - reduceRange(applyHash(hasherFunc, bucketElements[rank - 1].key), maxElements)) % maxElements >= (idx + maxElements - deletedIdx) % maxElements)
         {
             // swap
             unsigned int swapWindowPos = deletedIdx / HOLY_GRAIL_SIZE;
             unsigned int swapWindowOffset = deletedIdx % HOLY_GRAIL_SIZE;
             SparseBucket * swapBucket = &(buckets[swapWindowPos]);
             SparseBucketElement * swapWindowElements = swapBucket->elements;
-            unsigned long long swaprank = googlerank((const unsigned char*) &(swapBucket->elementBitmap), swapWindowOffset + 1);
-            swapWindowElements[swaprank - 1] = bucketElements[rank - 1];
+            unsigned long long swaprank = rank64(swapBucket->elementBitmap, swapWindowOffset + 1);
+            swapWindowElements[swaprank - 1] = std::move(bucketElements[rank - 1]);
+            swapBucket->setFingerprint(swapWindowOffset, bucket->fingerprintAt(bucketOffset));
             deletedIdx = idx;
         }
         ++bucketOffset;
-        idx = (idx + 1) % maxElements;
+        idx = nextProbeIdx(idx, maxElements);
         if(bucketOffset == HOLY_GRAIL_SIZE || !idx)
         {
             rank = 0; // if there are window elements rank will be incremented later
@@ -669,7 +2038,8 @@ bool LFSparseHashTable<K, V, HashFunc>::remove(const K & inKey)
             bucketOffset = idx % HOLY_GRAIL_SIZE;
             bucket = &(buckets[bucketPos]);
             __builtin_prefetch(bucket, 1, 3 /* _MM_HINT_T0 */);
-            bucket->lockBucket();
+            bucket->lockBucket(lockContention);
+            preserveBucket(bucketPos);
             endBucketIdx = bucketPos;
             bucketElements = bucket->elements;
         }
@@ -680,56 +2050,70 @@ bool LFSparseHashTable<K, V, HashFunc>::remove(const K & inKey)
     unsigned long long deletedBucketOffset = deletedIdx % HOLY_GRAIL_SIZE;
     SparseBucket * deletedBucket = &(buckets[deletedBucketPos]);
     SparseBucketElement * deletedBucketElements = deletedBucket->elements;
-    unsigned long long deletedCount = googlerank((const unsigned char*) &(deletedBucket->elementBitmap), HOLY_GRAIL_SIZE);
+    unsigned long long deletedCount = rank64(deletedBucket->elementBitmap, HOLY_GRAIL_SIZE);
+    unsigned long long deletedrank = rank64(deletedBucket->elementBitmap, deletedBucketOffset + 1);
+    deletedBucketElements[deletedrank - 1].~SparseBucketElement(); // destroy the deleted element, or what was moved out of the hole
     if(deletedCount == 1)
     {
-        std::free(deletedBucketElements);
+        freeElements(deletedBucketElements);
         deletedBucket->elements = deletedBucketElements = 0;
     }
     else
     {
-        unsigned long long deletedrank = googlerank((const unsigned char*) &(deletedBucket->elementBitmap), deletedBucketOffset + 1);
-        if(deletedrank < deletedCount)
-            memmove(deletedBucketElements + deletedrank - 1, deletedBucketElements + deletedrank, (deletedCount - deletedrank) * sizeof(SparseBucketElement));
-        deletedBucketElements = (SparseBucketElement *) std::realloc(deletedBucketElements, (deletedCount - 1) * sizeof(SparseBucketElement));
+        deletedBucketElements = shrinkElements(ownElements(deletedBucket, deletedCount), deletedCount, deletedrank - 1);
         deletedBucket->elements = deletedBucketElements;
     }
     deletedBucket->bitmapClear(deletedBucketOffset);
+    markDirtyRange(startBucketIdx, endBucketIdx);
     unlockBuckets(startBucketIdx, endBucketIdx);
     return true;
 }
 
 template<typename K, typename V, class HashFunc>
-bool LFSparseHashTable<K, V, HashFunc>::insert(const K & inKey, const V & inValue)
+bool LFSparseHashTable<K, V, HashFunc>::insertInternal(const K & inKey, unsigned long long inHash, const V & inValue)
+{
+    auto constructor = [&inKey, &inValue](SparseBucketElement * element)
+    {
+        new (&(element->key)) K(inKey);
+        new (&(element->value)) V(inValue);
+    };
+    return emplaceInternal(inKey, inHash, constructor);
+}
+
+// inKey must stay valid until constructor is done with it, it is compared against before construction only
+template<typename K, typename V, class HashFunc>
+template<class Constructor>
+bool LFSparseHashTable<K, V, HashFunc>::emplaceInternal(const K & inKey, unsigned long long inHash, Constructor & constructor)
 {
-    unsigned long long idx = hasherFunc(inKey) % maxElements; // TODO: seed
+    unsigned long long idx = reduceRange(inHash, maxElements);
     unsigned long long bucketPos = idx / HOLY_GRAIL_SIZE;
     unsigned long long startBucketIdx = bucketPos, endBucketIdx = bucketPos;
     unsigned long long bucketOffset = idx % HOLY_GRAIL_SIZE;
     SparseBucket * bucket = &(buckets[bucketPos]);
     __builtin_prefetch(bucket, 1, 3 /* _MM_HINT_T0 */);
-    bucket->lockBucket();
+    bucket->lockBucket(lockContention);
+    preserveBucket(bucketPos);
     SparseBucketElement * bucketElements = bucket->elements;
     if(bucketElements == 0)
     {
-        bucket->elements = (SparseBucketElement *) std::malloc(sizeof(SparseBucketElement));
+        bucket->elements = allocElements(bucketPos, 1);
         bucketElements = bucket->elements;
-        new (&(bucketElements[0].key)) K(inKey);
-        new (&(bucketElements[0].value)) V(inValue);
-        bucket->bitmapSet(bucketOffset);
+        constructor(&(bucketElements[0]));
+        bucket->bitmapSet(bucketOffset, fingerprintOf(inHash));
+        markDirtyRange(startBucketIdx, endBucketIdx);
         unlockBuckets(startBucketIdx, endBucketIdx);
         return true;
     }
     else
     {
         bool stepBack = false; // to avoid extra rank calculation later
-        unsigned long long rank = googlerank((const unsigned char*) &(bucket->elementBitmap), bucketOffset + 1);
+        unsigned long long rank = rank64(bucket->elementBitmap, bucketOffset + 1);
         while(true) // linear probing
         {
             bool elementExists = bucket->bitmapTest(bucketOffset);
             if(elementExists)
             {
-                if(bucketElements[rank - 1].key == inKey)
+                if(bucket->fingerprintMatch(bucketOffset, fingerprintOf(inHash)) && bucketElements[rank - 1].key == inKey)
                 {
                     unlockBuckets(startBucketIdx, endBucketIdx);
                     return false;
@@ -739,7 +2123,7 @@ bool LFSparseHashTable<K, V, HashFunc>::insert(const K & inKey, const V & inValu
                     stepBack = true;
                     ++rank;
                     ++bucketOffset;
-                    idx = (idx + 1) % maxElements;
+                    idx = nextProbeIdx(idx, maxElements);
                     if(bucketOffset == HOLY_GRAIL_SIZE || !idx)
                     {
                         rank = 1;
@@ -747,16 +2131,17 @@ bool LFSparseHashTable<K, V, HashFunc>::insert(const K & inKey, const V & inValu
                         bucketOffset = idx % HOLY_GRAIL_SIZE;
                         bucket = &(buckets[bucketPos]);
                         __builtin_prefetch(bucket, 1, 3 /* _MM_HINT_T0 */);
-                        bucket->lockBucket();
+                        bucket->lockBucket(lockContention);
+                        preserveBucket(bucketPos);
                         endBucketIdx = bucketPos;
                         bucketElements = bucket->elements;
                         if(bucketElements == 0)
                         {
-                            bucket->elements = (SparseBucketElement *) std::malloc(sizeof(SparseBucketElement));
+                            bucket->elements = allocElements(bucketPos, 1);
                             bucketElements = bucket->elements;
-                            new (&(bucketElements[0].key)) K(inKey);
-                            new (&(bucketElements[0].value)) V(inValue);
-                            bucket->bitmapSet(bucketOffset);
+                            constructor(&(bucketElements[0]));
+                            bucket->bitmapSet(bucketOffset, fingerprintOf(inHash));
+                            markDirtyRange(startBucketIdx, endBucketIdx);
                             unlockBuckets(startBucketIdx, endBucketIdx);
                             return true;
                         }
@@ -767,14 +2152,12 @@ bool LFSparseHashTable<K, V, HashFunc>::insert(const K & inKey, const V & inValu
             {
                 if(stepBack)
                     --rank;
-                unsigned long long count = googlerank((const unsigned char*) &(bucket->elementBitmap), HOLY_GRAIL_SIZE);
-                bucketElements = (SparseBucketElement *) std::realloc(bucketElements, (count + 1) * sizeof(SparseBucketElement));
+                unsigned long long count = rank64(bucket->elementBitmap, HOLY_GRAIL_SIZE);
+                bucketElements = growElements(bucketPos, ownElements(bucket, count), count, rank);
                 bucket->elements = bucketElements;
-                if(rank < count)
-                    memmove(bucketElements + rank + 1, bucketElements + rank, (count - rank) * sizeof(SparseBucketElement));
-                new (&(bucketElements[rank].key)) K(inKey);
-                new (&(bucketElements[rank].value)) V(inValue);
-                bucket->bitmapSet(bucketOffset);
+                constructor(&(bucketElements[rank]));
+                bucket->bitmapSet(bucketOffset, fingerprintOf(inHash));
+                markDirtyRange(startBucketIdx, endBucketIdx);
                 unlockBuckets(startBucketIdx, endBucketIdx);
                 return true;
             }
@@ -783,30 +2166,119 @@ bool LFSparseHashTable<K, V, HashFunc>::insert(const K & inKey, const V & inValu
 }
 
 template<typename K, typename V, class HashFunc>
-bool LFSparseHashTable<K, V, HashFunc>::set(const K & inKey, const V & inValue, bool locked)
+template<class VV>
+bool LFSparseHashTable<K, V, HashFunc>::setInternal(const K & inKey, unsigned long long inHash, VV && inValue, bool locked)
+{
+    unsigned long long idx = reduceRange(inHash, maxElements);
+    unsigned long long bucketPos = idx / HOLY_GRAIL_SIZE;
+    unsigned long long bucketOffset = idx % HOLY_GRAIL_SIZE;
+    unsigned long long lockRangeStart = idx;
+    unsigned long long lockRangeEnd = idx;
+    SparseBucket * bucket = &(buckets[bucketPos]);
+    __builtin_prefetch(bucket, 1, 3 /* _MM_HINT_T0 */);
+    if(!locked)
+        bucket->lockElement(bucketOffset, lockContention);
+    SparseBucketElement * bucketElements = bucket->elements;
+#ifdef SPARSEHASHTABLE_DEBUG
+    unsigned long long collisions = 0;
+#endif
+    unsigned long long rank = rank64(bucket->elementBitmap, bucketOffset + 1);
+    while(bucket->bitmapTest(bucketOffset)) // linear probing
+    {
+        if(bucketElements && bucket->fingerprintMatch(bucketOffset, fingerprintOf(inHash)) && bucketElements[rank - 1].key == inKey)
+        {
+#ifdef SPARSEHASHTABLE_DEBUG
+            ++(collisionAudit[collisions]);
+#endif
+            // locked element was already handled by get(false) or lockElement(), checkpoint can not start while it is held
+            if(!locked && testBucketBit(checkpointBuckets, bucketPos))
+            {
+                if(lockRangeStart == lockRangeEnd)
+                    bucket->unlockElement(bucketOffset);
+                else
+                    unlockRange(lockRangeStart, lockRangeEnd);
+                preserveBucketUnlocked(bucketPos);
+                return setInternal(inKey, inHash, std::forward<VV>(inValue), false);
+            }
+            bucketElements[rank - 1].value = std::forward<VV>(inValue); // write value
+            markDirty(bucketPos);
+            if(lockRangeStart == lockRangeEnd) // unlock element
+            {
+                bucket->unlockElement(bucketOffset);
+            }
+            else // or element range is there were collisions
+            {
+                unlockRange(lockRangeStart, lockRangeEnd);
+            }
+            return true;
+        }
+        else
+        {
+#ifdef SPARSEHASHTABLE_DEBUG
+            ++collisions;
+#endif
+            ++rank;
+            ++bucketOffset;
+            lockRangeEnd = nextProbeIdx(lockRangeEnd, maxElements);
+            idx = nextProbeIdx(idx, maxElements);
+            if(bucketOffset == HOLY_GRAIL_SIZE || !idx)
+            {
+                rank = 1;
+                bucketPos = idx / HOLY_GRAIL_SIZE;
+                bucketOffset = idx % HOLY_GRAIL_SIZE;
+                bucket = &(buckets[bucketPos]);
+                __builtin_prefetch(bucket, 1, 3 /* _MM_HINT_T0 */);
+                if(!locked)
+                    bucket->lockElement(bucketOffset, lockContention);
+                bucketElements = bucket->elements;
+            }
+            else
+            {
+                if(!locked)
+                    bucket->lockElement(bucketOffset, lockContention);
+            }
+        }
+    }
+    if(lockRangeStart == lockRangeEnd) // unlock element
+    {
+        bucket->unlockElement(bucketOffset);
+    }
+    else // or element range is there were collisions
+    {
+        unlockRange(lockRangeStart, lockRangeEnd);
+    }
+    return false;
+}
+
+template<typename K, typename V, class HashFunc>
+template<class Updater>
+bool LFSparseHashTable<K, V, HashFunc>::updateInternal(const K & inKey, unsigned long long inHash, Updater & updater)
 {
-    unsigned long long idx = hasherFunc(inKey) % maxElements; // TODO: seed
+    unsigned long long idx = reduceRange(inHash, maxElements);
     unsigned long long bucketPos = idx / HOLY_GRAIL_SIZE;
     unsigned long long bucketOffset = idx % HOLY_GRAIL_SIZE;
     unsigned long long lockRangeStart = idx;
     unsigned long long lockRangeEnd = idx;
     SparseBucket * bucket = &(buckets[bucketPos]);
     __builtin_prefetch(bucket, 1, 3 /* _MM_HINT_T0 */);
-    if(!locked)
-        bucket->lockElement(bucketOffset);
+    bucket->lockElement(bucketOffset, lockContention);
     SparseBucketElement * bucketElements = bucket->elements;
-#ifdef SPARSEHASHTABLE_DEBUG
-    unsigned long long collisions = 0;
-#endif
-    unsigned long long rank = googlerank((const unsigned char*) &(bucket->elementBitmap), bucketOffset + 1);
+    unsigned long long rank = rank64(bucket->elementBitmap, bucketOffset + 1);
     while(bucket->bitmapTest(bucketOffset)) // linear probing
     {
-        if(bucketElements && bucketElements[rank - 1].key == inKey)
+        if(bucketElements && bucket->fingerprintMatch(bucketOffset, fingerprintOf(inHash)) && bucketElements[rank - 1].key == inKey)
         {
-#ifdef SPARSEHASHTABLE_DEBUG
-            ++(collisionAudit[collisions]);
-#endif
-            bucketElements[rank - 1].value = inValue; // write value
+            if(testBucketBit(checkpointBuckets, bucketPos)) // checkpoint gets its copy first
+            {
+                if(lockRangeStart == lockRangeEnd)
+                    bucket->unlockElement(bucketOffset);
+                else
+                    unlockRange(lockRangeStart, lockRangeEnd);
+                preserveBucketUnlocked(bucketPos);
+                return updateInternal(inKey, inHash, updater);
+            }
+            updater(bucketElements[rank - 1]);
+            markDirty(bucketPos);
             if(lockRangeStart == lockRangeEnd) // unlock element
             {
                 bucket->unlockElement(bucketOffset);
@@ -819,13 +2291,10 @@ bool LFSparseHashTable<K, V, HashFunc>::set(const K & inKey, const V & inValue,
         }
         else
         {
-#ifdef SPARSEHASHTABLE_DEBUG
-            ++collisions;
-#endif
             ++rank;
             ++bucketOffset;
-            lockRangeEnd = (lockRangeEnd + 1) % maxElements;
-            idx = (idx + 1) % maxElements;
+            lockRangeEnd = nextProbeIdx(lockRangeEnd, maxElements);
+            idx = nextProbeIdx(idx, maxElements);
             if(bucketOffset == HOLY_GRAIL_SIZE || !idx)
             {
                 rank = 1;
@@ -833,15 +2302,11 @@ bool LFSparseHashTable<K, V, HashFunc>::set(const K & inKey, const V & inValue,
                 bucketOffset = idx % HOLY_GRAIL_SIZE;
                 bucket = &(buckets[bucketPos]);
                 __builtin_prefetch(bucket, 1, 3 /* _MM_HINT_T0 */);
-                if(!locked)
-                    bucket->lockElement(bucketOffset);
+                bucket->lockElement(bucketOffset, lockContention);
                 bucketElements = bucket->elements;
             }
             else
-            {
-                if(!locked)
-                    bucket->lockElement(bucketOffset);
-            }
+                bucket->lockElement(bucketOffset, lockContention);
         }
     }
     if(lockRangeStart == lockRangeEnd) // unlock element
@@ -856,30 +2321,39 @@ bool LFSparseHashTable<K, V, HashFunc>::set(const K & inKey, const V & inValue,
 }
 
 template<typename K, typename V, class HashFunc>
-bool LFSparseHashTable<K, V, HashFunc>::lockElement(const K & inKey)
+bool LFSparseHashTable<K, V, HashFunc>::lockElementInternal(const K & inKey, unsigned long long inHash)
 {
-    unsigned long long idx = hasherFunc(inKey) % maxElements; // TODO: seed
+    unsigned long long idx = reduceRange(inHash, maxElements);
     unsigned long long bucketPos = idx / HOLY_GRAIL_SIZE;
     unsigned long long bucketOffset = idx % HOLY_GRAIL_SIZE;
     unsigned long long lockRangeStart = idx;
     unsigned long long lockRangeEnd = idx;
     SparseBucket * bucket = &(buckets[bucketPos]);
     __builtin_prefetch(bucket, 1, 3 /* _MM_HINT_T0 */);
-    bucket->lockElement(bucketOffset);
+    bucket->lockElement(bucketOffset, lockContention);
     SparseBucketElement * bucketElements = bucket->elements;
-    unsigned long long rank = googlerank((const unsigned char*) &(bucket->elementBitmap), bucketOffset + 1);
+    unsigned long long rank = rank64(bucket->elementBitmap, bucketOffset + 1);
     while(bucket->bitmapTest(bucketOffset)) // linear probing
     {
-        if(bucketElements && bucketElements[rank - 1].key == inKey)
+        if(bucketElements && bucket->fingerprintMatch(bucketOffset, fingerprintOf(inHash)) && bucketElements[rank - 1].key == inKey)
         {
+            if(testBucketBit(checkpointBuckets, bucketPos)) // caller may write it, checkpoint gets its copy first
+            {
+                if(lockRangeStart == lockRangeEnd)
+                    bucket->unlockElement(bucketOffset);
+                else
+                    unlockRange(lockRangeStart, lockRangeEnd);
+                preserveBucketUnlocked(bucketPos);
+                return lockElementInternal(inKey, inHash);
+            }
             return true;
         }
         else
         {
             ++rank;
             ++bucketOffset;
-            lockRangeEnd = (lockRangeEnd + 1) % maxElements;
-            idx = (idx + 1) % maxElements;
+            lockRangeEnd = nextProbeIdx(lockRangeEnd, maxElements);
+            idx = nextProbeIdx(idx, maxElements);
             if(bucketOffset == HOLY_GRAIL_SIZE || !idx)
             {
                 rank = 1;
@@ -887,11 +2361,11 @@ bool LFSparseHashTable<K, V, HashFunc>::lockElement(const K & inKey)
                 bucketOffset = idx % HOLY_GRAIL_SIZE;
                 bucket = &(buckets[bucketPos]);
                 __builtin_prefetch(bucket, 1, 3 /* _MM_HINT_T0 */);
-                bucket->lockElement(bucketOffset);
+                bucket->lockElement(bucketOffset, lockContention);
                 bucketElements = bucket->elements;
             }
             else
-                bucket->lockElement(bucketOffset);
+                bucket->lockElement(bucketOffset, lockContention);
         }
     }
     if(lockRangeStart == lockRangeEnd) // unlock element
@@ -906,9 +2380,9 @@ bool LFSparseHashTable<K, V, HashFunc>::lockElement(const K & inKey)
 }
 
 template<typename K, typename V, class HashFunc>
-bool LFSparseHashTable<K, V, HashFunc>::unlockElement(const K & inKey)
+bool LFSparseHashTable<K, V, HashFunc>::unlockElementInternal(const K & inKey, unsigned long long inHash)
 {
-    unsigned long long idx = hasherFunc(inKey) % maxElements; // TODO: seed
+    unsigned long long idx = reduceRange(inHash, maxElements);
     unsigned long long bucketPos = idx / HOLY_GRAIL_SIZE;
     unsigned long long bucketOffset = idx % HOLY_GRAIL_SIZE;
     unsigned long long lockRangeStart = idx;
@@ -916,10 +2390,10 @@ bool LFSparseHashTable<K, V, HashFunc>::unlockElement(const K & inKey)
     SparseBucket * bucket = &(buckets[bucketPos]);
     __builtin_prefetch(bucket, 1, 3 /* _MM_HINT_T0 */);
     SparseBucketElement * bucketElements = bucket->elements;
-    unsigned long long rank = googlerank((const unsigned char*) &(bucket->elementBitmap), bucketOffset + 1);
+    unsigned long long rank = rank64(bucket->elementBitmap, bucketOffset + 1);
     while(bucket->bitmapTest(bucketOffset)) // linear probing
     {
-        if(bucketElements && bucketElements[rank - 1].key == inKey)
+        if(bucketElements && bucket->fingerprintMatch(bucketOffset, fingerprintOf(inHash)) && bucketElements[rank - 1].key == inKey)
         {
             if(lockRangeStart == lockRangeEnd) // unlock element
             {
@@ -935,8 +2409,8 @@ bool LFSparseHashTable<K, V, HashFunc>::unlockElement(const K & inKey)
         {
             ++rank;
             ++bucketOffset;
-            lockRangeEnd = (lockRangeEnd + 1) % maxElements;
-            idx = (idx + 1) % maxElements;
+            lockRangeEnd = nextProbeIdx(lockRangeEnd, maxElements);
+            idx = nextProbeIdx(idx, maxElements);
             if(bucketOffset == HOLY_GRAIL_SIZE || !idx)
             {
                 rank = 1;
@@ -952,14 +2426,434 @@ bool LFSparseHashTable<K, V, HashFunc>::unlockElement(const K & inKey)
 }
 
 template<typename K, typename V, class HashFunc>
-size_t LFSparseHashTable<K, V, HashFunc>::packHash(std::function<bool(SparseBucketElement&)> itemPredicate)
+bool LFSparseHashTable<K, V, HashFunc>::insert(const K & inKey, const V & inValue)
+{
+    const unsigned long long hash = applyHash(hasherFunc, inKey);
+    OperationGuard guard(this);
+    if(guard.migrating())
+        migrateChain(hash);
+    bool res = insertInternal(inKey, hash, inValue);
+    if(res)
+        guard.elementAdded();
+    return res;
+}
+
+template<typename K, typename V, class HashFunc>
+bool LFSparseHashTable<K, V, HashFunc>::insert(const K & inKey, V && inValue)
+{
+    const unsigned long long hash = applyHash(hasherFunc, inKey);
+    OperationGuard guard(this);
+    if(guard.migrating())
+        migrateChain(hash);
+    auto constructor = [&inKey, &inValue](SparseBucketElement * element)
+    {
+        new (&(element->key)) K(inKey);
+        new (&(element->value)) V(std::move(inValue));
+    };
+    bool res = emplaceInternal(inKey, hash, constructor);
+    if(res)
+        guard.elementAdded();
+    return res;
+}
+
+template<typename K, typename V, class HashFunc>
+bool LFSparseHashTable<K, V, HashFunc>::insertOrSet(const K & inKey, const V & inValue)
+{
+    const unsigned long long hash = applyHash(hasherFunc, inKey);
+    OperationGuard guard(this);
+    if(guard.migrating())
+        migrateChain(hash);
+    bool res = insertOrSetInternal(inKey, hash, inValue);
+    if(res)
+        guard.elementAdded();
+    return res;
+}
+
+template<typename K, typename V, class HashFunc>
+bool LFSparseHashTable<K, V, HashFunc>::insertOrSet(const K & inKey, V && inValue)
+{
+    const unsigned long long hash = applyHash(hasherFunc, inKey);
+    OperationGuard guard(this);
+    if(guard.migrating())
+        migrateChain(hash);
+    auto constructor = [&inKey, &inValue](SparseBucketElement * element)
+    {
+        new (&(element->key)) K(inKey);
+        new (&(element->value)) V(std::move(inValue));
+    };
+    auto updater = [&inValue](SparseBucketElement & element) { element.value = std::move(inValue); };
+    bool res = upsertInternal(inKey, hash, constructor, updater);
+    if(res)
+        guard.elementAdded();
+    return res;
+}
+
+template<typename K, typename V, class HashFunc>
+template<class... Args>
+bool LFSparseHashTable<K, V, HashFunc>::emplace(Args&&... args)
+{
+    SparseBucketElement newElement{std::forward<Args>(args)...};
+    const unsigned long long hash = applyHash(hasherFunc, newElement.key);
+    OperationGuard guard(this);
+    if(guard.migrating())
+        migrateChain(hash);
+    auto constructor = [&newElement](SparseBucketElement * element) { new (element) SparseBucketElement(std::move(newElement)); };
+    bool res = emplaceInternal(newElement.key, hash, constructor);
+    if(res)
+        guard.elementAdded();
+    return res;
+}
+
+template<typename K, typename V, class HashFunc>
+template<class... Args>
+bool LFSparseHashTable<K, V, HashFunc>::try_emplace(const K & inKey, Args&&... args)
+{
+    return tryEmplaceInternal<const K &>(inKey, std::forward<Args>(args)...);
+}
+
+template<typename K, typename V, class HashFunc>
+template<class... Args>
+bool LFSparseHashTable<K, V, HashFunc>::try_emplace(K && inKey, Args&&... args)
+{
+    return tryEmplaceInternal<K>(std::move(inKey), std::forward<Args>(args)...);
+}
+
+template<typename K, typename V, class HashFunc>
+template<class KK, class... Args>
+bool LFSparseHashTable<K, V, HashFunc>::tryEmplaceInternal(KK && inKey, Args&&... args)
+{
+    const unsigned long long hash = applyHash(hasherFunc, inKey);
+    OperationGuard guard(this);
+    if(guard.migrating())
+        migrateChain(hash);
+    auto constructor = [&](SparseBucketElement * element)
+    {
+        new (&(element->key)) K(std::forward<KK>(inKey));
+        new (&(element->value)) V(std::forward<Args>(args)...);
+    };
+    bool res = emplaceInternal(inKey, hash, constructor);
+    if(res)
+        guard.elementAdded();
+    return res;
+}
+
+template<typename K, typename V, class HashFunc>
+bool LFSparseHashTable<K, V, HashFunc>::get(const K & inKey, V & value, bool unlock)
+{
+    const unsigned long long hash = applyHash(hasherFunc, inKey);
+    if(!unlock)
+        waitKeptLockGate();
+    OperationGuard guard(this);
+    if(!unlock)
+    {
+        // element stays locked, so it has to be in new generation
+        if(guard.migrating())
+            migrateChain(hash);
+        bool res = getInternal(inKey, hash, value, false);
+        if(res)
+        {
+            heldLocks.fetch_add(1, std::memory_order_seq_cst);
+            ++threadKeptLocks();
+            guard.keepLocks();
+        }
+        return res;
+    }
+    if(guard.migrating() && !chainMigrated(hash))
+        return getMigrating(inKey, hash, value);
+    return getInternal(inKey, hash, value, true);
+}
+
+template<typename K, typename V, class HashFunc>
+bool LFSparseHashTable<K, V, HashFunc>::set(const K & inKey, const V & inValue, bool locked)
+{
+    const unsigned long long hash = applyHash(hasherFunc, inKey);
+    if(locked)
+    {
+        // element was locked by get(false) or lockElement(), resize can not start until it is released
+        bool res = setInternal(inKey, hash, inValue, true);
+        if(res)
+        {
+            heldLocks.fetch_sub(1, std::memory_order_seq_cst);
+            --threadKeptLocks();
+        }
+        return res;
+    }
+    OperationGuard guard(this);
+    if(guard.migrating())
+        migrateChain(hash);
+    return setInternal(inKey, hash, inValue, false);
+}
+
+template<typename K, typename V, class HashFunc>
+bool LFSparseHashTable<K, V, HashFunc>::set(const K & inKey, V && inValue, bool locked)
+{
+    const unsigned long long hash = applyHash(hasherFunc, inKey);
+    if(locked)
+    {
+        bool res = setInternal(inKey, hash, std::move(inValue), true);
+        if(res)
+        {
+            heldLocks.fetch_sub(1, std::memory_order_seq_cst);
+            --threadKeptLocks();
+        }
+        return res;
+    }
+    OperationGuard guard(this);
+    if(guard.migrating())
+        migrateChain(hash);
+    return setInternal(inKey, hash, std::move(inValue), false);
+}
+
+template<typename K, typename V, class HashFunc>
+bool LFSparseHashTable<K, V, HashFunc>::remove(const K & inKey)
+{
+    const unsigned long long hash = applyHash(hasherFunc, inKey);
+    OperationGuard guard(this);
+    if(guard.migrating())
+        migrateChain(hash);
+    bool res = removeInternal(inKey, hash);
+    if(res)
+        guard.elementRemoved();
+    return res;
+}
+
+template<typename K, typename V, class HashFunc>
+template<class Updater>
+bool LFSparseHashTable<K, V, HashFunc>::update(const K & inKey, Updater updater)
+{
+    const unsigned long long hash = applyHash(hasherFunc, inKey);
+    OperationGuard guard(this);
+    if(guard.migrating())
+        migrateChain(hash);
+    auto elementUpdater = [&updater](SparseBucketElement & element)
+    {
+        V value(static_cast<V &&>(element.value)); // std::move can not take packed fields
+        updater(value);
+        element.value = std::move(value);
+    };
+    return updateInternal(inKey, hash, elementUpdater);
+}
+
+template<typename K, typename V, class HashFunc>
+bool LFSparseHashTable<K, V, HashFunc>::fetchAdd(const K & inKey, const V & delta, V & previous)
+{
+    const unsigned long long hash = applyHash(hasherFunc, inKey);
+    OperationGuard guard(this);
+    if(guard.migrating())
+        migrateChain(hash);
+    auto elementUpdater = [&delta, &previous](SparseBucketElement & element)
+    {
+        previous = element.value;
+        element.value = previous + delta;
+    };
+    return updateInternal(inKey, hash, elementUpdater);
+}
+
+template<typename K, typename V, class HashFunc>
+bool LFSparseHashTable<K, V, HashFunc>::compareExchange(const K & inKey, V & expected, const V & desired)
+{
+    const unsigned long long hash = applyHash(hasherFunc, inKey);
+    OperationGuard guard(this);
+    if(guard.migrating())
+        migrateChain(hash);
+    bool exchanged = false;
+    auto elementUpdater = [&expected, &desired, &exchanged](SparseBucketElement & element)
+    {
+        if(element.value == expected)
+        {
+            element.value = desired;
+            exchanged = true;
+        }
+        else
+            expected = element.value;
+    };
+    return updateInternal(inKey, hash, elementUpdater) && exchanged;
+}
+
+template<typename K, typename V, class HashFunc>
+template<class Factory, class Updater>
+bool LFSparseHashTable<K, V, HashFunc>::upsert(const K & inKey, Factory factory, Updater updater)
+{
+    const unsigned long long hash = applyHash(hasherFunc, inKey);
+    OperationGuard guard(this);
+    if(guard.migrating())
+        migrateChain(hash);
+    auto elementUpdater = [&updater](SparseBucketElement & element)
+    {
+        V value(static_cast<V &&>(element.value)); // std::move can not take packed fields
+        updater(value);
+        element.value = std::move(value);
+    };
+    auto constructor = [&inKey, &factory](SparseBucketElement * element)
+    {
+        new (&(element->key)) K(inKey);
+        new (&(element->value)) V(factory());
+    };
+    bool res = upsertInternal(inKey, hash, constructor, elementUpdater);
+    if(res)
+        guard.elementAdded();
+    return res;
+}
+
+template<typename K, typename V, class HashFunc>
+bool LFSparseHashTable<K, V, HashFunc>::lockElement(const K & inKey)
+{
+    const unsigned long long hash = applyHash(hasherFunc, inKey);
+    waitKeptLockGate();
+    OperationGuard guard(this);
+    if(guard.migrating())
+        migrateChain(hash);
+    bool res = lockElementInternal(inKey, hash);
+    if(res)
+    {
+        heldLocks.fetch_add(1, std::memory_order_seq_cst);
+        ++threadKeptLocks();
+        guard.keepLocks();
+    }
+    return res;
+}
+
+template<typename K, typename V, class HashFunc>
+bool LFSparseHashTable<K, V, HashFunc>::unlockElement(const K & inKey)
+{
+    bool res = unlockElementInternal(inKey, applyHash(hasherFunc, inKey));
+    if(res)
+    {
+        heldLocks.fetch_sub(1, std::memory_order_seq_cst);
+        --threadKeptLocks();
+    }
+    return res;
+}
+
+// Batches are resolved BATCH_WINDOW keys at a time. Next window is hashed and its bucket headers prefetched before current
+// window is resolved, element slots of current window are prefetched right before, when headers are (hopefully) in cache.
+// Unlocked reads here are only hints, internals redo everything under locks
+template<typename K, typename V, class HashFunc>
+void LFSparseHashTable<K, V, HashFunc>::prefetchBatchBuckets(const K * inKeys, unsigned long long * outHashes, size_t count)
+{
+    for(size_t keyIdx = 0; keyIdx < count; ++keyIdx)
+    {
+        outHashes[keyIdx] = applyHash(hasherFunc, inKeys[keyIdx]);
+        const unsigned long long idx = reduceRange(outHashes[keyIdx], maxElements);
+        __builtin_prefetch(&(buckets[idx / HOLY_GRAIL_SIZE]), 1, 3 /* _MM_HINT_T0 */);
+    }
+}
+
+template<typename K, typename V, class HashFunc>
+void LFSparseHashTable<K, V, HashFunc>::prefetchBatchElements(const unsigned long long * inHashes, size_t count)
+{
+    for(size_t keyIdx = 0; keyIdx < count; ++keyIdx)
+    {
+        unsigned long long idx = reduceRange(inHashes[keyIdx], maxElements);
+        SparseBucket * bucket = &(buckets[idx / HOLY_GRAIL_SIZE]);
+        SparseBucketElement * bucketElements = bucket->elements;
+        if(bucketElements)
+            __builtin_prefetch(bucketElements + rank64(bucket->elementBitmap, idx % HOLY_GRAIL_SIZE), 1, 3 /* _MM_HINT_T0 */);
+    }
+}
+
+template<typename K, typename V, class HashFunc>
+size_t LFSparseHashTable<K, V, HashFunc>::getBatch(const K * inKeys, V * outValues, bool * outResults, size_t count)
+{
+    unsigned long long hashes[2][BATCH_WINDOW];
+    size_t numFound = 0;
+    prefetchBatchBuckets(inKeys, hashes[0], count < BATCH_WINDOW ? count : BATCH_WINDOW);
+    for(size_t windowStart = 0, window = 0; windowStart < count; windowStart += BATCH_WINDOW, ++window)
+    {
+        const size_t windowSize = count - windowStart < BATCH_WINDOW ? count - windowStart : BATCH_WINDOW;
+        const unsigned long long * windowHashes = hashes[window & 1];
+        OperationGuard guard(this);
+        prefetchBatchElements(windowHashes, windowSize);
+        if(windowStart + windowSize < count)
+            prefetchBatchBuckets(inKeys + windowStart + windowSize, hashes[(window + 1) & 1],
+                                 count - windowStart - windowSize < BATCH_WINDOW ? count - windowStart - windowSize : BATCH_WINDOW);
+        for(size_t keyIdx = 0; keyIdx < windowSize; ++keyIdx)
+        {
+            const K & key = inKeys[windowStart + keyIdx];
+            bool res;
+            if(guard.migrating() && !chainMigrated(windowHashes[keyIdx]))
+                res = getMigrating(key, windowHashes[keyIdx], outValues[windowStart + keyIdx]);
+            else
+                res = getInternal(key, windowHashes[keyIdx], outValues[windowStart + keyIdx], true);
+            outResults[windowStart + keyIdx] = res;
+            numFound += res;
+        }
+    }
+    return numFound;
+}
+
+template<typename K, typename V, class HashFunc>
+size_t LFSparseHashTable<K, V, HashFunc>::insertBatch(const K * inKeys, const V * inValues, bool * outResults, size_t count)
+{
+    unsigned long long hashes[2][BATCH_WINDOW];
+    size_t numInserted = 0;
+    prefetchBatchBuckets(inKeys, hashes[0], count < BATCH_WINDOW ? count : BATCH_WINDOW);
+    for(size_t windowStart = 0, window = 0; windowStart < count; windowStart += BATCH_WINDOW, ++window)
+    {
+        const size_t windowSize = count - windowStart < BATCH_WINDOW ? count - windowStart : BATCH_WINDOW;
+        const unsigned long long * windowHashes = hashes[window & 1];
+        OperationGuard guard(this); // growth kicks in between windows
+        prefetchBatchElements(windowHashes, windowSize);
+        if(windowStart + windowSize < count)
+            prefetchBatchBuckets(inKeys + windowStart + windowSize, hashes[(window + 1) & 1],
+                                 count - windowStart - windowSize < BATCH_WINDOW ? count - windowStart - windowSize : BATCH_WINDOW);
+        for(size_t keyIdx = 0; keyIdx < windowSize; ++keyIdx)
+        {
+            if(guard.migrating())
+                migrateChain(windowHashes[keyIdx]);
+            bool res = insertInternal(inKeys[windowStart + keyIdx], windowHashes[keyIdx], inValues[windowStart + keyIdx]);
+            if(res)
+                guard.elementAdded();
+            outResults[windowStart + keyIdx] = res;
+            numInserted += res;
+        }
+    }
+    return numInserted;
+}
+
+template<typename K, typename V, class HashFunc>
+size_t LFSparseHashTable<K, V, HashFunc>::setBatch(const K * inKeys, const V * inValues, bool * outResults, size_t count)
+{
+    unsigned long long hashes[2][BATCH_WINDOW];
+    size_t numSet = 0;
+    prefetchBatchBuckets(inKeys, hashes[0], count < BATCH_WINDOW ? count : BATCH_WINDOW);
+    for(size_t windowStart = 0, window = 0; windowStart < count; windowStart += BATCH_WINDOW, ++window)
+    {
+        const size_t windowSize = count - windowStart < BATCH_WINDOW ? count - windowStart : BATCH_WINDOW;
+        const unsigned long long * windowHashes = hashes[window & 1];
+        OperationGuard guard(this);
+        prefetchBatchElements(windowHashes, windowSize);
+        if(windowStart + windowSize < count)
+            prefetchBatchBuckets(inKeys + windowStart + windowSize, hashes[(window + 1) & 1],
+                                 count - windowStart - windowSize < BATCH_WINDOW ? count - windowStart - windowSize : BATCH_WINDOW);
+        for(size_t keyIdx = 0; keyIdx < windowSize; ++keyIdx)
+        {
+            if(guard.migrating())
+                migrateChain(windowHashes[keyIdx]);
+            bool res = setInternal(inKeys[windowStart + keyIdx], windowHashes[keyIdx], inValues[windowStart + keyIdx], false);
+            outResults[windowStart + keyIdx] = res;
+            numSet += res;
+        }
+    }
+    return numSet;
+}
+
+// removal of every rejected element is remove's backward shift: its window is locked forward from the element up to the next
+// hole, wrapping past the last bucket. Shifted elements only move back into the hole, so the ones that land in the bucket
+// being packed get looked at as well. With shiftedPast the furthest final hole of windows that went past endBucketPos is kept
+// (not wrapped), elements shifted there may have gone behind whoever walks the next buckets
+template<typename K, typename V, class HashFunc>
+template<class Predicate>
+size_t LFSparseHashTable<K, V, HashFunc>::packBuckets(unsigned long long beginBucketPos, unsigned long long endBucketPos, Predicate & itemPredicate,
+                                                      OperationGuard & guard, unsigned long long * shiftedPast)
 {
     size_t numElementsProcessed = 0;
-    for(unsigned long long packBucketPos = 0; packBucketPos < maxElements / HOLY_GRAIL_SIZE + (maxElements % HOLY_GRAIL_SIZE ? 1ULL : 0ULL); ++packBucketPos)
+    for(unsigned long long packBucketPos = beginBucketPos; packBucketPos < endBucketPos; ++packBucketPos)
     {
         SparseBucket * packBucket = &(buckets[packBucketPos]);
-        packBucket->lockBucket();
-        unsigned long long packElementCount = googlerank((const unsigned char*) &(packBucket->elementBitmap), HOLY_GRAIL_SIZE);
+        packBucket->lockBucket(lockContention);
+        preserveBucket(packBucketPos);
+        unsigned long long packElementCount = rank64(packBucket->elementBitmap, HOLY_GRAIL_SIZE);
         SparseBucketElement * packBucketElements = packBucket->elements;
         for(unsigned long long j = 0; j < packElementCount; ++j)
         {
@@ -967,7 +2861,10 @@ size_t LFSparseHashTable<K, V, HashFunc>::packHash(std::function<bool(SparseBuck
             if(predicateRes)
             {
                 ++numElementsProcessed;
-                unsigned long long idx = hasherFunc(packBucketElements[j].key) % maxElements; // TODO: seed
+                guard.elementRemoved();
+                // element sits at its own slot, not necessarily its home one
+                unsigned long long idx = packBucketPos * HOLY_GRAIL_SIZE + select64(packBucket->elementBitmap, j);
+                const unsigned long long removedIdx = idx;
                 unsigned long long bucketPos = idx / HOLY_GRAIL_SIZE;
                 unsigned long long startBucketIdx = bucketPos, endBucketIdx = bucketPos;
                 unsigned long long bucketOffset = idx % HOLY_GRAIL_SIZE;
@@ -976,13 +2873,12 @@ size_t LFSparseHashTable<K, V, HashFunc>::packHash(std::function<bool(SparseBuck
                 SparseBucketElement * bucketElements = bucket->elements;
 
                 unsigned long long rank;
-                rank = googlerank((const unsigned char*) &(bucket->elementBitmap), bucketOffset + 1);
-                bucketElements[rank - 1].~SparseBucketElement(); // destroy the deleted element
+                rank = rank64(bucket->elementBitmap, bucketOffset + 1);
 
                 // walk forward until next hole to see if any records need to be moved back
                 unsigned long long deletedIdx = idx;
                 ++bucketOffset;
-                idx = (idx + 1) % maxElements;
+                idx = nextProbeIdx(idx, maxElements);
                 if(bucketOffset == HOLY_GRAIL_SIZE || !idx)
                 {
                     rank = 0; // if there are window elements rank will be incremented later
@@ -990,28 +2886,29 @@ size_t LFSparseHashTable<K, V, HashFunc>::packHash(std::function<bool(SparseBuck
                     bucketOffset = idx % HOLY_GRAIL_SIZE;
                     bucket = &(buckets[bucketPos]);
                     __builtin_prefetch(bucket, 1, 3 /* _MM_HINT_T0 */);
-                    bucket->lockBucket();
+                    bucket->lockBucket(lockContention);
+                    preserveBucket(bucketPos);
                     endBucketIdx = bucketPos;
                     bucketElements = bucket->elements;
-                    bucketElements = (SparseBucketElement *) (((unsigned long long) bucketElements) & (~15ULL));
                 }
                 while(bucketElements && (bucket->bitmapTest(bucketOffset)))
                 {
-                    // calc hash. If its less or equal new hole position, swap, save new hole and move on
+                    // calc hash. If hole is not before its home position (counting wrapped chains), swap, save new hole and move on
                     ++rank;
-                    if(bucketElements && hasherFunc(bucketElements[rank - 1].key) % maxElements <= deletedIdx)
+                    if(bucketElements && (idx + maxElements - reduceRange(applyHash(hasherFunc, bucketElements[rank - 1].key), maxElements)) % maxElements >= (idx + maxElements - deletedIdx) % maxElements)
                     {
                         // swap
                         unsigned int swapWindowPos = deletedIdx / HOLY_GRAIL_SIZE;
                         unsigned int swapWindowOffset = deletedIdx % HOLY_GRAIL_SIZE;
                         SparseBucket * swapBucket = &(buckets[swapWindowPos]);
                         SparseBucketElement * swapWindowElements = swapBucket->elements;
-                        unsigned long long swaprank = googlerank((const unsigned char*) &(swapBucket->elementBitmap), swapWindowOffset + 1);
-                        swapWindowElements[swaprank - 1] = bucketElements[rank - 1];
+                        unsigned long long swaprank = rank64(swapBucket->elementBitmap, swapWindowOffset + 1);
+                        swapWindowElements[swaprank - 1] = std::move(bucketElements[rank - 1]);
+                        swapBucket->setFingerprint(swapWindowOffset, bucket->fingerprintAt(bucketOffset));
                         deletedIdx = idx;
                     }
                     ++bucketOffset;
-                    idx = (idx + 1) % maxElements;
+                    idx = nextProbeIdx(idx, maxElements);
                     if(bucketOffset == HOLY_GRAIL_SIZE || !idx)
                     {
                         rank = 0; // if there are window elements rank will be incremented later
@@ -1019,37 +2916,44 @@ size_t LFSparseHashTable<K, V, HashFunc>::packHash(std::function<bool(SparseBuck
                         bucketOffset = idx % HOLY_GRAIL_SIZE;
                         bucket = &(buckets[bucketPos]);
                         __builtin_prefetch(bucket, 1, 3 /* _MM_HINT_T0 */);
-                        bucket->lockBucket();
+                        bucket->lockBucket(lockContention);
+                        preserveBucket(bucketPos);
                         endBucketIdx = bucketPos;
                         bucketElements = bucket->elements;
                     }
                 }
 
+                if(shiftedPast)
+                {
+                    unsigned long long shiftedEnd = removedIdx + (deletedIdx + maxElements - removedIdx) % maxElements;
+                    if(shiftedEnd > endBucketPos * HOLY_GRAIL_SIZE && shiftedEnd > *shiftedPast)
+                        *shiftedPast = shiftedEnd;
+                }
+
                 // remove record
                 unsigned long long deletedBucketPos = deletedIdx / HOLY_GRAIL_SIZE;
                 unsigned long long deletedBucketOffset = deletedIdx % HOLY_GRAIL_SIZE;
                 SparseBucket * deletedBucket = &(buckets[deletedBucketPos]);
                 SparseBucketElement * deletedBucketElements = deletedBucket->elements;
-                unsigned long long deletedCount = googlerank((const unsigned char*) &(deletedBucket->elementBitmap), HOLY_GRAIL_SIZE);
+                unsigned long long deletedCount = rank64(deletedBucket->elementBitmap, HOLY_GRAIL_SIZE);
+                unsigned long long deletedrank = rank64(deletedBucket->elementBitmap, deletedBucketOffset + 1);
+                deletedBucketElements[deletedrank - 1].~SparseBucketElement(); // destroy the deleted element, or what was moved out of the hole
                 if(deletedCount == 1)
                 {
-                    std::free(deletedBucketElements);
+                    freeElements(deletedBucketElements);
                     deletedBucket->elements = deletedBucketElements = 0;
                 }
                 else
                 {
-                    unsigned long long deletedrank = googlerank((const unsigned char*) &(deletedBucket->elementBitmap), deletedBucketOffset + 1);
-                    if(deletedrank < deletedCount)
-                        memmove(deletedBucketElements + deletedrank - 1, deletedBucketElements + deletedrank,
-                                (deletedCount - deletedrank) * sizeof(SparseBucketElement));
-                    deletedBucketElements = (SparseBucketElement *) std::realloc(deletedBucketElements, (deletedCount - 1) * sizeof(SparseBucketElement));
+                    deletedBucketElements = shrinkElements(ownElements(deletedBucket, deletedCount), deletedCount, deletedrank - 1);
                     deletedBucket->elements = deletedBucketElements;
                 }
                 deletedBucket->bitmapClear(deletedBucketOffset);
-                if(endBucketIdx > startBucketIdx)
-                    unlockBuckets(startBucketIdx + 1, endBucketIdx);
+                markDirtyRange(startBucketIdx, endBucketIdx);
+                if(endBucketIdx != startBucketIdx) // pack bucket stays locked, rest of the window may have wrapped
+                    unlockBuckets(startBucketIdx + 1 == maxElements / HOLY_GRAIL_SIZE ? 0 : startBucketIdx + 1, endBucketIdx);
 
-                packElementCount = googlerank((const unsigned char*) &(packBucket->elementBitmap), HOLY_GRAIL_SIZE);
+                packElementCount = rank64(packBucket->elementBitmap, HOLY_GRAIL_SIZE);
                 packBucketElements = packBucket->elements;
                 --j;
             }
@@ -1060,19 +2964,286 @@ size_t LFSparseHashTable<K, V, HashFunc>::packHash(std::function<bool(SparseBuck
 }
 
 template<typename K, typename V, class HashFunc>
-void LFSparseHashTable<K, V, HashFunc>::processHash(std::function<void(SparseBucketElement&)> itemProcessor)
+template<class Processor>
+void LFSparseHashTable<K, V, HashFunc>::processBuckets(unsigned long long beginBucketPos, unsigned long long endBucketPos, Processor & itemProcessor)
 {
-    for(unsigned long long bucketPos = 0; bucketPos < maxElements / HOLY_GRAIL_SIZE + (maxElements % HOLY_GRAIL_SIZE ? 1ULL : 0ULL); ++bucketPos)
+    for(unsigned long long bucketPos = beginBucketPos; bucketPos < endBucketPos; ++bucketPos)
     {
         SparseBucket * bucket = &(buckets[bucketPos]);
-        bucket->lockBucket();
-        unsigned long long count = googlerank((const unsigned char*) &(bucket->elementBitmap), HOLY_GRAIL_SIZE);
+        bucket->lockBucket(lockContention);
+        preserveBucket(bucketPos);
+        unsigned long long count = rank64(bucket->elementBitmap, HOLY_GRAIL_SIZE);
         SparseBucketElement * bucketElements = bucket->elements;
         for(unsigned long long j = 0; j < count; ++j)
         {
             itemProcessor(bucketElements[j]);
         }
+        if(count)
+            markDirty(bucketPos); // processor may have changed values
         bucket->unlockBucket();
     }
 }
+template<typename K, typename V, class HashFunc>
+template<class Predicate>
+size_t LFSparseHashTable<K, V, HashFunc>::packHash(Predicate itemPredicate)
+{
+    // whole table walk has to see a single generation
+    OperationGuard guard(this);
+    if(guard.migrating())
+        migrateAll();
+    return packBuckets(0, maxElements / HOLY_GRAIL_SIZE, itemPredicate, guard);
+}
+
+template<typename K, typename V, class HashFunc>
+template<class Processor>
+void LFSparseHashTable<K, V, HashFunc>::processHash(Processor itemProcessor)
+{
+    OperationGuard guard(this);
+    if(guard.migrating())
+        migrateAll();
+    processBuckets(0, maxElements / HOLY_GRAIL_SIZE, itemProcessor);
+}
+
+// workers run under guard of the calling thread, it keeps the generation in place until all chunks are done. A removal near the
+// end of a chunk may shift elements of the next one back into buckets its worker already passed, so once workers are done the
+// buckets such windows reached past their chunk are packed again
+template<typename K, typename V, class HashFunc>
+template<class Predicate, class Progress>
+size_t LFSparseHashTable<K, V, HashFunc>::packHashParallel(Predicate itemPredicate, Progress progress, WorkStealingPool & pool)
+{
+    OperationGuard guard(this);
+    if(guard.migrating())
+        migrateAll();
+    const unsigned long long numBuckets = maxElements / HOLY_GRAIL_SIZE;
+    const unsigned long long numChunks = (numBuckets + PARALLEL_CHUNK_BUCKETS - 1) / PARALLEL_CHUNK_BUCKETS;
+    std::vector<unsigned long long> shiftedPast(numChunks, 0);
+    std::atomic<size_t> numElementsProcessed(0);
+    std::atomic<unsigned long long> bucketsDone(0);
+    pool.run(numChunks, [&](size_t, size_t chunkIdx)
+    {
+        const unsigned long long beginBucketPos = chunkIdx * PARALLEL_CHUNK_BUCKETS;
+        const unsigned long long endBucketPos = std::min(beginBucketPos + PARALLEL_CHUNK_BUCKETS, numBuckets);
+        numElementsProcessed.fetch_add(packBuckets(beginBucketPos, endBucketPos, itemPredicate, guard, &shiftedPast[chunkIdx]),
+                                       std::memory_order_relaxed);
+        progress(bucketsDone.fetch_add(endBucketPos - beginBucketPos, std::memory_order_relaxed) + endBucketPos - beginBucketPos, numBuckets);
+    });
+    size_t numRepacked = 0;
+    for(unsigned long long chunkIdx = 0; chunkIdx < numChunks; ++chunkIdx)
+    {
+        if(!shiftedPast[chunkIdx])
+            continue;
+        unsigned long long beginBucketPos = std::min((chunkIdx + 1) * PARALLEL_CHUNK_BUCKETS, numBuckets);
+        unsigned long long endBucketPos = (shiftedPast[chunkIdx] + HOLY_GRAIL_SIZE - 1) / HOLY_GRAIL_SIZE;
+        if(endBucketPos > numBuckets) // window wrapped past the last bucket
+        {
+            if(beginBucketPos < numBuckets)
+                numRepacked += packBuckets(beginBucketPos, numBuckets, itemPredicate, guard);
+            beginBucketPos = 0;
+            endBucketPos -= numBuckets;
+        }
+        numRepacked += packBuckets(beginBucketPos, endBucketPos, itemPredicate, guard);
+    }
+    return numElementsProcessed.load() + numRepacked;
+}
+
+template<typename K, typename V, class HashFunc>
+template<class Processor, class Progress>
+void LFSparseHashTable<K, V, HashFunc>::processHashParallel(Processor itemProcessor, Progress progress, WorkStealingPool & pool)
+{
+    OperationGuard guard(this);
+    if(guard.migrating())
+        migrateAll();
+    const unsigned long long numBuckets = maxElements / HOLY_GRAIL_SIZE;
+    std::atomic<unsigned long long> bucketsDone(0);
+    pool.run((numBuckets + PARALLEL_CHUNK_BUCKETS - 1) / PARALLEL_CHUNK_BUCKETS, [&](size_t, size_t chunkIdx)
+    {
+        const unsigned long long beginBucketPos = chunkIdx * PARALLEL_CHUNK_BUCKETS;
+        const unsigned long long endBucketPos = std::min(beginBucketPos + PARALLEL_CHUNK_BUCKETS, numBuckets);
+        processBuckets(beginBucketPos, endBucketPos, itemProcessor);
+        progress(bucketsDone.fetch_add(endBucketPos - beginBucketPos, std::memory_order_relaxed) + endBucketPos - beginBucketPos, numBuckets);
+    });
+}
+
+// smallest hash reduceRange puts into the bucket, (hash * maxElements) >> 64 inverted and rounded up
+template<typename K, typename V, class HashFunc>
+unsigned long long LFSparseHashTable<K, V, HashFunc>::bucketHashBegin(unsigned long long bucketPos) const
+{
+    return (unsigned long long) ((((unsigned __int128) (bucketPos * HOLY_GRAIL_SIZE) << 64) + maxElements - 1) / maxElements);
+}
+
+// old buckets of the hash range, then the rest of the old chain of its last hash. Elements homed anywhere in the range can not be
+// further than that
+template<typename K, typename V, class HashFunc>
+void LFSparseHashTable<K, V, HashFunc>::migrateHashRange(unsigned long long beginHash, unsigned long long lastHash)
+{
+    const unsigned long long lastOldBucketPos = reduceRange(lastHash, oldMaxElements) / HOLY_GRAIL_SIZE;
+    for(unsigned long long oldBucketPos = reduceRange(beginHash, oldMaxElements) / HOLY_GRAIL_SIZE; oldBucketPos < lastOldBucketPos; ++oldBucketPos)
+        migrateOldBucket(oldBucketPos);
+    migrateChain(lastHash);
+}
+
+// elements homed in the bucket are in it or, when it ends full, in the probe run spilling over into next buckets. Whole run is
+// locked at once and removals only shift elements back towards their home, so none of them can slip past
+template<typename K, typename V, class HashFunc>
+void LFSparseHashTable<K, V, HashFunc>::scanBucket(unsigned long long bucketPos, unsigned long long fromHash,
+                                                   std::vector<SparseBucketElement> & outElements)
+{
+    const unsigned long long numBuckets = maxElements / HOLY_GRAIL_SIZE;
+    unsigned long long endBucketPos = bucketPos;
+    SparseBucket * bucket = &(buckets[bucketPos]);
+    bucket->lockBucket(lockContention);
+    unsigned long long count = rank64(bucket->elementBitmap, HOLY_GRAIL_SIZE);
+    while(true)
+    {
+        SparseBucketElement * bucketElements = bucket->elements;
+        for(unsigned long long j = 0; j < count; ++j)
+        {
+            const unsigned long long hash = applyHash(hasherFunc, bucketElements[j].key);
+            if(hash >= fromHash && reduceRange(hash, maxElements) / HOLY_GRAIL_SIZE == bucketPos)
+                outElements.push_back(bucketElements[j]);
+        }
+        // spill buckets only count their leading run, the run goes on only if it takes the whole bucket
+        if(!bucket->bitmapTest(HOLY_GRAIL_SIZE - 1) || (endBucketPos != bucketPos && count != HOLY_GRAIL_SIZE))
+            break;
+        if((endBucketPos + 1) % numBuckets == bucketPos)
+            break;
+        endBucketPos = (endBucketPos + 1) % numBuckets;
+        bucket = &(buckets[endBucketPos]);
+        bucket->lockBucket(lockContention);
+        count = ~(bucket->elementBitmap) ? __builtin_ctzll(~(bucket->elementBitmap)) : HOLY_GRAIL_SIZE;
+    }
+    unlockBuckets(bucketPos, endBucketPos);
+}
+
+// buckets are visited in hash order and reduceRange keeps that order for any table size, so the cursor means the same thing
+// before and after a resize. While migrating, old chains of the bucket's hashes are migrated first
+template<typename K, typename V, class HashFunc>
+bool LFSparseHashTable<K, V, HashFunc>::scan(unsigned long long & cursor, std::vector<SparseBucketElement> & outElements, size_t count)
+{
+    OperationGuard guard(this);
+    const unsigned long long numBuckets = maxElements / HOLY_GRAIL_SIZE;
+    const size_t targetSize = outElements.size() + count;
+    unsigned long long bucketPos = reduceRange(cursor, maxElements) / HOLY_GRAIL_SIZE;
+    do
+    {
+        const bool lastBucket = bucketPos + 1 == numBuckets;
+        const unsigned long long nextCursor = lastBucket ? 0 : bucketHashBegin(bucketPos + 1);
+        if(guard.migrating())
+            migrateHashRange(cursor, nextCursor - 1);
+        scanBucket(bucketPos, cursor, outElements);
+        cursor = nextCursor;
+        if(lastBucket)
+            return false;
+        ++bucketPos;
+    } while(outElements.size() < targetSize);
+    return true;
+}
+
+/*
+    // Sample batch vs loop benchmark, 8M elements, random lookups in groups of 128 (half of them misses). Hasher has to mix,
+    // std::hash on integers is identity. On a single core box batch does about 4.8M lookups/s vs 2.8-3.3M for the loop
+
+    struct Mix { size_t operator()(unsigned long long x) const { x ^= x >> 33; x *= 0xff51afd7ed558ccdULL; x ^= x >> 33; return x; } };
+
+    const size_t N = 1 << 23, BATCH = 128, LOOKUPS = 1 << 23;
+    LFSparseHashTable<unsigned long long, unsigned long long, Mix> table(N * 2, 0.7);
+    for (unsigned long long i = 0; i < N; ++i)
+        table.insert(i, i);
+    std::vector<unsigned long long> keys(LOOKUPS), values(BATCH);
+    std::mt19937_64 rng(42);
+    for (auto & k : keys)
+        k = rng() % (N * 2);
+    bool results[BATCH];
+
+    auto t0 = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < LOOKUPS; i += BATCH)
+        for (size_t j = 0; j < BATCH; ++j)
+            table.get(keys[i + j], values[j]);
+    auto t1 = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < LOOKUPS; i += BATCH)
+        table.getBatch(&keys[i], &values[0], results, BATCH);
+    auto t2 = std::chrono::steady_clock::now();
+    printf("loop %.1f Mops/s, batch %.1f Mops/s\n", LOOKUPS / std::chrono::duration<double>(t1 - t0).count() / 1e6,
+           LOOKUPS / std::chrono::duration<double>(t2 - t1).count() / 1e6);
+
+*/
+
+/*
+    // Sample insert/remove churn at steady size, 4M slots, 1.6M resident keys plus a sliding window of 100k per thread.
+    // RSS before -> after 8M insert/remove pairs: STORAGE_HEAP 32 -> 43 MB, STORAGE_SECTORS 44 -> 46 MB
+
+    typedef LFSparseHashTable<unsigned long long, unsigned long long> Table;
+    Table table(1 << 22, 0.5, 0.0, SeededHash<unsigned long long>(), Table::STORAGE_SECTORS, 8192);
+    for (unsigned long long i = 0; i < 1600000; ++i)
+        table.insert(i, i);
+    std::vector<std::thread> threads;
+    for (unsigned long long threadIdx = 0; threadIdx < 4; ++threadIdx)
+        threads.emplace_back([&table, threadIdx]
+        {
+            const unsigned long long base = 1000000000ULL * (threadIdx + 1), window = 100000;
+            for (unsigned long long i = 0; i < 2000000; ++i)
+            {
+                table.insert(base + i, i);
+                if (i >= window)
+                    table.remove(base + i - window);
+            }
+        });
+    for (auto & thread : threads)
+        thread.join();
+
+*/
+
+/*
+    // Sample streaming the table to a replica while it serves traffic, a batch of about 1000 elements per round trip. Cursor is all
+    // the state there is, so a broken connection resumes from the last acknowledged cursor
+
+    typedef LFSparseHashTable<unsigned long long, unsigned long long> Table;
+    std::vector<Table::SparseBucketElement> batch;
+    unsigned long long cursor = 0;
+    bool more = true;
+    while (more)
+    {
+        batch.clear();
+        more = table.scan(cursor, batch, 1000);
+        replica.send(batch.data(), batch.size(), cursor); // replica acks cursor, resend from it after reconnect
+    }
+
+*/
+
+/*
+    // Sample routing lookups to the node that owns the key, PLACEMENT_PARTITION on a 2 socket box. A worker per core pinned to its
+    // node drains a queue per node (LFMPMCQueue.h), so bucket and arena reads stay local. Keys the router can't place go anywhere
+
+    typedef LFSparseHashTable<unsigned long long, unsigned long long> Table;
+    Table table(1ULL << 30, 0.5, 0.0, SeededHash<unsigned long long>(), Table::STORAGE_SECTORS, 8192, LockContention::NEVER_PARK,
+                Table::READS_OPTIMISTIC, Table::PLACEMENT_PARTITION);
+    const unsigned long long numNodes = NumaPlacement::numNodes(), workersPerNode = 16;
+    std::vector<std::unique_ptr<LFMPMCQueue<Request *>>> queues;
+    for (unsigned long long node = 0; node < numNodes; ++node)
+        queues.emplace_back(new LFMPMCQueue<Request *>(1 << 16));
+    std::vector<std::thread> workers;
+    for (unsigned long long workerIdx = 0; workerIdx < numNodes * workersPerNode; ++workerIdx)
+        workers.emplace_back([&, workerIdx]
+        {
+            const unsigned long long node = workerIdx / workersPerNode;
+            NumaPlacement::bindThread(node);
+            Request * request;
+            while (running)
+            {
+                if (!queues[node]->pop(request))
+                {
+                    _mm_pause();
+                    continue;
+                }
+                request->found = table.get(request->key, request->value);
+                request->done();
+            }
+        });
+    // router
+    unsigned long long node = table.nodeOf(request->key);
+    while (!queues[node == NumaPlacement::ANY_NODE ? NumaPlacement::currentNode() : node]->push(request))
+        _mm_pause();
+
+*/
+
 #endif /* LFSPARSEHASHTABLE_H_ */
@@ -8,39 +8,14 @@
 #include <utility>
 #include <memory>
 
+#include "bittwiddlinghacks.hh"
+
 // TODO: implement save/load/rehash in a separate friend class\file LFSparseHashTableUtil
 // TODO: remove size() / numElements from the table as its the only data causing sharing between thread, move it to separate method in Util class with O(N) complexity, multithreaded
 // TODO: Implement support for monotonous keys for given key - truncate last bits for number of pairs to fit into cache line - hash, add truncated bits
 template<typename K, typename V, class HashFunc = std::hash<K> >
 class LFSparseHashTableSimple
 {
-    unsigned long long googlerank(const unsigned char *bm, unsigned long long pos) const noexcept
-    {
-        static constexpr char bits_in_char[256] =
-        {
-          0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4,
-          1, 2, 2, 3, 2, 3, 3, 4, 2, 3, 3, 4, 3, 4, 4, 5,
-          1, 2, 2, 3, 2, 3, 3, 4, 2, 3, 3, 4, 3, 4, 4, 5,
-          2, 3, 3, 4, 3, 4, 4, 5, 3, 4, 4, 5, 4, 5, 5, 6,
-          1, 2, 2, 3, 2, 3, 3, 4, 2, 3, 3, 4, 3, 4, 4, 5,
-          2, 3, 3, 4, 3, 4, 4, 5, 3, 4, 4, 5, 4, 5, 5, 6,
-          2, 3, 3, 4, 3, 4, 4, 5, 3, 4, 4, 5, 4, 5, 5, 6,
-          3, 4, 4, 5, 4, 5, 5, 6, 4, 5, 5, 6, 5, 6, 6, 7,
-          1, 2, 2, 3, 2, 3, 3, 4, 2, 3, 3, 4, 3, 4, 4, 5,
-          2, 3, 3, 4, 3, 4, 4, 5, 3, 4, 4, 5, 4, 5, 5, 6,
-          2, 3, 3, 4, 3, 4, 4, 5, 3, 4, 4, 5, 4, 5, 5, 6,
-          3, 4, 4, 5, 4, 5, 5, 6, 4, 5, 5, 6, 5, 6, 6, 7,
-          2, 3, 3, 4, 3, 4, 4, 5, 3, 4, 4, 5, 4, 5, 5, 6,
-          3, 4, 4, 5, 4, 5, 5, 6, 4, 5, 5, 6, 5, 6, 6, 7,
-          3, 4, 4, 5, 4, 5, 5, 6, 4, 5, 5, 6, 5, 6, 6, 7,
-          4, 5, 5, 6, 5, 6, 6, 7, 5, 6, 6, 7, 6, 7, 7, 8,
-        };
-        unsigned long long retval = 0;
-        for (; pos > 8ULL; pos -= 8ULL)
-            retval += bits_in_char[*bm++];
-        return retval + bits_in_char[*bm & ((1ULL << pos) - 1ULL)];
-    }
-
 public:
     typedef K key_type;
     typedef V mapped_type;
@@ -182,7 +157,7 @@ void LFSparseHashTableSimple<K, V, HashFunc>::rehash(bool grow)
     {
         SparseBucket * bucket = &(buckets[bucketPos]);
         std::pair<K, V> * bucketElements = bucket->elements; // rehash should operate when no buckets are locked
-        unsigned long long count = googlerank((const unsigned char*)&(bucket->elementBitmap), HOLY_GRAIL_SIZE);
+        unsigned long long count = rank64(bucket->elementBitmap, HOLY_GRAIL_SIZE);
         for (unsigned long long bucketElement = 0; bucketElement < count; ++bucketElement)
         {
             tmpTable.insertOrSet(bucketElements[bucketElement].first, bucketElements[bucketElement].second);
@@ -215,7 +190,7 @@ LFSparseHashTableSimple<K, V, HashFunc>::~LFSparseHashTableSimple()
     for (unsigned long long bucketPos = 0; bucketPos < maxElements / HOLY_GRAIL_SIZE + 1; ++bucketPos)
     {
         SparseBucket * bucket = &(buckets[bucketPos]);
-        unsigned long long count = googlerank((const unsigned char*)&(bucket->elementBitmap), HOLY_GRAIL_SIZE);
+        unsigned long long count = rank64(bucket->elementBitmap, HOLY_GRAIL_SIZE);
         std::pair<K, V> * bucketElements = bucket->elements; // destructor should work when no buckets are locked
         for (unsigned long long j = 0; j < count; ++j)
         {
@@ -237,7 +212,7 @@ LFSparseHashTableSimple<K, V, HashFunc>::LFSparseHashTableSimple(const LFSparseH
     for (unsigned long long bucketPos = 0; bucketPos < other.maxElements / HOLY_GRAIL_SIZE + 1; ++bucketPos)
     {
         buckets[bucketPos] = other.buckets[bucketPos];
-        unsigned long long count = googlerank((const unsigned char*)&(buckets[bucketPos]->elementBitmap), HOLY_GRAIL_SIZE);
+        unsigned long long count = rank64(buckets[bucketPos].elementBitmap, HOLY_GRAIL_SIZE);
         buckets[bucketPos].elements = (std::pair<K, V> *) std::malloc(count * sizeof(std::pair<K, V>)); // all buckets are created unlocked
         memcpy(buckets[bucketPos].elements, other.buckets[bucketPos].elements, count * sizeof(std::pair<K, V>)); // other table buckets should be unlocked
     }
@@ -281,7 +256,7 @@ bool LFSparseHashTableSimple<K, V, HashFunc>::insertOrSet(const K & inKey, const
     else
     {
         bool stepBack = false; // to avoid extra rank calculation later
-        unsigned long long rank = googlerank((const unsigned char*)&(bucket->elementBitmap), bucketOffset + 1);
+        unsigned long long rank = rank64(bucket->elementBitmap, bucketOffset + 1);
         while (true) // linear probing
         {
             bool elementExists = bucket->bitmapTest(bucketOffset);
@@ -330,7 +305,7 @@ bool LFSparseHashTableSimple<K, V, HashFunc>::insertOrSet(const K & inKey, const
             {
                 if (stepBack)
                     --rank;
-                unsigned long long count = googlerank((const unsigned char*)&(bucket->elementBitmap), HOLY_GRAIL_SIZE);
+                unsigned long long count = rank64(bucket->elementBitmap, HOLY_GRAIL_SIZE);
                 bucketElements = (std::pair<K, V> *) std::realloc(bucketElements, (count + 1) * sizeof(std::pair<K, V>));
                 bucket->elements = (std::pair<K, V> *)(((unsigned long long)bucketElements) | 1ULL);
                 if (rank < count)
@@ -360,7 +335,7 @@ bool LFSparseHashTableSimple<K, V, HashFunc>::get(const K & inKey, V & value, bo
     bucket->lockBucket();
     std::pair<K, V> * bucketElements = bucket->elements;
     bucketElements = (std::pair<K, V> *)(((unsigned long long)bucketElements) & 0xFFFFFFFFFFFFFFFEULL);
-    unsigned long long rank = googlerank((const unsigned char*)&(bucket->elementBitmap), bucketOffset + 1);
+    unsigned long long rank = rank64(bucket->elementBitmap, bucketOffset + 1);
     while (bucket->bitmapTest(bucketOffset)) // linear probing
     {
         if (bucketElements && bucketElements[rank - 1].first == inKey)
@@ -430,7 +405,7 @@ bool LFSparseHashTableSimple<K, V, HashFunc>::remove(const K & inKey)
     while (bucket->bitmapTest(bucketOffset))
     {
         if (bucketElements)
-            rank = googlerank((const unsigned char*)&(bucket->elementBitmap), bucketOffset + 1);
+            rank = rank64(bucket->elementBitmap, bucketOffset + 1);
         if (bucketElements && bucketElements[rank - 1].first == inKey)
         {
             elementFound = true;
@@ -494,7 +469,7 @@ bool LFSparseHashTableSimple<K, V, HashFunc>::remove(const K & inKey)
                 SparseBucket* swapBucket = &(buckets[swapWindowPos]);
                 std::pair<K, V>* swapWindowElements = swapBucket->elements;
                 swapWindowElements = (std::pair<K, V> *)(((unsigned long long)swapWindowElements) & 0xFFFFFFFFFFFFFFFEULL);
-                unsigned long long swaprank = googlerank((const unsigned char*)&(swapBucket->elementBitmap), swapWindowOffset + 1);
+                unsigned long long swaprank = rank64(swapBucket->elementBitmap, swapWindowOffset + 1);
                 swapWindowElements[swaprank - 1] = bucketElements[rank - 1];
                 deletedIdx = idx;
             }
@@ -521,7 +496,7 @@ bool LFSparseHashTableSimple<K, V, HashFunc>::remove(const K & inKey)
     SparseBucket * deletedBucket = &(buckets[deletedBucketPos]);
     std::pair<K, V> * deletedBucketElements = deletedBucket->elements;
     deletedBucketElements = (std::pair<K, V> *)(((unsigned long long)deletedBucketElements) & 0xFFFFFFFFFFFFFFFEULL);
-    unsigned long long deletedCount = googlerank((const unsigned char*)&(deletedBucket->elementBitmap), HOLY_GRAIL_SIZE);
+    unsigned long long deletedCount = rank64(deletedBucket->elementBitmap, HOLY_GRAIL_SIZE);
     if (deletedCount == 1)
     {
         std::free(deletedBucketElements);
@@ -530,7 +505,7 @@ bool LFSparseHashTableSimple<K, V, HashFunc>::remove(const K & inKey)
     }
     else
     {
-        unsigned long long deletedrank = googlerank((const unsigned char*)&(deletedBucket->elementBitmap), deletedBucketOffset + 1);
+        unsigned long long deletedrank = rank64(deletedBucket->elementBitmap, deletedBucketOffset + 1);
         if (deletedrank < deletedCount)
             memmove(deletedBucketElements + deletedrank - 1, deletedBucketElements + deletedrank, (deletedCount - deletedrank) * sizeof(std::pair<K, V>));
         deletedBucketElements = (std::pair<K, V> *) std::realloc(deletedBucketElements, (deletedCount - 1) * sizeof(std::pair<K, V>));
@@ -573,7 +548,7 @@ bool LFSparseHashTableSimple<K, V, HashFunc>::insert(const K & inKey, const V &
     else
     {
         bool stepBack = false; // to avoid extra rank calculation later
-        unsigned long long rank = googlerank((const unsigned char*)&(bucket->elementBitmap), bucketOffset + 1);
+        unsigned long long rank = rank64(bucket->elementBitmap, bucketOffset + 1);
         while (true) // linear probing
         {
             bool elementExists = bucket->bitmapTest(bucketOffset);
@@ -621,7 +596,7 @@ bool LFSparseHashTableSimple<K, V, HashFunc>::insert(const K & inKey, const V &
             {
                 if (stepBack)
                     --rank;
-                unsigned long long count = googlerank((const unsigned char*)&(bucket->elementBitmap), HOLY_GRAIL_SIZE);
+                unsigned long long count = rank64(bucket->elementBitmap, HOLY_GRAIL_SIZE);
                 bucketElements = (std::pair<K, V> *) std::realloc(bucketElements, (count + 1) * sizeof(std::pair<K, V>));
                 bucket->elements = (std::pair<K, V> *)(((unsigned long long)bucketElements) | 1ULL);
                 if (rank < count)
@@ -652,7 +627,7 @@ bool LFSparseHashTableSimple<K, V, HashFunc>::set(const K & inKey, const V & inV
         bucket->lockBucket();
     std::pair<K, V> * bucketElements = bucket->elements;
     bucketElements = (std::pair<K, V> *)(((unsigned long long)bucketElements) & 0xFFFFFFFFFFFFFFFEULL);
-    unsigned long long rank = googlerank((const unsigned char*)&(bucket->elementBitmap), bucketOffset + 1);
+    unsigned long long rank = rank64(bucket->elementBitmap, bucketOffset + 1);
     while (bucket->bitmapTest(bucketOffset)) // linear probing
     {
         if (bucketElements && bucketElements[rank - 1].first == inKey)
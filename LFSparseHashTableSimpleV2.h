@@ -8,9 +8,21 @@
 #include <stdexcept>
 #include <utility>
 #include <memory>
+#include <tuple>
+#include <type_traits>
+
+#include <x86intrin.h>
+
+#include "bittwiddlinghacks.hh"
+#include "EpochReclaimer.h"
+#include "LockContention.h"
 
 // TODO: implement save/load/rehash in a separate friend class\file LFSparseHashTableUtil
 // TODO: Implement support for monotonous keys for given key - truncate last bits for number of pairs to fit into cache line - hash, add truncated bits
+// READS_OPTIMISTIC makes get() of trivially copyable keys and values lock free: lock bit, bitmap and element pointer share a word, so
+// a reader that finds it unlocked has a consistent bucket. Every unlock bumps the bucket version, readers copy the value out and
+// check the version of every bucket they probed still holds. Element arrays are retired through EpochReclaimer instead of freed
+// (and not realloc'd). get(unlock = false) and readers that keep failing take the locks
 template<typename K, typename V, class HashFunc = std::hash<K> >
 class LFSparseHashTableSimpleV2
 {
@@ -25,6 +37,12 @@ public:
     typedef value_type& reference;
     typedef const value_type& const_reference;
 
+    enum Reads
+    {
+        READS_LOCKED = 0, // get locks the probed buckets
+        READS_OPTIMISTIC = 1 // lock free get for trivially copyable keys and values, locked for anything else
+    };
+
     struct SparseBucket
     {
         static const unsigned long long ELEMENTS_PER_BUCKET = 16ULL;
@@ -32,6 +50,7 @@ public:
         static const unsigned long long LOCK_BITS = 1ULL;
 
         unsigned long long data = 0; 
+        unsigned long long version = 0; // bumped by every unlock, optimistic readers validate against it
 
         inline std::pair<const K, V>* getElements() const 
         {
@@ -42,12 +61,22 @@ public:
         {
             data = (data & 0xFFFF000000000001ULL) | ((unsigned long long)ptr & 0x0000FFFFFFFFFFFEULL);
         }
-        inline void lockBucket()
+        // contended acquires back off and count themselves in contention (may be 0), see LockContention.h
+        inline void lockBucket(LockContention * contention = 0)
         {
-            unsigned long long newPointer, expectedPointer = data;
+            unsigned long long newPointer, expectedPointer = data & 0xFFFFFFFFFFFFFFFEULL; // expect last bit to be zero
+            newPointer = expectedPointer | 1ULL;
+            if (std::atomic_compare_exchange_strong((std::atomic_ullong*)&data, &expectedPointer, newPointer))
+                return;
+            LockContention::Waiter waiter(contention, &data);
             while (true)
             {
-                expectedPointer &= 0xFFFFFFFFFFFFFFFEULL; // expect last bit to be zero
+                if (expectedPointer & 1ULL)
+                {
+                    waiter.wait(expectedPointer, 1ULL);
+                    expectedPointer = __atomic_load_n(&data, __ATOMIC_RELAXED);
+                    continue;
+                }
                 newPointer = expectedPointer | 1ULL;
                 if (std::atomic_compare_exchange_strong((std::atomic_ullong*)&data, &expectedPointer, newPointer))
                     break;
@@ -55,10 +84,12 @@ public:
         }
         inline void unlockBucket()
         {
+            __atomic_store_n(&version, version + 1ULL, __ATOMIC_RELAXED); // nobody else bumps it while we hold the lock
             unsigned long long newPointer, oldPointer = data, expectedPointer;
             expectedPointer = oldPointer | 1ULL; // expect last bit to be one
             newPointer = expectedPointer & 0xFFFFFFFFFFFFFFFEULL;
             std::atomic_compare_exchange_strong((std::atomic_ullong*)&data, &expectedPointer, newPointer);
+            LockContention::wake(&data, 1ULL);
         }
         inline void bitmapSet(unsigned long long pos)
         {
@@ -72,33 +103,18 @@ public:
         {
             return data & (1ULL << (pos + POINTER_BITS + LOCK_BITS));
         }
-        inline unsigned long long rankAtPos(unsigned long long pos) 
+        inline unsigned long long rankAtPos(unsigned long long pos)
         {
-            // TODO: intrinsics for MSVC/GCC/CLANG
-            unsigned long long retval = 0;
-            static constexpr char bits_in_char[256] =
-            {
-                0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4,
-                1, 2, 2, 3, 2, 3, 3, 4, 2, 3, 3, 4, 3, 4, 4, 5,
-                1, 2, 2, 3, 2, 3, 3, 4, 2, 3, 3, 4, 3, 4, 4, 5,
-                2, 3, 3, 4, 3, 4, 4, 5, 3, 4, 4, 5, 4, 5, 5, 6,
-                1, 2, 2, 3, 2, 3, 3, 4, 2, 3, 3, 4, 3, 4, 4, 5,
-                2, 3, 3, 4, 3, 4, 4, 5, 3, 4, 4, 5, 4, 5, 5, 6,
-                2, 3, 3, 4, 3, 4, 4, 5, 3, 4, 4, 5, 4, 5, 5, 6,
-                3, 4, 4, 5, 4, 5, 5, 6, 4, 5, 5, 6, 5, 6, 6, 7,
-                1, 2, 2, 3, 2, 3, 3, 4, 2, 3, 3, 4, 3, 4, 4, 5,
-                2, 3, 3, 4, 3, 4, 4, 5, 3, 4, 4, 5, 4, 5, 5, 6,
-                2, 3, 3, 4, 3, 4, 4, 5, 3, 4, 4, 5, 4, 5, 5, 6,
-                3, 4, 4, 5, 4, 5, 5, 6, 4, 5, 5, 6, 5, 6, 6, 7,
-                2, 3, 3, 4, 3, 4, 4, 5, 3, 4, 4, 5, 4, 5, 5, 6,
-                3, 4, 4, 5, 4, 5, 5, 6, 4, 5, 5, 6, 5, 6, 6, 7,
-                3, 4, 4, 5, 4, 5, 5, 6, 4, 5, 5, 6, 5, 6, 6, 7,
-                4, 5, 5, 6, 5, 6, 6, 7, 5, 6, 6, 7, 6, 7, 7, 8,
-            };
-            const unsigned char* bm = (const unsigned char*)&data + (POINTER_BITS+LOCK_BITS) / CHAR_BIT;
-            for (; pos > 8ULL; pos -= 8ULL)
-                retval += bits_in_char[*bm++];
-            return retval + bits_in_char[*bm & ((1ULL << pos) - 1ULL)];
+            return rank64(data >> (POINTER_BITS + LOCK_BITS), pos);
+        }
+        // optimistic read of the bucket is still good, nobody holds it or unlocked it since version was read. Unlock bumps
+        // version before it clears the lock bit
+        inline bool validate(unsigned long long readVersion) const
+        {
+            std::atomic_thread_fence(std::memory_order_acquire);
+            if(__atomic_load_n(&data, __ATOMIC_ACQUIRE) & 1ULL)
+                return false;
+            return __atomic_load_n(&version, __ATOMIC_ACQUIRE) == readVersion;
         }
     };
 
@@ -108,10 +124,36 @@ private:
     SparseBucket* buckets; //8
     unsigned long long maxElements; //8
     HashFunc hasherFunc; // padded to 4
-    char padding1[44]; // padding to cacheline
+    LockContention * lockContention; //8 backoff settings and counters of contended bucket locks
+    bool optimisticReads; // READS_OPTIMISTIC with trivially copyable keys and values
+    char padding1[35]; // padding to cacheline
+
+    static const unsigned long long OPTIMISTIC_ATTEMPTS = 4; // lock free get tries before it takes the locks
+    static const unsigned long long OPTIMISTIC_MAX_BUCKETS = 4; // probe runs over more buckets than that take the locks
+
+    // element arrays of trivially copyable keys and values are realloc'd and memmoved, anything else is move constructed into
+    // a new array. With optimistic reads arrays are copied and the old one retired, a reader may still be in it.
+    // grow leaves gapPos unconstructed, shrink expects removedPos to be destroyed already
+    static const bool ELEMENTS_RELOCATABLE = std::is_trivially_copyable<K>::value && std::is_trivially_copyable<V>::value;
+    static inline void moveElement(std::pair<const K, V> * to, std::pair<const K, V> & from);
+    inline std::pair<const K, V> * growElements(std::pair<const K, V> * elements, unsigned long long count, unsigned long long gapPos);
+    inline std::pair<const K, V> * shrinkElements(std::pair<const K, V> * elements, unsigned long long count, unsigned long long removedPos);
+    inline void freeElements(std::pair<const K, V> * elements);
+    bool getOptimistic(const K & inKey, V & value, bool & found);
+
+    // constructor(std::pair<const K, V> *) placement constructs a new element, updater(std::pair<const K, V> &) changes the existing one,
+    // both with bucket range locked. Returns true if inserted
+    template<class Constructor, class Updater>
+    bool upsertInternal(const K & inKey, Constructor & constructor, Updater & updater);
+    template<class VV>
+    bool setInternal(const K & inKey, VV && inValue, bool locked);
+    template<class KK, class... Args>
+    bool tryEmplaceInternal(KK && inKey, Args&&... args);
 
 public:
-    LFSparseHashTableSimpleV2(unsigned long long inMaxElements = 1024, const HashFunc & inHasher = HashFunc());
+    // contended bucket locks spin with backoff, after inLockSpinBudget pauses waiters park on a futex. inReads is one of Reads
+    LFSparseHashTableSimpleV2(unsigned long long inMaxElements = 1024, const HashFunc & inHasher = HashFunc(),
+                              unsigned long long inLockSpinBudget = LockContention::NEVER_PARK, unsigned int inReads = READS_OPTIMISTIC);
     ~LFSparseHashTableSimpleV2();
     LFSparseHashTableSimpleV2(const LFSparseHashTableSimpleV2& other);
     LFSparseHashTableSimpleV2& operator= (const LFSparseHashTableSimpleV2& other);
@@ -121,13 +163,35 @@ public:
     // Example: if (get(false)) { ++value; set ( true ) } is equivalent to FETCH_ADD
     // Example: if (get(false) && (value==expected)) set ( true ); is equivalent to CAS
     bool insert(const K & inKey, const V & inValue);
+    bool insert(const K & inKey, V && inValue);
     bool insertOrSet(const K & inKey, const V & inValue);
+    bool insertOrSet(const K & inKey, V && inValue);
     bool get(const K & inKey, V & inValue, bool unlock = true); // NOTE: if called with unlock == false, it will try to get the element and leave it locked if found
     bool set(const K & inKey, const V & inValue, bool locked = false); // NOTE: if called with locked == true, it will not try to lock element but will unlock it after set
+    bool set(const K & inKey, V && inValue, bool locked = false);
     bool remove(const K & inKey);
+
+    // emplace builds the pair from args first and drops it if key is there already. try_emplace constructs the value from args
+    // in place only if key is missing, args are left alone otherwise. NOTE: both true if inserted
+    template<class... Args>
+    bool emplace(Args&&... args);
+    template<class... Args>
+    bool try_emplace(const K & inKey, Args&&... args);
+    template<class... Args>
+    bool try_emplace(K && inKey, Args&&... args);
     void unlockBuckets(unsigned long long startBucketIdx, unsigned long long endBucketIdx);
 
     void swap(LFSparseHashTableSimpleV2& other);
+
+    // contended bucket lock acquires since construction or resetLockStats, hotLock is the lock word of the most contended bucket
+    LockContention::Stats lockStats() const
+    {
+        return lockContention->stats();
+    }
+    void resetLockStats()
+    {
+        lockContention->reset();
+    }
 };
 
 template<typename K, typename V, class HashFunc>
@@ -155,17 +219,94 @@ void LFSparseHashTableSimpleV2<K, V, HashFunc>::unlockBuckets(unsigned long long
     }
 }
 
+// keys are moved too, pairs with const keys could only copy them
+template<typename K, typename V, class HashFunc>
+void LFSparseHashTableSimpleV2<K, V, HashFunc>::moveElement(std::pair<const K, V> * to, std::pair<const K, V> & from)
+{
+    new (to) std::pair<const K, V>(std::move((std::pair<K, V>&)from));
+}
+
+template<typename K, typename V, class HashFunc>
+std::pair<const K, V> * LFSparseHashTableSimpleV2<K, V, HashFunc>::growElements(std::pair<const K, V> * elements, unsigned long long count, unsigned long long gapPos)
+{
+    if (ELEMENTS_RELOCATABLE && !optimisticReads)
+    {
+        elements = (std::pair<const K, V> *) std::realloc((void *) elements, (count + 1) * sizeof(std::pair<const K, V>));
+        if (gapPos < count)
+            memmove((void *) (elements + gapPos + 1), (void *) (elements + gapPos), (count - gapPos) * sizeof(std::pair<const K, V>));
+        return elements;
+    }
+    std::pair<const K, V> * grownElements = (std::pair<const K, V> *) std::malloc((count + 1) * sizeof(std::pair<const K, V>));
+    if (ELEMENTS_RELOCATABLE)
+    {
+        memcpy((void *) grownElements, (void *) elements, gapPos * sizeof(std::pair<const K, V>));
+        memcpy((void *) (grownElements + gapPos + 1), (void *) (elements + gapPos), (count - gapPos) * sizeof(std::pair<const K, V>));
+    }
+    else
+    {
+        for (unsigned long long j = 0; j < count; ++j)
+        {
+            moveElement(&(grownElements[j < gapPos ? j : j + 1]), elements[j]);
+            elements[j].~pair();
+        }
+    }
+    freeElements(elements);
+    return grownElements;
+}
+
+template<typename K, typename V, class HashFunc>
+std::pair<const K, V> * LFSparseHashTableSimpleV2<K, V, HashFunc>::shrinkElements(std::pair<const K, V> * elements, unsigned long long count, unsigned long long removedPos)
+{
+    if (ELEMENTS_RELOCATABLE && !optimisticReads)
+    {
+        if (removedPos + 1 < count)
+            memmove((void *) (elements + removedPos), (void *) (elements + removedPos + 1), (count - removedPos - 1) * sizeof(std::pair<const K, V>));
+        return (std::pair<const K, V> *) std::realloc((void *) elements, (count - 1) * sizeof(std::pair<const K, V>));
+    }
+    std::pair<const K, V> * shrunkElements = (std::pair<const K, V> *) std::malloc((count - 1) * sizeof(std::pair<const K, V>));
+    if (ELEMENTS_RELOCATABLE)
+    {
+        memcpy((void *) shrunkElements, (void *) elements, removedPos * sizeof(std::pair<const K, V>));
+        memcpy((void *) (shrunkElements + removedPos), (void *) (elements + removedPos + 1), (count - removedPos - 1) * sizeof(std::pair<const K, V>));
+    }
+    else
+    {
+        for (unsigned long long j = 0; j < count; ++j)
+        {
+            if (j == removedPos)
+                continue;
+            moveElement(&(shrunkElements[j < removedPos ? j : j - 1]), elements[j]);
+            elements[j].~pair();
+        }
+    }
+    freeElements(elements);
+    return shrunkElements;
+}
+
+template<typename K, typename V, class HashFunc>
+void LFSparseHashTableSimpleV2<K, V, HashFunc>::freeElements(std::pair<const K, V> * elements)
+{
+    if (optimisticReads)
+        EpochReclaimer::shared().retire(elements, EpochReclaimer::freeDeleter);
+    else
+        std::free(elements);
+}
+
 template<typename K, typename V, class HashFunc>
 void LFSparseHashTableSimpleV2<K, V, HashFunc>::swap(LFSparseHashTableSimpleV2<K, V, HashFunc>& other)
 {
     std::swap(hasherFunc, other.hasherFunc);
     std::swap(buckets, other.buckets);
     std::swap(maxElements, other.maxElements);
+    std::swap(lockContention, other.lockContention);
+    std::swap(optimisticReads, other.optimisticReads);
 }
 
 template<typename K, typename V, class HashFunc>
-LFSparseHashTableSimpleV2<K, V, HashFunc>::LFSparseHashTableSimpleV2(unsigned long long inMaxElements, const HashFunc & inHasher) :
-    buckets(0), maxElements(inMaxElements), hasherFunc(inHasher)
+LFSparseHashTableSimpleV2<K, V, HashFunc>::LFSparseHashTableSimpleV2(unsigned long long inMaxElements, const HashFunc & inHasher,
+                                                                     unsigned long long inLockSpinBudget, unsigned int inReads) :
+    buckets(0), maxElements(inMaxElements), hasherFunc(inHasher), lockContention(new LockContention(inLockSpinBudget)),
+    optimisticReads(ELEMENTS_RELOCATABLE && inReads == READS_OPTIMISTIC)
 {
     buckets = (SparseBucket*)std::malloc((maxElements / SparseBucket::ELEMENTS_PER_BUCKET + 1) * sizeof(SparseBucket));
     memset(buckets, 0, (maxElements / SparseBucket::ELEMENTS_PER_BUCKET + 1) * sizeof(SparseBucket));
@@ -186,11 +327,13 @@ LFSparseHashTableSimpleV2<K, V, HashFunc>::~LFSparseHashTableSimpleV2()
         std::free(bucket->getElements());
     }
     std::free(buckets);
+    delete lockContention;
 }
 
 template<typename K, typename V, class HashFunc>
 LFSparseHashTableSimpleV2<K, V, HashFunc>::LFSparseHashTableSimpleV2(const LFSparseHashTableSimpleV2& other) :
-    buckets(0), maxElements(other.maxElements), hasherFunc(other.hasherFunc)
+    buckets(0), maxElements(other.maxElements), hasherFunc(other.hasherFunc), lockContention(new LockContention(other.lockContention->spinBudget())),
+    optimisticReads(other.optimisticReads)
 {
     buckets = (SparseBucket*)std::malloc((maxElements / SparseBucket::ELEMENTS_PER_BUCKET + 1) * sizeof(SparseBucket));
     memset(buckets, 0, (maxElements / SparseBucket::ELEMENTS_PER_BUCKET + 1) * sizeof(SparseBucket));
@@ -199,7 +342,13 @@ LFSparseHashTableSimpleV2<K, V, HashFunc>::LFSparseHashTableSimpleV2(const LFSpa
         buckets[bucketPos] = other.buckets[bucketPos];
         unsigned long long count = buckets[bucketPos].rankAtPos(SparseBucket::ELEMENTS_PER_BUCKET);
         buckets[bucketPos].setElements((std::pair<const K, V>*) std::malloc(count * sizeof(std::pair<const K, V>))); // all buckets are created unlocked
-        memcpy(buckets[bucketPos].getElements(), other.buckets[bucketPos].getElements(), count * sizeof(std::pair<const K, V>)); // other table buckets should be unlocked
+        if (ELEMENTS_RELOCATABLE)
+            memcpy((void *) buckets[bucketPos].getElements(), other.buckets[bucketPos].getElements(), count * sizeof(std::pair<const K, V>)); // other table buckets should be unlocked
+        else
+        {
+            for (unsigned long long j = 0; j < count; ++j)
+                new (&(buckets[bucketPos].getElements()[j])) std::pair<const K, V>(other.buckets[bucketPos].getElements()[j]);
+        }
     }
 }
 
@@ -216,22 +365,93 @@ LFSparseHashTableSimpleV2<K, V, HashFunc>& LFSparseHashTableSimpleV2<K, V, HashF
 
 template<typename K, typename V, class HashFunc>
 bool LFSparseHashTableSimpleV2<K, V, HashFunc>::insertOrSet(const K & inKey, const V & inValue)
+{
+    auto constructor = [&inKey, &inValue](std::pair<const K, V> * element) { new (element) std::pair<const K, V>(inKey, inValue); };
+    auto updater = [&inValue](std::pair<const K, V> & element) { element.second = inValue; };
+    return !upsertInternal(inKey, constructor, updater);
+}
+
+template<typename K, typename V, class HashFunc>
+bool LFSparseHashTableSimpleV2<K, V, HashFunc>::insertOrSet(const K & inKey, V && inValue)
+{
+    auto constructor = [&inKey, &inValue](std::pair<const K, V> * element) { new (element) std::pair<const K, V>(inKey, std::move(inValue)); };
+    auto updater = [&inValue](std::pair<const K, V> & element) { element.second = std::move(inValue); };
+    return !upsertInternal(inKey, constructor, updater);
+}
+
+template<typename K, typename V, class HashFunc>
+bool LFSparseHashTableSimpleV2<K, V, HashFunc>::insert(const K & inKey, const V & inValue)
+{
+    auto constructor = [&inKey, &inValue](std::pair<const K, V> * element) { new (element) std::pair<const K, V>(inKey, inValue); };
+    auto updater = [](std::pair<const K, V> &) {};
+    return upsertInternal(inKey, constructor, updater);
+}
+
+template<typename K, typename V, class HashFunc>
+bool LFSparseHashTableSimpleV2<K, V, HashFunc>::insert(const K & inKey, V && inValue)
+{
+    auto constructor = [&inKey, &inValue](std::pair<const K, V> * element) { new (element) std::pair<const K, V>(inKey, std::move(inValue)); };
+    auto updater = [](std::pair<const K, V> &) {};
+    return upsertInternal(inKey, constructor, updater);
+}
+
+template<typename K, typename V, class HashFunc>
+template<class... Args>
+bool LFSparseHashTableSimpleV2<K, V, HashFunc>::emplace(Args&&... args)
+{
+    std::pair<const K, V> newElement(std::forward<Args>(args)...);
+    auto constructor = [&newElement](std::pair<const K, V> * element) { moveElement(element, newElement); };
+    auto updater = [](std::pair<const K, V> &) {};
+    return upsertInternal(newElement.first, constructor, updater);
+}
+
+template<typename K, typename V, class HashFunc>
+template<class... Args>
+bool LFSparseHashTableSimpleV2<K, V, HashFunc>::try_emplace(const K & inKey, Args&&... args)
+{
+    return tryEmplaceInternal<const K &>(inKey, std::forward<Args>(args)...);
+}
+
+template<typename K, typename V, class HashFunc>
+template<class... Args>
+bool LFSparseHashTableSimpleV2<K, V, HashFunc>::try_emplace(K && inKey, Args&&... args)
+{
+    return tryEmplaceInternal<K>(std::move(inKey), std::forward<Args>(args)...);
+}
+
+// inKey is compared against before it is moved into the new element
+template<typename K, typename V, class HashFunc>
+template<class KK, class... Args>
+bool LFSparseHashTableSimpleV2<K, V, HashFunc>::tryEmplaceInternal(KK && inKey, Args&&... args)
+{
+    auto constructor = [&](std::pair<const K, V> * element)
+    {
+        new (element) std::pair<const K, V>(std::piecewise_construct, std::forward_as_tuple(std::forward<KK>(inKey)), std::forward_as_tuple(std::forward<Args>(args)...));
+    };
+    auto updater = [](std::pair<const K, V> &) {};
+    return upsertInternal(inKey, constructor, updater);
+}
+
+// returns true if inserted, false if updated
+template<typename K, typename V, class HashFunc>
+template<class Constructor, class Updater>
+bool LFSparseHashTableSimpleV2<K, V, HashFunc>::upsertInternal(const K & inKey, Constructor & constructor, Updater & updater)
 {
     unsigned long long idx = hasherFunc(inKey) % maxElements; // TODO: seed
     unsigned long long bucketPos = idx / SparseBucket::ELEMENTS_PER_BUCKET;
     unsigned long long startBucketIdx = bucketPos, endBucketIdx = bucketPos;
     unsigned long long bucketOffset = idx % SparseBucket::ELEMENTS_PER_BUCKET;
     SparseBucket * bucket = &(buckets[bucketPos]);
-    bucket->lockBucket();
+    bucket->lockBucket(lockContention);
     std::pair<const K, V> * bucketElements = bucket->getElements();
     if (bucketElements == nullptr)
     {
         bucket->setElements((std::pair<const K, V> *)std::malloc(sizeof(std::pair<const K, V>)));
         bucketElements = bucket->getElements();
-        new (&(bucketElements[0])) std::pair<const K, V>(inKey, inValue);
+        constructor(&(bucketElements[0]));
         bucket->bitmapSet(bucketOffset);
         unlockBuckets(startBucketIdx, endBucketIdx);
-        return false;
+        return true;
     }
     else
     {
@@ -244,9 +464,9 @@ bool LFSparseHashTableSimpleV2<K, V, HashFunc>::insertOrSet(const K & inKey, con
             {
                 if (bucketElements[rank - 1].first == inKey)
                 {
-                    bucketElements[rank - 1].second = inValue;
+                    updater(bucketElements[rank - 1]);
                     unlockBuckets(startBucketIdx, endBucketIdx);
-                    return true;
+                    return false;
                 }
                 else
                 {
@@ -261,7 +481,7 @@ bool LFSparseHashTableSimpleV2<K, V, HashFunc>::insertOrSet(const K & inKey, con
                         bucketOffset = idx % SparseBucket::ELEMENTS_PER_BUCKET;
                         bucket = &(buckets[bucketPos]);
                         if (bucketPos != startBucketIdx)
-                            bucket->lockBucket();
+                            bucket->lockBucket(lockContention);
                         endBucketIdx = bucketPos;
                         bucketElements = bucket->getElements();
                         if (bucketElements == nullptr)
@@ -269,10 +489,10 @@ bool LFSparseHashTableSimpleV2<K, V, HashFunc>::insertOrSet(const K & inKey, con
                             bucketElements = (std::pair<const K, V> *) std::malloc(sizeof(std::pair<const K, V>));
                             bucket->setElements(bucketElements);
                             bucketElements = bucket->getElements();
-                            new (&(bucketElements[0])) std::pair<const K, V>(inKey, inValue);
+                            constructor(&(bucketElements[0]));
                             bucket->bitmapSet(bucketOffset);
                             unlockBuckets(startBucketIdx, endBucketIdx);
-                            return false;
+                            return true;
                         }
                     }
                 }
@@ -282,30 +502,102 @@ bool LFSparseHashTableSimpleV2<K, V, HashFunc>::insertOrSet(const K & inKey, con
                 if (stepBack)
                     --rank;
                 unsigned long long count = bucket->rankAtPos(SparseBucket::ELEMENTS_PER_BUCKET);
-                bucketElements = (std::pair<const K, V> *) std::realloc(bucketElements, (count + 1) * sizeof(std::pair<const K, V>));
+                bucketElements = growElements(bucketElements, count, rank);
                 bucket->setElements(bucketElements);
                 bucketElements = bucket->getElements();
-                if (rank < count)
-                    memmove(bucketElements + rank + 1, bucketElements + rank, (count - rank) * sizeof(std::pair<const K, V>));
-                new (&(bucketElements[rank])) std::pair<const K, V>(inKey, inValue);
+                constructor(&(bucketElements[rank]));
                 bucket->bitmapSet(bucketOffset);
                 unlockBuckets(startBucketIdx, endBucketIdx);
+                return true;
+            }
+        }
+    }
+}
+
+// lock free lookup for READS_OPTIMISTIC. A bucket read unlocked is consistent on its own, elements are followed right away and every
+// probed bucket is validated once the value is copied out. false if no attempt got a consistent view
+template<typename K, typename V, class HashFunc>
+bool LFSparseHashTableSimpleV2<K, V, HashFunc>::getOptimistic(const K & inKey, V & value, bool & found)
+{
+    const unsigned long long numBuckets = maxElements / SparseBucket::ELEMENTS_PER_BUCKET + (maxElements % SparseBucket::ELEMENTS_PER_BUCKET ? 1ULL : 0ULL);
+    const unsigned long long startIdx = hasherFunc(inKey) % maxElements; // TODO: seed
+    SparseBucket * probedBuckets[OPTIMISTIC_MAX_BUCKETS];
+    unsigned long long probedVersions[OPTIMISTIC_MAX_BUCKETS];
+    alignas(V) char valueCopy[sizeof(V)] = {}; // only read when found, zeroed for -Wmaybe-uninitialized
+    EpochReclaimer::Guard reclaimGuard; // element arrays we follow are not freed meanwhile
+    for (unsigned long long attempt = 0; attempt < OPTIMISTIC_ATTEMPTS; ++attempt)
+    {
+        unsigned long long bucketPos = startIdx / SparseBucket::ELEMENTS_PER_BUCKET;
+        unsigned long long bucketOffset = startIdx % SparseBucket::ELEMENTS_PER_BUCKET;
+        unsigned long long numProbed = 0;
+        bool consistent = true;
+        found = false;
+        while (true)
+        {
+            if (numProbed == OPTIMISTIC_MAX_BUCKETS)
                 return false;
+            SparseBucket * bucket = &(buckets[bucketPos]);
+            probedBuckets[numProbed] = bucket;
+            probedVersions[numProbed++] = __atomic_load_n(&(bucket->version), __ATOMIC_ACQUIRE);
+            const unsigned long long bucketData = __atomic_load_n(&(bucket->data), __ATOMIC_ACQUIRE);
+            if (bucketData & 1ULL)
+            {
+                consistent = false;
+                break;
+            }
+            const std::pair<const K, V> * bucketElements = (const std::pair<const K, V> *) (bucketData & 0x0000FFFFFFFFFFFEULL);
+            const unsigned long long bitmap = bucketData >> (SparseBucket::POINTER_BITS + SparseBucket::LOCK_BITS);
+            // last bucket ends at maxElements, probing wraps to bucket 0 from there
+            const unsigned long long bucketEnd = (bucketPos + 1 == numBuckets && (maxElements % SparseBucket::ELEMENTS_PER_BUCKET)) ?
+                                                 maxElements % SparseBucket::ELEMENTS_PER_BUCKET : SparseBucket::ELEMENTS_PER_BUCKET;
+            unsigned long long run = __builtin_ctzll(~(bitmap >> bucketOffset)); // bitmap is 16 bits, there is always a zero above it
+            if (bucketOffset + run > bucketEnd)
+                run = bucketEnd - bucketOffset;
+            const unsigned long long rank = rank64(bitmap, bucketOffset);
+            for (unsigned long long j = 0; j < run; ++j)
+            {
+                if (bucketElements[rank + j].first == inKey)
+                {
+                    memcpy(valueCopy, (const void *) &(bucketElements[rank + j].second), sizeof(V));
+                    found = true;
+                    break;
+                }
             }
+            if (found || bucketOffset + run < bucketEnd)
+                break;
+            bucketPos = (bucketPos + 1ULL) % numBuckets;
+            bucketOffset = 0;
         }
+        for (unsigned long long probedIdx = 0; consistent && probedIdx < numProbed; ++probedIdx)
+            consistent = probedBuckets[probedIdx]->validate(probedVersions[probedIdx]);
+        if (!consistent)
+        {
+            _mm_pause();
+            continue;
+        }
+        if (found)
+            memcpy((void *) &value, valueCopy, sizeof(V));
+        return true;
     }
+    return false;
 }
 
 template<typename K, typename V, class HashFunc>
 bool LFSparseHashTableSimpleV2<K, V, HashFunc>::get(const K & inKey, V & value, bool unlock)
 {
+    if (unlock && optimisticReads)
+    {
+        bool found;
+        if (getOptimistic(inKey, value, found))
+            return found;
+    }
     unsigned long long idx = hasherFunc(inKey) % maxElements; // TODO: seed
     unsigned long long bucketPos = idx / SparseBucket::ELEMENTS_PER_BUCKET;
     unsigned long long bucketOffset = idx % SparseBucket::ELEMENTS_PER_BUCKET;
     unsigned long long lockRangeStart = bucketPos;
     unsigned long long lockRangeEnd = bucketPos;
     SparseBucket * bucket = &(buckets[bucketPos]);
-    bucket->lockBucket();
+    bucket->lockBucket(lockContention);
     std::pair<const K, V> * bucketElements = bucket->getElements();
     bucketElements = (std::pair<const K, V> *)(((unsigned long long)bucketElements) & 0xFFFFFFFFFFFFFFFEULL);
     unsigned long long rank = bucket->rankAtPos(bucketOffset + 1);
@@ -340,7 +632,7 @@ bool LFSparseHashTableSimpleV2<K, V, HashFunc>::get(const K & inKey, V & value,
                 bucketOffset = idx % SparseBucket::ELEMENTS_PER_BUCKET;
                 bucket = &(buckets[bucketPos]);
                 if (bucketPos != lockRangeStart)
-                    bucket->lockBucket();
+                    bucket->lockBucket(lockContention);
                 bucketElements = bucket->getElements();
             }
         }
@@ -367,7 +659,7 @@ bool LFSparseHashTableSimpleV2<K, V, HashFunc>::remove(const K & inKey)
     unsigned long long startBucketIdx = bucketPos, endBucketIdx = bucketPos;
     unsigned long long bucketOffset = idx % SparseBucket::ELEMENTS_PER_BUCKET;
     SparseBucket * bucket = &(buckets[bucketPos]);
-    bucket->lockBucket();
+    bucket->lockBucket(lockContention);
     std::pair<const K, V> * bucketElements = bucket->getElements();
     bool elementFound = false;
 
@@ -390,7 +682,7 @@ bool LFSparseHashTableSimpleV2<K, V, HashFunc>::remove(const K & inKey)
             bucketOffset = idx % SparseBucket::ELEMENTS_PER_BUCKET;
             bucket = &(buckets[bucketPos]);
             if (bucketPos != startBucketIdx)
-                bucket->lockBucket();
+                bucket->lockBucket(lockContention);
             endBucketIdx = bucketPos;
             bucketElements = bucket->getElements();
         }
@@ -400,10 +692,6 @@ bool LFSparseHashTableSimpleV2<K, V, HashFunc>::remove(const K & inKey)
         unlockBuckets(startBucketIdx, endBucketIdx);
         return false;
     }
-    else
-    {
-        bucketElements[rank - 1].~pair(); // destroy the deleted element
-    }
 
     // walk forward until next hole to see if any records need to be moved back
     unsigned long long deletedIdx = idx, originalDeletedIdx = deletedIdx;
@@ -416,7 +704,7 @@ bool LFSparseHashTableSimpleV2<K, V, HashFunc>::remove(const K & inKey)
         bucketOffset = idx % SparseBucket::ELEMENTS_PER_BUCKET;
         bucket = &(buckets[bucketPos]);
         if (bucketPos != startBucketIdx)
-            bucket->lockBucket();
+            bucket->lockBucket(lockContention);
         endBucketIdx = bucketPos;
         bucketElements = bucket->getElements();
     }
@@ -451,7 +739,7 @@ bool LFSparseHashTableSimpleV2<K, V, HashFunc>::remove(const K & inKey)
             bucketOffset = idx % SparseBucket::ELEMENTS_PER_BUCKET;
             bucket = &(buckets[bucketPos]);
             if (bucketPos != startBucketIdx)
-                bucket->lockBucket();
+                bucket->lockBucket(lockContention);
             endBucketIdx = bucketPos;
             bucketElements = bucket->getElements();
         }
@@ -463,19 +751,18 @@ bool LFSparseHashTableSimpleV2<K, V, HashFunc>::remove(const K & inKey)
     SparseBucket * deletedBucket = &(buckets[deletedBucketPos]);
     std::pair<const K, V>* deletedBucketElements = deletedBucket->getElements();;
     unsigned long long deletedCount = deletedBucket->rankAtPos(SparseBucket::ELEMENTS_PER_BUCKET);
+    unsigned long long deletedrank = deletedBucket->rankAtPos(deletedBucketOffset + 1);
+    deletedBucketElements[deletedrank - 1].~pair(); // destroy the deleted element, swaps carried it to the hole
 
     if (deletedCount == 1)
     {
-        std::free(deletedBucketElements);
+        freeElements(deletedBucketElements);
         deletedBucket->setElements(nullptr); // must be locked!
         deletedBucketElements = nullptr;
     }
     else
     {
-        unsigned long long deletedrank = deletedBucket->rankAtPos(deletedBucketOffset + 1);
-        if (deletedrank < deletedCount)
-            memmove(deletedBucketElements + deletedrank - 1, deletedBucketElements + deletedrank, (deletedCount - deletedrank) * sizeof(std::pair<const K, V>));
-        deletedBucketElements = (std::pair<const K, V> *) std::realloc(deletedBucketElements, (deletedCount - 1) * sizeof(std::pair<const K, V>));
+        deletedBucketElements = shrinkElements(deletedBucketElements, deletedCount, deletedrank - 1);
         deletedBucket->setElements(deletedBucketElements); ; // must be locked!
     }
     deletedBucket->bitmapClear(deletedBucketOffset);
@@ -484,87 +771,20 @@ bool LFSparseHashTableSimpleV2<K, V, HashFunc>::remove(const K & inKey)
 }
 
 template<typename K, typename V, class HashFunc>
-bool LFSparseHashTableSimpleV2<K, V, HashFunc>::insert(const K & inKey, const V & inValue)
+bool LFSparseHashTableSimpleV2<K, V, HashFunc>::set(const K & inKey, const V & inValue, bool locked)
 {
-    unsigned long long idx = hasherFunc(inKey) % maxElements; // TODO: seed
-    unsigned long long bucketPos = idx / SparseBucket::ELEMENTS_PER_BUCKET;
-    unsigned long long startBucketIdx = bucketPos, endBucketIdx = bucketPos;
-    unsigned long long bucketOffset = idx % SparseBucket::ELEMENTS_PER_BUCKET;
-    SparseBucket * bucket = &(buckets[bucketPos]);
-    bucket->lockBucket();
-    std::pair<const K, V> * bucketElements = bucket->getElements();
-    if (bucketElements == 0)
-    {
-        bucket->setElements((std::pair<const K, V> *) std::malloc(sizeof(std::pair<const K, V>)));
-        bucketElements = bucket->getElements();
-        new (&(bucketElements[0])) std::pair<const K, V>(inKey, inValue);
-        bucket->bitmapSet(bucketOffset);
-        unlockBuckets(startBucketIdx, endBucketIdx);
-        return true;
-    }
-    else
-    {
-        bool stepBack = false; // to avoid extra rank calculation later
-        unsigned long long rank = bucket->rankAtPos(bucketOffset + 1);
-        while (true) // linear probing
-        {
-            bool elementExists = bucket->bitmapTest(bucketOffset);
-            if (elementExists)
-            {
-                if (bucketElements[rank - 1].first == inKey)
-                {
-                    unlockBuckets(startBucketIdx, endBucketIdx);
-                    return false;
-                }
-                else
-                {
-                    stepBack = true;
-                    ++rank;
-                    ++bucketOffset;
-                    idx = (idx + 1) % maxElements;
-                    if (bucketOffset == SparseBucket::ELEMENTS_PER_BUCKET || !idx)
-                    {
-                        rank = 1;
-                        bucketPos = idx / SparseBucket::ELEMENTS_PER_BUCKET;
-                        bucketOffset = idx % SparseBucket::ELEMENTS_PER_BUCKET;
-                        bucket = &(buckets[bucketPos]);
-                        if (bucketPos != startBucketIdx)
-                            bucket->lockBucket();
-                        endBucketIdx = bucketPos;
-                        bucketElements = bucket->getElements();
-                        if (bucketElements == 0)
-                        {
-                            bucket->setElements((std::pair<const K, V> *)std::malloc(sizeof(std::pair<const K, V>)));
-                            bucketElements = bucket->getElements();
-                            new (&(bucketElements[0])) std::pair<const K, V>(inKey, inValue);
-                            bucket->bitmapSet(bucketOffset);
-                            unlockBuckets(startBucketIdx, endBucketIdx);
-                            return true;
-                        }
-                    }
-                }
-            }
-            else
-            {
-                if (stepBack)
-                    --rank;
-                unsigned long long count = bucket->rankAtPos(SparseBucket::ELEMENTS_PER_BUCKET);
-                bucketElements = (std::pair<const K, V> *) std::realloc(bucketElements, (count + 1) * sizeof(std::pair<const K, V>));
-                bucket->setElements(bucketElements); // must be locked!
-                bucketElements = bucket->getElements();
-                if (rank < count)
-                    memmove(bucketElements + rank + 1, bucketElements + rank, (count - rank) * sizeof(std::pair<const K, V>));
-                new (&(bucketElements[rank])) std::pair<const K, V>(inKey, inValue);
-                bucket->bitmapSet(bucketOffset);
-                unlockBuckets(startBucketIdx, endBucketIdx);
-                return true;
-            }
-        }
-    }
+    return setInternal(inKey, inValue, locked);
 }
 
 template<typename K, typename V, class HashFunc>
-bool LFSparseHashTableSimpleV2<K, V, HashFunc>::set(const K & inKey, const V & inValue, bool locked)
+bool LFSparseHashTableSimpleV2<K, V, HashFunc>::set(const K & inKey, V && inValue, bool locked)
+{
+    return setInternal(inKey, std::move(inValue), locked);
+}
+
+template<typename K, typename V, class HashFunc>
+template<class VV>
+bool LFSparseHashTableSimpleV2<K, V, HashFunc>::setInternal(const K & inKey, VV && inValue, bool locked)
 {
     unsigned long long idx = hasherFunc(inKey) % maxElements; // TODO: seed
     unsigned long long bucketPos = idx / SparseBucket::ELEMENTS_PER_BUCKET;
@@ -573,7 +793,7 @@ bool LFSparseHashTableSimpleV2<K, V, HashFunc>::set(const K & inKey, const V & i
     unsigned long long lockRangeEnd = bucketPos;
     SparseBucket * bucket = &(buckets[bucketPos]);
     if (!locked)
-        bucket->lockBucket();
+        bucket->lockBucket(lockContention);
     std::pair<const K, V> * bucketElements = bucket->getElements();
     unsigned long long rank = bucket->rankAtPos(bucketOffset + 1);
 
@@ -581,7 +801,7 @@ bool LFSparseHashTableSimpleV2<K, V, HashFunc>::set(const K & inKey, const V & i
     {
         if (bucketElements && bucketElements[rank - 1].first == inKey)
         {
-            bucketElements[rank - 1].second = inValue; // read value
+            bucketElements[rank - 1].second = std::forward<VV>(inValue); // write value
             if (lockRangeStart == lockRangeEnd) // unlock element
             {
                 bucket->unlockBucket();
@@ -605,7 +825,7 @@ bool LFSparseHashTableSimpleV2<K, V, HashFunc>::set(const K & inKey, const V & i
                 bucketOffset = idx % SparseBucket::ELEMENTS_PER_BUCKET;
                 bucket = &(buckets[bucketPos]);
                 if (!locked && (bucketPos != lockRangeStart))
-                    bucket->lockBucket();
+                    bucket->lockBucket(lockContention);
                 bucketElements = bucket->getElements();
             }
         }
@@ -8,15 +8,26 @@
 #ifndef LFSPARSEHASHTABLEUTIL_H_
 #define LFSPARSEHASHTABLEUTIL_H_
 
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <functional>
+#include <string>
 #include <vector>
-#include <boost/thread.hpp>
+#include <type_traits>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 #include "LFSparseHashTable.h"
+#include "WorkStealingPool.h"
 
 // TODO: change the code to work with fd's instead of filenames so it can work with both sockets and files, pack bucket info before data
 // TODO: redo *Raw methods into threaded implementation
 
-template<typename K, typename V, class HashFunc = std::hash<K> >
+template<typename K, typename V, class HashFunc = SeededHash<K> >
 class LFSparseHashTableUtil
 {
 public:
@@ -24,9 +35,94 @@ public:
     typedef typename LFHT::SparseBucket LFHTSB;
     typedef typename LFHT::SparseBucketElement LFHTSBE;
 
+    // snapshot file layout: header | hasher | SnapshotBucket per bucket | element arrays. Offsets are from the start of file,
+    // element arrays are SNAPSHOT_ALIGNMENT aligned, openSnapshot points buckets straight into the mapping and elements need their
+    // natural alignment there (16 covers keys and values up to __int128)
+    // delta file layout: header | DeltaRecord followed by its elements, for every bucket changed since the parent checkpoint.
+    // Records are in no particular order, each bucket shows up once
+    static const unsigned long long SNAPSHOT_VERSION = 2;
+    static const unsigned long long DELTA_VERSION = 1;
+    static const unsigned long long SNAPSHOT_ALIGNMENT = 16;
+    static const size_t SNAPSHOT_WRITE_BUFFER = 4*1024*1024;
+
+    struct SnapshotHeader
+    {
+        char magic[8]; // "LFSHTSNP"
+        unsigned long long version;
+        unsigned long long keySize;
+        unsigned long long valueSize;
+        unsigned long long hasherSize;
+        unsigned long long maxElements;
+        unsigned long long numElements;
+        double maxLoadFactor;
+        double minLoadFactor;
+        unsigned long long hasherOffset;
+        unsigned long long bucketsOffset;
+        unsigned long long elementsOffset;
+        unsigned long long fileSize;
+        unsigned long long checkpointId; // deltas taken after this snapshot chain to it
+    };
+
+    struct SnapshotBucket
+    {
+        unsigned long long elementBitmap;
+        unsigned long long elementsOffset;
+    };
+
+    struct DeltaHeader
+    {
+        char magic[8]; // "LFSHTDLT"
+        unsigned long long version;
+        unsigned long long keySize;
+        unsigned long long valueSize;
+        unsigned long long maxElements;
+        unsigned long long numRecords;
+        unsigned long long full; // every bucket is in, table might have been resized since parent
+        unsigned long long parentId; // snapshot or delta this one goes on top of
+        unsigned long long checkpointId;
+        unsigned long long fileSize;
+    };
+
+    struct DeltaRecord
+    {
+        unsigned long long bucketPos;
+        unsigned long long elementBitmap;
+    };
+
+    // save/load file layout: header | hasher | bitmap per bucket | SavedChunk per chunk | chunk data. Chunk data is (size_t size, item)
+    // records for SAVE_CHUNK_BUCKETS buckets in bucket and rank order. Chunks go to the file in the order they get done, each one
+    // SAVE_BLOCK_SIZE aligned and padded for O_DIRECT
+    static const unsigned long long SAVE_VERSION = 1;
+    static const unsigned long long SAVE_CHUNK_BUCKETS = 1024;
+    static const size_t SAVE_BLOCK_SIZE = 4096;
+
+    struct SaveHeader
+    {
+        char magic[8]; // "LFSHTSAV"
+        unsigned long long version;
+        unsigned long long hasherSize;
+        unsigned long long maxElements;
+        double maxLoadFactor;
+        double minLoadFactor;
+        unsigned long long numChunks;
+        unsigned long long chunkBuckets;
+        unsigned long long hasherOffset;
+        unsigned long long bitmapsOffset;
+        unsigned long long chunksOffset;
+        unsigned long long dataOffset;
+        unsigned long long fileSize;
+    };
+
+    struct SavedChunk
+    {
+        unsigned long long dataOffset;
+        unsigned long long dataSize; // without padding
+    };
+
     // ONLY FOR POD TYPES
     static void saveRaw(LFSparseHashTable<K, V, HashFunc> * pTable, const char * fileName)
     {
+        pTable->finishResize(); // only a single generation gets saved or replaced
         FILE * pFile = fopen(fileName, "wb+");
         fwrite(pTable, sizeof(LFHT), 1, pFile);
         fwrite(pTable->buckets, sizeof(LFHTSB), (pTable->maxElements / LFHT::HOLY_GRAIL_SIZE + (pTable->maxElements % LFHT::HOLY_GRAIL_SIZE ? 1ULL : 0ULL)), pFile);
@@ -34,7 +130,7 @@ public:
                         packBucketPos < pTable->maxElements / LFHT::HOLY_GRAIL_SIZE + (pTable->maxElements % LFHT::HOLY_GRAIL_SIZE ? 1ULL : 0ULL); ++packBucketPos)
         {
             LFHTSB * bucket = &(pTable->buckets[packBucketPos]);
-            unsigned long long count = googlerank((const unsigned char*) &(bucket->elementBitmap), LFHT::HOLY_GRAIL_SIZE);
+            unsigned long long count = rank64(bucket->elementBitmap, LFHT::HOLY_GRAIL_SIZE);
             LFHTSBE * bucketElements = bucket->elements;
             fwrite(bucketElements, sizeof(LFHTSBE), count, pFile);
         }
@@ -44,32 +140,36 @@ public:
     // ONLY FOR POD TYPES
     static void loadRaw(LFSparseHashTable<K, V, HashFunc> * pTable, const char * fileName)
     {
+        pTable->finishResize(); // only a single generation gets saved or replaced
         for(unsigned long long bucketPos = 0; bucketPos < pTable->maxElements / LFHT::HOLY_GRAIL_SIZE + (pTable->maxElements % LFHT::HOLY_GRAIL_SIZE ? 1ULL : 0ULL);
                         ++bucketPos)
         {
             LFHTSB * bucket = &(pTable->buckets[bucketPos]);
-            unsigned long long count = googlerank((const unsigned char*) &(bucket->elementBitmap), LFHT::HOLY_GRAIL_SIZE);
+            unsigned long long count = rank64(bucket->elementBitmap, LFHT::HOLY_GRAIL_SIZE);
             LFHTSBE * bucketElements = bucket->elements;
             for(unsigned long long j = 0; j < count; ++j)
             {
                 bucketElements[j].~SparseBucketElement();
             }
-            std::free(bucket->elements);
+            pTable->freeElements(bucket->elements);
         }
-        std::free(pTable->buckets);
+        HugePages::release(pTable->buckets);
+        pTable->releaseSnapshot();
 
         FILE * pFile = fopen(fileName, "rb");
         char metaBuffer[sizeof(LFHT)];
         fread(metaBuffer, sizeof(LFHT), 1, pFile);
         unsigned long long savedMaxElements = ((LFHT*) metaBuffer)->maxElements;
+        if(pTable->maxElements < savedMaxElements) // saved table might have grown past the one we load into
+            pTable->maxElements = savedMaxElements;
         if(pTable->maxElements == savedMaxElements)
         {
             pTable->maxLoadFactor = ((LFHT*) metaBuffer)->maxLoadFactor;
             pTable->minLoadFactor = ((LFHT*) metaBuffer)->minLoadFactor;
+            pTable->hasherFunc = ((LFHT*) metaBuffer)->hasherFunc; // bitmaps are loaded as is, so is the seed they were built with
 
-            pTable->buckets = (LFHTSB*) std::malloc(
-                            (pTable->maxElements / LFHT::HOLY_GRAIL_SIZE + (pTable->maxElements % LFHT::HOLY_GRAIL_SIZE ? 1ULL : 0ULL)) * sizeof(LFHTSB));
-            memset(pTable->buckets, 0, (pTable->maxElements / LFHT::HOLY_GRAIL_SIZE + (pTable->maxElements % LFHT::HOLY_GRAIL_SIZE ? 1ULL : 0ULL)) * sizeof(LFHTSB));
+            pTable->resetStorage();
+            pTable->buckets = pTable->allocBucketArray(pTable->maxElements / LFHT::HOLY_GRAIL_SIZE + (pTable->maxElements % LFHT::HOLY_GRAIL_SIZE ? 1ULL : 0ULL));
             fread(pTable->buckets, sizeof(LFHTSB), (pTable->maxElements / LFHT::HOLY_GRAIL_SIZE + (pTable->maxElements % LFHT::HOLY_GRAIL_SIZE ? 1ULL : 0ULL)),
                   pFile);
 
@@ -79,16 +179,15 @@ public:
             {
                 LFHTSB * bucket = &(pTable->buckets[packBucketPos]);
                 bucket->elementLocks = 0;
-                unsigned long long count = googlerank((const unsigned char*) &(bucket->elementBitmap), LFHT::HOLY_GRAIL_SIZE);
-                bucket->elements = (LFHTSBE *) std::malloc(count * sizeof(LFHTSBE));
+                unsigned long long count = rank64(bucket->elementBitmap, LFHT::HOLY_GRAIL_SIZE);
+                bucket->elements = pTable->allocElements(packBucketPos, count);
                 fread(bucket->elements, sizeof(LFHTSBE), count, pFile);
             }
         }
         else
         {
-            pTable->buckets = (LFHTSB*) std::malloc(
-                            (pTable->maxElements / LFHT::HOLY_GRAIL_SIZE + (pTable->maxElements % LFHT::HOLY_GRAIL_SIZE ? 1ULL : 0ULL)) * sizeof(LFHTSB));
-            memset(pTable->buckets, 0, (pTable->maxElements / LFHT::HOLY_GRAIL_SIZE + (pTable->maxElements % LFHT::HOLY_GRAIL_SIZE ? 1ULL : 0ULL)) * sizeof(LFHTSB));
+            pTable->resetStorage();
+            pTable->buckets = pTable->allocBucketArray(pTable->maxElements / LFHT::HOLY_GRAIL_SIZE + (pTable->maxElements % LFHT::HOLY_GRAIL_SIZE ? 1ULL : 0ULL));
 
             LFHTSB * pSavedBuckets = (LFHTSB*) std::malloc(
                             (savedMaxElements / LFHT::HOLY_GRAIL_SIZE + (savedMaxElements % LFHT::HOLY_GRAIL_SIZE ? 1ULL : 0ULL)) * sizeof(LFHTSB));
@@ -100,7 +199,7 @@ public:
             {
                 LFHTSB * savedbucket = &(pSavedBuckets[packBucketPos]);
                 savedbucket->elementLocks = 0;
-                unsigned long long count = googlerank((const unsigned char*) &(savedbucket->elementBitmap), LFHT::HOLY_GRAIL_SIZE);
+                unsigned long long count = rank64(savedbucket->elementBitmap, LFHT::HOLY_GRAIL_SIZE);
                 LFHTSBE * pSavedBucketElements = (LFHTSBE *) std::malloc(count * sizeof(LFHTSBE));
                 fread(pSavedBucketElements, sizeof(LFHTSBE), count, pFile);
 
@@ -108,19 +207,19 @@ public:
                 for(unsigned long long eidx = 0; eidx < count; ++eidx)
                 {
                     K inKey = pSavedBucketElements[eidx].key;
-                    unsigned long long idx = pTable->hasherFunc(inKey) % pTable->maxElements; // TODO: seed
+                    unsigned long long idx = reduceRange(applyHash(pTable->hasherFunc, inKey), pTable->maxElements);
                     unsigned long long bucketPos = idx / LFHT::HOLY_GRAIL_SIZE;
                     unsigned long long bucketOffset = idx % LFHT::HOLY_GRAIL_SIZE;
                     LFHTSB * bucket = &(pTable->buckets[bucketPos]);
                     __builtin_prefetch(bucket, 1, 3 /* _MM_HINT_T0 */);
                     if(bucket->elementBitmap == 0)
                     {
-                        bucket->bitmapSet(bucketOffset);
+                        bucket->bitmapSet(bucketOffset, LFHT::FINGERPRINT_UNKNOWN); // set for real below
                     }
                     else
                     {
                         bool stepBack = false; // to avoid extra rank calculation later
-                        unsigned long long rank = googlerank((const unsigned char*) &(bucket->elementBitmap), bucketOffset + 1);
+                        unsigned long long rank = rank64(bucket->elementBitmap, bucketOffset + 1);
                         while(true) // linear probing
                         {
                             bool elementExists = bucket->bitmapTest(bucketOffset);
@@ -129,7 +228,7 @@ public:
                                 stepBack = true;
                                 ++rank;
                                 ++bucketOffset;
-                                idx = (idx + 1) % pTable->maxElements;
+                                idx = nextProbeIdx(idx, pTable->maxElements);
                                 if(bucketOffset == LFHT::HOLY_GRAIL_SIZE)
                                 {
                                     rank = 1;
@@ -139,7 +238,7 @@ public:
                                     __builtin_prefetch(bucket, 1, 3 /* _MM_HINT_T0 */);
                                     if(bucket->elementBitmap == 0)
                                     {
-                                        bucket->bitmapSet(bucketOffset);
+                                        bucket->bitmapSet(bucketOffset, LFHT::FINGERPRINT_UNKNOWN); // set for real below
                                         break;
                                     }
                                 }
@@ -148,7 +247,7 @@ public:
                             {
                                 if(stepBack)
                                     --rank;
-                                bucket->bitmapSet(bucketOffset);
+                                bucket->bitmapSet(bucketOffset, LFHT::FINGERPRINT_UNKNOWN); // set for real below
                                 break;
                             }
                         }
@@ -162,8 +261,8 @@ public:
                             bucketPos < pTable->maxElements / LFHT::HOLY_GRAIL_SIZE + (pTable->maxElements % LFHT::HOLY_GRAIL_SIZE ? 1ULL : 0ULL); ++bucketPos)
             {
                 LFHTSB * bucket = &(pTable->buckets[bucketPos]);
-                unsigned long long count = googlerank((const unsigned char*) &(bucket->elementBitmap), LFHT::HOLY_GRAIL_SIZE);
-                bucket->elements = (LFHTSBE *) std::malloc(sizeof(LFHTSBE) * count);
+                unsigned long long count = rank64(bucket->elementBitmap, LFHT::HOLY_GRAIL_SIZE);
+                bucket->elements = pTable->allocElements(bucketPos, count);
                 bucket->elementLocks = 0ULL;
                 bucket->elementBitmap = 0ULL;
             }
@@ -180,7 +279,7 @@ public:
             {
                 LFHTSB * savedBucket = &(pSavedBuckets[packBucketPos]);
                 savedBucket->elementLocks = 0;
-                unsigned long long savedcount = googlerank((const unsigned char*) &(savedBucket->elementBitmap), LFHT::HOLY_GRAIL_SIZE);
+                unsigned long long savedcount = rank64(savedBucket->elementBitmap, LFHT::HOLY_GRAIL_SIZE);
                 LFHTSBE * pSavedBucketElements = (LFHTSBE *) std::malloc(savedcount * sizeof(LFHTSBE));
                 fread(pSavedBucketElements, sizeof(LFHTSBE), savedcount, pFile);
 
@@ -189,7 +288,8 @@ public:
                 {
                     K inKey = pSavedBucketElements[sidx].key;
                     V inValue = pSavedBucketElements[sidx].value;
-                    unsigned long long idx = pTable->hasherFunc(inKey) % pTable->maxElements;
+                    const unsigned long long inHash = applyHash(pTable->hasherFunc, inKey);
+                    unsigned long long idx = reduceRange(inHash, pTable->maxElements);
                     unsigned long long bucketPos = idx / LFHT::HOLY_GRAIL_SIZE;
                     unsigned long long bucketOffset = idx % LFHT::HOLY_GRAIL_SIZE;
                     LFHTSB * bucket = &(pTable->buckets[bucketPos]);
@@ -200,13 +300,13 @@ public:
                         bucketElements = bucket->elements;
                         new (&(bucketElements[0].key)) K(std::move(inKey));
                         new (&(bucketElements[0].value)) V(std::move(inValue));
-                        bucket->bitmapSet(bucketOffset);
+                        bucket->bitmapSet(bucketOffset, LFHT::fingerprintOf(inHash));
                         continue;
                     }
                     else
                     {
                         bool stepBack = false; // to avoid extra rank calculation later
-                        unsigned long long rank = googlerank((const unsigned char*) &(bucket->elementBitmap), bucketOffset + 1);
+                        unsigned long long rank = rank64(bucket->elementBitmap, bucketOffset + 1);
                         while(true) // linear probing
                         {
                             bool elementExists = bucket->bitmapTest(bucketOffset);
@@ -215,7 +315,7 @@ public:
                                 stepBack = true;
                                 ++rank;
                                 ++bucketOffset;
-                                idx = (idx + 1) % pTable->maxElements;
+                                idx = nextProbeIdx(idx, pTable->maxElements);
                                 if(bucketOffset == LFHT::HOLY_GRAIL_SIZE)
                                 {
                                     rank = 1;
@@ -228,7 +328,7 @@ public:
                                     {
                                         new (&(bucketElements[0].key)) K(std::move(inKey));
                                         new (&(bucketElements[0].value)) V(std::move(inValue));
-                                        bucket->bitmapSet(bucketOffset);
+                                        bucket->bitmapSet(bucketOffset, LFHT::fingerprintOf(inHash));
                                         break;
                                     }
                                 }
@@ -237,12 +337,12 @@ public:
                             {
                                 if(stepBack)
                                     --rank;
-                                unsigned long long count = googlerank((const unsigned char*) &(bucket->elementBitmap), LFHT::HOLY_GRAIL_SIZE);
+                                unsigned long long count = rank64(bucket->elementBitmap, LFHT::HOLY_GRAIL_SIZE);
                                 if(rank < count)
                                     memmove(bucketElements + rank + 1, bucketElements + rank, (count - rank) * sizeof(LFHTSBE));
                                 new (&(bucketElements[rank].key)) K(std::move(inKey));
                                 new (&(bucketElements[rank].value)) V(std::move(inValue));
-                                bucket->bitmapSet(bucketOffset);
+                                bucket->bitmapSet(bucketOffset, LFHT::fingerprintOf(inHash));
                                 break;
                             }
                         }
@@ -253,417 +353,715 @@ public:
             std::free(pSavedBuckets);
         }
         fclose(pFile);
+        pTable->recountElements();
+        pTable->resetDirty(true);
+        pTable->checkpointId = 0;
     }
 
-    static void save(LFSparseHashTable<K, V, HashFunc> * pTable, const char * fileName, std::function<void(LFHTSBE&, char*)> itemSaveFunc, std::function<size_t(LFHTSBE&)> itemSizeFunc)
+    // Saves any K and V through itemSizeFunc/itemSaveFunc into a single file (fileName.tmp, renamed over fileName once complete).
+    // Chunks of SAVE_CHUNK_BUCKETS buckets are serialized and written by WorkStealingPool::shared() workers, each bucket is locked
+    // while its items are serialized. Workers run under guard of the calling thread, table does not grow until the save is done.
+    // False on I/O errors
+    static bool save(LFSparseHashTable<K, V, HashFunc> * pTable, const char * fileName, std::function<void(LFHTSBE&, char*)> itemSaveFunc, std::function<size_t(LFHTSBE&)> itemSizeFunc)
     {
-        FILE * pFile = fopen(fileName, "wb+");
-        fwrite(pTable, sizeof(LFHT), 1, pFile);
-        fwrite(pTable->buckets, sizeof(LFHTSB), (pTable->maxElements / LFHT::HOLY_GRAIL_SIZE + (pTable->maxElements % LFHT::HOLY_GRAIL_SIZE ? 1ULL : 0ULL)), pFile);
-        std::vector<char> buffer;
-        size_t numBuckets = pTable->maxElements / LFHT::HOLY_GRAIL_SIZE + (pTable->maxElements % LFHT::HOLY_GRAIL_SIZE ? 1ULL : 0ULL);
-        size_t numStreams = boost::thread::hardware_concurrency();
-        size_t bucketsPerStream = numBuckets / numStreams + 1;
-        std::vector<std::shared_ptr<boost::thread> > savers(numStreams);
-        std::string itemDataFileNames;
-        for (size_t idxStream = 0; idxStream < numStreams; ++idxStream)
-        {
-            static const size_t MAX_PATH = 1024;
-            char fileNameBuf[MAX_PATH];
-            snprintf(fileNameBuf,MAX_PATH, "%s.data.%lu.%lu", fileName, idxStream*bucketsPerStream, bucketsPerStream*(idxStream+1) > numBuckets ? numBuckets : bucketsPerStream*(idxStream+1));
-            itemDataFileNames += fileNameBuf;
-            if (idxStream != numStreams - 1)
-                itemDataFileNames += std::string(";");
-            savers[idxStream].reset(new boost::thread(saveThreadProc, pTable, std::string(fileNameBuf), idxStream*bucketsPerStream, bucketsPerStream*(idxStream+1) > numBuckets ? numBuckets : bucketsPerStream*(idxStream+1), itemSaveFunc, itemSizeFunc));
-        }
-        fwrite(itemDataFileNames.c_str(), itemDataFileNames.size(), 1, pFile);
-        fclose(pFile);
-        for (size_t idxStream = 0; idxStream < numStreams; ++idxStream)
+        // only a single generation gets saved, guard keeps it in place until all chunks are written
+        typename LFHT::OperationGuard guard(pTable);
+        if(guard.migrating())
+            pTable->migrateAll();
+        const unsigned long long numBuckets = pTable->maxElements / LFHT::HOLY_GRAIL_SIZE;
+        SaveHeader header;
+        memset(&header, 0, sizeof(header));
+        memcpy(header.magic, "LFSHTSAV", sizeof(header.magic));
+        header.version = SAVE_VERSION;
+        header.hasherSize = sizeof(HashFunc);
+        header.maxElements = pTable->maxElements;
+        header.maxLoadFactor = pTable->maxLoadFactor;
+        header.minLoadFactor = pTable->minLoadFactor;
+        header.numChunks = (numBuckets + SAVE_CHUNK_BUCKETS - 1) / SAVE_CHUNK_BUCKETS;
+        header.chunkBuckets = SAVE_CHUNK_BUCKETS;
+        header.hasherOffset = sizeof(SaveHeader);
+        header.bitmapsOffset = snapshotAlign(header.hasherOffset + header.hasherSize);
+        header.chunksOffset = header.bitmapsOffset + numBuckets * sizeof(unsigned long long);
+        header.dataOffset = ioAlign(header.chunksOffset + header.numChunks * sizeof(SavedChunk));
+
+        std::string tmpFileName = std::string(fileName) + ".tmp";
+        int fd = openDirect(tmpFileName.c_str(), O_WRONLY | O_CREAT | O_TRUNC);
+        if(fd < 0)
+            return false;
+        // everything in front of chunk data is filled in while chunks are written and goes last
+        IOBuffer meta;
+        memset(meta.grow(header.dataOffset), 0, header.dataOffset);
+        unsigned long long * bitmaps = (unsigned long long *) (meta.data + header.bitmapsOffset);
+        SavedChunk * chunks = (SavedChunk *) (meta.data + header.chunksOffset);
+        std::atomic<unsigned long long> nextDataOffset(header.dataOffset);
+        std::atomic<bool> ok(true);
+        WorkStealingPool & pool = WorkStealingPool::shared();
+        std::vector<IOBuffer> buffers(pool.size());
+        pool.run(header.numChunks, [&](size_t workerIdx, size_t chunkIdx)
         {
-            savers[idxStream]->join();
-        }
+            IOBuffer & buffer = buffers[workerIdx];
+            buffer.size = 0;
+            const unsigned long long endBucketPos = std::min((chunkIdx + 1) * SAVE_CHUNK_BUCKETS, numBuckets);
+            for(unsigned long long bucketPos = chunkIdx * SAVE_CHUNK_BUCKETS; bucketPos < endBucketPos; ++bucketPos)
+            {
+                LFHTSB * bucket = &(pTable->buckets[bucketPos]);
+                bucket->lockBucket(pTable->lockContention);
+                bitmaps[bucketPos] = bucket->elementBitmap;
+                unsigned long long count = rank64(bucket->elementBitmap, LFHT::HOLY_GRAIL_SIZE);
+                LFHTSBE * bucketElements = bucket->elements;
+                for(unsigned long long itemIdx = 0; itemIdx < count; ++itemIdx)
+                {
+                    size_t itemSize = itemSizeFunc(bucketElements[itemIdx]);
+                    char * record = buffer.grow(sizeof(size_t) + itemSize);
+                    memcpy(record, &itemSize, sizeof(size_t));
+                    itemSaveFunc(bucketElements[itemIdx], record + sizeof(size_t));
+                }
+                bucket->unlockBucket();
+            }
+            chunks[chunkIdx].dataSize = buffer.size;
+            buffer.pad();
+            chunks[chunkIdx].dataOffset = nextDataOffset.fetch_add(buffer.size, std::memory_order_relaxed);
+            if(buffer.size && !pwriteAll(fd, buffer.data, buffer.size, chunks[chunkIdx].dataOffset))
+                ok.store(false, std::memory_order_relaxed);
+        });
+        header.fileSize = nextDataOffset.load(std::memory_order_relaxed);
+        memcpy(meta.data, &header, sizeof(header));
+        memcpy(meta.data + header.hasherOffset, (const void *) &(pTable->hasherFunc), sizeof(HashFunc));
+        bool res = ok.load() && fsync(fd) == 0 && pwriteAll(fd, meta.data, meta.size, 0) && fsync(fd) == 0;
+        res = (close(fd) == 0) && res;
+        if(res)
+            res = rename(tmpFileName.c_str(), fileName) == 0;
+        else
+            unlink(tmpFileName.c_str());
+        return res;
     }
 
-    static void load(LFSparseHashTable<K, V, HashFunc> * pTable, const char * fileName, std::function<void(LFHTSBE&, char*)> itemLoadFunc)
+    // Loads file written by save. Table that is not bigger than the saved one takes its size, seed and bitmaps and gets items put
+    // straight into their slots, bigger table gets them inserted. Chunks are read (with O_DIRECT where file system can do it) and
+    // parsed by WorkStealingPool::shared() workers. Table must not be used by other threads meanwhile. False if file is missing or
+    // corrupt, table is left empty then
+    static bool load(LFSparseHashTable<K, V, HashFunc> * pTable, const char * fileName, std::function<void(LFHTSBE&, char*)> itemLoadFunc)
     {
-        for(unsigned long long bucketPos = 0; bucketPos < pTable->maxElements / LFHT::HOLY_GRAIL_SIZE + (pTable->maxElements % LFHT::HOLY_GRAIL_SIZE ? 1ULL : 0ULL);
-                        ++bucketPos)
+        int fd = openDirect(fileName, O_RDONLY);
+        if(fd < 0)
+            return false;
+        struct stat fileStat;
+        IOBuffer meta;
+        SaveHeader header;
+        bool ok = fstat(fd, &fileStat) == 0 && (unsigned long long) fileStat.st_size >= SAVE_BLOCK_SIZE
+                        && preadAll(fd, meta.grow(SAVE_BLOCK_SIZE), SAVE_BLOCK_SIZE, 0);
+        if(ok)
         {
-            LFHTSB * bucket = &(pTable->buckets[bucketPos]);
-            unsigned long long count = googlerank((const unsigned char*) &(bucket->elementBitmap), LFHT::HOLY_GRAIL_SIZE);
-            LFHTSBE * bucketElements = bucket->elements;
-            for(unsigned long long j = 0; j < count; ++j)
-            {
-                bucketElements[j].~SparseBucketElement();
-            }
-            std::free(bucket->elements);
+            memcpy(&header, meta.data, sizeof(header));
+            const unsigned long long numBuckets = header.maxElements / LFHT::HOLY_GRAIL_SIZE;
+            ok = !memcmp(header.magic, "LFSHTSAV", sizeof(header.magic)) && header.version == SAVE_VERSION && header.hasherSize == sizeof(HashFunc)
+                            && numBuckets && !(header.maxElements % LFHT::HOLY_GRAIL_SIZE) && header.chunkBuckets
+                            && header.numChunks == (numBuckets + header.chunkBuckets - 1) / header.chunkBuckets
+                            && header.hasherOffset + header.hasherSize <= header.bitmapsOffset
+                            && header.bitmapsOffset + numBuckets * sizeof(unsigned long long) <= header.chunksOffset
+                            && header.chunksOffset + header.numChunks * sizeof(SavedChunk) <= header.dataOffset && !(header.dataOffset % SAVE_BLOCK_SIZE)
+                            && header.dataOffset <= header.fileSize && header.fileSize == (unsigned long long) fileStat.st_size;
         }
-        std::free(pTable->buckets);
-
-        FILE * pFile = fopen(fileName, "rb");
-        char metaBuffer[sizeof(LFHT)];
-        fread(metaBuffer, sizeof(LFHT), 1, pFile);
-        unsigned long long savedMaxElements = ((LFHT*) metaBuffer)->maxElements;
-        if(pTable->maxElements != savedMaxElements)
-        {
-            pTable->buckets = (LFHTSB*) std::malloc(
-                            (pTable->maxElements / LFHT::HOLY_GRAIL_SIZE + (pTable->maxElements % LFHT::HOLY_GRAIL_SIZE ? 1ULL : 0ULL)) * sizeof(LFHTSB));
-            memset(pTable->buckets, 0, (pTable->maxElements / LFHT::HOLY_GRAIL_SIZE + (pTable->maxElements % LFHT::HOLY_GRAIL_SIZE ? 1ULL : 0ULL)) * sizeof(LFHTSB));
-
-            // Seek past saved buckets
-            fseek(pFile, sizeof(LFHTSB)*(savedMaxElements / LFHT::HOLY_GRAIL_SIZE + (savedMaxElements % LFHT::HOLY_GRAIL_SIZE ? 1ULL : 0ULL)), SEEK_CUR);
-            static const size_t MAX_FILENAMES_LEN = 32768;
-            char fileNamesBuf[MAX_FILENAMES_LEN];
-            std::vector<std::string> fileNames;
-            fileNamesBuf[fread(fileNamesBuf, 1, MAX_FILENAMES_LEN, pFile)] = 0;
-            char* pch = strtok(fileNamesBuf,";");
-            while (pch != NULL)
-            {
-              fileNames.push_back(pch);
-              pch = strtok (NULL, ";");
-            }
-            fclose(pFile);
-            std::vector<std::shared_ptr<boost::thread> > loaders(fileNames.size());
-            for (size_t idxStream = 0; idxStream < fileNames.size(); ++idxStream)
-            {
-                loaders[idxStream].reset(new boost::thread(loadThreadProc, pTable, fileNames[idxStream], itemLoadFunc));
-            }
-            for (size_t idxStream = 0; idxStream < loaders.size(); ++idxStream)
-            {
-                loaders[idxStream]->join();
-            }
+        if(ok)
+        {
+            meta.size = 0;
+            ok = preadAll(fd, meta.grow(header.dataOffset), header.dataOffset, 0);
         }
-        else 
+        const unsigned long long * bitmaps = (const unsigned long long *) (meta.data + header.bitmapsOffset);
+        const SavedChunk * chunks = (const SavedChunk *) (meta.data + header.chunksOffset);
+        for(unsigned long long chunkIdx = 0; ok && chunkIdx < header.numChunks; ++chunkIdx)
+            ok = !(chunks[chunkIdx].dataOffset % SAVE_BLOCK_SIZE) && chunks[chunkIdx].dataOffset >= header.dataOffset
+                            && chunks[chunkIdx].dataOffset + ioAlign(chunks[chunkIdx].dataSize) <= header.fileSize;
+        if(!ok)
         {
-            pTable->buckets = (LFHTSB*) std::malloc(
-                            (pTable->maxElements / LFHT::HOLY_GRAIL_SIZE + (pTable->maxElements % LFHT::HOLY_GRAIL_SIZE ? 1ULL : 0ULL)) * sizeof(LFHTSB));
-            fread(pTable->buckets, sizeof(LFHTSB), (pTable->maxElements / LFHT::HOLY_GRAIL_SIZE + (pTable->maxElements % LFHT::HOLY_GRAIL_SIZE ? 1ULL : 0ULL)), pFile);
-            std::vector<unsigned char> freeSlots;
-            // by now we have all bits set in all pTable->buckets as if we had loaded the pTable->
-            // alloc memory according to bucket counts and process file again to "insert allocated" all elements
-            for(unsigned long long bucketPos = 0;
-                            bucketPos < pTable->maxElements / LFHT::HOLY_GRAIL_SIZE + (pTable->maxElements % LFHT::HOLY_GRAIL_SIZE ? 1ULL : 0ULL); ++bucketPos)
-            {
-                LFHTSB * bucket = &(pTable->buckets[bucketPos]);
-                unsigned long long count = googlerank((const unsigned char*) &(bucket->elementBitmap), LFHT::HOLY_GRAIL_SIZE);
-                bucket->elements = (LFHTSBE *) std::malloc(sizeof(LFHTSBE) * count);
-                freeSlots.push_back(count);
-                bucket->elementLocks = 0ULL;
-                bucket->elementBitmap = 0ULL;
-            }
+            close(fd);
+            return false;
+        }
 
-            static const size_t MAX_FILENAMES_LEN = 32768;
-            char fileNamesBuf[MAX_FILENAMES_LEN];
-            std::vector<std::string> fileNames;
-            fileNamesBuf[fread(fileNamesBuf, 1, MAX_FILENAMES_LEN, pFile)] = 0;
-            char* pch = strtok(fileNamesBuf,";");
-            while (pch != NULL)
-            {
-              fileNames.push_back(pch);
-              pch = strtok (NULL, ";");
-            }
-            fclose(pFile);
+        destroyBuckets(pTable);
+        const bool sameSize = pTable->maxElements <= header.maxElements; // saved table might have grown past the one we load into
+        if(sameSize)
+        {
+            pTable->maxElements = header.maxElements;
+            memcpy((void *) &(pTable->hasherFunc), meta.data + header.hasherOffset, sizeof(HashFunc)); // bitmaps were built with saved seed
+        }
+        allocBuckets(pTable);
+        pTable->recountElements();
 
-            std::vector<std::shared_ptr<boost::thread> > loaders(fileNames.size());
-            std::vector<std::vector< LFHTSBE > > misfits(loaders.size());
-            for (size_t idxStream = 0; idxStream < fileNames.size(); ++idxStream)
+        const unsigned long long numBuckets = header.maxElements / LFHT::HOLY_GRAIL_SIZE;
+        std::atomic<bool> chunksOk(true);
+        WorkStealingPool & pool = WorkStealingPool::shared();
+        std::vector<IOBuffer> buffers(pool.size());
+        pool.run(header.numChunks, [&](size_t workerIdx, size_t chunkIdx)
+        {
+            if(!chunksOk.load(std::memory_order_relaxed))
+                return;
+            IOBuffer & buffer = buffers[workerIdx];
+            buffer.size = 0;
+            const unsigned long long dataSize = chunks[chunkIdx].dataSize;
+            if(dataSize && !preadAll(fd, buffer.grow(ioAlign(dataSize)), ioAlign(dataSize), chunks[chunkIdx].dataOffset))
             {
-                loaders[idxStream].reset(new boost::thread(loadThreadProcComplex, pTable, fileNames[idxStream], itemLoadFunc, &(misfits[idxStream]), &freeSlots));
+                chunksOk.store(false, std::memory_order_relaxed);
+                return;
             }
-            for (size_t idxStream = 0; idxStream < loaders.size(); ++idxStream)
+            unsigned long long readIdx = 0;
+            const unsigned long long endBucketPos = std::min((chunkIdx + 1) * header.chunkBuckets, numBuckets);
+            for(unsigned long long bucketPos = chunkIdx * header.chunkBuckets; bucketPos < endBucketPos; ++bucketPos)
             {
-                loaders[idxStream]->join();
-            }
-            for(unsigned long long bucketPos = 0;
-                            bucketPos < pTable->maxElements / LFHT::HOLY_GRAIL_SIZE + (pTable->maxElements % LFHT::HOLY_GRAIL_SIZE ? 1ULL : 0ULL); ++bucketPos)
-            {
-                if (freeSlots[bucketPos])
+                const unsigned long long count = rank64(bitmaps[bucketPos], LFHT::HOLY_GRAIL_SIZE);
+                LFHTSB * bucket = &(pTable->buckets[bucketPos]);
+                LFHTSBE * bucketElements = 0;
+                if(sameSize && count)
+                    bucketElements = bucket->elements = pTable->allocElements(bucketPos, count);
+                for(unsigned long long rank = 0; rank < count; ++rank)
                 {
-                    LFHTSB * bucket = &(pTable->buckets[bucketPos]);
-                    unsigned long long count = googlerank((const unsigned char*) &(bucket->elementBitmap), LFHT::HOLY_GRAIL_SIZE);
-                    bucket->elements = (LFHTSBE *) std::realloc(bucket->elements, count * sizeof(LFHTSBE));
+                    size_t itemSize;
+                    if(readIdx + sizeof(size_t) > dataSize || (memcpy(&itemSize, buffer.data + readIdx, sizeof(size_t)), itemSize > dataSize - readIdx - sizeof(size_t)))
+                    {
+                        for(unsigned long long constructed = 0; constructed < rank && sameSize; ++constructed)
+                            bucketElements[constructed].~SparseBucketElement();
+                        chunksOk.store(false, std::memory_order_relaxed);
+                        return;
+                    }
+                    LFHTSBE nextItem;
+                    itemLoadFunc(nextItem, buffer.data + readIdx + sizeof(size_t));
+                    readIdx += sizeof(size_t) + itemSize;
+                    if(sameSize) // same layout, item goes to the slot it was saved from
+                    {
+                        new (&(bucketElements[rank].key)) K(nextItem.key);
+                        new (&(bucketElements[rank].value)) V(nextItem.value);
+                    }
+                    else
+                    {
+                        K inKey = nextItem.key;
+                        V inValue = nextItem.value;
+                        pTable->insert(inKey, inValue);
+                    }
                 }
-            }
-            for (size_t idxStream = 0; idxStream < loaders.size(); ++idxStream)
-            {
-                for(unsigned long long misfitPos = 0; misfitPos < misfits[idxStream].size(); ++ misfitPos)
+                if(sameSize)
                 {
-                    pTable->insert(misfits[idxStream][misfitPos].key, misfits[idxStream][misfitPos].value);
+                    bucket->elementBitmap = bitmaps[bucketPos]; // only complete buckets count
+                    pTable->fingerprintBucket(bucket);
                 }
             }
+            if(readIdx != dataSize)
+                chunksOk.store(false, std::memory_order_relaxed);
+        });
+        close(fd);
+        if(!chunksOk.load())
+        {
+            destroyBuckets(pTable);
+            allocBuckets(pTable);
         }
+        pTable->recountElements();
+        pTable->resetDirty(true);
+        pTable->checkpointId = 0;
+        return chunksOk.load();
     }
-private:
-    static void saveThreadProc(LFSparseHashTable<K, V, HashFunc> * pTable, std::string fileName, size_t startIdx, size_t endIdx, std::function<void(LFHTSBE&, char*)> itemSaveFunc, std::function<size_t(LFHTSBE&)> itemSizeFunc)
+
+    // ONLY FOR POD TYPES. Writes fileName.tmp and renames it over fileName, so a snapshot currently mapped by a table can be replaced.
+    // Saves the table as it was when the checkpoint started, writers keep going meanwhile (see writeCheckpoint). Snapshot becomes
+    // the base deltas are taken against. One checkpoint at a time per table
+    static bool saveSnapshot(LFSparseHashTable<K, V, HashFunc> * pTable, const char * fileName)
     {
-        FILE * pFile = fopen(fileName.c_str(), "wb+");
-        for(unsigned long long packBucketPos = startIdx; packBucketPos < endIdx; ++packBucketPos)
+        static_assert(std::is_trivially_copyable<K>::value && std::is_trivially_copyable<V>::value, "snapshots are for POD keys and values");
+        std::string tmpFileName = std::string(fileName) + ".tmp";
+        int fd = open(tmpFileName.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if(fd < 0)
+            return false;
+        bool full;
+        beginCheckpoint(pTable, true, full); // table size is fixed from here on until writeCheckpoint is done
+        const unsigned long long numBuckets = pTable->maxElements / LFHT::HOLY_GRAIL_SIZE;
+        SnapshotHeader header;
+        memset(&header, 0, sizeof(header));
+        memcpy(header.magic, "LFSHTSNP", sizeof(header.magic));
+        header.version = SNAPSHOT_VERSION;
+        header.keySize = sizeof(K);
+        header.valueSize = sizeof(V);
+        header.hasherSize = sizeof(HashFunc);
+        header.maxElements = pTable->maxElements;
+        header.maxLoadFactor = pTable->maxLoadFactor;
+        header.minLoadFactor = pTable->minLoadFactor;
+        header.hasherOffset = sizeof(SnapshotHeader);
+        header.bucketsOffset = snapshotAlign(header.hasherOffset + header.hasherSize);
+        header.elementsOffset = snapshotAlign(header.bucketsOffset + numBuckets * sizeof(SnapshotBucket));
+        header.checkpointId = randomSeed() | 1ULL; // 0 is "no checkpoint"
+
+        // bucket entries and element arrays go through their own buffers, both flushed with pwrite at their running offsets.
+        // Buckets taken over by writers come out of order, entries are left empty for them and written in place later
+        std::vector<SnapshotBucket> bucketBuffer;
+        bucketBuffer.reserve(SNAPSHOT_WRITE_BUFFER / sizeof(SnapshotBucket));
+        unsigned long long bucketsWritten = 0;
+        std::vector<char> elementBuffer;
+        elementBuffer.reserve(SNAPSHOT_WRITE_BUFFER);
+        unsigned long long elementBufferOffset = header.elementsOffset;
+        auto flushBuckets = [&]()
         {
-            std::vector<char> buffer;
-            LFHTSB * bucket = &(pTable->buckets[packBucketPos]);
-            unsigned long long count = googlerank((const unsigned char*) &(bucket->elementBitmap), LFHT::HOLY_GRAIL_SIZE);
-            LFHTSBE * bucketElements = bucket->elements;
-            for (size_t itemIdx = 0; itemIdx < count; ++itemIdx)
+            bool res = bucketBuffer.empty() || pwriteAll(fd, &bucketBuffer[0], bucketBuffer.size() * sizeof(SnapshotBucket),
+                                                         header.bucketsOffset + bucketsWritten * sizeof(SnapshotBucket));
+            bucketsWritten += bucketBuffer.size();
+            bucketBuffer.clear();
+            return res;
+        };
+        auto padBuckets = [&](unsigned long long bucketPos) // empty entries up to bucketPos
+        {
+            SnapshotBucket emptyBucket = {0, 0};
+            while(bucketsWritten + bucketBuffer.size() < bucketPos)
             {
-                size_t curItemSize = itemSizeFunc(bucketElements[itemIdx]);
-                buffer.reserve(sizeof(size_t) + curItemSize);
-                memcpy(&buffer[0],&curItemSize, sizeof(size_t));
-                itemSaveFunc(bucketElements[itemIdx], &buffer[sizeof(size_t)]);
-                fwrite(&buffer[0], 1, sizeof(size_t) + curItemSize, pFile);
+                bucketBuffer.push_back(emptyBucket);
+                if(bucketBuffer.size() == bucketBuffer.capacity() && !flushBuckets())
+                    return false;
             }
-        }
-        fclose(pFile);
+            return true;
+        };
+        bool ok = writeCheckpoint(pTable, [&](unsigned long long bucketPos, unsigned long long elementBitmap, const LFHTSBE * elements)
+        {
+            SnapshotBucket snapshotBucket;
+            snapshotBucket.elementBitmap = elementBitmap;
+            unsigned long long count = rank64(elementBitmap, LFHT::HOLY_GRAIL_SIZE);
+            unsigned long long elementsSize = count * sizeof(LFHTSBE);
+            if(elementBuffer.size() + elementsSize + SNAPSHOT_ALIGNMENT > elementBuffer.capacity() && !elementBuffer.empty())
+            {
+                if(!pwriteAll(fd, &elementBuffer[0], elementBuffer.size(), elementBufferOffset))
+                    return false;
+                elementBufferOffset += elementBuffer.size();
+                elementBuffer.clear();
+            }
+            elementBuffer.resize(snapshotAlign(elementBufferOffset + elementBuffer.size()) - elementBufferOffset);
+            snapshotBucket.elementsOffset = count ? elementBufferOffset + elementBuffer.size() : 0;
+            elementBuffer.insert(elementBuffer.end(), (const char *) elements, (const char *) elements + elementsSize);
+            header.numElements += count;
+            if(bucketPos < bucketsWritten + bucketBuffer.size()) // entry was left empty
+                return flushBuckets() && pwriteAll(fd, &snapshotBucket, sizeof(SnapshotBucket), header.bucketsOffset + bucketPos * sizeof(SnapshotBucket));
+            if(!padBuckets(bucketPos))
+                return false;
+            bucketBuffer.push_back(snapshotBucket);
+            return bucketBuffer.size() < bucketBuffer.capacity() || flushBuckets();
+        });
+        ok = ok && padBuckets(numBuckets) && flushBuckets() && pwriteAll(fd, &(pTable->hasherFunc), sizeof(HashFunc), header.hasherOffset);
+        if(ok && !elementBuffer.empty())
+            ok = pwriteAll(fd, &elementBuffer[0], elementBuffer.size(), elementBufferOffset);
+        header.fileSize = elementBufferOffset + elementBuffer.size();
+        return finishCheckpointFile(pTable, fd, ok, &header, sizeof(header), header.fileSize, tmpFileName, fileName, header.checkpointId);
     }
 
-    static void loadThreadProc(LFSparseHashTable<K, V, HashFunc> * pTable, std::string fileName, std::function<void(LFHTSBE&, char*)> itemLoadFunc)
+    // ONLY FOR POD TYPES. Writes every bucket changed since the last saveSnapshot/saveDelta (or openSnapshot/applyDelta) of this
+    // table as it was when the delta started, concurrently with writers, same as saveSnapshot. First delta after a resize or a
+    // failed checkpoint has all buckets in. False if there is no checkpoint to go on top of. One checkpoint at a time per table
+    static bool saveDelta(LFSparseHashTable<K, V, HashFunc> * pTable, const char * fileName)
     {
-        enum READER_STATE
-        {
-            READING_SIZE,
-            READING_ITEM
-        };
-
-        FILE * pFile = fopen(fileName.c_str(), "rb");
-
-        size_t sizeBytesRead = 0;
-        size_t itemBytesRead = 0;
-
-        READER_STATE readerState = READING_SIZE;
+        static_assert(std::is_trivially_copyable<K>::value && std::is_trivially_copyable<V>::value, "snapshots are for POD keys and values");
+        if(!pTable->checkpointId)
+            return false;
+        std::string tmpFileName = std::string(fileName) + ".tmp";
+        int fd = open(tmpFileName.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if(fd < 0)
+            return false;
+        bool full;
+        beginCheckpoint(pTable, false, full);
+        DeltaHeader header;
+        memset(&header, 0, sizeof(header));
+        memcpy(header.magic, "LFSHTDLT", sizeof(header.magic));
+        header.version = DELTA_VERSION;
+        header.keySize = sizeof(K);
+        header.valueSize = sizeof(V);
+        header.maxElements = pTable->maxElements;
+        header.full = full;
+        header.parentId = pTable->checkpointId;
+        header.checkpointId = randomSeed() | 1ULL;
 
-        std::vector<char> buffer(1024*1024);
+        std::vector<char> buffer;
+        buffer.reserve(SNAPSHOT_WRITE_BUFFER);
+        unsigned long long bufferOffset = sizeof(DeltaHeader);
+        bool ok = writeCheckpoint(pTable, [&](unsigned long long bucketPos, unsigned long long elementBitmap, const LFHTSBE * elements)
+        {
+            DeltaRecord record;
+            record.bucketPos = bucketPos;
+            record.elementBitmap = elementBitmap;
+            unsigned long long elementsSize = rank64(elementBitmap, LFHT::HOLY_GRAIL_SIZE) * sizeof(LFHTSBE);
+            if(buffer.size() + sizeof(DeltaRecord) + elementsSize > buffer.capacity() && !buffer.empty())
+            {
+                if(!pwriteAll(fd, &buffer[0], buffer.size(), bufferOffset))
+                    return false;
+                bufferOffset += buffer.size();
+                buffer.clear();
+            }
+            buffer.insert(buffer.end(), (const char *) &record, (const char *) &record + sizeof(DeltaRecord));
+            buffer.insert(buffer.end(), (const char *) elements, (const char *) elements + elementsSize);
+            ++header.numRecords;
+            return true;
+        });
+        if(ok && !buffer.empty())
+            ok = pwriteAll(fd, &buffer[0], buffer.size(), bufferOffset);
+        header.fileSize = bufferOffset + buffer.size();
+        return finishCheckpointFile(pTable, fd, ok, &header, sizeof(header), header.fileSize, tmpFileName, fileName, header.checkpointId);
+    }
 
-        size_t readIdx = 0;
-        size_t bytesRead = 0;
-        size_t readPos = 0;
+    // ONLY FOR POD TYPES. Maps snapshot written by saveSnapshot and points buckets straight into it, reads are served off the mapping
+    // (paged in on demand) as soon as this returns. Buckets are copied to heap by the first insert/remove that touches them, in place
+    // value writes stay private to the process. Table is left untouched if file is missing or doesn't match K, V and HashFunc
+    static bool openSnapshot(LFSparseHashTable<K, V, HashFunc> * pTable, const char * fileName)
+    {
+        static_assert(std::is_trivially_copyable<K>::value && std::is_trivially_copyable<V>::value, "snapshots are for POD keys and values");
+        int fd = open(fileName, O_RDONLY);
+        if(fd < 0)
+            return false;
+        struct stat fileStat;
+        if(fstat(fd, &fileStat) || (unsigned long long) fileStat.st_size < sizeof(SnapshotHeader))
+        {
+            close(fd);
+            return false;
+        }
+        const unsigned long long fileSize = fileStat.st_size;
+        char * base = (char *) mmap(0, fileSize, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+        close(fd);
+        if(base == MAP_FAILED)
+            return false;
 
-        size_t nextItemSavedSize = 0;
+        const SnapshotHeader * header = (const SnapshotHeader *) base;
+        const unsigned long long numBuckets = header->maxElements / LFHT::HOLY_GRAIL_SIZE;
+        if(memcmp(header->magic, "LFSHTSNP", sizeof(header->magic)) || header->version != SNAPSHOT_VERSION || header->keySize != sizeof(K)
+                        || header->valueSize != sizeof(V) || header->hasherSize != sizeof(HashFunc) || header->fileSize != fileSize
+                        || !numBuckets || header->maxElements % LFHT::HOLY_GRAIL_SIZE || header->hasherOffset + header->hasherSize > fileSize
+                        || header->bucketsOffset + numBuckets * sizeof(SnapshotBucket) > fileSize)
+        {
+            munmap(base, fileSize);
+            return false;
+        }
 
-        while(true)
+        // build and check new bucket array before the current contents are dropped
+        const SnapshotBucket * snapshotBuckets = (const SnapshotBucket *) (base + header->bucketsOffset);
+        LFHTSB * newBuckets = pTable->allocBucketArray(numBuckets);
+        for(unsigned long long bucketPos = 0; bucketPos < numBuckets; ++bucketPos)
         {
-            bool largeItem = false;
-            bytesRead = fread(&buffer[readPos], 1, buffer.capacity() - readPos, pFile) + readPos;
-            readPos = 0;
-            if (!bytesRead)
-                break; // TODO: anything left behind is bad news
-            readIdx = 0;
-            while(readIdx < bytesRead && !largeItem)
+            const unsigned long long elementBitmap = snapshotBuckets[bucketPos].elementBitmap;
+            const unsigned long long elementsOffset = snapshotBuckets[bucketPos].elementsOffset;
+            const unsigned long long count = rank64(elementBitmap, LFHT::HOLY_GRAIL_SIZE);
+            if(count && (elementsOffset < header->elementsOffset || elementsOffset % SNAPSHOT_ALIGNMENT || elementsOffset + count * sizeof(LFHTSBE) > fileSize))
             {
-                switch (readerState)
-                {
-                    case READING_SIZE:
-                    {
-                        if (bytesRead - readIdx >= (sizeof(size_t) - sizeBytesRead))
-                        {
-                            memcpy(((char*)&nextItemSavedSize) + sizeBytesRead, &buffer[readIdx], sizeof(size_t) - sizeBytesRead);
-                            readIdx += sizeof(size_t) - sizeBytesRead;
-                            readerState = READING_ITEM;
-                            itemBytesRead = 0;
-                            sizeBytesRead = 0;
-                        }
-                        else
-                        {
-                            memcpy(((char*)&nextItemSavedSize) + sizeBytesRead, &buffer[readIdx], bytesRead - readIdx);
-                            sizeBytesRead += bytesRead - readIdx;
-                            readIdx += bytesRead - readIdx;
-                        }
-                        if (readerState == READING_ITEM && nextItemSavedSize >= (buffer.capacity() + sizeof(size_t)))
-                        {
-                            buffer.resize(buffer.capacity() + nextItemSavedSize + sizeof(size_t));
-                            largeItem = true;
-                        }
-                    }
-                    break;
-                    case READING_ITEM:
-                    {
-                        if (bytesRead - readIdx >= (nextItemSavedSize - itemBytesRead))
-                        {
-                            LFHTSBE nextItem;
-                            itemLoadFunc(nextItem, &buffer[readIdx]);
-                            pTable->insert(nextItem.key, nextItem.value);
-                            readIdx += nextItemSavedSize - itemBytesRead;
-                            readerState = READING_SIZE;
-                        }
-                        else
-                        {
-                            memmove(&buffer[0], &buffer[readIdx - itemBytesRead], bytesRead - readIdx + itemBytesRead);
-                            readPos = bytesRead - readIdx;
-                            readIdx += bytesRead - readIdx;
-                            itemBytesRead = 0;
-                        }
-                    }
-                    break;
-                    default:
-                        abort();
-                    break;
-                }
+                HugePages::release(newBuckets);
+                munmap(base, fileSize);
+                return false;
             }
+            newBuckets[bucketPos].elementLocks = 0;
+            newBuckets[bucketPos].elementBitmap = elementBitmap;
+            newBuckets[bucketPos].elements = count ? (LFHTSBE *) (base + elementsOffset) : 0;
         }
-        fclose(pFile);
+        madvise(base + header->elementsOffset, fileSize - header->elementsOffset, MADV_RANDOM); // hash lookups, readahead is wasted
+
+        pTable->finishResize(); // only a single generation gets saved or replaced
+        for(unsigned long long bucketPos = 0; bucketPos < pTable->maxElements / LFHT::HOLY_GRAIL_SIZE; ++bucketPos)
+            pTable->freeElements(pTable->buckets[bucketPos].elements);
+        HugePages::release(pTable->buckets);
+        pTable->releaseSnapshot();
+
+        pTable->buckets = newBuckets;
+        pTable->maxElements = header->maxElements;
+        pTable->maxLoadFactor = header->maxLoadFactor;
+        pTable->minLoadFactor = header->minLoadFactor;
+        pTable->resetStorage(); // elements stay mapped until written
+        memcpy((void *) &(pTable->hasherFunc), base + header->hasherOffset, sizeof(HashFunc)); // bitmaps were built with saved seed
+        pTable->snapshotBase = base;
+        pTable->snapshotSize = fileSize;
+        pTable->recountElements();
+        pTable->resetDirty(false);
+        pTable->checkpointId = header->checkpointId;
+        return true;
     }
 
-    static void loadThreadProcComplex(LFSparseHashTable<K, V, HashFunc> * pTable, std::string fileName, std::function<void(LFHTSBE&, char*)> itemLoadFunc, std::vector<LFHTSBE>* misfits, std::vector<unsigned char>* freeSlots)
+    // ONLY FOR POD TYPES. Applies delta written by saveDelta on top of what the table holds, which has to be its parent checkpoint
+    // (openSnapshot or applyDelta of the previous delta). Table is left untouched if the delta is corrupt or does not follow it.
+    // Table must not be used by other threads meanwhile
+    static bool applyDelta(LFSparseHashTable<K, V, HashFunc> * pTable, const char * fileName)
     {
-        enum READER_STATE
+        static_assert(std::is_trivially_copyable<K>::value && std::is_trivially_copyable<V>::value, "snapshots are for POD keys and values");
+        int fd = open(fileName, O_RDONLY);
+        if(fd < 0)
+            return false;
+        struct stat fileStat;
+        if(fstat(fd, &fileStat) || (unsigned long long) fileStat.st_size < sizeof(DeltaHeader))
         {
-            READING_SIZE,
-            READING_ITEM
-        };
+            close(fd);
+            return false;
+        }
+        const unsigned long long fileSize = fileStat.st_size;
+        char * base = (char *) mmap(0, fileSize, PROT_READ, MAP_PRIVATE, fd, 0);
+        close(fd);
+        if(base == MAP_FAILED)
+            return false;
+        madvise(base, fileSize, MADV_SEQUENTIAL);
 
-        size_t endBucketPos = atoi(fileName.substr(fileName.rfind('.')+1).c_str());
-        size_t beginBucketPos = atoi(fileName.substr(fileName.rfind('.', fileName.rfind('.')-1)+1, fileName.rfind('.') - (fileName.rfind('.', fileName.rfind('.')-1)+1)).c_str());
+        pTable->finishResize(); // only a single generation gets saved or replaced
+        const DeltaHeader * header = (const DeltaHeader *) base;
+        const unsigned long long numBuckets = header->maxElements / LFHT::HOLY_GRAIL_SIZE;
+        bool ok = !memcmp(header->magic, "LFSHTDLT", sizeof(header->magic)) && header->version == DELTA_VERSION && header->keySize == sizeof(K)
+                        && header->valueSize == sizeof(V) && header->fileSize == fileSize && numBuckets && !(header->maxElements % LFHT::HOLY_GRAIL_SIZE)
+                        && pTable->checkpointId && header->parentId == pTable->checkpointId
+                        && (header->full || header->maxElements == pTable->maxElements);
+        // walk records once before anything is touched
+        unsigned long long recordOffset = sizeof(DeltaHeader);
+        for(unsigned long long recordIdx = 0; ok && recordIdx < header->numRecords; ++recordIdx)
+        {
+            const DeltaRecord * record = (const DeltaRecord *) (base + recordOffset);
+            ok = recordOffset + sizeof(DeltaRecord) <= fileSize && record->bucketPos < numBuckets;
+            recordOffset += sizeof(DeltaRecord) + (ok ? rank64(record->elementBitmap, LFHT::HOLY_GRAIL_SIZE) * sizeof(LFHTSBE) : 0);
+        }
+        if(!ok || recordOffset != fileSize)
+        {
+            munmap(base, fileSize);
+            return false;
+        }
 
-        FILE * pFile = fopen(fileName.c_str(), "rb");
+        if(header->maxElements != pTable->maxElements) // full delta of a resized table, every bucket gets replaced below
+        {
+            for(unsigned long long bucketPos = 0; bucketPos < pTable->maxElements / LFHT::HOLY_GRAIL_SIZE; ++bucketPos)
+                pTable->freeElements(pTable->buckets[bucketPos].elements);
+            HugePages::release(pTable->buckets);
+            pTable->buckets = pTable->allocBucketArray(numBuckets);
+            pTable->maxElements = header->maxElements;
+            pTable->resetStorage();
+        }
+        recordOffset = sizeof(DeltaHeader);
+        for(unsigned long long recordIdx = 0; recordIdx < header->numRecords; ++recordIdx)
+        {
+            const DeltaRecord * record = (const DeltaRecord *) (base + recordOffset);
+            const unsigned long long count = rank64(record->elementBitmap, LFHT::HOLY_GRAIL_SIZE);
+            LFHTSB * bucket = &(pTable->buckets[record->bucketPos]);
+            pTable->freeElements(bucket->elements);
+            bucket->elements = count ? pTable->allocElements(record->bucketPos, count) : 0;
+            memcpy(bucket->elements, base + recordOffset + sizeof(DeltaRecord), count * sizeof(LFHTSBE));
+            bucket->elementBitmap = record->elementBitmap;
+            pTable->fingerprintBucket(bucket);
+            bucket->elementLocks = 0;
+            recordOffset += sizeof(DeltaRecord) + count * sizeof(LFHTSBE);
+        }
+        if(header->full) // nothing points into the mapped snapshot anymore
+            pTable->releaseSnapshot();
+        pTable->recountElements();
+        pTable->resetDirty(false);
+        pTable->checkpointId = header->checkpointId;
+        munmap(base, fileSize);
+        return true;
+    }
 
-        size_t sizeBytesRead = 0;
-        size_t itemBytesRead = 0;
+    // ONLY FOR POD TYPES. openSnapshot followed by applyDelta of every delta in the order they were taken. On failure table holds
+    // whatever was applied before the failing file
+    static bool openCheckpoint(LFSparseHashTable<K, V, HashFunc> * pTable, const char * snapshotFileName, const std::vector<std::string> & deltaFileNames)
+    {
+        if(!openSnapshot(pTable, snapshotFileName))
+            return false;
+        for(size_t deltaIdx = 0; deltaIdx < deltaFileNames.size(); ++deltaIdx)
+        {
+            if(!applyDelta(pTable, deltaFileNames[deltaIdx].c_str()))
+                return false;
+        }
+        return true;
+    }
+private:
+    // Takes the checkpoint cut (see LFSparseHashTable::beginCheckpoint), waits for a resize in progress to finish first
+    static void beginCheckpoint(LFSparseHashTable<K, V, HashFunc> * pTable, bool allBuckets, bool & full)
+    {
+        do
+        {
+            pTable->finishResize();
+        } while(!pTable->beginCheckpoint(allBuckets, full));
+    }
 
-        READER_STATE readerState = READING_SIZE;
+    // Copies out every bucket pending since beginCheckpoint. Bucket is locked just for the copy, bucketFunc(bucketPos, elementBitmap,
+    // elements) runs on the copy with nothing locked. Buckets writers got to first come last, from the copies they made. Every
+    // pending bucket is passed exactly once, as it was at the cut. False if bucketFunc failed, table is left all dirty then
+    template<typename BucketFunc>
+    static bool writeCheckpoint(LFSparseHashTable<K, V, HashFunc> * pTable, BucketFunc bucketFunc)
+    {
+        const unsigned long long numBuckets = pTable->maxElements / LFHT::HOLY_GRAIL_SIZE;
+        std::vector<char> bucketCopy(LFHT::HOLY_GRAIL_SIZE * sizeof(LFHTSBE));
+        bool ok = true;
+        for(unsigned long long bucketPos = 0; ok && bucketPos < numBuckets; ++bucketPos)
+        {
+            if(!LFHT::testBucketBit(pTable->checkpointBuckets, bucketPos))
+                continue;
+            LFHTSB * bucket = &(pTable->buckets[bucketPos]);
+            bucket->lockBucket(pTable->lockContention);
+            if(!LFHT::takeBucketBit(pTable->checkpointBuckets, bucketPos))
+            {
+                bucket->unlockBucket();
+                continue;
+            }
+            const unsigned long long elementBitmap = bucket->elementBitmap;
+            memcpy(&bucketCopy[0], (const void *) bucket->elements, rank64(elementBitmap, LFHT::HOLY_GRAIL_SIZE) * sizeof(LFHTSBE));
+            bucket->unlockBucket();
+            ok = bucketFunc(bucketPos, elementBitmap, (const LFHTSBE *) &bucketCopy[0]);
+        }
+        typename LFHT::CheckpointCopy * copies = pTable->endCheckpoint(!ok);
+        while(copies)
+        {
+            typename LFHT::CheckpointCopy * next = copies->next;
+            ok = ok && bucketFunc(copies->bucketPos, copies->elementBitmap, copies->elements);
+            std::free(copies->elements);
+            std::free(copies);
+            copies = next;
+        }
+        return ok;
+    }
 
-        std::vector<char> buffer(1024*1024);
+    // header goes last, a torn write never looks like a valid checkpoint. On failure pending bits taken by the walk are gone,
+    // so next delta has to write everything
+    static bool finishCheckpointFile(LFSparseHashTable<K, V, HashFunc> * pTable, int fd, bool ok, const void * header, size_t headerSize,
+                                     unsigned long long fileSize, const std::string & tmpFileName, const char * fileName, unsigned long long checkpointId)
+    {
+        ok = ok && ftruncate(fd, fileSize) == 0 && fsync(fd) == 0 && pwriteAll(fd, header, headerSize, 0) && fsync(fd) == 0;
+        ok = (close(fd) == 0) && ok;
+        if(ok)
+            ok = rename(tmpFileName.c_str(), fileName) == 0;
+        else
+            unlink(tmpFileName.c_str());
+        if(ok)
+            pTable->checkpointId = checkpointId;
+        else
+        {
+            typename LFHT::OperationGuard guard(pTable);
+            pTable->markAllDirty();
+        }
+        return ok;
+    }
 
-        size_t readIdx = 0;
-        size_t bytesRead = 0;
-        size_t readPos = 0;
+    // SAVE_BLOCK_SIZE aligned buffer that grows like a vector
+    struct IOBuffer
+    {
+        char * data;
+        size_t size;
+        size_t capacity;
 
-        size_t nextItemSavedSize = 0;
+        IOBuffer() : data(0), size(0), capacity(0)
+        {
+        }
+        ~IOBuffer()
+        {
+            std::free(data);
+        }
+        IOBuffer(const IOBuffer&) = delete;
+        IOBuffer& operator=(const IOBuffer&) = delete;
 
-        while(true)
+        char * grow(size_t bytes) // returns where appended bytes go
         {
-            bool largeItem = false;
-            bytesRead = fread(&buffer[readPos], 1, buffer.capacity() - readPos, pFile) + readPos;
-            readPos = 0;
-            if (!bytesRead)
-                break; // TODO: anything left behind is bad news
-            readIdx = 0;
-            while(readIdx < bytesRead && !largeItem)
+            if(size + bytes > capacity)
             {
-                switch (readerState)
-                {
-                    case READING_SIZE:
-                    {
-                        if (bytesRead - readIdx >= (sizeof(size_t) - sizeBytesRead))
-                        {
-                            memcpy(((char*)&nextItemSavedSize) + sizeBytesRead, &buffer[readIdx], sizeof(size_t) - sizeBytesRead);
-                            readIdx += sizeof(size_t) - sizeBytesRead;
-                            readerState = READING_ITEM;
-                            sizeBytesRead = 0;
-                            itemBytesRead = 0;
-                        }
-                        else
-                        {
-                            memcpy(((char*)&nextItemSavedSize) + sizeBytesRead, &buffer[readIdx], bytesRead - readIdx);
-                            sizeBytesRead += bytesRead - readIdx;
-                            readIdx += bytesRead - readIdx;
-                        }
-                        if (readerState == READING_ITEM && nextItemSavedSize >= (buffer.capacity() + sizeof(size_t)))
-                        {
-                            buffer.resize(buffer.capacity() + nextItemSavedSize + sizeof(size_t));
-                            largeItem = true;
-                        }
+                size_t newCapacity = ioAlign(std::max(capacity * 2, size + bytes));
+                char * newData = (char *) aligned_alloc(SAVE_BLOCK_SIZE, newCapacity);
+                if(size)
+                    memcpy(newData, data, size);
+                std::free(data);
+                data = newData;
+                capacity = newCapacity;
+            }
+            size += bytes;
+            return data + size - bytes;
+        }
+        void pad()
+        {
+            size_t padding = ioAlign(size) - size;
+            if(padding)
+                memset(grow(padding), 0, padding);
+        }
+    };
 
-                    }
-                    break;
-                    case READING_ITEM:
-                    {
-                        if (bytesRead - readIdx >= (nextItemSavedSize - itemBytesRead))
-                        {
-                            LFHTSBE nextItem;
-                            itemLoadFunc(nextItem, &buffer[readIdx]);
+    // table must be idle. Destroys whatever it holds, bucket array included
+    static void destroyBuckets(LFSparseHashTable<K, V, HashFunc> * pTable)
+    {
+        pTable->finishResize();
+        for(unsigned long long bucketPos = 0; bucketPos < pTable->maxElements / LFHT::HOLY_GRAIL_SIZE; ++bucketPos)
+        {
+            LFHTSB * bucket = &(pTable->buckets[bucketPos]);
+            unsigned long long count = rank64(bucket->elementBitmap, LFHT::HOLY_GRAIL_SIZE);
+            LFHTSBE * bucketElements = bucket->elements;
+            for(unsigned long long j = 0; j < count; ++j)
+            {
+                bucketElements[j].~SparseBucketElement();
+            }
+            pTable->freeElements(bucket->elements);
+        }
+        HugePages::release(pTable->buckets);
+        pTable->buckets = 0;
+        pTable->releaseSnapshot();
+    }
 
-                            // do da elephant
-                            unsigned long long idx = pTable->hasherFunc(nextItem.key) % pTable->maxElements; // TODO: seed
-                            unsigned long long bucketPos = idx / LFHT::HOLY_GRAIL_SIZE;
+    static void allocBuckets(LFSparseHashTable<K, V, HashFunc> * pTable)
+    {
+        pTable->resetStorage();
+        pTable->buckets = pTable->allocBucketArray(pTable->maxElements / LFHT::HOLY_GRAIL_SIZE);
+    }
 
-                            if (bucketPos >= beginBucketPos && bucketPos < endBucketPos)
-                            {
-                                bool inserted = false;
-                                unsigned long long bucketOffset = idx % LFHT::HOLY_GRAIL_SIZE;
-                                LFHTSB * bucket = &(pTable->buckets[bucketPos]);
-                                __builtin_prefetch(bucket, 1, 3 /* _MM_HINT_T0 */);
-                                LFHTSBE * bucketElements = bucket->elements;
-                                if(bucket->elementBitmap == 0 && (*freeSlots)[bucketPos])
-                                {
-                                    bucketElements = bucket->elements;
-                                    new (&(bucketElements[0].key)) K(nextItem.key);
-                                    new (&(bucketElements[0].value)) V(nextItem.value);
-                                    --((*freeSlots)[bucketPos]);
-                                    inserted = true;
-                                    bucket->bitmapSet(bucketOffset);
-                                }
-                                else
-                                {
-                                    bool stepBack = false; // to avoid extra rank calculation later
-                                    unsigned long long rank = googlerank((const unsigned char*) &(bucket->elementBitmap), bucketOffset + 1);
-                                    while(true) // linear probing
-                                    {
-                                        bool elementExists = bucket->bitmapTest(bucketOffset);
-                                        if(elementExists)
-                                        {
-                                            stepBack = true;
-                                            ++rank;
-                                            ++bucketOffset;
-                                            idx = (idx + 1) % pTable->maxElements;
-                                            if(bucketOffset == LFHT::HOLY_GRAIL_SIZE)
-                                            {
-                                                rank = 1;
-                                                bucketPos = idx / LFHT::HOLY_GRAIL_SIZE;
-                                                bucketOffset = idx % LFHT::HOLY_GRAIL_SIZE;
-                                                bucket = &(pTable->buckets[bucketPos]);
-                                                __builtin_prefetch(bucket, 1, 3 /* _MM_HINT_T0 */);
-                                                bucketElements = bucket->elements;
-                                                if(bucket->elementBitmap == 0 && (*freeSlots)[bucketPos])
-                                                {
-                                                    new (&(bucketElements[0].key)) K(nextItem.key);
-                                                    new (&(bucketElements[0].value)) V(nextItem.value);
-                                                    --((*freeSlots)[bucketPos]);
-                                                    inserted = true;
-                                                    bucket->bitmapSet(bucketOffset);
-                                                    break;
-                                                }
-                                            }
-                                        }
-                                        else if ((*freeSlots)[bucketPos])
-                                        {
-                                            if(stepBack)
-                                                --rank;
-                                            unsigned long long count = googlerank((const unsigned char*) &(bucket->elementBitmap), LFHT::HOLY_GRAIL_SIZE);
-                                            if(rank < count)
-                                                memmove(bucketElements + rank + 1, bucketElements + rank, (count - rank) * sizeof(LFHTSBE));
-                                            new (&(bucketElements[rank].key)) K(nextItem.key);
-                                            new (&(bucketElements[rank].value)) V(nextItem.value);
-                                            --((*freeSlots)[bucketPos]);
-                                            inserted = true;
-                                            bucket->bitmapSet(bucketOffset);
-                                            break;
-                                        }
-                                    }
-                                }
-                                if (!inserted)
-                                    (*misfits).push_back(nextItem);
-                            }
-                            else
-                                (*misfits).push_back(nextItem);
+    // O_DIRECT if file system supports it (tmpfs doesn't)
+    static int openDirect(const char * fileName, int flags)
+    {
+        int fd = open(fileName, flags | O_DIRECT, 0644);
+        if(fd < 0 && errno == EINVAL)
+            fd = open(fileName, flags, 0644);
+        return fd;
+    }
 
-                            readIdx += nextItemSavedSize - itemBytesRead;
-                            readerState = READING_SIZE;
-                        }
-                        else
-                        {
-                            memmove(&buffer[0], &buffer[readIdx - itemBytesRead], bytesRead - readIdx + itemBytesRead);
-                            readPos = bytesRead - readIdx;
-                            readIdx += bytesRead - readIdx;
-                            itemBytesRead = 0;
-                        }
-                    }
-                    break;
-                    default:
-                        abort();
-                    break;
-                }
-            }
+    static unsigned long long ioAlign(unsigned long long offset)
+    {
+        return (offset + SAVE_BLOCK_SIZE - 1) & ~((unsigned long long) SAVE_BLOCK_SIZE - 1);
+    }
+
+    static unsigned long long snapshotAlign(unsigned long long offset)
+    {
+        return (offset + SNAPSHOT_ALIGNMENT - 1) & ~(SNAPSHOT_ALIGNMENT - 1);
+    }
+
+    static bool pwriteAll(int fd, const void * data, size_t size, unsigned long long offset)
+    {
+        const char * pos = (const char *) data;
+        while(size)
+        {
+            ssize_t written = pwrite(fd, pos, size, offset);
+            if(written <= 0)
+                return false;
+            pos += written;
+            offset += written;
+            size -= written;
         }
-        fclose(pFile);
+        return true;
+    }
+
+    static bool preadAll(int fd, void * data, size_t size, unsigned long long offset)
+    {
+        char * pos = (char *) data;
+        while(size)
+        {
+            ssize_t bytesRead = pread(fd, pos, size, offset);
+            if(bytesRead <= 0)
+                return false;
+            pos += bytesRead;
+            offset += bytesRead;
+            size -= bytesRead;
+        }
+        return true;
     }
 };
 
+/*
+    // Sample checkpoint chain, 4M elements, 0.1% of them changed between snapshot and delta. Writers may keep going during both calls.
+    // On a single core box snapshot takes ~110ms for 69MB, delta ~7ms for 2.2MB (every changed key drags in its whole bucket)
+
+    typedef LFSparseHashTableUtil<unsigned long long, unsigned long long> Util;
+    const unsigned long long N = 1 << 22;
+    LFSparseHashTable<unsigned long long, unsigned long long> table(N * 2, 0.7);
+    for (unsigned long long i = 0; i < N; ++i)
+        table.insert(i, i);
+    Util::saveSnapshot(&table, "table.snap");
+    std::mt19937_64 rng(42);
+    for (unsigned long long i = 0; i < N / 1000; ++i)
+        table.set(rng() % N, i);
+    Util::saveDelta(&table, "table.delta.0");
+    // ... more deltas, each one on top of the previous
+
+    LFSparseHashTable<unsigned long long, unsigned long long> restored;
+    std::vector<std::string> deltas = {"table.delta.0"};
+    if(!Util::openCheckpoint(&restored, "table.snap", deltas))
+        abort();
+
+*/
+
 #endif /* LFSPARSEHASHTABLEUTIL_H_ */
@@ -0,0 +1,215 @@
+/*
+ * LockContention.h
+ *
+ * Backoff and contention counters for spin locks built on CAS over a 64 bit lock word. A waiter reads the word until the bits it
+ * wants look free and only then tries CAS again, pausing between reads with the pause doubling up to MAX_PAUSE_ROUND. With a spin
+ * budget a waiter that paused that many times parks on a futex of the 32 bit half of the word it waits for. Parked waiters are
+ * counted per stripe of lock word addresses and unlockers wake that half only while someone is parked on a word of their stripe, so
+ * lock words need no waiter bit, the uncontended paths stay a single CAS and a parked waiter costs no syscalls to unrelated locks.
+ *
+ * Uncontended acquires are not counted. Contended ones add to striped per table counters together with the pauses they took and
+ * the times they parked. A lossy tally per lock word keeps the most contended word seen so far, to spot hot buckets.
+ */
+
+#ifndef LOCKCONTENTION_H_
+#define LOCKCONTENTION_H_
+
+#include <atomic>
+#include <climits>
+#include <cstring>
+#include <ctime>
+
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <x86intrin.h>
+
+#include "seededhash.hh"
+
+class LockContention
+{
+public:
+    static const unsigned long long NEVER_PARK = 0; // spin budget of tables that only ever spin
+    static const unsigned long long MAX_PAUSE_ROUND = 64;
+
+    struct Stats
+    {
+        unsigned long long contendedAcquires;
+        unsigned long long spins; // pauses taken by contended acquires
+        unsigned long long parks;
+        const void * hotLock; // most contended lock word, 0 if none
+        unsigned long long hotLockContended; // approximate
+    };
+
+    // after spinBudget pauses a waiter parks, NEVER_PARK spins forever
+    explicit LockContention(unsigned long long inSpinBudget = NEVER_PARK);
+
+    unsigned long long spinBudget() const
+    {
+        return parkAfter;
+    }
+    Stats stats() const; // approximate while locks are taken
+    void reset();
+
+    // one contended acquire, lives from the first failed attempt until the lock is taken. contention may be 0, then it only backs off
+    class Waiter
+    {
+        LockContention * contention;
+        const unsigned long long * lockWord;
+        unsigned long long pauseRound;
+        unsigned long long spins;
+        unsigned long long parks;
+    public:
+        inline Waiter(LockContention * inContention, const unsigned long long * inLockWord) :
+                        contention(inContention), lockWord(inLockWord), pauseRound(1), spins(0), parks(0)
+        {
+        }
+        inline ~Waiter()
+        {
+            if(contention)
+                contention->record(lockWord, spins, parks);
+        }
+        // observed is what the waiter saw in the lock word, waitBits the held bits it waits for
+        inline void wait(unsigned long long observed, unsigned long long waitBits);
+    };
+
+    // after an unlock CAS that cleared releasedBits
+    static inline void wake(const unsigned long long * lockWord, unsigned long long releasedBits);
+
+private:
+    LockContention(const LockContention&) = delete;
+    LockContention& operator=(const LockContention&) = delete;
+
+    static const unsigned long long COUNTER_STRIPES = 16;
+    static const unsigned long long HOT_TALLY_SIZE = 1024;
+    static const unsigned long long PARK_STRIPES = 256;
+    static const long PARK_TIMEOUT_NS = 1000000; // parked waiters recheck every ms even if a wake got lost
+
+    struct CounterStripe
+    {
+        std::atomic<unsigned long long> contendedAcquires; //8
+        std::atomic<unsigned long long> spins; //8
+        std::atomic<unsigned long long> parks; //8
+        char padding0[40]; // padding to cacheline
+    }__attribute__((aligned(64)));
+
+    struct ParkStripe
+    {
+        std::atomic<unsigned long long> waiters; //8
+        char padding0[56]; // padding to cacheline
+    }__attribute__((aligned(64)));
+
+    // waiters parked on lock words of the stripe of lockWord, process wide. Unlockers skip the wake syscall while it is 0
+    static std::atomic<unsigned long long> & parkedWaiters(const unsigned long long * lockWord)
+    {
+        static ParkStripe stripes[PARK_STRIPES];
+        return stripes[mix64((unsigned long long) lockWord) % PARK_STRIPES].waiters;
+    }
+    static inline unsigned long long counterStripeIdx();
+    static inline void park(const unsigned long long * lockWord, unsigned long long observed, unsigned long long waitBits);
+    inline void record(const unsigned long long * lockWord, unsigned long long spins, unsigned long long parks);
+
+    CounterStripe counters[COUNTER_STRIPES];
+    std::atomic<unsigned int> hotTally[HOT_TALLY_SIZE];
+    std::atomic<const void *> hotLock;
+    std::atomic<unsigned long long> hotLockContended;
+    unsigned long long parkAfter;
+};
+
+inline LockContention::LockContention(unsigned long long inSpinBudget) :
+                hotLock(0), hotLockContended(0), parkAfter(inSpinBudget)
+{
+    reset();
+}
+
+inline LockContention::Stats LockContention::stats() const
+{
+    Stats res;
+    memset(&res, 0, sizeof(res));
+    for(unsigned long long stripeIdx = 0; stripeIdx < COUNTER_STRIPES; ++stripeIdx)
+    {
+        res.contendedAcquires += counters[stripeIdx].contendedAcquires.load(std::memory_order_relaxed);
+        res.spins += counters[stripeIdx].spins.load(std::memory_order_relaxed);
+        res.parks += counters[stripeIdx].parks.load(std::memory_order_relaxed);
+    }
+    res.hotLock = hotLock.load(std::memory_order_relaxed);
+    res.hotLockContended = hotLockContended.load(std::memory_order_relaxed);
+    return res;
+}
+
+inline void LockContention::reset()
+{
+    for(unsigned long long stripeIdx = 0; stripeIdx < COUNTER_STRIPES; ++stripeIdx)
+    {
+        counters[stripeIdx].contendedAcquires.store(0, std::memory_order_relaxed);
+        counters[stripeIdx].spins.store(0, std::memory_order_relaxed);
+        counters[stripeIdx].parks.store(0, std::memory_order_relaxed);
+    }
+    for(unsigned long long tallyIdx = 0; tallyIdx < HOT_TALLY_SIZE; ++tallyIdx)
+        hotTally[tallyIdx].store(0, std::memory_order_relaxed);
+    hotLock.store(0, std::memory_order_relaxed);
+    hotLockContended.store(0, std::memory_order_relaxed);
+}
+
+inline unsigned long long LockContention::counterStripeIdx()
+{
+    static std::atomic<unsigned long long> nextStripeIdx(0);
+    static thread_local unsigned long long stripeIdx = nextStripeIdx++ % COUNTER_STRIPES;
+    return stripeIdx;
+}
+
+// hot lock is replaced by whichever word outgrows it in the tally, words sharing a tally slot add up
+inline void LockContention::record(const unsigned long long * lockWord, unsigned long long spins, unsigned long long parks)
+{
+    CounterStripe & stripe = counters[counterStripeIdx()];
+    stripe.contendedAcquires.fetch_add(1, std::memory_order_relaxed);
+    stripe.spins.fetch_add(spins, std::memory_order_relaxed);
+    if(parks)
+        stripe.parks.fetch_add(parks, std::memory_order_relaxed);
+    const unsigned long long tally = hotTally[mix64((unsigned long long) lockWord) % HOT_TALLY_SIZE].fetch_add(1, std::memory_order_relaxed) + 1;
+    if(tally > hotLockContended.load(std::memory_order_relaxed))
+    {
+        hotLockContended.store(tally, std::memory_order_relaxed);
+        hotLock.store(lockWord, std::memory_order_relaxed);
+    }
+}
+
+inline void LockContention::Waiter::wait(unsigned long long observed, unsigned long long waitBits)
+{
+    if(contention && contention->parkAfter != NEVER_PARK && spins >= contention->parkAfter)
+    {
+        park(lockWord, observed, waitBits);
+        ++parks;
+        return;
+    }
+    for(unsigned long long pauseIdx = 0; pauseIdx < pauseRound; ++pauseIdx)
+        _mm_pause();
+    spins += pauseRound;
+    if(pauseRound < MAX_PAUSE_ROUND)
+        pauseRound <<= 1;
+}
+
+// waits on the half holding one of the bits, FUTEX_WAIT returns right away if that half changed since it was observed. Parked count
+// goes up before the futex compare and unlockers read it after their CAS, so either the waiter sees the release or the unlocker wakes it
+inline void LockContention::park(const unsigned long long * lockWord, unsigned long long observed, unsigned long long waitBits)
+{
+    const unsigned long long halfIdx = (observed & waitBits & 0xFFFFFFFFULL) ? 0 : 1;
+    const unsigned int * half = (const unsigned int *) lockWord + halfIdx;
+    struct timespec timeout = { 0, PARK_TIMEOUT_NS };
+    std::atomic<unsigned long long> & parked = parkedWaiters(lockWord);
+    parked.fetch_add(1, std::memory_order_seq_cst);
+    syscall(SYS_futex, half, FUTEX_WAIT_PRIVATE, (unsigned int) (observed >> (32 * halfIdx)), &timeout, 0, 0);
+    parked.fetch_sub(1, std::memory_order_relaxed);
+}
+
+inline void LockContention::wake(const unsigned long long * lockWord, unsigned long long releasedBits)
+{
+    if(!parkedWaiters(lockWord).load(std::memory_order_seq_cst))
+        return;
+    if(releasedBits & 0xFFFFFFFFULL)
+        syscall(SYS_futex, (const unsigned int *) lockWord, FUTEX_WAKE_PRIVATE, INT_MAX, 0, 0, 0);
+    if(releasedBits >> 32)
+        syscall(SYS_futex, (const unsigned int *) lockWord + 1, FUTEX_WAKE_PRIVATE, INT_MAX, 0, 0, 0);
+}
+
+#endif /* LOCKCONTENTION_H_ */
@@ -0,0 +1,178 @@
+/*
+ * NumaPlacement.h
+ *
+ * NUMA placement of big arrays without libnuma. Nodes are read from sysfs once, policies are set with the raw mbind syscall on
+ * ranges that were not touched yet, so the pages land where the policy says when they are first written. Placement is a hint:
+ * preferred node falls back to others when it runs out of memory and a kernel without NUMA support just leaves first touch.
+ * Only pages fully inside a range are placed, ranges don't have to be page aligned (malloc'd arrays work too).
+ *
+ * Nodes are numbered 0 .. numNodes() - 1 in the order sysfs lists them, which differs from kernel node ids only on hosts with
+ * holes in their node list.
+ */
+
+#ifndef NUMAPLACEMENT_H_
+#define NUMAPLACEMENT_H_
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#include <linux/mempolicy.h>
+#include <sched.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+class NumaPlacement
+{
+public:
+    static const unsigned long long MAX_NODES = 64; // node masks are a single word
+    static const unsigned long long ANY_NODE = 0xFFFFFFFFFFFFFFFFULL;
+
+    static unsigned long long numNodes()
+    {
+        return topology().count;
+    }
+    static inline unsigned long long currentNode(); // node of the cpu the calling thread runs on, 0 if unknown
+
+    // pages of the range go round robin over all nodes
+    static inline bool interleave(void * ptr, size_t size);
+    // pages of the range go to node, others if it is full
+    static inline bool prefer(void * ptr, size_t size, unsigned long long node);
+    // node that owns item when numItems are split into numNodes() contiguous parts of equal size
+    static unsigned long long partitionNode(unsigned long long item, unsigned long long numItems)
+    {
+        return numItems ? (unsigned long long) (((unsigned __int128) item * numNodes()) / numItems) : 0;
+    }
+    // first item of node's part, partitionNode(partitionBegin(node, n), n) == node for non empty parts
+    static unsigned long long partitionBegin(unsigned long long node, unsigned long long numItems)
+    {
+        return (unsigned long long) (((unsigned __int128) numItems * node + numNodes() - 1) / numNodes());
+    }
+    // pins the calling thread to the cpus of node
+    static inline bool bindThread(unsigned long long node);
+
+private:
+    struct Topology
+    {
+        unsigned long long count;
+        unsigned long long nodeIds[MAX_NODES];
+    };
+
+    static inline const Topology & topology();
+    static inline unsigned long long parseList(const char * fileName, unsigned long long * ids, unsigned long long maxIds);
+    static inline bool setPolicy(void * ptr, size_t size, int mode, unsigned long long nodeMask);
+};
+
+// list files look like "0-3,8,10-11"
+inline unsigned long long NumaPlacement::parseList(const char * fileName, unsigned long long * ids, unsigned long long maxIds)
+{
+    FILE * pFile = fopen(fileName, "r");
+    if(!pFile)
+        return 0;
+    char line[4096];
+    const bool read = fgets(line, sizeof(line), pFile) != 0;
+    fclose(pFile);
+    unsigned long long count = 0;
+    for(char * pos = line; read && *pos && *pos != '\n' && count < maxIds;)
+    {
+        char * end;
+        const unsigned long long first = strtoull(pos, &end, 10);
+        unsigned long long last = first;
+        if(end == pos)
+            break;
+        if(*end == '-')
+        {
+            pos = end + 1;
+            last = strtoull(pos, &end, 10);
+        }
+        for(unsigned long long id = first; id <= last && count < maxIds; ++id)
+            ids[count++] = id;
+        pos = *end == ',' ? end + 1 : end;
+    }
+    return count;
+}
+
+inline const NumaPlacement::Topology & NumaPlacement::topology()
+{
+    static Topology res = []()
+    {
+        Topology topo;
+        topo.count = parseList("/sys/devices/system/node/online", topo.nodeIds, MAX_NODES);
+        while(topo.count && topo.nodeIds[topo.count - 1] >= MAX_NODES) // don't fit the mask, list is sorted
+            --topo.count;
+        if(!topo.count)
+        {
+            topo.count = 1;
+            topo.nodeIds[0] = 0;
+        }
+        return topo;
+    }();
+    return res;
+}
+
+inline unsigned long long NumaPlacement::currentNode()
+{
+    unsigned int cpu = 0, nodeId = 0;
+    if(syscall(SYS_getcpu, &cpu, &nodeId, 0))
+        return 0;
+    const Topology & topo = topology();
+    for(unsigned long long node = 0; node < topo.count; ++node)
+    {
+        if(topo.nodeIds[node] == nodeId)
+            return node;
+    }
+    return 0;
+}
+
+inline bool NumaPlacement::setPolicy(void * ptr, size_t size, int mode, unsigned long long nodeMask)
+{
+    const unsigned long long pageSize = sysconf(_SC_PAGESIZE);
+    const unsigned long long begin = ((unsigned long long) ptr + pageSize - 1) & ~(pageSize - 1);
+    const unsigned long long end = ((unsigned long long) ptr + size) & ~(pageSize - 1);
+    if(end <= begin)
+        return true;
+    // MPOL_MF_MOVE also moves pages of the range that were touched already, malloc may hand back memory that was
+    return !syscall(SYS_mbind, begin, end - begin, mode, &nodeMask, MAX_NODES + 1, MPOL_MF_MOVE);
+}
+
+inline bool NumaPlacement::interleave(void * ptr, size_t size)
+{
+    const Topology & topo = topology();
+    if(topo.count < 2)
+        return true;
+    unsigned long long nodeMask = 0;
+    for(unsigned long long node = 0; node < topo.count; ++node)
+        nodeMask |= 1ULL << topo.nodeIds[node];
+    return setPolicy(ptr, size, MPOL_INTERLEAVE, nodeMask);
+}
+
+inline bool NumaPlacement::prefer(void * ptr, size_t size, unsigned long long node)
+{
+    const Topology & topo = topology();
+    if(topo.count < 2)
+        return true;
+    if(node >= topo.count)
+        return false;
+    return setPolicy(ptr, size, MPOL_PREFERRED, 1ULL << topo.nodeIds[node]);
+}
+
+inline bool NumaPlacement::bindThread(unsigned long long node)
+{
+    const Topology & topo = topology();
+    if(node >= topo.count)
+        return false;
+    char fileName[64];
+    snprintf(fileName, sizeof(fileName), "/sys/devices/system/node/node%llu/cpulist", topo.nodeIds[node]);
+    static const unsigned long long MAX_CPUS = CPU_SETSIZE;
+    unsigned long long cpus[MAX_CPUS];
+    const unsigned long long numCpus = parseList(fileName, cpus, MAX_CPUS);
+    if(!numCpus)
+        return false;
+    cpu_set_t cpuSet;
+    CPU_ZERO(&cpuSet);
+    for(unsigned long long cpuIdx = 0; cpuIdx < numCpus; ++cpuIdx)
+        CPU_SET(cpus[cpuIdx], &cpuSet);
+    return !sched_setaffinity(0, sizeof(cpuSet), &cpuSet);
+}
+
+#endif /* NUMAPLACEMENT_H_ */
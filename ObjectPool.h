@@ -12,6 +12,8 @@ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLI
 #include <stdexcept>
 #include <cstring>
 
+#include "HugePages.h"
+
 // Bullshittenator9000 single threaded object pool. Aquire continuous memory at the start. Have a tree of bitmaps, every chunk with size of cacheline.
 // On the lowest level 1 means element is free, on upper level 1 means chunk has free elements, etc , etc. Overhead is ~2 bit per element
 
@@ -117,8 +119,8 @@ public:
         return bitmap & (1ULL << (pos & 63ULL));
     }
 
-    // Pool size MUST be a multiple of 512
-    static void setUp(size_t in_poolSize)
+    // Pool size MUST be a multiple of 512, in_hugePages is HugePages::Policy of the storage
+    static void setUp(size_t in_poolSize, unsigned int in_hugePages = HugePages::HUGEPAGES_NONE)
     {
         if (in_poolSize % POOL_CHUNK_SIZE)
             abort();
@@ -126,7 +128,7 @@ public:
             abort();
         poolSize = in_poolSize;
         freeSize = poolSize;
-        storage = static_cast<T*>(std::malloc(sizeof(T)*poolSize));
+        storage = static_cast<T*>(HugePages::allocate(sizeof(T)*poolSize, in_hugePages));
         memset(storage, 0x0, poolSize * sizeof(T));
         size_t counter = poolSize;
         size_t prevCounter = counter;
@@ -171,7 +173,7 @@ public:
     {
         if (storage == nullptr)
             abort();
-        std::free(storage);
+        HugePages::release(storage);
         storage = nullptr;
         for (size_t i = 0; i < treeMapLevels; ++i)
             delete[] treeMap[i]; //TODO: leak checks!
@@ -321,6 +323,12 @@ public:
         return storage != nullptr;
     }
 
+    // backing the storage got, see HugePages.h
+    static HugePages::RegionStats storageStats()
+    {
+        return HugePages::stats(storage);
+    }
+
 private:
     static uint64_t * treeMap[BMP_TREE_HEIGHT];
     static T * storage;
@@ -0,0 +1,286 @@
+/*
+ * SectorArena.h
+ *
+ * Preallocated storage for tables that keep a variable length element array per bucket. Table slots are split into sectors
+ * of sectorSlots (1024 - 8192) slots and every sector owns an arena of sectorSlots * loadFactor elements plus a margin.
+ * Bucket arrays are contiguous runs in the arena of their sector, tracked by a used bitmap and a bitmap of run starts, so a
+ * run can be released by pointer alone. Runs grow and shrink by one element in place whenever the neighbouring slot allows
+ * it, which is what inserts and removes do all the time. Arena never grows: once a sector has no room alloc returns 0 and
+ * the caller overflows to heap, so memory stays flat no matter how long inserts and removes churn.
+ *
+ * Hands out raw memory only, constructing and moving elements is up to the caller. Bitmaps of a sector are guarded by a
+ * spin lock of that sector, held for bit flips only.
+ */
+
+#ifndef SECTORARENA_H_
+#define SECTORARENA_H_
+
+#include <cstdlib>
+#include <cstring>
+
+#include <x86intrin.h>
+
+template<typename T>
+class SectorArena
+{
+public:
+    static const unsigned long long MIN_SECTOR_SLOTS = 1024;
+    static const unsigned long long MAX_SECTOR_SLOTS = 8192;
+
+    // sectorSlots is rounded to power of 2 within MIN/MAX_SECTOR_SLOTS, loadFactor is what the table runs at
+    SectorArena(unsigned long long inNumSlots, unsigned long long inSectorSlots, double loadFactor);
+    ~SectorArena();
+
+    inline bool owns(const T * elements) const;
+    // run of count elements in sector of table slot, 0 if there is no room
+    inline T * alloc(unsigned long long slot, unsigned long long count);
+    // run grows by one, returns elements (grew at the end) or elements - 1 (grew at the front), 0 if neither neighbour is free
+    inline T * extend(T * elements, unsigned long long count, bool frontFirst);
+    // run of count > 1 drops its first or last element, returns new start
+    inline T * shrink(T * elements, unsigned long long count, bool front);
+    inline void release(T * elements);
+
+    unsigned long long sectorSlots() const
+    {
+        return 1ULL << sectorShift;
+    }
+    unsigned long long capacity() const
+    {
+        return numSectors * sectorCapacity;
+    }
+    unsigned long long used() const; // approximate while runs are allocated and released
+
+    // memory of a sector, sectors are laid out one after another. For placing it over NUMA nodes before runs land there
+    T * sectorElements(unsigned long long sectorIdx) const
+    {
+        return arena + sectorIdx * sectorCapacity;
+    }
+    unsigned long long elementsPerSector() const
+    {
+        return sectorCapacity;
+    }
+    unsigned long long sectorCount() const
+    {
+        return numSectors;
+    }
+
+private:
+    SectorArena(const SectorArena&) = delete;
+    SectorArena& operator=(const SectorArena&) = delete;
+
+    static const unsigned long long SECTOR_MARGIN_DIVISOR = 8; // arena is 1/8 over load factor to absorb bucket variance
+
+    struct Sector
+    {
+        unsigned long long lock; //8
+        unsigned long long usedCount; //8
+        char padding0[48]; // padding to cacheline
+    }__attribute__((aligned(64)));
+
+    inline void lockSector(unsigned long long sectorIdx);
+    inline void unlockSector(unsigned long long sectorIdx);
+    static inline bool testBit(const unsigned long long * bits, unsigned long long pos)
+    {
+        return bits[pos / 64ULL] & (1ULL << (pos % 64ULL));
+    }
+    static inline void setBit(unsigned long long * bits, unsigned long long pos)
+    {
+        bits[pos / 64ULL] |= (1ULL << (pos % 64ULL));
+    }
+    static inline void clearBit(unsigned long long * bits, unsigned long long pos)
+    {
+        bits[pos / 64ULL] &= ~(1ULL << (pos % 64ULL));
+    }
+
+    T * arena; //8
+    unsigned long long * usedBits; //8 bit per arena element
+    unsigned long long * startBits; //8 first element of every run
+    Sector * sectors; //8
+    unsigned long long numSlots; //8 table slots served, arrays of slots past that go to heap
+    unsigned long long sectorShift; //8 log2 of sector slots
+    unsigned long long sectorCapacity; //8 arena elements per sector, multiple of 64
+    unsigned long long numSectors; //8
+};
+
+template<typename T>
+inline SectorArena<T>::SectorArena(unsigned long long inNumSlots, unsigned long long inSectorSlots, double loadFactor) :
+                arena(0), usedBits(0), startBits(0), sectors(0), numSlots(inNumSlots), sectorShift(0), sectorCapacity(0), numSectors(0)
+{
+    while((1ULL << sectorShift) < inSectorSlots || (1ULL << sectorShift) < MIN_SECTOR_SLOTS)
+        ++sectorShift;
+    if((1ULL << sectorShift) > MAX_SECTOR_SLOTS)
+        sectorShift = __builtin_ctzll(MAX_SECTOR_SLOTS);
+    if(loadFactor <= 0.0 || loadFactor > 1.0)
+        loadFactor = 1.0;
+    sectorCapacity = (unsigned long long) ((1ULL << sectorShift) * loadFactor);
+    sectorCapacity += sectorCapacity / SECTOR_MARGIN_DIVISOR;
+    sectorCapacity = (sectorCapacity + 63ULL) & ~63ULL;
+    numSectors = (numSlots + (1ULL << sectorShift) - 1ULL) >> sectorShift;
+
+    arena = (T *) std::malloc(numSectors * sectorCapacity * sizeof(T)); // untouched pages cost nothing until runs land there
+    usedBits = (unsigned long long *) std::malloc(numSectors * sectorCapacity / 8ULL);
+    memset(usedBits, 0, numSectors * sectorCapacity / 8ULL);
+    startBits = (unsigned long long *) std::malloc(numSectors * sectorCapacity / 8ULL);
+    memset(startBits, 0, numSectors * sectorCapacity / 8ULL);
+    sectors = (Sector *) aligned_alloc(64, numSectors * sizeof(Sector));
+    memset((void *) sectors, 0, numSectors * sizeof(Sector));
+}
+
+template<typename T>
+inline SectorArena<T>::~SectorArena()
+{
+    std::free(arena);
+    std::free(usedBits);
+    std::free(startBits);
+    std::free(sectors);
+}
+
+template<typename T>
+inline void SectorArena<T>::lockSector(unsigned long long sectorIdx)
+{
+    while(__sync_lock_test_and_set(&(sectors[sectorIdx].lock), 1ULL))
+    {
+        while(__atomic_load_n(&(sectors[sectorIdx].lock), __ATOMIC_RELAXED))
+            _mm_pause();
+    }
+}
+
+template<typename T>
+inline void SectorArena<T>::unlockSector(unsigned long long sectorIdx)
+{
+    __sync_lock_release(&(sectors[sectorIdx].lock));
+}
+
+template<typename T>
+inline bool SectorArena<T>::owns(const T * elements) const
+{
+    return elements >= arena && elements < arena + numSectors * sectorCapacity;
+}
+
+// first fit, starting where the slot would be if the sector were packed evenly, so neighbouring buckets end up next to each
+// other and mostly have a free element between them to grow into
+template<typename T>
+inline T * SectorArena<T>::alloc(unsigned long long slot, unsigned long long count)
+{
+    if(slot >= numSlots || !count || count > sectorCapacity)
+        return 0;
+    const unsigned long long sectorIdx = slot >> sectorShift;
+    const unsigned long long sectorBase = sectorIdx * sectorCapacity;
+    unsigned long long pos = ((slot & ((1ULL << sectorShift) - 1ULL)) * sectorCapacity) >> sectorShift;
+    unsigned long long runLength = 0;
+    lockSector(sectorIdx);
+    for(unsigned long long scanned = 0; scanned < sectorCapacity + count; ++scanned)
+    {
+        if(!runLength && !(pos % 64ULL) && usedBits[(sectorBase + pos) / 64ULL] == 0xFFFFFFFFFFFFFFFFULL)
+        {
+            scanned += 63ULL; // full word
+            pos += 64ULL;
+        }
+        else if(testBit(usedBits, sectorBase + pos))
+        {
+            runLength = 0;
+            ++pos;
+        }
+        else if(++runLength == count)
+        {
+            const unsigned long long runStart = sectorBase + pos + 1ULL - count;
+            for(unsigned long long j = 0; j < count; ++j)
+                setBit(usedBits, runStart + j);
+            setBit(startBits, runStart);
+            sectors[sectorIdx].usedCount += count;
+            unlockSector(sectorIdx);
+            return arena + runStart;
+        }
+        else
+            ++pos;
+        if(pos >= sectorCapacity) // runs don't cross sectors
+        {
+            pos = 0;
+            runLength = 0;
+        }
+    }
+    unlockSector(sectorIdx);
+    return 0;
+}
+
+template<typename T>
+inline T * SectorArena<T>::extend(T * elements, unsigned long long count, bool frontFirst)
+{
+    const unsigned long long runStart = elements - arena;
+    const unsigned long long sectorIdx = runStart / sectorCapacity;
+    const unsigned long long sectorBase = sectorIdx * sectorCapacity;
+    const unsigned long long runEnd = runStart + count;
+    const bool canFront = runStart > sectorBase;
+    const bool canBack = runEnd < sectorBase + sectorCapacity;
+    T * res = 0;
+    lockSector(sectorIdx);
+    for(unsigned long long attempt = 0; attempt < 2 && !res; ++attempt)
+    {
+        if((attempt == 0) == frontFirst)
+        {
+            if(canFront && !testBit(usedBits, runStart - 1ULL))
+            {
+                setBit(usedBits, runStart - 1ULL);
+                clearBit(startBits, runStart);
+                setBit(startBits, runStart - 1ULL);
+                res = elements - 1;
+            }
+        }
+        else if(canBack && !testBit(usedBits, runEnd))
+        {
+            setBit(usedBits, runEnd);
+            res = elements;
+        }
+    }
+    if(res)
+        ++(sectors[sectorIdx].usedCount);
+    unlockSector(sectorIdx);
+    return res;
+}
+
+template<typename T>
+inline T * SectorArena<T>::shrink(T * elements, unsigned long long count, bool front)
+{
+    const unsigned long long runStart = elements - arena;
+    const unsigned long long sectorIdx = runStart / sectorCapacity;
+    lockSector(sectorIdx);
+    if(front)
+    {
+        clearBit(usedBits, runStart);
+        clearBit(startBits, runStart);
+        setBit(startBits, runStart + 1ULL);
+        ++elements;
+    }
+    else
+        clearBit(usedBits, runStart + count - 1ULL);
+    --(sectors[sectorIdx].usedCount);
+    unlockSector(sectorIdx);
+    return elements;
+}
+
+template<typename T>
+inline void SectorArena<T>::release(T * elements)
+{
+    const unsigned long long runStart = elements - arena;
+    const unsigned long long sectorIdx = runStart / sectorCapacity;
+    const unsigned long long sectorEnd = (sectorIdx + 1ULL) * sectorCapacity;
+    lockSector(sectorIdx);
+    clearBit(startBits, runStart);
+    clearBit(usedBits, runStart);
+    unsigned long long pos = runStart + 1ULL;
+    while(pos < sectorEnd && testBit(usedBits, pos) && !testBit(startBits, pos))
+        clearBit(usedBits, pos++);
+    sectors[sectorIdx].usedCount -= pos - runStart;
+    unlockSector(sectorIdx);
+}
+
+template<typename T>
+inline unsigned long long SectorArena<T>::used() const
+{
+    unsigned long long res = 0;
+    for(unsigned long long sectorIdx = 0; sectorIdx < numSectors; ++sectorIdx)
+        res += __atomic_load_n(&(sectors[sectorIdx].usedCount), __ATOMIC_RELAXED);
+    return res;
+}
+
+#endif /* SECTORARENA_H_ */
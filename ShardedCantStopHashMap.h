@@ -0,0 +1,358 @@
+/*
+ * ShardedCantStopHashMap.h
+ *
+ * Concurrent CantStopHashMap (SparseHashTableV2.h): keys are split over shards by the high bits of their mixed hash, every shard
+ * is a CantStopHashMap of its own behind a reader-writer spin lock, so the map keeps the density of the single threaded one. The
+ * shard map still places keys with the raw hash, low bits, so the two choices don't correlate. Like CantStopHashMap it needs a
+ * uniform HashFunc, identity std::hash of clustered integer keys overflows the 256 element buckets.
+ *
+ * Lock word of a shard holds the writer bit and a writer pending bit in the low half and the reader count in the high half. A
+ * writer that finds readers sets the pending bit, which keeps new readers out until a writer got in. Contended acquires back off
+ * and may park through LockContention.h. Reads take the shard lock shared: element and slot vectors of a bucket are reallocated
+ * and freed by writers, a reader not holding the lock could read freed memory.
+ */
+
+#ifndef SHARDEDCANTSTOPHASHMAP_H_
+#define SHARDEDCANTSTOPHASHMAP_H_
+
+#include <functional>
+#include <atomic>
+#include <cstdlib>
+#include <thread>
+#include <utility>
+
+#include "seededhash.hh"
+#include "LockContention.h"
+#include "SparseHashTableV2.h"
+
+template<typename K, typename V, class HashFunc = std::hash<K>, class KeyEqual = std::equal_to<K> >
+class ShardedCantStopHashMap
+{
+public:
+    typedef K key_type;
+    typedef V mapped_type;
+    typedef std::pair<const K, V> value_type;
+    typedef HashFunc hasher;
+    typedef CantStopHashMap<K, V, HashFunc, KeyEqual> shard_map_type;
+
+    static const unsigned long long SHARDS_PER_THREAD = 8; // default shard count per hardware thread
+    static const unsigned long long WRITER = 1ULL;
+    static const unsigned long long WRITER_PENDING = 2ULL;
+    static const unsigned long long READER_ONE = 1ULL << 32;
+    static const unsigned long long READERS = 0xFFFFFFFF00000000ULL;
+
+    struct Shard
+    {
+        unsigned long long lockWord; //8
+        shard_map_type map; //48
+
+        explicit Shard(unsigned long long inMaxElements) : lockWord(0), map(inMaxElements)
+        {
+        }
+
+        inline void lockShared(LockContention * contention);
+        inline void unlockShared();
+        inline void lockExclusive(LockContention * contention);
+        inline void unlockExclusive();
+    }__attribute__((aligned(64)));
+
+private:
+    ShardedCantStopHashMap(const ShardedCantStopHashMap&) = delete;
+    ShardedCantStopHashMap& operator=(const ShardedCantStopHashMap&) = delete;
+
+    Shard * shards; //8
+    unsigned long long numShards; //8
+    LockContention * lockContention; //8 backoff settings and counters of contended shard locks
+
+    inline Shard & shardOf(const K & inKey)
+    {
+        return shards[reduceRange(applyHash(HashFunc(), inKey), numShards)];
+    }
+
+public:
+    // inMaxElements is split evenly over the shards, every shard map is sized for its part. inShards 0 picks SHARDS_PER_THREAD per
+    // hardware thread
+    explicit ShardedCantStopHashMap(unsigned long long inMaxElements, unsigned long long inShards = 0,
+                                    unsigned long long inLockSpinBudget = LockContention::NEVER_PARK);
+    ~ShardedCantStopHashMap();
+
+    bool insert(const K & inKey, const V & inValue);
+    bool insert(const K & inKey, V && inValue);
+    bool put(const K & inKey, const V & inValue); // inserted(false) or set(true)
+    bool put(const K & inKey, V && inValue);
+    bool get(const K & inKey, V & inValue);
+    bool set(const K & inKey, const V & inValue);
+    bool set(const K & inKey, V && inValue);
+    bool remove(const K & inKey);
+
+    // emplace builds the pair from args first and drops it if key is there already. try_emplace constructs the value from args
+    // in place only if key is missing, args are left alone otherwise. NOTE: both true if inserted
+    template<class... Args>
+    bool emplace(Args&&... args);
+    template<class... Args>
+    bool try_emplace(const K & inKey, Args&&... args);
+
+    // read-modify-write with the shard locked exclusive. updater(V &) changes the value in place, upsert calls factory() for the
+    // value of a missing key
+    template<class Updater>
+    bool update(const K & inKey, Updater updater); // NOTE: false if key is missing
+    template<class Factory, class Updater>
+    bool upsert(const K & inKey, Factory factory, Updater updater); // NOTE: true if inserted
+
+    unsigned long long shardCount() const
+    {
+        return numShards;
+    }
+    // contended shard lock acquires since construction or resetLockStats, hotLock is the lock word of the most contended shard
+    LockContention::Stats lockStats() const
+    {
+        return lockContention->stats();
+    }
+    void resetLockStats()
+    {
+        lockContention->reset();
+    }
+};
+
+template<typename K, typename V, class HashFunc, class KeyEqual>
+void ShardedCantStopHashMap<K, V, HashFunc, KeyEqual>::Shard::lockShared(LockContention * contention)
+{
+    unsigned long long expected = __atomic_load_n(&lockWord, __ATOMIC_RELAXED);
+    if(!(expected & (WRITER | WRITER_PENDING)) && __atomic_compare_exchange_n(&lockWord, &expected, expected + READER_ONE, false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+        return;
+    LockContention::Waiter waiter(contention, &lockWord);
+    while(true)
+    {
+        if(expected & (WRITER | WRITER_PENDING))
+        {
+            waiter.wait(expected, WRITER | WRITER_PENDING);
+            expected = __atomic_load_n(&lockWord, __ATOMIC_RELAXED);
+            continue;
+        }
+        if(__atomic_compare_exchange_n(&lockWord, &expected, expected + READER_ONE, false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+            break;
+    }
+}
+
+// last reader out wakes writers parked on the reader count
+template<typename K, typename V, class HashFunc, class KeyEqual>
+void ShardedCantStopHashMap<K, V, HashFunc, KeyEqual>::Shard::unlockShared()
+{
+    const unsigned long long previous = __atomic_fetch_sub(&lockWord, READER_ONE, __ATOMIC_RELEASE);
+    if((previous & READERS) == READER_ONE)
+        LockContention::wake(&lockWord, READERS);
+}
+
+template<typename K, typename V, class HashFunc, class KeyEqual>
+void ShardedCantStopHashMap<K, V, HashFunc, KeyEqual>::Shard::lockExclusive(LockContention * contention)
+{
+    unsigned long long expected = __atomic_load_n(&lockWord, __ATOMIC_RELAXED);
+    if(!(expected & (WRITER | READERS)) && __atomic_compare_exchange_n(&lockWord, &expected, (expected & ~WRITER_PENDING) | WRITER, false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+        return;
+    LockContention::Waiter waiter(contention, &lockWord);
+    while(true)
+    {
+        if(expected & WRITER)
+        {
+            waiter.wait(expected, WRITER);
+            expected = __atomic_load_n(&lockWord, __ATOMIC_RELAXED);
+            continue;
+        }
+        if(expected & READERS)
+        {
+            if(!(expected & WRITER_PENDING) && !__atomic_compare_exchange_n(&lockWord, &expected, expected | WRITER_PENDING, false, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+                continue; // expected got the current word
+            waiter.wait(expected | WRITER_PENDING, READERS);
+            expected = __atomic_load_n(&lockWord, __ATOMIC_RELAXED);
+            continue;
+        }
+        if(__atomic_compare_exchange_n(&lockWord, &expected, (expected & ~WRITER_PENDING) | WRITER, false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+            break;
+    }
+}
+
+template<typename K, typename V, class HashFunc, class KeyEqual>
+void ShardedCantStopHashMap<K, V, HashFunc, KeyEqual>::Shard::unlockExclusive()
+{
+    __atomic_fetch_and(&lockWord, ~WRITER, __ATOMIC_RELEASE);
+    LockContention::wake(&lockWord, WRITER);
+}
+
+template<typename K, typename V, class HashFunc, class KeyEqual>
+ShardedCantStopHashMap<K, V, HashFunc, KeyEqual>::ShardedCantStopHashMap(unsigned long long inMaxElements, unsigned long long inShards,
+                                                                         unsigned long long inLockSpinBudget) :
+                shards(0), numShards(inShards), lockContention(new LockContention(inLockSpinBudget))
+{
+    if(!numShards)
+    {
+        const unsigned long long numThreads = std::thread::hardware_concurrency();
+        numShards = (numThreads ? numThreads : 1ULL) * SHARDS_PER_THREAD;
+    }
+    shards = (Shard *) aligned_alloc(64, numShards * sizeof(Shard));
+    if(!shards)
+        abort();
+    for(unsigned long long shardIdx = 0; shardIdx < numShards; ++shardIdx)
+        new (&shards[shardIdx]) Shard(inMaxElements / numShards + 1);
+}
+
+template<typename K, typename V, class HashFunc, class KeyEqual>
+ShardedCantStopHashMap<K, V, HashFunc, KeyEqual>::~ShardedCantStopHashMap()
+{
+    for(unsigned long long shardIdx = 0; shardIdx < numShards; ++shardIdx)
+        shards[shardIdx].~Shard();
+    free(shards);
+    delete lockContention;
+}
+
+template<typename K, typename V, class HashFunc, class KeyEqual>
+bool ShardedCantStopHashMap<K, V, HashFunc, KeyEqual>::insert(const K & inKey, const V & inValue)
+{
+    Shard & shard = shardOf(inKey);
+    shard.lockExclusive(lockContention);
+    const bool res = shard.map.insert(inKey, inValue);
+    shard.unlockExclusive();
+    return res;
+}
+
+template<typename K, typename V, class HashFunc, class KeyEqual>
+bool ShardedCantStopHashMap<K, V, HashFunc, KeyEqual>::insert(const K & inKey, V && inValue)
+{
+    Shard & shard = shardOf(inKey);
+    shard.lockExclusive(lockContention);
+    const bool res = shard.map.insert(inKey, std::move(inValue));
+    shard.unlockExclusive();
+    return res;
+}
+
+template<typename K, typename V, class HashFunc, class KeyEqual>
+bool ShardedCantStopHashMap<K, V, HashFunc, KeyEqual>::put(const K & inKey, const V & inValue)
+{
+    Shard & shard = shardOf(inKey);
+    shard.lockExclusive(lockContention);
+    const bool res = shard.map.put(inKey, inValue);
+    shard.unlockExclusive();
+    return res;
+}
+
+template<typename K, typename V, class HashFunc, class KeyEqual>
+bool ShardedCantStopHashMap<K, V, HashFunc, KeyEqual>::put(const K & inKey, V && inValue)
+{
+    Shard & shard = shardOf(inKey);
+    shard.lockExclusive(lockContention);
+    const bool res = shard.map.put(inKey, std::move(inValue));
+    shard.unlockExclusive();
+    return res;
+}
+
+template<typename K, typename V, class HashFunc, class KeyEqual>
+bool ShardedCantStopHashMap<K, V, HashFunc, KeyEqual>::get(const K & inKey, V & inValue)
+{
+    Shard & shard = shardOf(inKey);
+    shard.lockShared(lockContention);
+    const bool res = shard.map.get(inKey, inValue);
+    shard.unlockShared();
+    return res;
+}
+
+template<typename K, typename V, class HashFunc, class KeyEqual>
+bool ShardedCantStopHashMap<K, V, HashFunc, KeyEqual>::set(const K & inKey, const V & inValue)
+{
+    Shard & shard = shardOf(inKey);
+    shard.lockExclusive(lockContention);
+    const bool res = shard.map.set(inKey, inValue);
+    shard.unlockExclusive();
+    return res;
+}
+
+template<typename K, typename V, class HashFunc, class KeyEqual>
+bool ShardedCantStopHashMap<K, V, HashFunc, KeyEqual>::set(const K & inKey, V && inValue)
+{
+    Shard & shard = shardOf(inKey);
+    shard.lockExclusive(lockContention);
+    const bool res = shard.map.set(inKey, std::move(inValue));
+    shard.unlockExclusive();
+    return res;
+}
+
+template<typename K, typename V, class HashFunc, class KeyEqual>
+bool ShardedCantStopHashMap<K, V, HashFunc, KeyEqual>::remove(const K & inKey)
+{
+    Shard & shard = shardOf(inKey);
+    shard.lockExclusive(lockContention);
+    const bool res = shard.map.remove(inKey);
+    shard.unlockExclusive();
+    return res;
+}
+
+// pair is built before the shard is known, outside the lock
+template<typename K, typename V, class HashFunc, class KeyEqual>
+template<class... Args>
+bool ShardedCantStopHashMap<K, V, HashFunc, KeyEqual>::emplace(Args&&... args)
+{
+    std::pair<K, V> newElement(std::forward<Args>(args)...);
+    Shard & shard = shardOf(newElement.first);
+    shard.lockExclusive(lockContention);
+    const bool res = shard.map.try_emplace(std::move(newElement.first), std::move(newElement.second));
+    shard.unlockExclusive();
+    return res;
+}
+
+template<typename K, typename V, class HashFunc, class KeyEqual>
+template<class... Args>
+bool ShardedCantStopHashMap<K, V, HashFunc, KeyEqual>::try_emplace(const K & inKey, Args&&... args)
+{
+    Shard & shard = shardOf(inKey);
+    shard.lockExclusive(lockContention);
+    const bool res = shard.map.try_emplace(inKey, std::forward<Args>(args)...);
+    shard.unlockExclusive();
+    return res;
+}
+
+template<typename K, typename V, class HashFunc, class KeyEqual>
+template<class Updater>
+bool ShardedCantStopHashMap<K, V, HashFunc, KeyEqual>::update(const K & inKey, Updater updater)
+{
+    auto elementUpdater = [&updater](value_type & element) { updater(element.second); };
+    Shard & shard = shardOf(inKey);
+    shard.lockExclusive(lockContention);
+    const bool res = shard.map.update_internal(inKey, elementUpdater);
+    shard.unlockExclusive();
+    return res;
+}
+
+template<typename K, typename V, class HashFunc, class KeyEqual>
+template<class Factory, class Updater>
+bool ShardedCantStopHashMap<K, V, HashFunc, KeyEqual>::upsert(const K & inKey, Factory factory, Updater updater)
+{
+    auto constructor = [&inKey, &factory](std::vector<value_type> & elements) { elements.emplace_back(inKey, factory()); };
+    auto elementUpdater = [&updater](value_type & element) { updater(element.second); };
+    Shard & shard = shardOf(inKey);
+    shard.lockExclusive(lockContention);
+    const bool res = shard.map.upsert_internal(inKey, constructor, elementUpdater);
+    shard.unlockExclusive();
+    return res;
+}
+
+/*
+    // Sample, counting words from many threads. 8 shards per hardware thread by default, reads of different shards never touch
+    // the same lock word
+
+    ShardedCantStopHashMap<std::string, unsigned long long> counts(10000000);
+    std::vector<std::thread> threads;
+    for(unsigned long long threadIdx = 0; threadIdx < numThreads; ++threadIdx)
+        threads.emplace_back([&, threadIdx]
+        {
+            for(const std::string & word : words[threadIdx])
+                counts.upsert(word, []() { return 1ULL; }, [](unsigned long long & count) { ++count; });
+        });
+    for(auto & thread : threads)
+        thread.join();
+    unsigned long long count;
+    if(counts.get("the", count))
+        printf("the: %llu\n", count);
+    LockContention::Stats stats = counts.lockStats();
+    printf("%llu contended shard locks, %llu spins\n", stats.contendedAcquires, stats.spins);
+
+*/
+
+#endif /* SHARDEDCANTSTOPHASHMAP_H_ */
@@ -4,6 +4,8 @@
 #include <memory>
 #include <vector>
 
+#include "bittwiddlinghacks.hh"
+
 template<typename T, unsigned long long HOLY_GRAIL_SIZE = 64>
 class SparseArray
 {
@@ -48,8 +50,6 @@ public:
 private:
     char padding0[40]; // padding to cacheline
 
-    unsigned long long googlerank(const unsigned char *bm, unsigned long long pos);
-    unsigned long long bits_in_char(unsigned char c);
 
 
 public:
@@ -69,42 +69,6 @@ public:
 
 }__attribute__((aligned(CACHE_LINE_SIZE)));
 
-template<typename T, unsigned long long HOLY_GRAIL_SIZE>
-unsigned long long SparseArray<T, HOLY_GRAIL_SIZE>::bits_in_char(unsigned char c)
-{
-  // We could make these ints.  The tradeoff is size (eg does it overwhelm
-  // the cache?) vs efficiency in referencing sub-word-sized array buckets.
-  static __thread const char bits_in[256] =
-  {
-    0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4,
-    1, 2, 2, 3, 2, 3, 3, 4, 2, 3, 3, 4, 3, 4, 4, 5,
-    1, 2, 2, 3, 2, 3, 3, 4, 2, 3, 3, 4, 3, 4, 4, 5,
-    2, 3, 3, 4, 3, 4, 4, 5, 3, 4, 4, 5, 4, 5, 5, 6,
-    1, 2, 2, 3, 2, 3, 3, 4, 2, 3, 3, 4, 3, 4, 4, 5,
-    2, 3, 3, 4, 3, 4, 4, 5, 3, 4, 4, 5, 4, 5, 5, 6,
-    2, 3, 3, 4, 3, 4, 4, 5, 3, 4, 4, 5, 4, 5, 5, 6,
-    3, 4, 4, 5, 4, 5, 5, 6, 4, 5, 5, 6, 5, 6, 6, 7,
-    1, 2, 2, 3, 2, 3, 3, 4, 2, 3, 3, 4, 3, 4, 4, 5,
-    2, 3, 3, 4, 3, 4, 4, 5, 3, 4, 4, 5, 4, 5, 5, 6,
-    2, 3, 3, 4, 3, 4, 4, 5, 3, 4, 4, 5, 4, 5, 5, 6,
-    3, 4, 4, 5, 4, 5, 5, 6, 4, 5, 5, 6, 5, 6, 6, 7,
-    2, 3, 3, 4, 3, 4, 4, 5, 3, 4, 4, 5, 4, 5, 5, 6,
-    3, 4, 4, 5, 4, 5, 5, 6, 4, 5, 5, 6, 5, 6, 6, 7,
-    3, 4, 4, 5, 4, 5, 5, 6, 4, 5, 5, 6, 5, 6, 6, 7,
-    4, 5, 5, 6, 5, 6, 6, 7, 5, 6, 6, 7, 6, 7, 7, 8,
-  };
-  return bits_in[c];
-}
-
-template<typename T, unsigned long long HOLY_GRAIL_SIZE>
-unsigned long long SparseArray<T, HOLY_GRAIL_SIZE>::googlerank(const unsigned char *bm, unsigned long long pos)
-{
-    unsigned long long retval = 0;
-  for (; pos > 8ULL; pos -= 8ULL)
-      retval += bits_in_char(*bm++);
-  return retval + bits_in_char(*bm & ((1ULL << pos)-1ULL));
-}
-
 template<typename T, unsigned long long HOLY_GRAIL_SIZE>
 void SparseArray<T, HOLY_GRAIL_SIZE>::swap(SparseArray<T, HOLY_GRAIL_SIZE>& other)
 {
@@ -136,7 +100,7 @@ SparseArray<T, HOLY_GRAIL_SIZE>::~SparseArray()
         SparseArrayBucket * bucket = &(buckets[bucketPos]);
         if (bucket)
         {
-            unsigned long long count = googlerank((const unsigned char*) bucket->bitmap, HOLY_GRAIL_SIZE/BITS_PER_BYTE);
+            unsigned long long count = rankBitmap((const unsigned long long*) bucket->bitmap, HOLY_GRAIL_SIZE);
             for(unsigned long long j = 0; j < count; ++j)
             {
                 bucket->elements[j].~T();
@@ -162,7 +126,7 @@ SparseArray<T, HOLY_GRAIL_SIZE>::SparseArray(const SparseArray<T, HOLY_GRAIL_SIZ
         T * otherbucket = &(other.buckets[bucketPos]);
         if (otherbucket)
         {
-            unsigned long long count = googlerank((const unsigned char*) otherbucket->bitmap, HOLY_GRAIL_SIZE/BITS_PER_BYTE);
+            unsigned long long count = rankBitmap((const unsigned long long*) otherbucket->bitmap, HOLY_GRAIL_SIZE);
             bucket->elements = (T*) std::malloc(count*sizeof(T));
             for(unsigned long long j = 0; j < count; ++j)
             {
@@ -192,7 +156,7 @@ bool SparseArray<T, HOLY_GRAIL_SIZE>::get(unsigned long long idx, T & outValue)
     SparseArrayBucket * const bucket = &(buckets[bucketPos]);
     if(bucket->bitmapTest(bucketOffset))
     {
-        const unsigned long long rank = googlerank((const unsigned char*) bucket->bitmap, bucketOffset + 1);
+        const unsigned long long rank = rankBitmap((const unsigned long long*) bucket->bitmap, bucketOffset + 1);
         outValue = bucket->elements[rank-1];
         return true;
     }
@@ -207,7 +171,7 @@ bool SparseArray<T, HOLY_GRAIL_SIZE>::set(unsigned long long idx, const T & inVa
     SparseArrayBucket * const bucket = &(buckets[bucketPos]);
     if(bucket->bitmapTest(bucketOffset))
     {
-        const unsigned long long rank = googlerank((const unsigned char*) bucket->bitmap, bucketOffset + 1);
+        const unsigned long long rank = rankBitmap((const unsigned long long*) bucket->bitmap, bucketOffset + 1);
         bucket->elements[rank-1] = inValue;
         return true;
     }
@@ -229,8 +193,8 @@ bool SparseArray<T, HOLY_GRAIL_SIZE>::add(unsigned long long idx, const T & inVa
     }
     else if (!bucket->bitmapTest(bucketOffset))
     {
-        const unsigned long long count = googlerank((const unsigned char*) bucket->bitmap, HOLY_GRAIL_SIZE);
-        const unsigned long long rank = googlerank((const unsigned char*) bucket->bitmap, bucketOffset + 1);
+        const unsigned long long count = rankBitmap((const unsigned long long*) bucket->bitmap, HOLY_GRAIL_SIZE);
+        const unsigned long long rank = rankBitmap((const unsigned long long*) bucket->bitmap, bucketOffset + 1);
         bucket->elements = (T*) std::realloc(bucket->elements, (count + 1) * sizeof(T));
         if(rank < count)
             memmove(bucket->elements + rank + 1, bucket->elements + rank, (count - rank) * sizeof(T));
@@ -251,7 +215,7 @@ bool SparseArray<T, HOLY_GRAIL_SIZE>::remove(unsigned long long idx)
 
     if (bucket->bitmapTest(bucketOffset))
     {
-        const unsigned long long count = googlerank((const unsigned char*) bucket->bitmap, HOLY_GRAIL_SIZE);
+        const unsigned long long count = rankBitmap((const unsigned long long*) bucket->bitmap, HOLY_GRAIL_SIZE);
         if (count == 1)
         {
             std::free(bucket->elements);
@@ -259,7 +223,7 @@ bool SparseArray<T, HOLY_GRAIL_SIZE>::remove(unsigned long long idx)
         }
         else
         {
-            const unsigned long long rank = googlerank((const unsigned char*) bucket->bitmap, bucketOffset + 1);
+            const unsigned long long rank = rankBitmap((const unsigned long long*) bucket->bitmap, bucketOffset + 1);
             if(rank < count)
                 memmove(bucket->elements + rank - 1, bucket->elements + rank, (count - rank) * sizeof(T));
             bucket->elements = (T*) std::realloc(bucket->elements, (count - 1) * sizeof(T));
@@ -6,11 +6,14 @@
 #include <climits>
 #include <utility>
 #include <memory>
+#include <tuple>
 #include <array>
 #include <vector>
 #include <deque>
 #include <algorithm>
 
+#include "bittwiddlinghacks.hh"
+
 template <
     typename K,
     typename V,
@@ -68,50 +71,11 @@ struct CantStopHashMap
             bitmap[offset / CHAR_BIT] &= ~(1 << (offset % CHAR_BIT));
         }
 
-        // TODO: intrinsics for MSVC/GCC/CLANG here 256 bit -> 128 bit -> 64 bit -> 64 bit masked
-        inline size_t rank_at_pos_lookup(size_t pos)
-        {
-            size_t retval = 0;
-            const size_t pos_copy = pos;
-            static constexpr char bits_in_char[256] =
-            {
-                0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4,
-                1, 2, 2, 3, 2, 3, 3, 4, 2, 3, 3, 4, 3, 4, 4, 5,
-                1, 2, 2, 3, 2, 3, 3, 4, 2, 3, 3, 4, 3, 4, 4, 5,
-                2, 3, 3, 4, 3, 4, 4, 5, 3, 4, 4, 5, 4, 5, 5, 6,
-                1, 2, 2, 3, 2, 3, 3, 4, 2, 3, 3, 4, 3, 4, 4, 5,
-                2, 3, 3, 4, 3, 4, 4, 5, 3, 4, 4, 5, 4, 5, 5, 6,
-                2, 3, 3, 4, 3, 4, 4, 5, 3, 4, 4, 5, 4, 5, 5, 6,
-                3, 4, 4, 5, 4, 5, 5, 6, 4, 5, 5, 6, 5, 6, 6, 7,
-                1, 2, 2, 3, 2, 3, 3, 4, 2, 3, 3, 4, 3, 4, 4, 5,
-                2, 3, 3, 4, 3, 4, 4, 5, 3, 4, 4, 5, 4, 5, 5, 6,
-                2, 3, 3, 4, 3, 4, 4, 5, 3, 4, 4, 5, 4, 5, 5, 6,
-                3, 4, 4, 5, 4, 5, 5, 6, 4, 5, 5, 6, 5, 6, 6, 7,
-                2, 3, 3, 4, 3, 4, 4, 5, 3, 4, 4, 5, 4, 5, 5, 6,
-                3, 4, 4, 5, 4, 5, 5, 6, 4, 5, 5, 6, 5, 6, 6, 7,
-                3, 4, 4, 5, 4, 5, 5, 6, 4, 5, 5, 6, 5, 6, 6, 7,
-                4, 5, 5, 6, 5, 6, 6, 7, 5, 6, 6, 7, 6, 7, 7, 8,
-            };
-            const unsigned char *bm = (const unsigned char *)bitmap;
-            for (; pos > 8ULL; pos -= 8ULL)
-                retval += bits_in_char[*bm++];
-            const auto res = retval + bits_in_char[*bm & ((1ULL << pos) - 1ULL)];
-            //const auto res1 = rank_at_pos(pos_copy);
-            //if (res != res1)
-            //    abort();
-            return res;
-        }
-
+        // 640 bits, AVX-512 VPOPCNTQ gets used for ranks past RANK_AVX512_MIN_BITS where CPU has it
         inline size_t rank_at_pos(size_t pos)
         {
-            size_t retval = 0;
-            const unsigned long long * bm = (const unsigned long long *) bitmap;
-            for (; pos >= 64ULL; pos -= 64ULL)
-                retval += __builtin_popcountll(*bm++);
-            return retval + (pos ? __builtin_popcountll(*bm & ((1ULL << pos) - 1ULL)) : 0);
+            return rankBitmap((const unsigned long long *) bitmap, pos);
         }
-
-
     };
 
     std::vector<CantStopHashMapBucket> buckets;   // 24
@@ -121,10 +85,31 @@ struct CantStopHashMap
 
     explicit CantStopHashMap(size_t in_max_elements);
     bool insert(const K &key, const V &value);
+    bool insert(const K &key, V &&value);
     bool put(const K &key, const V &value); // inserted(false) or set(true)
+    bool put(const K &key, V &&value);
     bool get(const K &key, V &value);
     bool set(const K &key, const V &value);
+    bool set(const K &key, V &&value);
     bool remove(const K &key);
+
+    // emplace builds the pair from args first and drops it if key is there already. try_emplace constructs the value from args
+    // in place only if key is missing, args are left alone otherwise. NOTE: both true if inserted
+    template <class... Args>
+    bool emplace(Args &&...args);
+    template <class... Args>
+    bool try_emplace(const K &key, Args &&...args);
+    template <class... Args>
+    bool try_emplace(K &&key, Args &&...args);
+
+    // constructor(std::vector<value_type> &) appends the new element, updater(value_type &) changes the existing one. true if inserted
+    template <class Constructor, class Updater>
+    bool upsert_internal(const K &key, Constructor &constructor, Updater &updater);
+    // updater(value_type &) changes the existing element in place. false if key is missing
+    template <class Updater>
+    bool update_internal(const K &key, Updater &updater);
+    template <class VV>
+    bool set_internal(const K &key, VV &&value);
 };
 
 template <typename K, typename V, typename HashFunc, typename KeyEqual, typename Allocator>
@@ -137,18 +122,85 @@ CantStopHashMap<K, V, HashFunc, KeyEqual, Allocator>::CantStopHashMap(size_t in_
 
 template <typename K, typename V, typename HashFunc, typename KeyEqual, typename Allocator>
 bool CantStopHashMap<K, V, HashFunc, KeyEqual, Allocator>::insert(const K &key, const V &value)
+{
+    auto constructor = [&key, &value](std::vector<value_type> &elements) { elements.emplace_back(key, value); };
+    auto updater = [](value_type &) {};
+    return upsert_internal(key, constructor, updater);
+}
+
+template <typename K, typename V, typename HashFunc, typename KeyEqual, typename Allocator>
+bool CantStopHashMap<K, V, HashFunc, KeyEqual, Allocator>::insert(const K &key, V &&value)
+{
+    auto constructor = [&key, &value](std::vector<value_type> &elements) { elements.emplace_back(key, std::move(value)); };
+    auto updater = [](value_type &) {};
+    return upsert_internal(key, constructor, updater);
+}
+
+template <typename K, typename V, typename HashFunc, typename KeyEqual, typename Allocator>
+bool CantStopHashMap<K, V, HashFunc, KeyEqual, Allocator>::put(const K &key, const V &value)
+{
+    auto constructor = [&key, &value](std::vector<value_type> &elements) { elements.emplace_back(key, value); };
+    auto updater = [&value](value_type &element) { element.second = value; };
+    return !upsert_internal(key, constructor, updater);
+}
+
+template <typename K, typename V, typename HashFunc, typename KeyEqual, typename Allocator>
+bool CantStopHashMap<K, V, HashFunc, KeyEqual, Allocator>::put(const K &key, V &&value)
+{
+    auto constructor = [&key, &value](std::vector<value_type> &elements) { elements.emplace_back(key, std::move(value)); };
+    auto updater = [&value](value_type &element) { element.second = std::move(value); };
+    return !upsert_internal(key, constructor, updater);
+}
+
+template <typename K, typename V, typename HashFunc, typename KeyEqual, typename Allocator>
+template <class... Args>
+bool CantStopHashMap<K, V, HashFunc, KeyEqual, Allocator>::emplace(Args &&...args)
+{
+    std::pair<K, V> new_element(std::forward<Args>(args)...); // non const key so it can be moved in
+    auto constructor = [&new_element](std::vector<value_type> &elements) { elements.emplace_back(std::move(new_element)); };
+    auto updater = [](value_type &) {};
+    return upsert_internal(new_element.first, constructor, updater);
+}
+
+template <typename K, typename V, typename HashFunc, typename KeyEqual, typename Allocator>
+template <class... Args>
+bool CantStopHashMap<K, V, HashFunc, KeyEqual, Allocator>::try_emplace(const K &key, Args &&...args)
+{
+    auto constructor = [&](std::vector<value_type> &elements)
+    {
+        elements.emplace_back(std::piecewise_construct, std::forward_as_tuple(key), std::forward_as_tuple(std::forward<Args>(args)...));
+    };
+    auto updater = [](value_type &) {};
+    return upsert_internal(key, constructor, updater);
+}
+
+// key is compared against before it is moved into the new element
+template <typename K, typename V, typename HashFunc, typename KeyEqual, typename Allocator>
+template <class... Args>
+bool CantStopHashMap<K, V, HashFunc, KeyEqual, Allocator>::try_emplace(K &&key, Args &&...args)
+{
+    auto constructor = [&](std::vector<value_type> &elements)
+    {
+        elements.emplace_back(std::piecewise_construct, std::forward_as_tuple(std::move(key)), std::forward_as_tuple(std::forward<Args>(args)...));
+    };
+    auto updater = [](value_type &) {};
+    return upsert_internal(key, constructor, updater);
+}
+
+template <typename K, typename V, typename HashFunc, typename KeyEqual, typename Allocator>
+template <class Constructor, class Updater>
+bool CantStopHashMap<K, V, HashFunc, KeyEqual, Allocator>::upsert_internal(const K &key, Constructor &constructor, Updater &updater)
 {
     const size_t key_hash = HashFunc()(key);
     size_t idx = key_hash % max_elements;
     size_t bucket_idx = idx / SLOTS_PER_BUCKET;
     size_t bucket_offset = idx % SLOTS_PER_BUCKET;
-    size_t rank = buckets[bucket_idx].rank_at_pos(bucket_offset + 1);
 
     if (buckets[bucket_idx].elements.empty())
     {
         buckets[bucket_idx].bitmap_set(bucket_offset);
         buckets[bucket_idx].slots.push_back(0);
-        buckets[bucket_idx].elements.emplace_back(key, value);
+        constructor(buckets[bucket_idx].elements);
         return true;
     }
     else
@@ -161,7 +213,10 @@ bool CantStopHashMap<K, V, HashFunc, KeyEqual, Allocator>::insert(const K &key,
             if (elementExists)
             {
                 if (buckets[bucket_idx].elements[buckets[bucket_idx].slots[rank - 1]].first == key)
+                {
+                    updater(buckets[bucket_idx].elements[buckets[bucket_idx].slots[rank - 1]]);
                     return false;
+                }
                 else
                 {
                     stepBack = true;
@@ -177,7 +232,7 @@ bool CantStopHashMap<K, V, HashFunc, KeyEqual, Allocator>::insert(const K &key,
                         {
                             buckets[bucket_idx].bitmap_set(bucket_offset);
                             buckets[bucket_idx].slots.push_back(0);
-                            buckets[bucket_idx].elements.emplace_back(key, value);
+                            constructor(buckets[bucket_idx].elements);
                             return true;
                         }
                     }
@@ -187,10 +242,9 @@ bool CantStopHashMap<K, V, HashFunc, KeyEqual, Allocator>::insert(const K &key,
             {
                 if (stepBack)
                     --rank;
-                size_t count = buckets[bucket_idx].elements.size();
                 unsigned char new_slot = buckets[bucket_idx].elements.size();
                 buckets[bucket_idx].slots.insert(buckets[bucket_idx].slots.begin()+rank, new_slot);
-                buckets[bucket_idx].elements.emplace_back(key, value);
+                constructor(buckets[bucket_idx].elements);
                 buckets[bucket_idx].bitmap_set(bucket_offset);
                 return true;
             }
@@ -199,7 +253,8 @@ bool CantStopHashMap<K, V, HashFunc, KeyEqual, Allocator>::insert(const K &key,
 }
 
 template <typename K, typename V, typename HashFunc, typename KeyEqual, typename Allocator>
-bool CantStopHashMap<K, V, HashFunc, KeyEqual, Allocator>::put(const K &key, const V &value)
+template <class Updater>
+bool CantStopHashMap<K, V, HashFunc, KeyEqual, Allocator>::update_internal(const K &key, Updater &updater)
 {
     const size_t key_hash = HashFunc()(key);
     size_t idx = key_hash % max_elements;
@@ -207,61 +262,27 @@ bool CantStopHashMap<K, V, HashFunc, KeyEqual, Allocator>::put(const K &key, con
     size_t bucket_offset = idx % SLOTS_PER_BUCKET;
     size_t rank = buckets[bucket_idx].rank_at_pos(bucket_offset + 1);
 
-    if (buckets[bucket_idx].elements.empty())
-    {
-        buckets[bucket_idx].bitmap_set(bucket_offset);
-        buckets[bucket_idx].slots.push_back(0);
-        buckets[bucket_idx].elements.emplace_back(key, value);
-        return false;
-    }
-    else
+    while (buckets[bucket_idx].bitmap_test(bucket_offset)) // linear probing
     {
-        bool stepBack = false; // to avoid extra rank calculation later
-        size_t rank = buckets[bucket_idx].rank_at_pos(bucket_offset + 1);
-        while (true) // linear probing
+        if (buckets[bucket_idx].elements[buckets[bucket_idx].slots[rank - 1]].first == key)
         {
-            bool elementExists = buckets[bucket_idx].bitmap_test(bucket_offset);
-            if (elementExists)
-            {
-                if (buckets[bucket_idx].elements[buckets[bucket_idx].slots[rank - 1]].first == key)
-                {
-                    buckets[bucket_idx].elements[buckets[bucket_idx].slots[rank - 1]].second = value;
-                    return true;
-                }
-                else
-                {
-                    stepBack = true;
-                    ++rank;
-                    ++bucket_offset;
-                    idx = (idx + 1) % max_elements;
-                    if (bucket_offset == SLOTS_PER_BUCKET || !idx)
-                    {
-                        rank = 1;
-                        bucket_idx = idx / SLOTS_PER_BUCKET;
-                        bucket_offset = idx % SLOTS_PER_BUCKET;
-                        if (buckets[bucket_idx].elements.empty())
-                        {
-                            buckets[bucket_idx].bitmap_set(bucket_offset);
-                            buckets[bucket_idx].slots.push_back(0);
-                            buckets[bucket_idx].elements.emplace_back(key, value);
-                            return false;
-                        }
-                    }
-                }
-            }
-            else
+            updater(buckets[bucket_idx].elements[buckets[bucket_idx].slots[rank - 1]]);
+            return true;
+        }
+        else
+        {
+            ++rank;
+            ++bucket_offset;
+            idx = (idx + 1) % max_elements;
+            if (bucket_offset == SLOTS_PER_BUCKET || !idx)
             {
-                if (stepBack)
-                    --rank;
-                size_t count = buckets[bucket_idx].elements.size();;
-                unsigned char new_slot = buckets[bucket_idx].elements.size();
-                buckets[bucket_idx].slots.insert(buckets[bucket_idx].slots.begin()+rank, new_slot);
-                buckets[bucket_idx].elements.emplace_back(key, value);
-                buckets[bucket_idx].bitmap_set(bucket_offset);
-                return false;
+                rank = 1;
+                bucket_idx = idx / SLOTS_PER_BUCKET;
+                bucket_offset = idx % SLOTS_PER_BUCKET;
             }
         }
     }
+    return false;
 }
 
 template <typename K, typename V, typename HashFunc, typename KeyEqual, typename Allocator>
@@ -298,6 +319,19 @@ bool CantStopHashMap<K, V, HashFunc, KeyEqual, Allocator>::get(const K &key, V &
 
 template <typename K, typename V, typename HashFunc, typename KeyEqual, typename Allocator>
 bool CantStopHashMap<K, V, HashFunc, KeyEqual, Allocator>::set(const K &key, const V &value)
+{
+    return set_internal(key, value);
+}
+
+template <typename K, typename V, typename HashFunc, typename KeyEqual, typename Allocator>
+bool CantStopHashMap<K, V, HashFunc, KeyEqual, Allocator>::set(const K &key, V &&value)
+{
+    return set_internal(key, std::move(value));
+}
+
+template <typename K, typename V, typename HashFunc, typename KeyEqual, typename Allocator>
+template <class VV>
+bool CantStopHashMap<K, V, HashFunc, KeyEqual, Allocator>::set_internal(const K &key, VV &&value)
 {
     const size_t key_hash = HashFunc()(key);
     size_t idx = key_hash % max_elements;
@@ -309,7 +343,7 @@ bool CantStopHashMap<K, V, HashFunc, KeyEqual, Allocator>::set(const K &key, con
     {
         if (buckets[bucket_idx].elements[buckets[bucket_idx].slots[rank - 1]].first == key)
         {
-            buckets[bucket_idx].elements[buckets[bucket_idx].slots[rank - 1]].second = value;
+            buckets[bucket_idx].elements[buckets[bucket_idx].slots[rank - 1]].second = std::forward<VV>(value);
             return true;
         }
         else
@@ -337,7 +371,7 @@ bool CantStopHashMap<K, V, HashFunc, KeyEqual, Allocator>::remove(const K &key)
     size_t bucket_offset = idx % SLOTS_PER_BUCKET;
     bool element_found = false;
     // first, find the matching record
-    size_t rank;
+    size_t rank = 0;
     while (buckets[bucket_idx].bitmap_test(bucket_offset))
     {
         if (!buckets[bucket_idx].elements.empty())
@@ -359,7 +393,7 @@ bool CantStopHashMap<K, V, HashFunc, KeyEqual, Allocator>::remove(const K &key)
         return false;
 
     // walk forward until next hole to see if any records need to be moved back
-    size_t deleted_idx = idx, original_deleted_idx = deleted_idx;
+    size_t deleted_idx = idx;
     ++bucket_offset;
     idx = (idx + 1) % max_elements;
     if (bucket_offset == SLOTS_PER_BUCKET || !idx)
@@ -370,12 +404,12 @@ bool CantStopHashMap<K, V, HashFunc, KeyEqual, Allocator>::remove(const K &key)
     }
     while (!buckets[bucket_idx].elements.empty() && (buckets[bucket_idx].bitmap_test(bucket_offset)))
     {
-        // calc hash. If its less or equal new hole position, swap, save new hole and move on
+        // calc hash. If home slot is not cyclically in (hole, idx], swap, save new hole and move on
         ++rank;
         if (!buckets[bucket_idx].elements.empty())
         {
             size_t idx_at_rank = HashFunc()(buckets[bucket_idx].elements[buckets[bucket_idx].slots[rank - 1]].first) % max_elements;
-            if ((idx_at_rank <= deleted_idx && deleted_idx - idx_at_rank < max_elements / 2) || (idx_at_rank > deleted_idx && idx_at_rank - deleted_idx >= max_elements / 2))// TODO: this if doesnt work if mismatch is larger than half of the table
+            if ((idx + max_elements - idx_at_rank) % max_elements >= (idx + max_elements - deleted_idx) % max_elements)
             {
                 // swap
                 size_t swap_pos = deleted_idx / SLOTS_PER_BUCKET;
@@ -408,18 +442,20 @@ bool CantStopHashMap<K, V, HashFunc, KeyEqual, Allocator>::remove(const K &key)
     else
     {
         size_t deleted_rank = buckets[deleted_bucket_idx].rank_at_pos(deleted_bucket_offset + 1);
-        if (deleted_rank < deleted_count) 
+        // save deleted slot, slots are in rank order but elements are not
+        size_t deleted_slot = buckets[deleted_bucket_idx].slots[deleted_rank - 1];
+        size_t last_slot = buckets[deleted_bucket_idx].elements.size() - 1;
+        if (deleted_slot != last_slot)
         {
             // move last element to deleted position, update slots
-            // save deleted slot
-            size_t deleted_slot = buckets[deleted_bucket_idx].slots[deleted_rank - 1];
             // find slot position for last element
-            auto last_slot_iter = std::find(buckets[deleted_bucket_idx].slots.begin(), buckets[deleted_bucket_idx].slots.end(), buckets[deleted_bucket_idx].slots.size()-1);
+            auto last_slot_iter = std::find(buckets[deleted_bucket_idx].slots.begin(), buckets[deleted_bucket_idx].slots.end(), last_slot);
             // move element
-            (std::pair<K,V>&)buckets[deleted_bucket_idx].elements[deleted_slot] = std::move((std::pair<K,V>&)buckets[deleted_bucket_idx].elements[buckets[deleted_bucket_idx].elements.size()-1]);
+            (std::pair<K,V>&)buckets[deleted_bucket_idx].elements[deleted_slot] = std::move((std::pair<K,V>&)buckets[deleted_bucket_idx].elements[last_slot]);
             // update slots according to move
             *last_slot_iter = deleted_slot;
         }
+        buckets[deleted_bucket_idx].elements.pop_back(); // moved out or deleted
         buckets[deleted_bucket_idx].slots.erase(buckets[deleted_bucket_idx].slots.begin() + deleted_rank - 1);
     }
     buckets[deleted_bucket_idx].bitmap_clear(deleted_bucket_offset);
@@ -15,6 +15,8 @@ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLI
 #include <stdio.h>
 #include <stdexcept>
 #include <cstring>
+
+#include "HugePages.h"
 #include <atomic>
 #include <thread>
 
@@ -111,15 +113,15 @@ public:
         return bitmap & (1ULL << pos);
     }
 
-    // Pool size MUST be a multiple of 512
-    static void setUp(size_t in_poolSize)
+    // Pool size MUST be a multiple of 512, in_hugePages is HugePages::Policy of the storage
+    static void setUp(size_t in_poolSize, unsigned int in_hugePages = HugePages::HUGEPAGES_NONE)
     {
         if (in_poolSize % POOL_CHUNK_SIZE)
             abort();
         if (storage != nullptr)
             abort();
         poolSize = in_poolSize;
-        storage = static_cast<T*>(std::malloc(sizeof(T)*poolSize));
+        storage = static_cast<T*>(HugePages::allocate(sizeof(T)*poolSize, in_hugePages));
         memset(storage, 0xFF, poolSize * sizeof(T));
         memset(treeMap, 0x0, BMP_TREE_HEIGHT * sizeof(uint64_t *));
         memset(treeLocks, 0x0, BMP_TREE_HEIGHT * sizeof(std::atomic_ulong *));
@@ -180,7 +182,7 @@ public:
     {
         if (storage == nullptr)
             abort();
-        std::free(storage);
+        HugePages::release(storage);
         storage = nullptr;
         for (size_t i = 0; i < treeMapLevels; ++i)
             delete[] treeMap[i]; //TODO: leak checks!
@@ -458,6 +460,12 @@ public:
         return storage != nullptr;
     }
 
+    // backing the storage got, see HugePages.h
+    static HugePages::RegionStats storageStats()
+    {
+        return HugePages::stats(storage);
+    }
+
 private:
     static uint64_t * treeMap[BMP_TREE_HEIGHT]; // neat cacheline
     static std::atomic_ulong * treeLocks[BMP_TREE_HEIGHT];
@@ -0,0 +1,198 @@
+/*
+ * WorkStealingPool.h
+ *
+ * Small std only pool for coarse parallel loops (file chunks, bucket ranges). Every worker starts with an even slice
+ * of task indices and eats it from the front, the ones that run out steal the back half of somebody else's slice.
+ * Slice is a single 64 bit word (begin and end, 32 bits each), so both sides are one CAS.
+ *
+ * Threads are started once and parked on a condition variable between jobs, calling thread works as worker 0.
+ * One job at a time per pool, other callers wait for their turn (so tasks must not run jobs on the same pool).
+ */
+
+#ifndef WORKSTEALINGPOOL_H_
+#define WORKSTEALINGPOOL_H_
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdlib>
+#include <functional>
+#include <mutex>
+#include <new>
+#include <thread>
+#include <vector>
+
+class WorkStealingPool
+{
+public:
+    // numThreads is total number of workers including the caller, 0 is one per core
+    explicit WorkStealingPool(size_t numThreads = 0);
+    ~WorkStealingPool();
+
+    // shared by the Util classes, one per core
+    static WorkStealingPool & shared();
+
+    size_t size() const
+    {
+        return numWorkers;
+    }
+
+    // taskFunc(workerIdx, taskIdx) for every taskIdx in [0, numTasks), numTasks must fit in 32 bits. Returns once all are done
+    void run(size_t numTasks, const std::function<void(size_t, size_t)> & taskFunc);
+
+private:
+    WorkStealingPool(const WorkStealingPool&) = delete;
+    WorkStealingPool& operator=(const WorkStealingPool&) = delete;
+
+    struct Slice
+    {
+        std::atomic<unsigned long long> range; // begin << 32 | end
+        char padding0[56]; // padding to cacheline
+    }__attribute__((aligned(64)));
+
+    static unsigned long long packRange(unsigned long long begin, unsigned long long end)
+    {
+        return (begin << 32) | end;
+    }
+    bool popFront(size_t workerIdx, size_t & taskIdx);
+    bool stealBack(size_t workerIdx);
+    void work(size_t workerIdx);
+    void threadProc(size_t workerIdx);
+
+    size_t numWorkers;
+    Slice * slices;
+    std::vector<std::thread> threads;
+    std::mutex runMutex; // one job at a time
+    std::mutex jobMutex;
+    std::condition_variable jobStarted;
+    std::condition_variable jobDone;
+    const std::function<void(size_t, size_t)> * jobFunc;
+    unsigned long long jobGeneration;
+    size_t busyWorkers;
+    bool stopping;
+};
+
+inline WorkStealingPool::WorkStealingPool(size_t numThreads) :
+                numWorkers(numThreads ? numThreads : std::thread::hardware_concurrency()), slices(0), jobFunc(0), jobGeneration(0), busyWorkers(0),
+                stopping(false)
+{
+    if(!numWorkers)
+        numWorkers = 1;
+    slices = (Slice *) aligned_alloc(64, numWorkers * sizeof(Slice));
+    for(size_t workerIdx = 0; workerIdx < numWorkers; ++workerIdx)
+        new (&(slices[workerIdx].range)) std::atomic<unsigned long long>(0);
+    for(size_t workerIdx = 1; workerIdx < numWorkers; ++workerIdx)
+        threads.emplace_back(&WorkStealingPool::threadProc, this, workerIdx);
+}
+
+inline WorkStealingPool::~WorkStealingPool()
+{
+    {
+        std::lock_guard<std::mutex> lock(jobMutex);
+        stopping = true;
+    }
+    jobStarted.notify_all();
+    for(size_t threadIdx = 0; threadIdx < threads.size(); ++threadIdx)
+        threads[threadIdx].join();
+    std::free(slices);
+}
+
+inline WorkStealingPool & WorkStealingPool::shared()
+{
+    static WorkStealingPool pool;
+    return pool;
+}
+
+inline bool WorkStealingPool::popFront(size_t workerIdx, size_t & taskIdx)
+{
+    std::atomic<unsigned long long> & range = slices[workerIdx].range;
+    unsigned long long current = range.load(std::memory_order_acquire);
+    while(true)
+    {
+        unsigned long long begin = current >> 32;
+        unsigned long long end = current & 0xFFFFFFFFULL;
+        if(begin >= end)
+            return false;
+        if(range.compare_exchange_weak(current, packRange(begin + 1, end), std::memory_order_acq_rel))
+        {
+            taskIdx = begin;
+            return true;
+        }
+    }
+}
+
+// moves back half of the first non empty slice after ours into our own (empty) one
+inline bool WorkStealingPool::stealBack(size_t workerIdx)
+{
+    for(size_t step = 1; step < numWorkers; ++step)
+    {
+        std::atomic<unsigned long long> & victim = slices[(workerIdx + step) % numWorkers].range;
+        unsigned long long current = victim.load(std::memory_order_acquire);
+        while(true)
+        {
+            unsigned long long begin = current >> 32;
+            unsigned long long end = current & 0xFFFFFFFFULL;
+            if(begin >= end)
+                break;
+            unsigned long long mid = begin + (end - begin) / 2; // single task left goes whole
+            if(victim.compare_exchange_weak(current, packRange(begin, mid), std::memory_order_acq_rel))
+            {
+                slices[workerIdx].range.store(packRange(mid, end), std::memory_order_release);
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+inline void WorkStealingPool::work(size_t workerIdx)
+{
+    size_t taskIdx;
+    do
+    {
+        while(popFront(workerIdx, taskIdx))
+            (*jobFunc)(workerIdx, taskIdx);
+    } while(stealBack(workerIdx));
+}
+
+inline void WorkStealingPool::threadProc(size_t workerIdx)
+{
+    unsigned long long seenGeneration = 0;
+    while(true)
+    {
+        {
+            std::unique_lock<std::mutex> lock(jobMutex);
+            jobStarted.wait(lock, [&]() { return stopping || jobGeneration != seenGeneration; });
+            if(stopping)
+                return;
+            seenGeneration = jobGeneration;
+        }
+        work(workerIdx);
+        {
+            std::lock_guard<std::mutex> lock(jobMutex);
+            --busyWorkers;
+        }
+        jobDone.notify_one();
+    }
+}
+
+inline void WorkStealingPool::run(size_t numTasks, const std::function<void(size_t, size_t)> & taskFunc)
+{
+    if(!numTasks)
+        return;
+    std::lock_guard<std::mutex> runLock(runMutex);
+    for(size_t workerIdx = 0; workerIdx < numWorkers; ++workerIdx)
+        slices[workerIdx].range.store(packRange(numTasks * workerIdx / numWorkers, numTasks * (workerIdx + 1) / numWorkers), std::memory_order_relaxed);
+    {
+        std::lock_guard<std::mutex> lock(jobMutex);
+        jobFunc = &taskFunc;
+        busyWorkers = numWorkers - 1;
+        ++jobGeneration;
+    }
+    jobStarted.notify_all();
+    work(0);
+    std::unique_lock<std::mutex> lock(jobMutex);
+    jobDone.wait(lock, [&]() { return !busyWorkers; });
+    jobFunc = 0;
+}
+
+#endif /* WORKSTEALINGPOOL_H_ */
@@ -0,0 +1,411 @@
+/*
+ * seededhash.hh
+ *
+ * Seeded hashing for the hash tables: integer mixers, a 64/128 bit byte hash in the spirit of XXH3/wyhash
+ * (128 bit multiply folding for short keys, 8 lane stripe accumulator for long ones, AVX2 kernel picked at runtime)
+ * and multiply-shift range reduction instead of hash % size.
+ *
+ * Every SeededHash instance draws its own random seed, so two tables never share a layout and colliding keys
+ * can't be precomputed offline. Tables copy their hasher along with their buckets, savers persist it.
+ */
+
+#ifndef SEEDEDHASH_HH_
+#define SEEDEDHASH_HH_
+
+#include <atomic>
+#include <cstring>
+#include <functional>
+#include <random>
+#include <string>
+#include <type_traits>
+
+#include <x86intrin.h>
+
+static const unsigned long long HASH_PRIME64_1 = 0x9E3779B185EBCA87ULL;
+static const unsigned long long HASH_PRIME64_2 = 0xC2B2AE3D27D4EB4FULL;
+static const unsigned long long HASH_PRIME64_3 = 0x165667B19E3779F9ULL;
+static const unsigned long long HASH_PRIME64_4 = 0x85EBCA77C2B2AE63ULL;
+static const unsigned long long HASH_PRIME64_5 = 0x27D4EB2F165667C5ULL;
+static const unsigned long long HASH_PRIME32_1 = 0x9E3779B1ULL;
+static const unsigned long long HASH_PRIME32_2 = 0x85EBCA77ULL;
+static const unsigned long long HASH_PRIME32_3 = 0xC2B2AE3DULL;
+
+static const unsigned long long HASH_SECRET_WORDS = 24; // 192 bytes
+static const unsigned long long HASH_STRIPE_LANES = 8; // 64 byte stripes
+static const unsigned long long HASH_STRIPES_PER_BLOCK = HASH_SECRET_WORDS - HASH_STRIPE_LANES; // secret slides one word per stripe
+static const unsigned long long HASH_MID_MAX_LEN = 256; // above this the stripe accumulator pays off
+
+static const unsigned long long HASH_SECRET[HASH_SECRET_WORDS] =
+{
+    0x2CB0F69F4ABEA221ULL, 0x9417034723148989ULL, 0xDD555950609DFE03ULL, 0xDBAFB150DEB12800ULL,
+    0x7E789B2E6C442CB6ULL, 0xF41E5636C7E4F8C4ULL, 0x0959D150F8FBA7E4ULL, 0xA97316F13CDB9EEAULL,
+    0x74CD8258F9520068ULL, 0x55C74A62E116868BULL, 0xD2F4C799A2023CBDULL, 0xDF98CB79A37B51B9ULL,
+    0x396F5885524F3905ULL, 0xAF1D56386CA3B276ULL, 0xA9FFBE6B5104E85AULL, 0x6BD0C51B9FD533B3ULL,
+    0x980CE91C50AB4B56ULL, 0x28AC395780FE62C5ULL, 0x768912E3A6BCEDC7ULL, 0x50B3E8C9332C7C88ULL,
+    0xCE3BBFE520BD47DAULL, 0xCBA6C8E8E0BB7C4FULL, 0xBF194DB8434A346DULL, 0x7D8F2A7B60416D7FULL,
+};
+
+struct Hash128
+{
+    unsigned long long low;
+    unsigned long long high;
+};
+
+// maps a well mixed 64 bit hash onto [0, range) with a multiply instead of a 64 bit divide. Uses the high bits of the hash
+inline unsigned long long reduceRange(const unsigned long long hash, const unsigned long long range)
+{
+    return (unsigned long long) (((unsigned __int128) hash * range) >> 64);
+}
+
+// linear probing step, wraps with a compare instead of a divide
+inline unsigned long long nextProbeIdx(const unsigned long long idx, const unsigned long long range)
+{
+    return idx + 1 == range ? 0ULL : idx + 1;
+}
+
+inline unsigned long long hashRead64(const unsigned char * p)
+{
+    unsigned long long v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+inline unsigned long long hashRead32(const unsigned char * p)
+{
+    unsigned int v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+// 64x64->128 multiply folded back to 64 bits
+inline unsigned long long mumMix(const unsigned long long a, const unsigned long long b)
+{
+    const unsigned __int128 r = (unsigned __int128) a * b;
+    return (unsigned long long) r ^ (unsigned long long) (r >> 64);
+}
+
+inline unsigned long long hashAvalanche(unsigned long long h)
+{
+    h ^= h >> 37;
+    h *= 0x165667919E3779F9ULL;
+    h ^= h >> 32;
+    return h;
+}
+
+// unseeded finalizer for hashers that don't mix their output (std::hash<integral> is identity)
+inline unsigned long long mix64(unsigned long long x)
+{
+    x ^= x >> 27;
+    x *= 0x3C79AC492BA7B653ULL;
+    x ^= x >> 33;
+    x *= 0x1C69B3F74AC4AE35ULL;
+    x ^= x >> 27;
+    return x;
+}
+
+// fixed width keys, two rounds of multiply folding
+inline unsigned long long hashInt64(const unsigned long long x, const unsigned long long seed)
+{
+    const unsigned __int128 r = (unsigned __int128) (x ^ HASH_SECRET[0]) * (seed ^ HASH_SECRET[1]);
+    return mumMix((unsigned long long) r ^ HASH_SECRET[2], (unsigned long long) (r >> 64) ^ HASH_SECRET[3]);
+}
+
+inline unsigned long long hashShort(const unsigned char * p, const unsigned long long len, const unsigned long long seed, const unsigned long long * secret)
+{
+    unsigned long long a = 0, b = 0;
+    if(len >= 4)
+    {
+        const unsigned long long mid = (len >> 3) << 2;
+        a = (hashRead32(p) << 32) | hashRead32(p + mid);
+        b = (hashRead32(p + len - 4) << 32) | hashRead32(p + len - 4 - mid);
+    }
+    else if(len)
+    {
+        a = ((unsigned long long) p[0] << 16) | ((unsigned long long) p[len >> 1] << 8) | p[len - 1];
+    }
+    return mumMix(secret[0] ^ len, mumMix(a ^ (secret[1] + seed), b ^ (secret[2] - seed)));
+}
+
+inline unsigned long long hashMid(const unsigned char * p, const unsigned long long len, const unsigned long long seed, const unsigned long long * secret)
+{
+    unsigned long long acc = len * HASH_PRIME64_1 ^ seed;
+    unsigned long long word = 0;
+    for(unsigned long long i = 0; i + 16 <= len; i += 16)
+    {
+        acc += mumMix(hashRead64(p + i) ^ (secret[word] + seed), hashRead64(p + i + 8) ^ (secret[word + 1] - seed));
+        word += 2;
+        if(word == HASH_SECRET_WORDS - 2) // last pair is reserved for the tail
+        {
+            // secret pairs repeat from here, chunks 11 apart would only add up and could be swapped
+            acc = hashAvalanche(acc);
+            word = 0;
+        }
+    }
+    // tail, overlaps the last full chunk if needed
+    acc += mumMix(hashRead64(p + len - 16) ^ (secret[HASH_SECRET_WORDS - 2] + seed), hashRead64(p + len - 8) ^ (secret[HASH_SECRET_WORDS - 1] - seed));
+    return hashAvalanche(acc);
+}
+
+inline void hashInitAccumulators(unsigned long long * acc)
+{
+    acc[0] = HASH_PRIME32_3;
+    acc[1] = HASH_PRIME64_1;
+    acc[2] = HASH_PRIME64_2;
+    acc[3] = HASH_PRIME64_3;
+    acc[4] = HASH_PRIME64_4;
+    acc[5] = HASH_PRIME32_2;
+    acc[6] = HASH_PRIME64_5;
+    acc[7] = HASH_PRIME32_1;
+}
+
+// seed gets folded into the secret, even words add it odd words subtract
+inline void hashDeriveKeys(unsigned long long * keys, const unsigned long long seed)
+{
+    for(unsigned long long i = 0; i < HASH_SECRET_WORDS; ++i)
+        keys[i] = (i & 1ULL) ? HASH_SECRET[i] - seed : HASH_SECRET[i] + seed;
+}
+
+inline void hashStripeScalar(unsigned long long * acc, const unsigned char * p, const unsigned long long * keys)
+{
+    for(unsigned long long lane = 0; lane < HASH_STRIPE_LANES; ++lane)
+    {
+        const unsigned long long data = hashRead64(p + lane * 8);
+        const unsigned long long key = data ^ keys[lane];
+        acc[lane ^ 1ULL] += data;
+        acc[lane] += (key & 0xFFFFFFFFULL) * (key >> 32);
+    }
+}
+
+inline void hashScrambleScalar(unsigned long long * acc, const unsigned long long * keys)
+{
+    for(unsigned long long lane = 0; lane < HASH_STRIPE_LANES; ++lane)
+    {
+        acc[lane] ^= acc[lane] >> 47;
+        acc[lane] ^= keys[lane];
+        acc[lane] *= HASH_PRIME32_1;
+    }
+}
+
+// last stripe (might overlap already consumed data) uses keys from the middle of the secret
+static const unsigned long long HASH_LAST_STRIPE_KEY = 7;
+static const unsigned long long HASH_SCRAMBLE_KEY = HASH_SECRET_WORDS - HASH_STRIPE_LANES;
+
+inline void hashLongScalar(unsigned long long * acc, const unsigned char * p, const unsigned long long len, const unsigned long long * keys)
+{
+    const unsigned long long numStripes = (len - 1) / 64;
+    for(unsigned long long stripe = 0; stripe < numStripes; ++stripe)
+    {
+        hashStripeScalar(acc, p + stripe * 64, keys + stripe % HASH_STRIPES_PER_BLOCK);
+        if(stripe % HASH_STRIPES_PER_BLOCK == HASH_STRIPES_PER_BLOCK - 1)
+            hashScrambleScalar(acc, keys + HASH_SCRAMBLE_KEY);
+    }
+    hashStripeScalar(acc, p + len - 64, keys + HASH_LAST_STRIPE_KEY);
+}
+
+__attribute__((target("avx2"))) inline void hashLongAvx2(unsigned long long * acc, const unsigned char * p, const unsigned long long len, const unsigned long long * keys)
+{
+    __m256i acc0 = _mm256_loadu_si256((const __m256i *) acc);
+    __m256i acc1 = _mm256_loadu_si256((const __m256i *) (acc + 4));
+    const __m256i prime = _mm256_set1_epi64x(HASH_PRIME32_1);
+    const unsigned long long numStripes = (len - 1) / 64;
+    for(unsigned long long stripe = 0; stripe <= numStripes; ++stripe)
+    {
+        const bool last = stripe == numStripes;
+        const unsigned char * data = last ? p + len - 64 : p + stripe * 64;
+        const unsigned long long * key = keys + (last ? HASH_LAST_STRIPE_KEY : stripe % HASH_STRIPES_PER_BLOCK);
+        const __m256i d0 = _mm256_loadu_si256((const __m256i *) data);
+        const __m256i d1 = _mm256_loadu_si256((const __m256i *) (data + 32));
+        const __m256i k0 = _mm256_xor_si256(d0, _mm256_loadu_si256((const __m256i *) key));
+        const __m256i k1 = _mm256_xor_si256(d1, _mm256_loadu_si256((const __m256i *) (key + 4)));
+        // acc[lane] += lo32(k) * hi32(k), acc[lane ^ 1] += data
+        acc0 = _mm256_add_epi64(acc0, _mm256_add_epi64(_mm256_mul_epu32(k0, _mm256_srli_epi64(k0, 32)), _mm256_shuffle_epi32(d0, _MM_SHUFFLE(1, 0, 3, 2))));
+        acc1 = _mm256_add_epi64(acc1, _mm256_add_epi64(_mm256_mul_epu32(k1, _mm256_srli_epi64(k1, 32)), _mm256_shuffle_epi32(d1, _MM_SHUFFLE(1, 0, 3, 2))));
+        if(!last && stripe % HASH_STRIPES_PER_BLOCK == HASH_STRIPES_PER_BLOCK - 1)
+        {
+            const __m256i s0 = _mm256_xor_si256(_mm256_xor_si256(acc0, _mm256_srli_epi64(acc0, 47)), _mm256_loadu_si256((const __m256i *) (keys + HASH_SCRAMBLE_KEY)));
+            const __m256i s1 = _mm256_xor_si256(_mm256_xor_si256(acc1, _mm256_srli_epi64(acc1, 47)), _mm256_loadu_si256((const __m256i *) (keys + HASH_SCRAMBLE_KEY + 4)));
+            // 64x32 multiply out of two 32x32 ones
+            acc0 = _mm256_add_epi64(_mm256_mul_epu32(s0, prime), _mm256_slli_epi64(_mm256_mul_epu32(_mm256_srli_epi64(s0, 32), prime), 32));
+            acc1 = _mm256_add_epi64(_mm256_mul_epu32(s1, prime), _mm256_slli_epi64(_mm256_mul_epu32(_mm256_srli_epi64(s1, 32), prime), 32));
+        }
+    }
+    _mm256_storeu_si256((__m256i *) acc, acc0);
+    _mm256_storeu_si256((__m256i *) (acc + 4), acc1);
+}
+
+inline bool hashUseAvx2()
+{
+#if defined(__AVX2__)
+    return true;
+#else
+    static const bool useAvx2 = (__builtin_cpu_init(), __builtin_cpu_supports("avx2"));
+    return useAvx2;
+#endif
+}
+
+inline void hashLong(unsigned long long * acc, const unsigned char * p, const unsigned long long len, const unsigned long long seed)
+{
+    unsigned long long keys[HASH_SECRET_WORDS];
+    hashDeriveKeys(keys, seed);
+    hashInitAccumulators(acc);
+    if(hashUseAvx2())
+        hashLongAvx2(acc, p, len, keys);
+    else
+        hashLongScalar(acc, p, len, keys);
+}
+
+inline unsigned long long hashMergeAccumulators(const unsigned long long * acc, const unsigned long long start, const unsigned long long * secret)
+{
+    unsigned long long result = start;
+    for(unsigned long long i = 0; i < HASH_STRIPE_LANES / 2; ++i)
+        result += mumMix(acc[2 * i] ^ secret[2 * i], acc[2 * i + 1] ^ secret[2 * i + 1]);
+    return hashAvalanche(result);
+}
+
+inline unsigned long long hashBytes64(const void * data, const unsigned long long len, const unsigned long long seed)
+{
+    const unsigned char * p = (const unsigned char *) data;
+    if(len <= 16)
+        return hashShort(p, len, seed, HASH_SECRET);
+    if(len <= HASH_MID_MAX_LEN)
+        return hashMid(p, len, seed, HASH_SECRET);
+    unsigned long long acc[HASH_STRIPE_LANES];
+    hashLong(acc, p, len, seed);
+    return hashMergeAccumulators(acc, len * HASH_PRIME64_1, HASH_SECRET + 11);
+}
+
+inline Hash128 hashBytes128(const void * data, const unsigned long long len, const unsigned long long seed)
+{
+    const unsigned char * p = (const unsigned char *) data;
+    Hash128 result;
+    if(len <= 16)
+    {
+        result.low = hashShort(p, len, seed, HASH_SECRET);
+        result.high = hashShort(p, len, seed ^ HASH_PRIME64_2, HASH_SECRET + 3);
+    }
+    else if(len <= HASH_MID_MAX_LEN)
+    {
+        result.low = hashMid(p, len, seed, HASH_SECRET);
+        result.high = hashMid(p, len, ~seed, HASH_SECRET);
+    }
+    else
+    {
+        unsigned long long acc[HASH_STRIPE_LANES];
+        hashLong(acc, p, len, seed);
+        result.low = hashMergeAccumulators(acc, len * HASH_PRIME64_1, HASH_SECRET + 11);
+        result.high = hashMergeAccumulators(acc, ~(len * HASH_PRIME64_2), HASH_SECRET + 3);
+    }
+    return result;
+}
+
+// per table seed, different on every call even within the same tick
+inline unsigned long long randomSeed()
+{
+    static std::atomic<unsigned long long> seedCounter(0);
+    std::random_device rd;
+    const unsigned long long entropy = ((unsigned long long) rd() << 32) ^ rd();
+    return hashInt64(entropy ^ __rdtsc(), seedCounter.fetch_add(HASH_PRIME64_1, std::memory_order_relaxed));
+}
+
+// tables skip the extra mix64 for hashers declaring this typedef
+template<typename H, typename Enable = void>
+struct IsAvalanchingHash : std::false_type
+{
+};
+
+template<typename H>
+struct IsAvalanchingHash<H, typename std::conditional<true, void, typename H::is_avalanching>::type> : std::true_type
+{
+};
+
+inline unsigned long long finalizeHash(const unsigned long long hash, std::true_type)
+{
+    return hash;
+}
+
+inline unsigned long long finalizeHash(const unsigned long long hash, std::false_type)
+{
+    return mix64(hash);
+}
+
+// what the tables call, hash ready for reduceRange
+template<class HashFunc, typename K>
+inline unsigned long long applyHash(const HashFunc & hasherFunc, const K & key)
+{
+    return finalizeHash(hasherFunc(key), IsAvalanchingHash<HashFunc>());
+}
+
+// integral, enum and pointer keys go through hashInt64, strings through hashBytes64, everything else through a seeded mix of std::hash
+// specialize SeededHashImpl for POD keys to hash their bytes directly
+template<typename K, typename Enable = void>
+struct SeededHashImpl
+{
+    static unsigned long long hash(const K & key, const unsigned long long seed)
+    {
+        return hashInt64(std::hash<K>()(key), seed);
+    }
+};
+
+template<typename K>
+struct SeededHashImpl<K, typename std::enable_if<std::is_integral<K>::value || std::is_enum<K>::value>::type>
+{
+    static unsigned long long hash(const K & key, const unsigned long long seed)
+    {
+        return hashInt64((unsigned long long) key, seed);
+    }
+};
+
+template<typename K>
+struct SeededHashImpl<K *>
+{
+    static unsigned long long hash(K * const & key, const unsigned long long seed)
+    {
+        return hashInt64((unsigned long long) key, seed);
+    }
+};
+
+template<typename C, typename T, typename A>
+struct SeededHashImpl<std::basic_string<C, T, A> >
+{
+    static unsigned long long hash(const std::basic_string<C, T, A> & key, const unsigned long long seed)
+    {
+        return hashBytes64(key.data(), key.size() * sizeof(C), seed);
+    }
+};
+
+template<typename K>
+struct SeededHash
+{
+    typedef void is_avalanching;
+
+    unsigned long long seed; //8
+
+    SeededHash() : seed(randomSeed())
+    {
+    }
+
+    explicit SeededHash(unsigned long long inSeed) : seed(inSeed)
+    {
+    }
+
+    unsigned long long operator()(const K & key) const
+    {
+        return SeededHashImpl<K>::hash(key, seed);
+    }
+};
+
+/*
+    //Sample, per table seeds and throughput check
+
+    LFSparseHashTable<std::string, size_t> table1(1024*1024); // SeededHash<std::string> by default, random seed
+    LFSparseHashTable<std::string, size_t> table2(1024*1024, 0.5, 0.0, SeededHash<std::string>(42ULL)); // fixed seed, reproducible layout
+
+    std::vector<char> buf(1 << 20, 'x');
+    unsigned long long sink = 0;
+    auto start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < 1024; ++i)
+        sink += hashBytes64(&buf[0], buf.size(), i);
+    printf("%f GB/s %llu\n", 1.0 / std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count(), sink);
+*/
+
+#endif /* SEEDEDHASH_HH_ */
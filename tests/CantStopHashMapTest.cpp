@@ -0,0 +1,77 @@
+/*
+ * CantStopHashMapTest.cpp
+ *
+ * Random inserts and removes on a single bucket CantStopHashMap, 640 slots, checked against std::unordered_map. Probe runs wrap
+ * around the end of the table, so remove has to shift back elements whose home slot is behind the hole cyclically.
+ *
+ * g++ -std=c++17 -O2 -Wall -I.. CantStopHashMapTest.cpp ../bittwiddlinghacks.cpp -o CantStopHashMapTest
+ */
+
+#include <cstdio>
+#include <random>
+#include <unordered_map>
+
+#include "SparseHashTableV2.h"
+#include "seededhash.hh"
+
+struct MixHash
+{
+    size_t operator()(unsigned long long key) const
+    {
+        return mix64(key);
+    }
+};
+
+typedef CantStopHashMap<unsigned long long, unsigned long long, MixHash> Map;
+
+static const unsigned long long KEY_RANGE = 1000, MAX_LIVE = 250, OPS = 2000000;
+
+static bool matches(Map & map, const std::unordered_map<unsigned long long, unsigned long long> & reference)
+{
+    for(unsigned long long key = 0; key < KEY_RANGE; ++key)
+    {
+        unsigned long long value;
+        const auto it = reference.find(key);
+        const bool found = map.get(key, value);
+        if(found != (it != reference.end()) || (found && value != it->second))
+        {
+            fprintf(stderr, "key %llu: map %s, reference %s\n", key, found ? "has it" : "misses it", it != reference.end() ? "has it" : "misses it");
+            return false;
+        }
+    }
+    return true;
+}
+
+int main()
+{
+    Map map(1);
+    if(map.max_elements != Map::SLOTS_PER_BUCKET)
+        return 1;
+    std::unordered_map<unsigned long long, unsigned long long> reference;
+    std::mt19937_64 rng(42);
+    for(unsigned long long op = 0; op < OPS; ++op)
+    {
+        const unsigned long long key = rng() % KEY_RANGE;
+        if(rng() & 1)
+        {
+            if(reference.size() >= MAX_LIVE && !reference.count(key))
+                continue;
+            map.put(key, op);
+            reference[key] = op;
+        }
+        else if(map.remove(key) != (reference.erase(key) == 1))
+        {
+            fprintf(stderr, "remove of key %llu disagrees at op %llu\n", key, op);
+            return 1;
+        }
+        if(!(op % 1024) && !matches(map, reference))
+        {
+            fprintf(stderr, "mismatch at op %llu\n", op);
+            return 1;
+        }
+    }
+    if(!matches(map, reference))
+        return 1;
+    printf("ok\n");
+    return 0;
+}
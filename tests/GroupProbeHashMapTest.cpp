@@ -0,0 +1,281 @@
+/*
+ * GroupProbeHashMapTest.cpp
+ *
+ * GroupProbeHashMap checked against std::unordered_map, growing from the smallest table. SlotHash builds runs on purpose: keys of
+ * one home slot with the same control bits, so every group match needs a key compare, long enough to cross several groups and the
+ * end of the table (mirrored control bytes). Remove shifts runs back instead of leaving tombstones, slots it frees are taken by
+ * later inserts and churn at a constant size never rehashes.
+ *
+ * Group width is picked at build time, 16 with SSE2 and 32 with AVX2. run_tests.sh builds this test a second time with -mavx2.
+ *
+ * g++ -std=c++17 -O2 -Wall -I.. GroupProbeHashMapTest.cpp ../bittwiddlinghacks.cpp -o GroupProbeHashMapTest
+ * g++ -std=c++17 -O2 -Wall -mavx2 -I.. GroupProbeHashMapTest.cpp ../bittwiddlinghacks.cpp -o GroupProbeHashMapTest_avx2
+ */
+
+#include <algorithm>
+#include <cstdio>
+#include <random>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "GroupProbeHashMap.h"
+#include "seededhash.hh"
+
+struct MixHash
+{
+    size_t operator()(unsigned long long key) const
+    {
+        return mix64(key);
+    }
+};
+
+// key is home slot << SLOT_SHIFT | id, for tables of 1 << (64 - SLOT_SHIFT) slots. Control bits are the low 7 bits of id
+struct SlotHash
+{
+    typedef void is_avalanching;
+
+    static const unsigned long long SLOT_SHIFT = 56;
+
+    unsigned long long operator()(unsigned long long key) const
+    {
+        return key;
+    }
+};
+
+typedef GroupProbeHashMap<unsigned long long, unsigned long long, MixHash> Map;
+typedef GroupProbeHashMap<unsigned long long, unsigned long long, SlotHash> SlotMap;
+
+static const unsigned long long GROUP_WIDTH = Map::GROUP_WIDTH;
+
+static bool matches(Map & map, const std::unordered_map<unsigned long long, unsigned long long> & reference, unsigned long long keyRange)
+{
+    if(map.size() != reference.size())
+    {
+        fprintf(stderr, "map has %llu elements, reference %zu\n", map.size(), reference.size());
+        return false;
+    }
+    for(unsigned long long key = 0; key < keyRange; ++key)
+    {
+        unsigned long long value;
+        const auto it = reference.find(key);
+        const bool found = map.get(key, value);
+        if(found != (it != reference.end()) || (found && value != it->second))
+        {
+            fprintf(stderr, "key %llu: map %s, reference %s\n", key, found ? "has it" : "misses it", it != reference.end() ? "has it" : "misses it");
+            return false;
+        }
+    }
+    return true;
+}
+
+// random insert/put/set/remove from a map sized for 1 element, so it grows all the way up while elements come and go
+static bool randomAgainstReference()
+{
+    static const unsigned long long KEY_RANGE = 20000, OPS = 1000000;
+    Map map(1);
+    const unsigned long long startSlots = map.slotCount();
+    std::unordered_map<unsigned long long, unsigned long long> reference;
+    std::mt19937_64 rng(7);
+    for(unsigned long long op = 0; op < OPS; ++op)
+    {
+        // key range widens with op, so the map keeps growing
+        const unsigned long long key = rng() % (1 + KEY_RANGE * op / OPS);
+        const unsigned long long value = rng();
+        const bool present = reference.count(key);
+        bool res = true;
+        switch(rng() % 5)
+        {
+        case 0:
+        case 1:
+            res = map.insert(key, value) == !present;
+            if(!present)
+                reference[key] = value;
+            break;
+        case 2:
+            res = map.put(key, value) == present;
+            reference[key] = value;
+            break;
+        case 3:
+            res = map.set(key, value) == present;
+            if(present)
+                reference[key] = value;
+            break;
+        case 4:
+            res = map.remove(key) == present;
+            reference.erase(key);
+            break;
+        }
+        if(!res)
+        {
+            fprintf(stderr, "op %llu on key %llu returned the wrong result\n", op, key);
+            return false;
+        }
+        if(!(op % 100000) && !matches(map, reference, KEY_RANGE))
+            return false;
+    }
+    if(map.slotCount() <= startSlots)
+    {
+        fprintf(stderr, "map did not grow, %llu slots\n", map.slotCount());
+        return false;
+    }
+    return matches(map, reference, KEY_RANGE);
+}
+
+// two runs over the end of a 256 slot table: one home a few slots before the end, longer than three groups, then keys homed at
+// slot 2 that sit behind it. Keys of a run share control bits
+static bool wrappingRuns()
+{
+    static const unsigned long long SLOTS = 1ULL << (64 - SlotHash::SLOT_SHIFT);
+    const unsigned long long wrapLength = 3 * GROUP_WIDTH + 5, behindLength = GROUP_WIDTH;
+    SlotMap map(SLOTS * SlotMap::MAX_LOAD_PERCENT / 100);
+    if(map.slotCount() != SLOTS)
+        return false;
+    std::vector<unsigned long long> keys;
+    for(unsigned long long i = 0; i < wrapLength; ++i)
+        keys.push_back(((SLOTS - 4) << SlotHash::SLOT_SHIFT) | (i << 7) | 5);
+    for(unsigned long long i = 0; i < behindLength; ++i)
+        keys.push_back((2ULL << SlotHash::SLOT_SHIFT) | (i << 7) | 5);
+    for(size_t i = 0; i < keys.size(); ++i)
+    {
+        if(!map.insert(keys[i], i))
+            return false;
+    }
+    for(int round = 0; round < 2; ++round)
+    {
+        // every third key of the wrapping run goes, the rest of both runs shift back and must stay reachable
+        for(size_t i = round; i < wrapLength; i += 3)
+        {
+            if(!map.remove(keys[i]) || map.remove(keys[i]))
+                return false;
+        }
+        for(size_t i = 0; i < keys.size(); ++i)
+        {
+            unsigned long long value;
+            const bool removed = i < wrapLength && i % 3 == (size_t) round;
+            if(map.get(keys[i], value) == removed || (!removed && value != i))
+            {
+                fprintf(stderr, "round %d: key %zu of the runs %s\n", round, i, removed ? "survived remove" : "lost");
+                return false;
+            }
+        }
+        for(size_t i = round; i < wrapLength; i += 3)
+        {
+            if(!map.insert(keys[i], i))
+                return false;
+        }
+    }
+    for(size_t i = 0; i < keys.size(); ++i)
+    {
+        unsigned long long value;
+        if(!map.get(keys[i], value) || value != i)
+            return false;
+    }
+    return map.size() == keys.size() && map.slotCount() == SLOTS;
+}
+
+// map filled right up to its growth limit, then one key out and a new one in over and over. Remove leaves no tombstones, every
+// insert finds a slot freed by remove and the map never rehashes
+static bool erasedSlotReuse()
+{
+    static const unsigned long long ROUNDS = 200000;
+    Map map(1000);
+    const unsigned long long slots = map.slotCount();
+    const unsigned long long live = slots * Map::MAX_LOAD_PERCENT / 100;
+    std::vector<unsigned long long> keys;
+    for(unsigned long long key = 0; key < live; ++key)
+    {
+        map.insert(key, key);
+        keys.push_back(key);
+    }
+    std::mt19937_64 rng(11);
+    unsigned long long nextKey = live;
+    for(unsigned long long round = 0; round < ROUNDS; ++round)
+    {
+        const size_t idx = rng() % keys.size();
+        if(!map.remove(keys[idx]))
+            return false;
+        keys[idx] = nextKey++;
+        if(!map.insert(keys[idx], keys[idx]))
+            return false;
+        if(map.slotCount() != slots)
+        {
+            fprintf(stderr, "round %llu: map rehashed to %llu slots at %llu elements\n", round, map.slotCount(), map.size());
+            return false;
+        }
+    }
+    if(map.size() != live)
+        return false;
+    for(size_t idx = 0; idx < keys.size(); ++idx)
+    {
+        unsigned long long value;
+        if(!map.get(keys[idx], value) || value != keys[idx])
+            return false;
+    }
+    for(unsigned long long key = 0; key < nextKey; key += 97)
+    {
+        unsigned long long value;
+        const bool live = std::find(keys.begin(), keys.end(), key) != keys.end();
+        if(map.get(key, value) != live || (live && value != key))
+            return false;
+    }
+    return true;
+}
+
+// values that own memory are moved on every rehash and on every backward shift
+static bool growthMovesValues()
+{
+    static const unsigned long long KEYS = 100000;
+    GroupProbeHashMap<unsigned long long, std::string, MixHash> map(1);
+    for(unsigned long long key = 0; key < KEYS; ++key)
+    {
+        if(!map.insert(key, std::string(32, (char) ('a' + key % 26)) + std::to_string(key)))
+            return false;
+    }
+    if(map.size() != KEYS || map.slotCount() * decltype(map)::MAX_LOAD_PERCENT / 100 < KEYS)
+        return false;
+    for(unsigned long long key = 0; key < KEYS; key += 2)
+    {
+        if(!map.remove(key))
+            return false;
+    }
+    for(unsigned long long key = 0; key < KEYS; ++key)
+    {
+        std::string value;
+        const bool found = map.get(key, value);
+        if(found != (key % 2 == 1) || (found && value != std::string(32, (char) ('a' + key % 26)) + std::to_string(key)))
+        {
+            fprintf(stderr, "key %llu %s\n", key, found ? "has the wrong value" : "lost");
+            return false;
+        }
+    }
+    return map.size() == KEYS / 2;
+}
+
+int main()
+{
+    printf("group width %llu\n", GROUP_WIDTH);
+    bool ok = true;
+    if(!randomAgainstReference())
+    {
+        fprintf(stderr, "randomAgainstReference failed\n");
+        ok = false;
+    }
+    if(!wrappingRuns())
+    {
+        fprintf(stderr, "wrappingRuns failed\n");
+        ok = false;
+    }
+    if(!erasedSlotReuse())
+    {
+        fprintf(stderr, "erasedSlotReuse failed\n");
+        ok = false;
+    }
+    if(!growthMovesValues())
+    {
+        fprintf(stderr, "growthMovesValues failed\n");
+        ok = false;
+    }
+    printf("%s\n", ok ? "ok" : "FAILED");
+    return ok ? 0 : 1;
+}
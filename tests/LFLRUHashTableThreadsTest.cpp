@@ -0,0 +1,96 @@
+/*
+ * LFLRUHashTableThreadsTest.cpp
+ *
+ * Thread lists of LFLRUHashTable past inMaxThreads. List directory starts with room for inMaxThreads lists and grows as more threads
+ * register, lists that are there already stay in place and in use meanwhile.
+ *
+ * g++ -std=c++17 -O2 -Wall -I.. LFLRUHashTableThreadsTest.cpp -o LFLRUHashTableThreadsTest -lpthread
+ */
+
+#include <atomic>
+#include <cstdio>
+#include <thread>
+#include <vector>
+
+#include "LFLRUHashTable.h"
+
+typedef LFLRUHashTable<unsigned long long, unsigned long long> Table;
+
+static const unsigned long long KEYS_PER_THREAD = 64;
+
+// ids registered at once go well past inMaxThreads, every one of them keeps its elements
+static bool registerPastMax()
+{
+    const unsigned long long numIds = 200;
+    Table table(numIds * KEYS_PER_THREAD * 2, numIds * KEYS_PER_THREAD * 4, 1, SeededHash<unsigned long long>(), Table::POLICY_LRU, 4);
+    std::vector<unsigned long long> ids;
+    for(unsigned long long idIdx = 0; idIdx < numIds; ++idIdx)
+    {
+        ids.push_back(table.registerThread());
+        for(unsigned long long i = 0; i < KEYS_PER_THREAD; ++i)
+        {
+            if(!table.insert(ids.back(), ids.back() * KEYS_PER_THREAD + i, i))
+                return false;
+        }
+    }
+    for(unsigned long long idIdx = 0; idIdx < numIds; ++idIdx)
+    {
+        for(unsigned long long i = 0; i < KEYS_PER_THREAD; ++i)
+        {
+            unsigned long long value;
+            if(!table.get(ids[0], ids[idIdx] * KEYS_PER_THREAD + i, value) || value != i)
+                return false;
+        }
+    }
+    for(unsigned long long idIdx = 0; idIdx < numIds; ++idIdx)
+        table.releaseThread(ids[idIdx]);
+    return true;
+}
+
+// threads register through getMyThreadId while the ones before them keep working on their lists
+static bool registerWhileRunning()
+{
+    const unsigned long long numThreads = 48;
+    Table table(numThreads * KEYS_PER_THREAD * 2, numThreads * KEYS_PER_THREAD * 4, 0, SeededHash<unsigned long long>(), Table::POLICY_LRU, 1);
+    std::atomic<unsigned long long> failures(0);
+    std::vector<std::thread> threads;
+    for(unsigned long long threadNum = 0; threadNum < numThreads; ++threadNum)
+    {
+        threads.push_back(std::thread([&table, &failures, threadNum]()
+        {
+            const unsigned long long threadIdx = table.getMyThreadId();
+            for(unsigned long long round = 0; round < 20; ++round)
+            {
+                for(unsigned long long i = 0; i < KEYS_PER_THREAD; ++i)
+                {
+                    const unsigned long long key = threadNum * KEYS_PER_THREAD + i;
+                    unsigned long long value;
+                    if(!round && !table.insert(threadIdx, key, i))
+                        failures.fetch_add(1);
+                    else if(!table.get(threadIdx, key, value) || value != i)
+                        failures.fetch_add(1);
+                }
+            }
+        }));
+    }
+    for(size_t threadNum = 0; threadNum < threads.size(); ++threadNum)
+        threads[threadNum].join();
+    return !failures.load();
+}
+
+int main()
+{
+    bool ok = true;
+    if(!registerPastMax())
+    {
+        fprintf(stderr, "registerPastMax failed\n");
+        ok = false;
+    }
+    if(!registerWhileRunning())
+    {
+        fprintf(stderr, "registerWhileRunning failed\n");
+        ok = false;
+    }
+    printf("%s\n", ok ? "ok" : "FAILED");
+    return ok ? 0 : 1;
+}
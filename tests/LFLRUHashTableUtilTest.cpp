@@ -0,0 +1,83 @@
+/*
+ * LFLRUHashTableUtilTest.cpp
+ *
+ * Warm start of LFLRUHashTable through LFLRUHashTableUtil. A table set up with no thread lists (threads register lazily through
+ * getMyThreadId) loads into a list of the loading thread, loadRaw turns down a file saved with a different value size.
+ *
+ * g++ -std=c++17 -O2 -Wall -I.. LFLRUHashTableUtilTest.cpp -o LFLRUHashTableUtilTest -lpthread
+ */
+
+#include <cstdio>
+#include <string>
+
+#include <unistd.h>
+
+#include "LFLRUHashTableUtil.h"
+
+typedef LFLRUHashTable<unsigned long long, unsigned long long> Table;
+typedef LFLRUHashTableUtil<unsigned long long, unsigned long long> Util;
+
+static const unsigned long long KEYS = 1000;
+
+static std::string saveFileName(const char * name)
+{
+    return std::string("/tmp/LFLRUHashTableUtilTest_") + std::to_string(getpid()) + "_" + name;
+}
+
+static bool saveKeys(const std::string & fileName)
+{
+    Table table(2 * KEYS, 4 * KEYS, 2);
+    for(unsigned long long key = 0; key < KEYS; ++key)
+    {
+        if(!table.insert(key % 2, key, key * 10))
+            return false;
+    }
+    return Util::saveRaw(&table, fileName.c_str());
+}
+
+// saved with 2 lists, loaded into a table that has none yet
+static bool loadWithoutLists()
+{
+    const std::string fileName = saveFileName("lists");
+    bool ok = saveKeys(fileName);
+    Table table(2 * KEYS, 4 * KEYS, 0);
+    ok = ok && Util::loadRaw(&table, fileName.c_str());
+    const unsigned long long threadIdx = table.getMyThreadId();
+    for(unsigned long long key = 0; ok && key < KEYS; ++key)
+    {
+        unsigned long long value;
+        ok = table.get(threadIdx, key, value) && value == key * 10;
+    }
+    unlink(fileName.c_str());
+    return ok;
+}
+
+// records are 8 + 8 bytes, table with 4 byte values must not read them
+static bool loadRawOtherSize()
+{
+    const std::string fileName = saveFileName("size");
+    bool ok = saveKeys(fileName);
+    LFLRUHashTable<unsigned long long, unsigned int> table(2 * KEYS, 4 * KEYS, 1);
+    ok = ok && !LFLRUHashTableUtil<unsigned long long, unsigned int>::loadRaw(&table, fileName.c_str());
+    unsigned int value;
+    ok = ok && !table.get(0, 1, value);
+    unlink(fileName.c_str());
+    return ok;
+}
+
+int main()
+{
+    bool ok = true;
+    if(!loadWithoutLists())
+    {
+        fprintf(stderr, "loadWithoutLists failed\n");
+        ok = false;
+    }
+    if(!loadRawOtherSize())
+    {
+        fprintf(stderr, "loadRawOtherSize failed\n");
+        ok = false;
+    }
+    printf("%s\n", ok ? "ok" : "FAILED");
+    return ok ? 0 : 1;
+}
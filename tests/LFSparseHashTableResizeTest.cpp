@@ -0,0 +1,219 @@
+/*
+ * LFSparseHashTableResizeTest.cpp
+ *
+ * Growth of LFSparseHashTable with elements kept locked across calls. A thread that keeps an element locked with get(unlock = false)
+ * and then inserts past the load factor must not wait for its own lock, growth is put off until the lock is released.
+ * Writers taking kept locks back to back from several threads must not put growth off for good either.
+ *
+ * Inserts lock whole buckets, so a thread inserting into the bucket of its own kept element would wait for itself whether the table
+ * grows or not. KeyRegionHash keeps the kept keys in the first quarter of the table and everything else in the middle half.
+ *
+ * g++ -std=c++17 -O2 -Wall -I.. LFSparseHashTableResizeTest.cpp -o LFSparseHashTableResizeTest -lpthread
+ */
+
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <thread>
+#include <vector>
+
+#include <unistd.h>
+
+#include "LFSparseHashTable.h"
+
+// keys with KEPT_BIT set go to the first quarter of the table, others to the middle half. Home slot comes from the high hash bits
+struct KeyRegionHash
+{
+    typedef void is_avalanching;
+
+    static const unsigned long long KEPT_BIT = 1ULL << 62;
+
+    unsigned long long operator()(unsigned long long key) const
+    {
+        const unsigned long long mixed = mix64(key);
+        return key & KEPT_BIT ? mixed >> 2 : (mixed >> 1) + (1ULL << 62);
+    }
+};
+
+typedef LFSparseHashTable<unsigned long long, unsigned long long, KeyRegionHash> Table;
+
+static unsigned long long bucketBytes(const Table & table)
+{
+    return table.bucketsStats().size;
+}
+
+// get(false) -> inserts through the growth threshold -> set(locked) releases -> growth goes ahead
+static bool keptLockThenGrow()
+{
+    const unsigned long long keptKey = KeyRegionHash::KEPT_BIT | 1;
+    Table table(1024, 0.3);
+    table.insert(keptKey, 10);
+    unsigned long long value;
+    if(!table.get(keptKey, value, false))
+        return false;
+    const unsigned long long startBytes = bucketBytes(table);
+    for(unsigned long long key = 2; key < 400; ++key)
+        table.insert(key, key * 10);
+    if(bucketBytes(table) != startBytes)
+    {
+        fprintf(stderr, "table grew with an element kept locked\n");
+        return false;
+    }
+    if(!table.set(keptKey, value + 1, true))
+        return false;
+    for(unsigned long long key = 400; key < 8000; ++key)
+        table.insert(key, key * 10);
+    table.finishResize();
+    if(bucketBytes(table) <= startBytes)
+    {
+        fprintf(stderr, "table did not grow after the lock was released\n");
+        return false;
+    }
+    for(unsigned long long key = 2; key < 8000; ++key)
+    {
+        if(!table.get(key, value) || value != key * 10)
+        {
+            fprintf(stderr, "key %llu lost\n", key);
+            return false;
+        }
+    }
+    return table.get(keptKey, value) && value == 11;
+}
+
+// every thread keeps a lock now and then and inserts while holding it
+static bool keptLocksConcurrent()
+{
+    static const unsigned long long THREADS = 4, KEYS = 50000;
+    Table table(1024, 0.3);
+    std::vector<std::thread> threads;
+    std::atomic<unsigned long long> failures(0);
+    for(unsigned long long threadIdx = 0; threadIdx < THREADS; ++threadIdx)
+        threads.emplace_back([&table, &failures, threadIdx]
+        {
+            const unsigned long long base = (threadIdx + 1) << 32;
+            for(unsigned long long i = 0; i < KEYS; ++i)
+            {
+                if(i % 64)
+                {
+                    table.insert(base + i, i);
+                    continue;
+                }
+                const unsigned long long keptKey = KeyRegionHash::KEPT_BIT | (base + i);
+                table.insert(keptKey, i);
+                unsigned long long value;
+                if(!table.get(keptKey, value, false))
+                {
+                    failures.fetch_add(1);
+                    continue;
+                }
+                table.insert(base + i, i); // may hit the growth threshold
+                if(!table.set(keptKey, value, true))
+                    failures.fetch_add(1);
+            }
+        });
+    for(auto & thread : threads)
+        thread.join();
+    table.finishResize();
+    for(unsigned long long threadIdx = 0; threadIdx < THREADS; ++threadIdx)
+    {
+        for(unsigned long long i = 0; i < KEYS; ++i)
+        {
+            const unsigned long long key = ((threadIdx + 1) << 32) + i;
+            unsigned long long value;
+            if(!table.get(key, value) || value != i || (!(i % 64) && (!table.get(KeyRegionHash::KEPT_BIT | key, value) || value != i)))
+                failures.fetch_add(1);
+        }
+    }
+    return !failures.load();
+}
+
+// writers take kept locks back to back from several threads, so heldLocks is hardly ever zero while another thread inserts well past
+// the load factor. Gate has to let the holders drain and the table grow while they are still at it
+static bool keptLocksContinuous()
+{
+    static const unsigned long long THREADS = 3, KEYS = 1600; // fits the middle half without growth, growth starts at 1228
+    Table table(4096, 0.3);
+    for(unsigned long long threadIdx = 0; threadIdx < THREADS; ++threadIdx)
+        table.insert(KeyRegionHash::KEPT_BIT | threadIdx, 0);
+    const unsigned long long startBytes = bucketBytes(table);
+    std::vector<std::thread> threads;
+    std::atomic<bool> stop(false);
+    std::atomic<unsigned long long> failures(0), cycles(0);
+    for(unsigned long long threadIdx = 0; threadIdx < THREADS; ++threadIdx)
+        threads.emplace_back([&table, &stop, &failures, &cycles, threadIdx]
+        {
+            const unsigned long long keptKey = KeyRegionHash::KEPT_BIT | threadIdx;
+            while(!stop.load(std::memory_order_relaxed))
+            {
+                unsigned long long value;
+                if(!table.get(keptKey, value, false))
+                {
+                    failures.fetch_add(1);
+                    return;
+                }
+                for(int i = 0; i < 16; ++i)
+                    std::this_thread::yield(); // others take theirs meanwhile
+                if(!table.set(keptKey, value + 1, true))
+                    failures.fetch_add(1);
+                cycles.fetch_add(1, std::memory_order_relaxed);
+            }
+        });
+    while(cycles.load() < THREADS * 16)
+        std::this_thread::sleep_for(std::chrono::milliseconds(1)); // writers are all at it before the inserts start
+    for(unsigned long long key = 0; key < KEYS; ++key)
+        table.insert(key, key * 10);
+    for(unsigned long long i = 0; i < 64 * 64; ++i)
+    {
+        table.insert(KEYS, KEYS * 10); // growth is checked every 64 inserts
+        table.remove(KEYS);
+    }
+    stop.store(true);
+    for(auto & thread : threads)
+        thread.join();
+    const unsigned long long grownBytes = bucketBytes(table);
+    if(grownBytes <= startBytes)
+    {
+        fprintf(stderr, "table did not grow while writers kept locks, %llu -> %llu bytes\n", startBytes, grownBytes);
+        return false;
+    }
+    table.finishResize();
+    unsigned long long value, keptTotal = 0;
+    for(unsigned long long key = 0; key < KEYS; ++key)
+    {
+        if(!table.get(key, value) || value != key * 10)
+        {
+            fprintf(stderr, "key %llu lost\n", key);
+            return false;
+        }
+    }
+    for(unsigned long long threadIdx = 0; threadIdx < THREADS; ++threadIdx)
+    {
+        if(!table.get(KeyRegionHash::KEPT_BIT | threadIdx, value))
+            return false;
+        keptTotal += value;
+    }
+    return !failures.load() && keptTotal == cycles.load();
+}
+
+int main()
+{
+    alarm(60); // a deadlock fails the test instead of hanging it
+    bool ok = true;
+    if(!keptLockThenGrow())
+    {
+        fprintf(stderr, "keptLockThenGrow failed\n");
+        ok = false;
+    }
+    if(!keptLocksConcurrent())
+    {
+        fprintf(stderr, "keptLocksConcurrent failed\n");
+        ok = false;
+    }
+    if(!keptLocksContinuous())
+    {
+        fprintf(stderr, "keptLocksContinuous failed\n");
+        ok = false;
+    }
+    printf("%s\n", ok ? "ok" : "FAILED");
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,212 @@
+/*
+ * PackHashParallelTest.cpp
+ *
+ * packHashParallel of LFSparseHashTable and LFLRUHashTable with a run that crosses the chunk boundary. Removal of an element at the
+ * end of chunk 0 shifts the run back, including an element of chunk 1 that lands in a slot chunk 1 worker has already passed. Such
+ * element must still be looked at, no rejected key may survive.
+ *
+ * SlotHash puts every key at the home slot in its high bits. Run is: rejected element at the end of chunk 0, elements with the same
+ * home up to the slot before blocker, blocker at its own home (kept locked so chunk 1 worker stops there), rejected victim with the
+ * run home right after it. Chunk 0 worker only takes its element out once chunk 1 worker is past the run start, then both wait for the
+ * blocker and whoever gets it first decides whether victim is shifted behind chunk 1 worker, so a few rounds are run.
+ *
+ * g++ -std=c++17 -O2 -Wall -I.. PackHashParallelTest.cpp -o PackHashParallelTest -lpthread
+ */
+
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <thread>
+
+#include <unistd.h>
+
+#include "LFSparseHashTable.h"
+#include "LFLRUHashTable.h"
+
+// key is home slot << SLOT_SHIFT | id, for tables of 1 << (64 - SLOT_SHIFT) slots
+struct SlotHash
+{
+    typedef void is_avalanching;
+
+    static const unsigned long long SLOT_SHIFT = 47;
+
+    unsigned long long operator()(unsigned long long key) const
+    {
+        return key;
+    }
+};
+
+static const unsigned long long TABLE_SLOTS = 1ULL << (64 - SlotHash::SLOT_SHIFT); // two chunks of either table
+static const unsigned long long CHUNK_SLOTS = TABLE_SLOTS / 2;
+static const unsigned long long ROUNDS = 8;
+
+static unsigned long long slotKey(unsigned long long slot, unsigned long long id)
+{
+    return (slot << SlotHash::SLOT_SHIFT) | id;
+}
+
+// predicate side of a round: chunk 0 worker waits for chunk 1 worker to pass the run start before it rejects its element
+struct RunPredicate
+{
+    unsigned long long firstKey; // last slot of chunk 0, rejected
+    unsigned long long passedKey; // last run element chunk 1 worker looks at before it stops at blocker
+    unsigned long long victimKey; // rejected, right after blocker
+    std::atomic<bool> passed;
+
+    bool operator()(unsigned long long key)
+    {
+        if(key == passedKey)
+            passed.store(true);
+        if(key == firstKey)
+        {
+            waitPassed();
+            return false;
+        }
+        return key != victimKey;
+    }
+
+    bool waitPassed() const
+    {
+        for(int waited = 0; !passed.load(); ++waited)
+        {
+            if(waited == 2000)
+                return false;
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+        return true;
+    }
+};
+
+typedef LFSparseHashTable<unsigned long long, unsigned long long, SlotHash> SparseTable;
+
+// run starts at the last slot of chunk 0 and fills the first bucket of chunk 1, blocker is first slot of the next bucket
+static bool sparseCrossingRun()
+{
+    const unsigned long long runHome = CHUNK_SLOTS - 1;
+    const unsigned long long runLength = SparseTable::HOLY_GRAIL_SIZE + 1;
+    const unsigned long long blockerSlot = runHome + runLength;
+    WorkStealingPool pool(2);
+    for(unsigned long long round = 0; round < ROUNDS; ++round)
+    {
+        SparseTable table(TABLE_SLOTS, 0.9);
+        for(unsigned long long i = 0; i < runLength; ++i)
+            table.insert(slotKey(runHome, i), i);
+        const unsigned long long blockerKey = slotKey(blockerSlot, 0);
+        table.insert(blockerKey, 0);
+        RunPredicate predicate;
+        predicate.firstKey = slotKey(runHome, 0);
+        predicate.passedKey = slotKey(runHome, runLength - 1);
+        predicate.victimKey = slotKey(runHome, runLength);
+        predicate.passed.store(false);
+        table.insert(predicate.victimKey, 0);
+
+        unsigned long long value;
+        if(!table.get(blockerKey, value, false))
+            return false;
+        size_t removed = 0;
+        std::thread packer([&]()
+        {
+            removed = table.packHashParallel([&](SparseTable::SparseBucketElement & element) { return predicate(element.key); },
+                                             SparseTable::noProgress, pool);
+        });
+        if(!predicate.waitPassed())
+        {
+            fprintf(stderr, "chunk 1 worker did not get to the run\n");
+            return false;
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(20)); // both workers wait for blocker
+        table.set(blockerKey, value, true);
+        packer.join();
+
+        if(table.get(predicate.firstKey, value) || table.get(predicate.victimKey, value))
+        {
+            fprintf(stderr, "round %llu: rejected key survived, %zu removed\n", round, removed);
+            return false;
+        }
+        for(unsigned long long i = 1; i < runLength; ++i)
+        {
+            if(!table.get(slotKey(runHome, i), value) || value != i)
+                return false;
+        }
+        if(!table.get(blockerKey, value))
+            return false;
+    }
+    return true;
+}
+
+typedef LFLRUHashTable<unsigned long long, unsigned long long, SlotHash> LRUTable;
+
+// run starts a few slots before the end of chunk 0, blocker is a few slots into chunk 1
+static bool lruCrossingRun()
+{
+    const unsigned long long runHome = CHUNK_SLOTS - 4;
+    const unsigned long long runLength = 8;
+    const unsigned long long blockerSlot = runHome + runLength;
+    WorkStealingPool pool(2);
+    for(unsigned long long round = 0; round < ROUNDS; ++round)
+    {
+        LRUTable table(1024, TABLE_SLOTS, 1);
+        const unsigned long long threadIdx = table.registerThread();
+        for(unsigned long long i = 0; i < runLength; ++i)
+            table.insert(threadIdx, slotKey(runHome, i), i);
+        const unsigned long long blockerKey = slotKey(blockerSlot, 0);
+        table.insert(threadIdx, blockerKey, 0);
+        RunPredicate predicate;
+        predicate.firstKey = slotKey(runHome, 0);
+        predicate.passedKey = slotKey(runHome, runLength - 1);
+        predicate.victimKey = slotKey(runHome, runLength);
+        predicate.passed.store(false);
+        table.insert(threadIdx, predicate.victimKey, 0);
+
+        unsigned int casLocks[LRUTable::HASH_MAX_LOCK_DEPTH];
+        if(!table.lockElement(threadIdx, blockerKey, casLocks))
+            return false;
+        size_t removed = 0;
+        std::thread packer([&]()
+        {
+            removed = table.packHashParallel([&](LRUTable::LRUElement & element) { return predicate(element.key); }, LRUTable::noProgress, pool);
+        });
+        if(!predicate.waitPassed())
+        {
+            fprintf(stderr, "chunk 1 worker did not get to the run\n");
+            return false;
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(20)); // both workers wait for blocker
+        table.unlockElement(threadIdx, blockerKey, casLocks, blockerSlot, blockerSlot);
+        packer.join();
+
+        unsigned long long value;
+        if(table.get(threadIdx, predicate.firstKey, value) || table.get(threadIdx, predicate.victimKey, value))
+        {
+            fprintf(stderr, "round %llu: rejected key survived, %zu removed\n", round, removed);
+            return false;
+        }
+        for(unsigned long long i = 1; i < runLength; ++i)
+        {
+            if(!table.get(threadIdx, slotKey(runHome, i), value) || value != i)
+                return false;
+        }
+        if(!table.get(threadIdx, blockerKey, value))
+            return false;
+        table.releaseThread(threadIdx);
+    }
+    return true;
+}
+
+int main()
+{
+    alarm(120); // a deadlock fails the test instead of hanging it
+    bool ok = true;
+    if(!sparseCrossingRun())
+    {
+        fprintf(stderr, "sparseCrossingRun failed\n");
+        ok = false;
+    }
+    if(!lruCrossingRun())
+    {
+        fprintf(stderr, "lruCrossingRun failed\n");
+        ok = false;
+    }
+    printf("%s\n", ok ? "ok" : "FAILED");
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,92 @@
+/*
+ * SeededHashTest.cpp
+ *
+ * Seed independent collisions of hashBytes64. Keys up to 16 bytes whose first folded word equals HASH_SECRET[1] all hashed the
+ * same under every seed before the seed went into both multiplicands of hashShort. Keys of hashMid length that differ by two swapped
+ * 16 byte chunks, far enough apart to use the same secret pair, collided under every seed before the accumulator was mixed at
+ * the wrap of the secret.
+ *
+ * g++ -std=c++17 -O2 -Wall -I.. SeededHashTest.cpp -o SeededHashTest
+ */
+
+#include <cstdio>
+#include <cstring>
+#include <unordered_set>
+
+#include "seededhash.hh"
+
+static const unsigned long long KEYS = 1000, SEEDS = 1000;
+
+// 16 byte key, hashShort reads a from bytes 0..3 and 8..11 and b from bytes 12..15 and 4..7
+static void craftKey(unsigned char * key, const unsigned long long i)
+{
+    const unsigned int aHigh = (unsigned int) (HASH_SECRET[1] >> 32), aLow = (unsigned int) HASH_SECRET[1];
+    const unsigned int bHigh = (unsigned int) (i >> 32), bLow = (unsigned int) i;
+    memcpy(key, &aHigh, 4);
+    memcpy(key + 4, &bLow, 4);
+    memcpy(key + 8, &aLow, 4);
+    memcpy(key + 12, &bHigh, 4);
+}
+
+static bool shortKeysWithSecretWord()
+{
+    bool ok = true;
+    std::unordered_set<unsigned long long> seen[2];
+    unsigned long long sameUnderBothSeeds = 0;
+    for(unsigned long long i = 0; i < KEYS; ++i)
+    {
+        unsigned char key[16];
+        craftKey(key, i * 0x9E3779B97F4A7C15ULL);
+        const unsigned long long h1 = hashBytes64(key, sizeof(key), 1), h2 = hashBytes64(key, sizeof(key), 2);
+        seen[0].insert(h1);
+        seen[1].insert(h2);
+        if(h1 == h2)
+            ++sameUnderBothSeeds;
+    }
+    if(seen[0].size() != KEYS || seen[1].size() != KEYS)
+    {
+        fprintf(stderr, "crafted keys collide: %zu and %zu distinct of %llu\n", seen[0].size(), seen[1].size(), KEYS);
+        ok = false;
+    }
+    if(sameUnderBothSeeds)
+    {
+        fprintf(stderr, "%llu crafted keys hash the same under two seeds\n", sameUnderBothSeeds);
+        ok = false;
+    }
+    return ok;
+}
+
+// 208 byte key, chunks 0 and 11 use the same secret pair in hashMid
+static bool swappedMidChunks()
+{
+    static const unsigned long long LEN = 208, CHUNK = 16, FAR_CHUNK = 11;
+    unsigned char key[LEN], swapped[LEN];
+    for(unsigned long long i = 0; i < LEN; ++i)
+        key[i] = (unsigned char) (i * 131 + 7);
+    memcpy(swapped, key, LEN);
+    memcpy(swapped, key + FAR_CHUNK * CHUNK, CHUNK);
+    memcpy(swapped + FAR_CHUNK * CHUNK, key, CHUNK);
+    unsigned long long collisions = 0;
+    for(unsigned long long seed = 0; seed < SEEDS; ++seed)
+        collisions += hashBytes64(key, LEN, seed) == hashBytes64(swapped, LEN, seed);
+    if(collisions)
+        fprintf(stderr, "swapped chunks collide under %llu of %llu seeds\n", collisions, SEEDS);
+    return !collisions;
+}
+
+int main()
+{
+    bool ok = true;
+    if(!shortKeysWithSecretWord())
+    {
+        fprintf(stderr, "shortKeysWithSecretWord failed\n");
+        ok = false;
+    }
+    if(!swappedMidChunks())
+    {
+        fprintf(stderr, "swappedMidChunks failed\n");
+        ok = false;
+    }
+    printf("%s\n", ok ? "ok" : "FAILED");
+    return ok ? 0 : 1;
+}
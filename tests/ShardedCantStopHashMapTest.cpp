@@ -0,0 +1,92 @@
+/*
+ * ShardedCantStopHashMapTest.cpp
+ *
+ * Threads run random puts, removes and updates on disjoint key ranges of one ShardedCantStopHashMap, each checked against its own
+ * std::unordered_map. Small shards keep the probe runs wrapping around the shard tables. update() must work for values that are
+ * not default constructible.
+ *
+ * g++ -std=c++17 -O2 -Wall -I.. ShardedCantStopHashMapTest.cpp ../bittwiddlinghacks.cpp -o ShardedCantStopHashMapTest -lpthread
+ */
+
+#include <cstdio>
+#include <random>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include "ShardedCantStopHashMap.h"
+
+struct MixHash
+{
+    size_t operator()(unsigned long long key) const
+    {
+        return mix64(key);
+    }
+};
+
+struct Counter
+{
+    unsigned long long count;
+
+    explicit Counter(unsigned long long inCount) : count(inCount)
+    {
+    }
+};
+
+typedef ShardedCantStopHashMap<unsigned long long, Counter, MixHash> Map;
+
+static const unsigned long long THREADS = 4, SHARDS = 16, KEYS_PER_THREAD = 600, OPS = 400000;
+
+int main()
+{
+    Map map(SHARDS, SHARDS); // every shard gets one 640 slot bucket
+    std::vector<std::thread> threads;
+    std::atomic<unsigned long long> failures(0);
+    for(unsigned long long threadIdx = 0; threadIdx < THREADS; ++threadIdx)
+        threads.emplace_back([&map, &failures, threadIdx]
+        {
+            std::unordered_map<unsigned long long, unsigned long long> reference;
+            std::mt19937_64 rng(threadIdx);
+            const unsigned long long base = threadIdx * KEYS_PER_THREAD;
+            for(unsigned long long op = 0; op < OPS; ++op)
+            {
+                const unsigned long long key = base + rng() % KEYS_PER_THREAD;
+                switch(rng() % 3)
+                {
+                case 0:
+                    map.put(key, Counter(op));
+                    reference[key] = op;
+                    break;
+                case 1:
+                    if(map.remove(key) != (reference.erase(key) == 1))
+                        failures.fetch_add(1);
+                    break;
+                default:
+                {
+                    const auto it = reference.find(key);
+                    if(map.update(key, [](Counter & counter) { ++counter.count; }) != (it != reference.end()))
+                        failures.fetch_add(1);
+                    else if(it != reference.end())
+                        ++it->second;
+                }
+                }
+            }
+            for(unsigned long long key = base; key < base + KEYS_PER_THREAD; ++key)
+            {
+                Counter counter(0);
+                const auto it = reference.find(key);
+                const bool found = map.get(key, counter);
+                if(found != (it != reference.end()) || (found && counter.count != it->second))
+                    failures.fetch_add(1);
+            }
+        });
+    for(auto & thread : threads)
+        thread.join();
+    if(failures.load())
+    {
+        fprintf(stderr, "%llu operations disagree with the reference maps\n", failures.load());
+        return 1;
+    }
+    printf("ok\n");
+    return 0;
+}
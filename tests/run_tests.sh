@@ -0,0 +1,36 @@
+#!/bin/sh
+# Builds and runs every test next to this script, a test fails by returning non zero. CXXFLAGS adds to the defaults,
+# e.g. CXXFLAGS=-fsanitize=thread ./run_tests.sh
+# Tests in AVX2_TESTS pick their SIMD path at build time, they are built once more with -mavx2 (name_avx2) where the CPU has it
+cd "$(dirname "$0")" || exit 1
+BUILD_DIR=${BUILD_DIR:-/tmp/hpcbits_tests}
+AVX2_TESTS="GroupProbeHashMapTest"
+mkdir -p "$BUILD_DIR" || exit 1
+failed=0
+run_test() {
+    name=$1
+    shift
+    if ! g++ -std=c++17 -O2 -Wall -I.. $CXXFLAGS "$@" "$test" ../bittwiddlinghacks.cpp -o "$BUILD_DIR/$name" -lpthread; then
+        echo "$name: build failed"
+        failed=1
+        return
+    fi
+    if "$BUILD_DIR/$name"; then
+        echo "$name: passed"
+    else
+        echo "$name: FAILED"
+        failed=1
+    fi
+}
+for test in *.cpp; do
+    name=${test%.cpp}
+    run_test "$name"
+    case " $AVX2_TESTS " in
+    *" $name "*)
+        if grep -q avx2 /proc/cpuinfo 2>/dev/null; then
+            run_test "${name}_avx2" -mavx2
+        fi
+        ;;
+    esac
+done
+exit $failed